@@ -0,0 +1,248 @@
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <PubSubClient.h>
+#include <Benchmark.h>
+#include <WatermeterFrame.h>
+#include <FrameSecurity.h>
+#include <LinkProfile.h>
+#include "FlowAnalytics.h"
+#include "GatewayState.h"
+#include "HomeAssistant.h"
+#include "History.h"
+#include "StatusPage.h"
+
+// Replaces main.cpp in the bench environments, runs the code of the web server and of the network task without radio, WiFi or broker.
+// Build and run with `pio run -e bench -t upload -t monitor` on the board or `pio run -e native_bench -t exec` on the host.
+// The status page is read from SPIFFS, upload it with `pio run -e bench -t uploadfs` first.
+#define BENCH_CHANNEL "esp32-lora-gw"
+#define BENCH_NODE 0x1a2b
+#define BENCH_MAX_TOKENS 32
+#define BENCH_DISCOVERY_ITERATIONS 100 // every iteration writes the hashes to NVS
+#define BENCH_HISTORY_START 1687115042
+#define BENCH_HISTORY_INTERVAL 60      // seconds between readings, the default interval of the sender
+#define BENCH_HISTORY_POINTS 10080     // a week, recorded before the queries
+#define BENCH_QUERY_ITERATIONS 10      // every iteration streams a day from SPIFFS
+#define BENCH_POINT_BYTES 20           // time, value, rate, temperature, humidity and RSSI uncompressed
+#define BENCH_KEY "000102030405060708090a0b0c0d0e0f"
+
+// Broker that accepts the connection and every message, so the config messages are formatted and streamed like on a real connection
+class NullClient : public Client
+{
+public:
+  int connect(IPAddress ip, uint16_t port) override { return 1; }
+  int connect(const char *host, uint16_t port) override { return 1; }
+  size_t write(uint8_t value) override { return 1; }
+  size_t write(const uint8_t *buffer, size_t size) override { return size; }
+  int available() override { return sizeof(connack) - position; }
+  int read() override { return position < sizeof(connack) ? connack[position++] : -1; }
+  int read(uint8_t *buffer, size_t size) override { return -1; }
+  int peek() override { return position < sizeof(connack) ? connack[position] : -1; }
+  void flush() override {}
+  void stop() override {}
+  uint8_t connected() override { return 1; }
+  operator bool() override { return true; }
+
+private:
+  const uint8_t connack[4] = {0x20, 0x02, 0x00, 0x00}; // the only answer PubSubClient waits for
+  size_t position = 0;
+};
+
+static NullClient nullClient;
+static PubSubClient client(nullClient);
+static String tokens[BENCH_MAX_TOKENS];
+static uint8_t tokenCount = 0;
+static volatile size_t rendered; // keeps the compiler from dropping the rendering
+static WatermeterReading historyReading;
+static uint32_t historyTime = BENCH_HISTORY_START;
+static HistoryQuery query;
+static FlowState flowState;
+static WatermeterReading flowReading;
+static uint32_t flowTime = BENCH_HISTORY_START;
+static uint8_t chunk[1436]; // a TCP segment, like the chunks of the web server
+static FrameKey frameKey;
+static uint8_t sealedFrame[FRAME_MAX_LENGTH];
+static size_t sealedLength;
+static uint8_t frame[FRAME_MAX_LENGTH];
+
+// Placeholders of the page in the order the web server asks for them
+static void loadTokens()
+{
+  File file = SPIFFS.open("/index.html", "r");
+  String page = file ? file.readString() : String();
+  file.close();
+
+  int start = page.indexOf('%');
+  while (start >= 0 && tokenCount < BENCH_MAX_TOKENS)
+  {
+    int end = page.indexOf('%', start + 1);
+    if (end < 0)
+    {
+      break;
+    }
+    tokens[tokenCount++] = page.substring(start + 1, end);
+    start = page.indexOf('%', end + 1);
+  }
+}
+
+static void benchStatusPage()
+{
+  size_t length = 0;
+  for (uint8_t i = 0; i < tokenCount; i++)
+  {
+    length += processorStats(tokens[i]).length();
+  }
+  rendered = length;
+}
+
+static void benchDiscovery()
+{
+  rendered = publishDiscovery(client, BENCH_CHANNEL, true);
+}
+
+static void benchNodeDiscovery()
+{
+  rendered = publishNodeDiscovery(client, BENCH_CHANNEL, BENCH_NODE, true);
+}
+
+// A reading per interval of a meter that runs now and then, climate and RSSI drift like in a basement
+static void recordNextReading()
+{
+  historyTime += BENCH_HISTORY_INTERVAL;
+  historyReading.sequence++;
+  historyReading.previous = historyReading.value;
+  historyReading.rate = random(4) == 0 ? random(1, 40) : 0;
+  historyReading.value += historyReading.rate;
+  historyReading.temperature += random(-1, 2);
+  historyReading.humidity += random(-1, 2);
+  recordHistory(historyReading, historyTime, -97 + random(-2, 3));
+}
+
+// The same meter into the flow analytics, every 60th call starts a new hour
+static void benchFlow()
+{
+  flowTime += BENCH_HISTORY_INTERVAL;
+  flowReading.value += random(4) == 0 ? random(1, 40) : 0;
+  rendered = recordFlow(flowState, flowReading, flowTime);
+}
+
+// Opens a copy of the same sealed keyframe every time, like the radio task before the node lookup
+static void benchOpenFrame()
+{
+  size_t length = sealedLength;
+  uint32_t counter;
+  memcpy(frame, sealedFrame, sealedLength);
+  rendered = openFrame(frameKey, frame, length, counter) ? length : 0;
+}
+
+static void benchSignLink()
+{
+  size_t length = encodeLink(7, BENCH_NODE, defaultLinkProfile, frame, sizeof(frame));
+  rendered = signLink(frameKey, frameCounter(1, 7), frame, length, sizeof(frame));
+}
+
+static void streamHistory(uint32_t from, uint32_t to, uint32_t step)
+{
+  size_t length = 0;
+  size_t written;
+  beginHistoryQuery(query, historyReading.node, 0, from, to, step);
+  while ((written = readHistoryJson(query, chunk, sizeof(chunk))) > 0)
+  {
+    length += written;
+  }
+  rendered = length;
+}
+
+static void benchHistoryDay()
+{
+  streamHistory(historyTime - 24 * 3600, historyTime, 0);
+}
+
+static void benchHistoryWeekHourly()
+{
+  streamHistory(historyTime - 7 * 24 * 3600, historyTime, 3600);
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  delay(1000);
+
+  if (!SPIFFS.begin(true))
+  {
+    Serial.println("An Error has occurred while mounting SPIFFS");
+  }
+  loadTokens();
+  if (tokenCount == 0)
+  {
+    Serial.println("No placeholders found in /index.html, upload the file system first");
+  }
+
+  // A packet with every field set, so every placeholder has something to render
+  GatewayState state = {};
+  state.valid = true;
+  state.reading.node = BENCH_NODE;
+  state.reading.flags = FRAME_FLAG_HAS_RATE | FRAME_FLAG_HAS_RAW;
+  state.reading.value = 4826027;
+  state.reading.previous = 4826019;
+  state.reading.rate = 8;
+  state.reading.temperature = 215;
+  state.reading.humidity = 452;
+  strlcpy(state.reading.raw, "00482.60N7", sizeof(state.reading.raw));
+  state.rssi = -97;
+  state.snr = 6.25;
+  state.packets = 1;
+  storeState(state);
+
+  // A node of its own for every run, the history of earlier runs stays in SPIFFS
+  setupHistory();
+  historyReading.node = 0x8000 | random(0x8000);
+  historyReading.flags = FRAME_FLAG_HAS_RATE;
+  historyReading.value = 4826027;
+  historyReading.temperature = 152;
+  historyReading.humidity = 610;
+
+  // The keyframe of the packet above, sealed like the sender does it
+  uint8_t key[FRAME_KEY_LENGTH];
+  parseFrameKey(BENCH_KEY, key);
+  setupFrameKey(frameKey, key);
+  DeltaReference reference = {};
+  sealedLength = encodeFrame(state.reading, reference, 10, sealedFrame, sizeof(sealedFrame) - FRAME_SECURED_OVERHEAD);
+  sealedLength = sealFrame(frameKey, 1, sealedFrame, sealedLength, sizeof(sealedFrame));
+
+  client.setServer("127.0.0.1", 1883);
+  client.connect(BENCH_CHANNEL);
+
+  beginBenchmarks();
+  runBenchmark("processorStats", benchStatusPage);
+  runBenchmark("publishDiscovery", benchDiscovery, BENCH_DISCOVERY_ITERATIONS);
+  runBenchmark("publishNodeDiscovery", benchNodeDiscovery, BENCH_DISCOVERY_ITERATIONS);
+  runBenchmark("openFrame", benchOpenFrame);
+  runBenchmark("signLink", benchSignLink);
+  runBenchmark("recordHistory", recordNextReading);
+  flowReading.node = historyReading.node;
+  flowReading.value = historyReading.value;
+  runBenchmark("recordFlow", benchFlow);
+  while ((historyTime - BENCH_HISTORY_START) / BENCH_HISTORY_INTERVAL < BENCH_HISTORY_POINTS)
+  {
+    recordNextReading();
+  }
+  runBenchmark("history/day", benchHistoryDay, BENCH_QUERY_ITERATIONS);
+  runBenchmark("history/week_hourly", benchHistoryWeekHourly, BENCH_QUERY_ITERATIONS);
+
+  // Compression of the blocks written so far, without the open block and the padding of the blocks
+  uint32_t points = historyPoints();
+  uint32_t bytes = historyBytes();
+  Serial.println("{\"history\":{\"points\":" + String(points) + ",\"encoded_bytes\":" + String(bytes) +
+                 ",\"bits_per_point\":" + String(points ? 8.0 * bytes / points : 0, 1) +
+                 ",\"ratio\":" + String(bytes ? (float)BENCH_POINT_BYTES * points / bytes : 0, 1) + "}}");
+  endBenchmarks();
+
+#ifndef ARDUINO_ARCH_ESP32
+  exit(0);
+#endif
+}
+
+void loop()
+{
+  delay(1000);
+}
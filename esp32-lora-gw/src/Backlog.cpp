@@ -0,0 +1,292 @@
+#include "Backlog.h"
+#include "SegmentFiles.h"
+#include <SPIFFS.h>
+
+#define BACKLOG_DIRECTORY "/backlog"
+#define BACKLOG_SEGMENT_EXTENSION ".log"
+#define BACKLOG_POSITION_FILE "/backlog/position"
+#define BACKLOG_POSITION_MAGIC 0x424c4f47 // "BLOG"
+#define BACKLOG_RECORD_HEADER 6 // length, checksum, timestamp
+
+typedef struct
+{
+  uint32_t readSegment;
+  uint32_t readOffset;
+  uint32_t writeSegment;
+} BacklogPosition;
+
+static BacklogPosition position;
+static uint32_t count = 0;
+static uint32_t dropped = 0;
+static uint32_t unsavedReleases = 0;
+
+// Record of the next peekBacklog(), releaseBacklog() skips it
+static uint32_t peekedLength = 0;
+
+static String segmentPath(uint32_t segment)
+{
+  return BACKLOG_DIRECTORY "/" + String(segment) + BACKLOG_SEGMENT_EXTENSION;
+}
+
+static uint8_t checksum(const uint8_t *data, size_t length)
+{
+  // CRC-8, polynomial 0x07
+  uint8_t crc = 0;
+  for (size_t i = 0; i < length; i++)
+  {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; bit++)
+    {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+// Reads the record at offset, returns its size on flash or 0 at the end of the segment or on a torn write
+static size_t readRecord(File &file, uint32_t offset, uint8_t *record)
+{
+  if (!file.seek(offset) || file.read(record, BACKLOG_RECORD_HEADER) != BACKLOG_RECORD_HEADER)
+  {
+    return 0;
+  }
+
+  uint8_t length = record[0];
+  if (length == 0 || file.read(record + BACKLOG_RECORD_HEADER, length) != length)
+  {
+    return 0;
+  }
+
+  if (checksum(record + 2, length + BACKLOG_RECORD_HEADER - 2) != record[1])
+  {
+    return 0;
+  }
+  return length + BACKLOG_RECORD_HEADER;
+}
+
+// Counts the valid records from offset on, end returns where the valid part of the segment ends
+static uint32_t countRecords(uint32_t segment, uint32_t offset, uint32_t &end)
+{
+  end = offset;
+  File file = SPIFFS.open(segmentPath(segment), FILE_READ);
+  if (!file)
+  {
+    return 0;
+  }
+
+  uint8_t record[BACKLOG_RECORD_HEADER + FRAME_MAX_LENGTH];
+  uint32_t records = 0;
+  size_t size;
+  while ((size = readRecord(file, end, record)) > 0)
+  {
+    end += size;
+    records++;
+  }
+  file.close();
+  return records;
+}
+
+static void savePosition()
+{
+  writePositionFile(BACKLOG_POSITION_FILE, BACKLOG_POSITION_MAGIC, &position, sizeof(position));
+  unsavedReleases = 0;
+}
+
+static void dropOldestSegment()
+{
+  uint32_t end;
+  uint32_t records = countRecords(position.readSegment, position.readOffset, end);
+  SPIFFS.remove(segmentPath(position.readSegment));
+
+  dropped += records;
+  count -= min(count, records);
+  position.readSegment++;
+  position.readOffset = 0;
+  peekedLength = 0;
+  Serial.println("Backlog full, dropped " + String(records) + " oldest readings");
+}
+
+// Starts a new segment for appends, the oldest segments are dropped if the log or SPIFFS is full
+static void startSegment()
+{
+  position.writeSegment++;
+  while (position.writeSegment - position.readSegment >= BACKLOG_MAX_SEGMENTS ||
+         (position.readSegment < position.writeSegment && SPIFFS.usedBytes() + BACKLOG_SEGMENT_SIZE > SPIFFS.totalBytes()))
+  {
+    dropOldestSegment();
+  }
+  savePosition();
+}
+
+void setupBacklog()
+{
+  BacklogPosition saved;
+  bool valid = readPositionFile(BACKLOG_POSITION_FILE, BACKLOG_POSITION_MAGIC, &saved, sizeof(saved));
+
+  // The segment files are the truth, the position is only saved every few records and may be lost with a reset.
+  // Reading starts at the oldest segment left, at the saved offset if the position still points to it.
+  uint32_t oldest;
+  uint32_t newest;
+  if (findSegments(BACKLOG_DIRECTORY, BACKLOG_SEGMENT_EXTENSION, oldest, newest))
+  {
+    bool current = valid && saved.readSegment == oldest;
+    position = {oldest, current ? saved.readOffset : 0, newest};
+    if (!valid)
+    {
+      Serial.println("Backlog position torn, replaying segments " + String(oldest) + " to " + String(newest));
+    }
+  }
+  else
+  {
+    // Segment numbers keep counting, so a segment of an old log is never taken for a new one
+    uint32_t next = valid ? max(saved.writeSegment, saved.readSegment) : 0;
+    position = {next, 0, next};
+  }
+
+  count = 0;
+  uint32_t end = 0;
+  for (uint32_t segment = position.readSegment; segment <= position.writeSegment; segment++)
+  {
+    count += countRecords(segment, segment == position.readSegment ? position.readOffset : 0, end);
+  }
+
+  // A reset during a write leaves a torn record at the end, it is never overwritten, appends continue in a new segment
+  File last = SPIFFS.open(segmentPath(position.writeSegment), FILE_READ);
+  if (last && last.size() > end)
+  {
+    Serial.println("Backlog segment " + String(position.writeSegment) + " ends with a torn record");
+    startSegment();
+  }
+  if (last)
+  {
+    last.close();
+  }
+
+  Serial.println("Backlog holds " + String(count) + " readings");
+}
+
+bool appendBacklog(const WatermeterReading &reading, uint32_t timestamp)
+{
+  uint8_t record[BACKLOG_RECORD_HEADER + FRAME_MAX_LENGTH];
+  size_t length = encodeReading(reading, record + BACKLOG_RECORD_HEADER, FRAME_MAX_LENGTH);
+  if (length == 0)
+  {
+    return false;
+  }
+  record[0] = length;
+  record[2] = timestamp;
+  record[3] = timestamp >> 8;
+  record[4] = timestamp >> 16;
+  record[5] = timestamp >> 24;
+  record[1] = checksum(record + 2, length + BACKLOG_RECORD_HEADER - 2);
+
+  File file = SPIFFS.open(segmentPath(position.writeSegment), FILE_APPEND);
+  if (file && file.size() + length + BACKLOG_RECORD_HEADER > BACKLOG_SEGMENT_SIZE)
+  {
+    file.close();
+    startSegment();
+    file = SPIFFS.open(segmentPath(position.writeSegment), FILE_APPEND);
+  }
+  if (!file)
+  {
+    Serial.println("Could not open backlog segment " + String(position.writeSegment));
+    return false;
+  }
+
+  // Closing flushes the record, so it survives a reset right after
+  size_t written = file.write(record, length + BACKLOG_RECORD_HEADER);
+  file.close();
+  if (written != length + BACKLOG_RECORD_HEADER)
+  {
+    // The torn record ends the segment for the reader, the next record starts a new one
+    startSegment();
+    return false;
+  }
+
+  count++;
+  return true;
+}
+
+bool peekBacklog(WatermeterReading &reading, uint32_t &timestamp)
+{
+  uint8_t record[BACKLOG_RECORD_HEADER + FRAME_MAX_LENGTH];
+
+  while (count > 0)
+  {
+    File file = SPIFFS.open(segmentPath(position.readSegment), FILE_READ);
+    size_t size = file ? readRecord(file, position.readOffset, record) : 0;
+    if (file)
+    {
+      file.close();
+    }
+
+    if (size > 0 && decodeReading(record + BACKLOG_RECORD_HEADER, record[0], reading))
+    {
+      timestamp = record[2] | (record[3] << 8) | (record[4] << 16) | ((uint32_t)record[5] << 24);
+      peekedLength = size;
+      return true;
+    }
+
+    if (size > 0)
+    {
+      // Written by a firmware with another protocol version, skipped
+      position.readOffset += size;
+      count--;
+      dropped++;
+      continue;
+    }
+
+    if (position.readSegment >= position.writeSegment)
+    {
+      // The counter disagrees with the log, trust the log
+      count = 0;
+      break;
+    }
+
+    // End of a replayed segment
+    SPIFFS.remove(segmentPath(position.readSegment));
+    position.readSegment++;
+    position.readOffset = 0;
+    savePosition();
+  }
+  return false;
+}
+
+void releaseBacklog()
+{
+  if (peekedLength == 0)
+  {
+    return;
+  }
+
+  position.readOffset += peekedLength;
+  peekedLength = 0;
+  count--;
+
+  // Replayed segments are removed right away, appends continue in the current segment
+  if (count == 0 && position.readSegment < position.writeSegment)
+  {
+    for (uint32_t segment = position.readSegment; segment < position.writeSegment; segment++)
+    {
+      SPIFFS.remove(segmentPath(segment));
+    }
+    position.readSegment = position.writeSegment;
+    position.readOffset = 0;
+  }
+
+  // Saving the position after every record would wear out the flash, after a reset a few readings may be replayed twice
+  if (count == 0 || ++unsavedReleases >= BACKLOG_POSITION_INTERVAL)
+  {
+    savePosition();
+  }
+}
+
+uint32_t backlogCount()
+{
+  return count;
+}
+
+uint32_t backlogDropped()
+{
+  return dropped;
+}
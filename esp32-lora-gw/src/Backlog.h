@@ -0,0 +1,24 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WatermeterFrame.h>
+
+// Append-only log in SPIFFS for readings that could not be published while WiFi or MQTT was down.
+// The log is split into segments, replayed segments are removed and the oldest segment is dropped when the log is full.
+// Only the network task may use it.
+#define BACKLOG_SEGMENT_SIZE 16384 // bytes
+#define BACKLOG_MAX_SEGMENTS 16
+#define BACKLOG_REPLAY_INTERVAL 200 // ms between two replayed readings
+#define BACKLOG_POSITION_INTERVAL 16 // replayed readings between two writes of the read position
+
+void setupBacklog();
+
+// Returns false if the reading could not be written to flash
+bool appendBacklog(const WatermeterReading &reading, uint32_t timestamp);
+
+// Returns the oldest reading with its original timestamp (0 if unknown) or false if the backlog is empty
+bool peekBacklog(WatermeterReading &reading, uint32_t &timestamp);
+void releaseBacklog();
+
+uint32_t backlogCount();
+uint32_t backlogDropped();
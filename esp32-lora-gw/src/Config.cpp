@@ -0,0 +1,134 @@
+#include "Config.h"
+#include <Preferences.h>
+
+#define CONFIG_NAMESPACE "gateway"
+#define CONFIG_KEY "config"
+
+static Config defaultConfig()
+{
+  Config config = {};
+  config.version = CONFIG_VERSION;
+  config.brokerPort = 1883;
+  strlcpy(config.brokerClient, "ESP32-LoRa-GW", sizeof(config.brokerClient));
+  config.syncWord = 243;
+  config.interval = 60;
+  config.adaptive = false;
+  config.linkInterval = 300;
+  return config;
+}
+
+static void loadLegacyString(Preferences &preferences, const char *key, char *value, size_t size)
+{
+  strlcpy(value, preferences.getString(key, value).c_str(), size);
+}
+
+// Firmwares before the config blob stored every setting as its own key in three namespaces
+static void loadLegacyConfig(Config &config)
+{
+  Preferences preferences;
+
+  preferences.begin("wifi-settings", true);
+  loadLegacyString(preferences, "ssid", config.ssid, sizeof(config.ssid));
+  loadLegacyString(preferences, "password", config.password, sizeof(config.password));
+  preferences.end();
+
+  preferences.begin("mqtt-settings", true);
+  loadLegacyString(preferences, "host", config.brokerHost, sizeof(config.brokerHost));
+  config.brokerPort = preferences.getInt("port", config.brokerPort);
+  loadLegacyString(preferences, "user", config.brokerUser, sizeof(config.brokerUser));
+  loadLegacyString(preferences, "password", config.brokerPassword, sizeof(config.brokerPassword));
+  loadLegacyString(preferences, "client", config.brokerClient, sizeof(config.brokerClient));
+  preferences.end();
+
+  preferences.begin("lora-settings", true);
+  config.syncWord = preferences.getUInt("sync", config.syncWord);
+  preferences.end();
+}
+
+void loadConfig(Config &config)
+{
+  Config defaults = defaultConfig();
+  config = defaults;
+
+  Preferences preferences;
+  preferences.begin(CONFIG_NAMESPACE, true);
+  // Fields added after the blob was stored keep their defaults
+  size_t length = preferences.getBytesLength(CONFIG_KEY);
+  bool stored = length >= sizeof(config.version) && length <= sizeof(Config);
+  if (stored)
+  {
+    preferences.getBytes(CONFIG_KEY, &config, length);
+  }
+  preferences.end();
+
+  if (!stored || config.version == 0 || config.version > CONFIG_VERSION)
+  {
+    Serial.println("Migrating preferences");
+    config = defaults;
+    loadLegacyConfig(config);
+    stored = false;
+  }
+
+  String invalid = validateConfig(config, defaults);
+  if (invalid != "")
+  {
+    Serial.println("Reset invalid settings to defaults: " + invalid);
+  }
+
+  if (!stored || length != sizeof(Config) || invalid != "")
+  {
+    saveConfig(config);
+  }
+  Serial.println("Loaded preferences");
+}
+
+bool saveConfig(const Config &config)
+{
+  Preferences preferences;
+  preferences.begin(CONFIG_NAMESPACE, false);
+  bool saved = preferences.putBytes(CONFIG_KEY, &config, sizeof(Config)) == sizeof(Config);
+  preferences.end();
+  return saved;
+}
+
+String validateConfig(Config &config, const Config &fallback)
+{
+  String invalid;
+
+  config.version = CONFIG_VERSION;
+  config.ssid[CONFIG_SSID_LENGTH] = '\0';
+  config.password[CONFIG_PASSWORD_LENGTH] = '\0';
+  config.brokerHost[CONFIG_MQTT_LENGTH] = '\0';
+  config.brokerUser[CONFIG_MQTT_LENGTH] = '\0';
+  config.brokerPassword[CONFIG_MQTT_LENGTH] = '\0';
+  config.brokerClient[CONFIG_MQTT_LENGTH] = '\0';
+
+  if (config.brokerPort == 0 || config.brokerPort > 0xFFFF)
+  {
+    config.brokerPort = fallback.brokerPort;
+    invalid += "mqtt-port ";
+  }
+  if (strlen(config.brokerClient) == 0)
+  {
+    strlcpy(config.brokerClient, fallback.brokerClient, sizeof(config.brokerClient));
+    invalid += "mqtt-client ";
+  }
+  if (config.syncWord > 0xFF)
+  {
+    config.syncWord = fallback.syncWord;
+    invalid += "lora-sync ";
+  }
+  if (config.interval == 0)
+  {
+    config.interval = fallback.interval;
+    invalid += "info-interval ";
+  }
+  if (config.linkInterval == 0)
+  {
+    config.linkInterval = fallback.linkInterval;
+    invalid += "link-interval ";
+  }
+
+  invalid.trim();
+  return invalid;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FrameSecurity.h>
+
+// Settings of the gateway, loaded once at boot and kept in RAM.
+// The whole struct is stored as one blob, so a save is a single NVS commit.
+#define CONFIG_VERSION 4 // new fields are only appended, older blobs are read as prefix
+#define CONFIG_SSID_LENGTH 32
+#define CONFIG_PASSWORD_LENGTH 63
+#define CONFIG_MQTT_LENGTH 64
+
+typedef struct
+{
+  uint32_t version;
+  char ssid[CONFIG_SSID_LENGTH + 1]; // empty starts the setup AP
+  char password[CONFIG_PASSWORD_LENGTH + 1];
+  char brokerHost[CONFIG_MQTT_LENGTH + 1]; // empty disables MQTT
+  uint32_t brokerPort;
+  char brokerUser[CONFIG_MQTT_LENGTH + 1];
+  char brokerPassword[CONFIG_MQTT_LENGTH + 1];
+  char brokerClient[CONFIG_MQTT_LENGTH + 1];
+  uint32_t syncWord;
+  uint32_t interval; // seconds between two device information updates
+  bool adaptive;         // since version 2
+  uint32_t linkInterval; // since version 3, seconds between two link statistics
+  uint8_t key[FRAME_KEY_LENGTH]; // since version 4, all zero accepts plain frames only
+} Config;
+
+// Loads the stored config, settings of older firmwares are migrated and invalid fields are replaced by defaults
+void loadConfig(Config &config);
+bool saveConfig(const Config &config);
+
+// Replaces invalid fields with the ones of fallback, returns the names of the replaced fields or an empty string
+String validateConfig(Config &config, const Config &fallback);
@@ -0,0 +1,247 @@
+#include "Connection.h"
+#include <WiFi.h>
+#include <Metrics.h>
+
+// Attempts take ms on the LAN and up to the socket timeout, outages seconds to hours
+static const float attemptBounds[] = {0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+static const float outageBounds[] = {1, 5, 10, 30, 60, 120, 300, 600, 1800, 3600};
+static MetricHistogram attemptSeconds = {"gateway_mqtt_connect_seconds", "Duration of an MQTT connect attempt.", attemptBounds, 9, {}, 0, 0};
+static MetricHistogram mqttOutageSeconds = {"gateway_mqtt_outage_seconds", "Time from the loss of the MQTT session until it was established again.", outageBounds, 10, {}, 0, 0};
+static MetricHistogram wifiOutageSeconds = {"gateway_wifi_outage_seconds", "Time from the loss of the WiFi until the next IP.", outageBounds, 10, {}, 0, 0};
+
+// Written by the event task of the WiFi driver
+static volatile bool wifiUp = false;
+static volatile uint32_t wifiLostAt = 0;
+static bool wifiLost = false;
+static uint32_t wifiDisconnects = 0;
+
+// Written by the network task, the web server only reads single fields
+static volatile ConnectionState state = CONNECTION_WIFI;
+static volatile bool configured = false;
+static bool wifiSeen = false;
+static uint32_t wifiAttemptAt = 0;
+static uint32_t wifiRetry = WIFI_RETRY_MIN;
+static volatile uint32_t mqttAttemptAt = 0;
+static volatile uint32_t mqttWait = 0; // first attempt right away
+static uint32_t backoff = MQTT_BACKOFF_MIN;
+static bool mqttLost = false;
+static uint32_t mqttLostAt = 0;
+static uint32_t mqttAttempts = 0;
+static uint32_t mqttFailures = 0;
+static uint32_t mqttDisconnects = 0;
+static volatile int mqttError = 0; // PubSubClient state of the last failed attempt
+
+static void onWiFiEvent(arduino_event_id_t event, arduino_event_info_t info)
+{
+  if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP)
+  {
+    if (!wifiUp && wifiLost)
+    {
+      observeHistogram(wifiOutageSeconds, (millis() - wifiLostAt) / 1000.0f);
+    }
+    wifiUp = true;
+    wifiLost = false;
+    Serial.println("ESP32 IP-Address: " + WiFi.localIP().toString());
+  }
+  else if (wifiUp)
+  {
+    // The driver repeats the disconnected event for every failed reconnect, only the first one counts
+    wifiUp = false;
+    wifiLost = true;
+    wifiLostAt = millis();
+    wifiDisconnects++;
+    Serial.println("WiFi connection lost");
+  }
+}
+
+void setupConnection()
+{
+  WiFi.onEvent(onWiFiEvent, ARDUINO_EVENT_WIFI_STA_GOT_IP);
+  WiFi.onEvent(onWiFiEvent, ARDUINO_EVENT_WIFI_STA_LOST_IP);
+  WiFi.onEvent(onWiFiEvent, ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
+}
+
+bool brokerConfigured(const Config &config)
+{
+  return config.brokerHost[0] != '\0' && config.brokerUser[0] != '\0' && config.brokerPassword[0] != '\0';
+}
+
+static void retryNow()
+{
+  backoff = MQTT_BACKOFF_MIN;
+  mqttWait = 0;
+}
+
+static void sessionLost(uint32_t now)
+{
+  mqttDisconnects++;
+  mqttLost = true;
+  mqttLostAt = now;
+  retryNow();
+}
+
+void stopMqtt(PubSubClient &client, const char *statusTopic)
+{
+  if (client.connected())
+  {
+    client.publish(statusTopic, MQTT_STATUS_OFFLINE, true);
+  }
+  client.disconnect();
+  if (state == CONNECTION_ONLINE)
+  {
+    state = CONNECTION_BACKOFF;
+  }
+  retryNow();
+}
+
+static bool connectMqtt(PubSubClient &client, const Config &config, const char *statusTopic)
+{
+  // PubSubClient keeps the pointer to the host, so the copy has to outlive this call
+  static Config broker;
+  broker = config;
+  client.setServer(broker.brokerHost, broker.brokerPort);
+  client.setKeepAlive(MQTT_KEEP_ALIVE);
+  client.setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+
+  Serial.println("Attempting MQTT connection...");
+  mqttAttempts++;
+  unsigned long start = micros();
+  bool connected = client.connect(broker.brokerClient, broker.brokerUser, broker.brokerPassword, statusTopic, 1, true, MQTT_STATUS_OFFLINE);
+  observeSince(attemptSeconds, start);
+  mqttAttemptAt = millis();
+
+  if (!connected)
+  {
+    // Exponential backoff with jitter, so a restarted broker is not hit by all its clients at the same time
+    mqttFailures++;
+    mqttError = client.state();
+    mqttWait = backoff + random(backoff);
+    backoff = min(backoff * 2, (uint32_t)MQTT_BACKOFF_MAX);
+    if (!mqttLost)
+    {
+      mqttLost = true;
+      mqttLostAt = mqttAttemptAt;
+    }
+    Serial.println("MQTT connection failed with state " + String(mqttError) + ", next attempt in " + String(mqttWait / 1000) + " s");
+    return false;
+  }
+
+  Serial.println("MQTT connected with name: " + String(broker.brokerClient));
+  client.publish(statusTopic, MQTT_STATUS_ONLINE, true);
+  if (mqttLost)
+  {
+    observeHistogram(mqttOutageSeconds, (mqttAttemptAt - mqttLostAt) / 1000.0f);
+    mqttLost = false;
+  }
+  retryNow();
+  return true;
+}
+
+bool serviceConnection(PubSubClient &client, const Config &config, const char *statusTopic)
+{
+  uint32_t now = millis();
+  configured = brokerConfigured(config);
+
+  // Without WiFi settings the gateway only runs the setup AP
+  if (WiFi.getMode() == WIFI_AP)
+  {
+    state = CONNECTION_SETUP_AP;
+    return false;
+  }
+
+  if (!wifiUp)
+  {
+    if (state == CONNECTION_ONLINE)
+    {
+      sessionLost(now);
+    }
+    if (wifiSeen || state == CONNECTION_SETUP_AP)
+    {
+      wifiSeen = false;
+      wifiAttemptAt = now;
+      wifiRetry = WIFI_RETRY_MIN;
+    }
+    state = CONNECTION_WIFI;
+
+    // The driver reconnects on its own, a reconnect is only forced when that takes too long
+    if (now - wifiAttemptAt >= wifiRetry)
+    {
+      Serial.println("Trying to reconnect to your WiFi...");
+      WiFi.reconnect();
+      wifiAttemptAt = now;
+      wifiRetry = min(wifiRetry * 2, (uint32_t)WIFI_RETRY_MAX);
+    }
+    return false;
+  }
+
+  // A new IP means a new route to the broker, the backoff of the old one does not apply
+  if (!wifiSeen)
+  {
+    wifiSeen = true;
+    retryNow();
+  }
+
+  if (client.connected())
+  {
+    state = CONNECTION_ONLINE;
+    return false;
+  }
+  if (state == CONNECTION_ONLINE)
+  {
+    Serial.println("MQTT connection lost with state " + String(client.state()));
+    sessionLost(now);
+  }
+  state = CONNECTION_BACKOFF;
+
+  if (!configured || now - mqttAttemptAt < mqttWait)
+  {
+    return false;
+  }
+  if (!connectMqtt(client, config, statusTopic))
+  {
+    return false;
+  }
+  state = CONNECTION_ONLINE;
+  return true;
+}
+
+ConnectionState connectionState()
+{
+  return state;
+}
+
+String describeConnection()
+{
+  switch (state)
+  {
+  case CONNECTION_SETUP_AP:
+    return "setup AP";
+  case CONNECTION_WIFI:
+    return "waiting for WiFi";
+  case CONNECTION_ONLINE:
+    return "connected";
+  default:
+    break;
+  }
+
+  if (!configured)
+  {
+    return "no MQTT-Server configured";
+  }
+  uint32_t waited = millis() - mqttAttemptAt;
+  uint32_t wait = mqttWait;
+  return "MQTT error " + String(mqttError) + ", next attempt in " + String(waited < wait ? (wait - waited) / 1000 : 0) + " s";
+}
+
+void writeConnectionMetrics(String &out)
+{
+  writeHistogram(out, attemptSeconds);
+  writeHistogram(out, mqttOutageSeconds);
+  writeHistogram(out, wifiOutageSeconds);
+  writeCounter(out, "gateway_mqtt_connect_attempts_total", "MQTT connect attempts.", mqttAttempts);
+  writeCounter(out, "gateway_mqtt_connect_failures_total", "MQTT connect attempts that failed.", mqttFailures);
+  writeCounter(out, "gateway_mqtt_disconnects_total", "Established MQTT sessions that were lost.", mqttDisconnects);
+  writeCounter(out, "gateway_wifi_disconnects_total", "Losses of the WiFi connection.", wifiDisconnects);
+  writeGauge(out, "gateway_mqtt_backoff_seconds", "Wait before the next MQTT attempt after a failed one.", mqttWait / 1000.0);
+  writeGauge(out, "gateway_connection_state", "0 setup AP, 1 waiting for WiFi, 2 waiting for MQTT, 3 connected.", state);
+}
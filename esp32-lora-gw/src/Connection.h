@@ -0,0 +1,46 @@
+#pragma once
+
+#include <Arduino.h>
+#include <PubSubClient.h>
+#include "Config.h"
+
+// WiFi and MQTT connection of the gateway as a state machine the network task steps on every pass.
+// WiFi is followed through its events, MQTT is retried with exponential backoff and jitter, so a broker outage
+// costs one connect attempt per backoff instead of a busy loop. Only the network task may use the client.
+#define WIFI_RETRY_MIN 5000      // ms without IP before WiFi.reconnect(), the driver reconnects on its own first
+#define WIFI_RETRY_MAX 60000     // ms
+#define MQTT_BACKOFF_MIN 1000    // ms before the second attempt, doubled after each failed one plus up to the same again as jitter
+#define MQTT_BACKOFF_MAX 120000  // ms
+#define MQTT_SOCKET_TIMEOUT 5    // seconds an attempt waits for the CONNACK, bounds the time the network task is held up
+#define MQTT_KEEP_ALIVE 30       // seconds, the broker publishes the last will after 1.5 times this without a packet
+#define MQTT_STATUS_ONLINE "connected"
+#define MQTT_STATUS_OFFLINE "disconnected" // retained by the broker as last will as well
+
+typedef enum
+{
+  CONNECTION_SETUP_AP, // no WiFi settings, only the setup AP runs
+  CONNECTION_WIFI,     // waiting for an IP
+  CONNECTION_BACKOFF,  // waiting for the next MQTT attempt, or no broker configured
+  CONNECTION_ONLINE
+} ConnectionState;
+
+// Registers the WiFi events, call once before the station is started
+void setupConnection();
+
+// Publishes the offline status and closes the session, the next attempt follows right away, e.g. with a new broker
+void stopMqtt(PubSubClient &client, const char *statusTopic);
+
+// Steps the state machine, at most one connect attempt per call.
+// Returns true on the call that established a new session, the caller subscribes its topics then.
+bool serviceConnection(PubSubClient &client, const Config &config, const char *statusTopic);
+
+// True if host, user and password are set, without them readings are not kept in the backlog
+bool brokerConfigured(const Config &config);
+
+ConnectionState connectionState();
+
+// State and the time until the next attempt for the status page
+String describeConnection();
+
+// Appends attempt durations, outages and counters for /metrics
+void writeConnectionMetrics(String &out);
@@ -0,0 +1,93 @@
+#include "DeliveryStats.h"
+
+static uint32_t delivered = 0;
+static uint32_t duplicates = 0;
+static uint32_t retransmitted = 0;
+static uint32_t lost = 0;
+
+bool recordDelivery(DeliveryState &state, uint16_t sequence, uint8_t retry, uint32_t received)
+{
+  for (uint8_t i = 0; i < state.historyLength; i++)
+  {
+    if (state.history[i].sequence == sequence && received - state.history[i].received < DELIVERY_DUPLICATE_WINDOW)
+    {
+      state.duplicates++;
+      duplicates++;
+      return false;
+    }
+  }
+
+  state.history[state.historyNext] = {sequence, received};
+  state.historyNext = (state.historyNext + 1) % DELIVERY_HISTORY;
+  state.historyLength = min(state.historyLength + 1, DELIVERY_HISTORY);
+
+  // Forward gaps are lost packets, a late retransmission fills its gap again and a large jump is a restarted sender
+  uint16_t gap = sequence - state.lastSequence - 1;
+  bool late = sequence != state.lastSequence && (uint16_t)(state.lastSequence - sequence) < DELIVERY_MAX_GAP;
+  if (state.heard && gap < DELIVERY_MAX_GAP)
+  {
+    state.lost += gap;
+    lost += gap;
+  }
+  else if (state.heard && late && state.lost > 0)
+  {
+    state.lost--;
+    lost--;
+  }
+  if (!state.heard || !late)
+  {
+    state.lastSequence = sequence;
+  }
+  state.heard = true;
+
+  state.delivered++;
+  delivered++;
+  state.retransmitted += retry;
+  retransmitted += retry;
+  return true;
+}
+
+void recordDuplicate(DeliveryState &state)
+{
+  state.duplicates++;
+  duplicates++;
+}
+
+uint32_t deliveredPackets()
+{
+  return delivered;
+}
+
+uint32_t duplicatePackets()
+{
+  return duplicates;
+}
+
+uint32_t retransmittedPackets()
+{
+  return retransmitted;
+}
+
+uint32_t lostPackets()
+{
+  return lost;
+}
+
+static float ratio(uint32_t delivered, uint32_t lost)
+{
+  if (delivered + lost == 0)
+  {
+    return 100;
+  }
+  return 100.0f * delivered / (delivered + lost);
+}
+
+float deliveryRatio()
+{
+  return ratio(delivered, lost);
+}
+
+float deliveryRatio(const DeliveryState &state)
+{
+  return ratio(state.delivered, state.lost);
+}
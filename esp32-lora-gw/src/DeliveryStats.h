@@ -0,0 +1,45 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Duplicate suppression and delivery statistics of the uplinks, kept per node and summed up for the gateway.
+// Senders in acknowledged mode retransmit with the same sequence number, the first copy is published and later ones are dropped.
+// Only the network task may record, the counters can be read from any task.
+#define DELIVERY_HISTORY 16              // sequence numbers remembered for the duplicate check
+#define DELIVERY_DUPLICATE_WINDOW 60000  // ms a sequence number counts as a duplicate
+#define DELIVERY_MAX_GAP 1024            // larger jumps of the sequence number are a restarted sender, not lost packets
+
+typedef struct
+{
+  uint16_t sequence;
+  uint32_t received; // millis
+} DeliveryEntry;
+
+typedef struct
+{
+  DeliveryEntry history[DELIVERY_HISTORY];
+  uint8_t historyLength;
+  uint8_t historyNext;
+  bool heard;
+  uint16_t lastSequence;
+  uint32_t delivered;
+  uint32_t duplicates;
+  uint32_t retransmitted; // retransmissions that were needed for the delivered packets
+  uint32_t lost;          // gaps in the sequence numbers
+} DeliveryState;
+
+// Returns false if the uplink is a duplicate of one the node sent before
+bool recordDelivery(DeliveryState &state, uint16_t sequence, uint8_t retry, uint32_t received);
+
+// Counts an uplink already known to be a duplicate, e.g. by its frame counter
+void recordDuplicate(DeliveryState &state);
+
+// Sums of all nodes
+uint32_t deliveredPackets();
+uint32_t duplicatePackets();
+uint32_t retransmittedPackets();
+uint32_t lostPackets();
+
+// Delivered packets in percent of the sent ones, 100 until the first packet
+float deliveryRatio();
+float deliveryRatio(const DeliveryState &state);
@@ -0,0 +1,164 @@
+#include "FlowAnalytics.h"
+#include <time.h>
+
+static float litres(uint32_t volume)
+{
+  return volume * (1000.0f / FRAME_VALUE_SCALE);
+}
+
+static bool nightHour(int8_t hour)
+{
+  return hour >= FLOW_NIGHT_START && hour < FLOW_NIGHT_END;
+}
+
+static void setAlarm(FlowState &state, uint8_t alarm, bool raised)
+{
+  state.alarms = raised ? state.alarms | alarm : state.alarms & ~alarm;
+}
+
+// Ends the current hour, the minimum of a night is its night flow once the first hour after it starts
+static void closeHour(FlowState &state, int8_t nextHour)
+{
+  if (nightHour(state.hour) && state.hourComplete)
+  {
+    float hourly = litres(state.hourVolume);
+    state.nightMinimum = isnan(state.nightMinimum) ? hourly : min(state.nightMinimum, hourly);
+  }
+
+  if (nightHour(state.hour) && !nightHour(nextHour))
+  {
+    state.nightFlow = state.nightMinimum;
+    state.nightMinimum = NAN;
+    // A night without a complete hour, e.g. with the sender out of range, leaves the alarm as it was
+    if (!isnan(state.nightFlow))
+    {
+      setAlarm(state, FLOW_ALARM_LEAK, state.nightFlow > FLOW_NIGHT_LEAK);
+    }
+  }
+  state.hourVolume = 0;
+}
+
+uint8_t recordFlow(FlowState &state, const WatermeterReading &reading, uint32_t timestamp)
+{
+  // A failed or erroneous reading repeats an older value, it says nothing about the flow
+  if (timestamp == 0 || (reading.flags & (FRAME_FLAG_METER_FAILED | FRAME_FLAG_METER_ERROR)) || (state.started && timestamp <= state.time))
+  {
+    return 0;
+  }
+
+  time_t now = timestamp;
+  struct tm local;
+  localtime_r(&now, &local);
+
+  if (!state.started)
+  {
+    // The first hour is incomplete, it does not count for the night flow
+    memset(&state, 0, sizeof(state));
+    state.started = true;
+    state.value = reading.value;
+    state.time = timestamp;
+    state.flow = NAN;
+    state.nightMinimum = NAN;
+    state.nightFlow = NAN;
+    state.day = local.tm_yday;
+    state.hour = local.tm_hour;
+    return 0;
+  }
+
+  uint32_t elapsed = timestamp - state.time;
+  bool fell = reading.value < state.value;
+  uint32_t used = fell ? 0 : reading.value - state.value;
+  bool suspicious = fell ? state.value - reading.value > FLOW_RESET_TOLERANCE : litres(used) * 60 > FLOW_MAX_RATE * elapsed;
+
+  // A misread digit is corrected by the next reading, until then the reading is skipped and the base stays
+  if (suspicious && ++state.suspicious < FLOW_RESET_READINGS)
+  {
+    return 0;
+  }
+
+  uint8_t before = state.alarms;
+  bool gap = elapsed > FLOW_MAX_GAP;
+  if (suspicious)
+  {
+    // The meter was reset or replaced, what it counted before the new value is unknown
+    char node[FRAME_NODE_TEXT_LENGTH];
+    formatNode(reading.node, node);
+    Serial.println("Meter " + String(reading.meter) + " of node " + String(node) + " reset from " + String(state.value) + " to " + String(reading.value));
+    state.resets++;
+    state.value = reading.value;
+    used = 0;
+    gap = true;
+  }
+  else if (!fell)
+  {
+    // A value that fell a little keeps the base, so it is not counted twice when it rises again
+    state.value = reading.value;
+  }
+  state.suspicious = 0;
+  state.time = timestamp;
+
+  if (local.tm_hour != state.hour || local.tm_yday != state.day)
+  {
+    closeHour(state, local.tm_hour);
+    state.hour = local.tm_hour;
+    state.hourComplete = true;
+  }
+  if (local.tm_yday != state.day)
+  {
+    state.yesterday = state.today;
+    state.today = 0;
+    state.day = local.tm_yday;
+  }
+  state.today += used;
+  state.hourVolume += used;
+
+  // The consumption of a gap is in the totals, but when it flowed is unknown
+  if (gap)
+  {
+    state.hourComplete = false;
+    state.flow = NAN;
+    state.flowingSince = 0;
+  }
+  else
+  {
+    state.flow = litres(used) * 60 / elapsed;
+    if (used == 0)
+    {
+      state.flowingSince = 0;
+    }
+    else if (state.flowingSince == 0)
+    {
+      state.flowingSince = timestamp - elapsed;
+    }
+    setAlarm(state, FLOW_ALARM_BURST, state.flow > FLOW_BURST_RATE);
+    setAlarm(state, FLOW_ALARM_CONTINUOUS, flowDuration(state) >= FLOW_CONTINUOUS_LIMIT);
+  }
+
+  uint8_t changed = state.alarms ^ before;
+  if (changed)
+  {
+    char node[FRAME_NODE_TEXT_LENGTH];
+    formatNode(reading.node, node);
+    Serial.println("Flow alarms of meter " + String(reading.meter) + " of node " + String(node) + ": leak " + String(state.alarms & FLOW_ALARM_LEAK ? "on" : "off") +
+                   ", continuous flow " + String(state.alarms & FLOW_ALARM_CONTINUOUS ? "on" : "off") + ", burst " + String(state.alarms & FLOW_ALARM_BURST ? "on" : "off"));
+  }
+  return changed;
+}
+
+uint8_t confirmFlow(FlowState &state, uint16_t node, uint8_t meter, uint32_t timestamp)
+{
+  if (!state.started)
+  {
+    return 0;
+  }
+  WatermeterReading reading = {};
+  reading.node = node;
+  reading.meter = meter;
+  reading.value = state.value;
+  return recordFlow(state, reading, timestamp);
+}
+
+uint32_t flowDuration(const FlowState &state)
+{
+  return state.flowingSince == 0 ? 0 : state.time - state.flowingSince;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WatermeterFrame.h>
+
+// Flow analytics of a meter, updated with every decoded reading in constant memory: the flow of the last interval,
+// how long water has been flowing without a pause, the daily consumption and the minimum night flow, the lowest
+// hourly consumption between FLOW_NIGHT_START and FLOW_NIGHT_END. Hours and days follow the local time of TIMEZONE.
+// A meter value that falls more than FLOW_RESET_TOLERANCE or rises faster than FLOW_MAX_RATE is a misread until
+// FLOW_RESET_READINGS readings in a row confirm it, then it is a reset or a replaced meter and the new value is the base.
+// Only the network task may record.
+#define FLOW_MAX_GAP 1800           // s between readings, the consumption of longer gaps counts for the totals but has no flow
+#define FLOW_RESET_TOLERANCE 100    // fixed-point FRAME_VALUE_SCALE, 10 L a value may fall without being suspicious
+#define FLOW_MAX_RATE 200.0f        // L/min, more is a misread digit, a house connection delivers about 50
+#define FLOW_RESET_READINGS 3       // suspicious readings in a row that make a reset
+#define FLOW_BURST_RATE 30.0f       // L/min over a whole interval, a burst pipe or a hose left open
+#define FLOW_CONTINUOUS_LIMIT 7200  // s of flow without a pause that count as leak
+#define FLOW_NIGHT_START 1          // local hour
+#define FLOW_NIGHT_END 5            // local hour, exclusive
+#define FLOW_NIGHT_LEAK 1.0f        // L/h, a higher minimum night flow is a leak, e.g. a dripping tap or a running toilet
+
+typedef enum
+{
+  FLOW_ALARM_LEAK = 0x01,       // minimum night flow above FLOW_NIGHT_LEAK, until the next night
+  FLOW_ALARM_CONTINUOUS = 0x02, // flow for FLOW_CONTINUOUS_LIMIT, until the next pause
+  FLOW_ALARM_BURST = 0x04       // flow above FLOW_BURST_RATE, until it drops
+} FlowAlarm;
+
+typedef struct
+{
+  bool started;
+  uint32_t value;        // base for the consumption, fixed-point FRAME_VALUE_SCALE
+  uint32_t time;         // of the last reading
+  uint8_t suspicious;    // readings in a row that did not fit the base
+  float flow;            // L/min of the last interval, NAN after a gap
+  uint32_t flowingSince; // start of the flow without a pause, 0 while no water flows
+  uint32_t today;        // since local midnight, fixed-point FRAME_VALUE_SCALE
+  uint32_t yesterday;
+  uint32_t hourVolume;   // in the current local hour, fixed-point FRAME_VALUE_SCALE
+  int16_t day;           // local day of the year
+  int8_t hour;           // local hour
+  bool hourComplete;     // readings without a gap since the start of the hour
+  float nightMinimum;    // L/h, of the complete hours of the current night, NAN before the first one
+  float nightFlow;       // L/h, minimum of the last night, NAN before the first night
+  uint8_t alarms;        // FlowAlarm
+  uint16_t resets;
+} FlowState;
+
+// Records a reading taken at timestamp, returns the alarms that were raised or cleared by it.
+// Readings without a timestamp or value, and readings older than the last one are ignored.
+uint8_t recordFlow(FlowState &state, const WatermeterReading &reading, uint32_t timestamp);
+
+// A heartbeat of a sender in report-by-exception mode confirms at timestamp that the value did not change since
+// the last reading. Returns the alarms that were raised or cleared, like a reading.
+uint8_t confirmFlow(FlowState &state, uint16_t node, uint8_t meter, uint32_t timestamp);
+
+// Seconds water has been flowing without a pause at the last reading
+uint32_t flowDuration(const FlowState &state);
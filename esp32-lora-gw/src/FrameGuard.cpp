@@ -0,0 +1,127 @@
+#include "FrameGuard.h"
+#include "DeliveryStats.h"
+#include <Preferences.h>
+#include <WatermeterFrame.h>
+
+static FrameKey frameKey;
+static bool secured = false;
+static uint32_t unauthenticated = 0;
+static uint32_t replayed = 0;
+
+void setupFrameGuard(const uint8_t *key)
+{
+  secured = hasFrameKey(key);
+  if (secured)
+  {
+    setupFrameKey(frameKey, key);
+  }
+}
+
+void changeFrameKey(const uint8_t *key)
+{
+  setupFrameGuard(key);
+
+  Preferences preferences;
+  preferences.begin(GUARD_NAMESPACE, false);
+  preferences.clear();
+  preferences.end();
+  preferences.begin(GUARD_LEGACY_NAMESPACE, false);
+  preferences.clear();
+  preferences.end();
+}
+
+bool framesSecured()
+{
+  return secured;
+}
+
+bool admitFrame(uint8_t *buffer, uint8_t &length, uint32_t &counter)
+{
+  counter = 0;
+  size_t opened = length;
+  bool admitted = secured ? openFrame(frameKey, buffer, opened, counter) : !isSecuredFrame(buffer, length);
+  if (!admitted)
+  {
+    unauthenticated++;
+    return false;
+  }
+  length = opened;
+  return true;
+}
+
+void resetReplay(ReplayState &state, uint16_t node)
+{
+  char key[FRAME_NODE_TEXT_LENGTH];
+  formatNode(node, key);
+
+  Preferences preferences;
+  preferences.begin(GUARD_NAMESPACE, true);
+  state.storedCounter = preferences.getUInt(key, 0);
+  preferences.end();
+  if (state.storedCounter == 0)
+  {
+    // A legacy entry only knows the epoch, its frames are checked from the start of it like before the update
+    preferences.begin(GUARD_LEGACY_NAMESPACE, true);
+    state.storedCounter = (uint32_t)preferences.getUShort(key, 0) << 16;
+    preferences.end();
+  }
+
+  // Frames up to GUARD_STORE_INTERVAL - 1 after the stored one may have been accepted without a write
+  state.counter = state.storedCounter > 0 ? state.storedCounter + GUARD_STORE_INTERVAL - 1 : 0;
+  state.received = 0;
+  state.heard = false;
+}
+
+CounterCheck checkCounter(ReplayState &state, uint32_t counter, uint8_t retry, uint32_t received)
+{
+  if (!secured)
+  {
+    return COUNTER_NEW;
+  }
+  if (counter > state.counter)
+  {
+    state.counter = counter;
+    state.received = received;
+    state.heard = true;
+    return COUNTER_NEW;
+  }
+  if (counter == state.counter && state.heard && retry > 0 && received - state.received < DELIVERY_DUPLICATE_WINDOW)
+  {
+    return COUNTER_RETRANSMISSION;
+  }
+  replayed++;
+  return COUNTER_REPLAYED;
+}
+
+size_t signAnswer(uint32_t counter, uint8_t *buffer, size_t length, size_t size)
+{
+  return secured && length > 0 ? signLink(frameKey, counter, buffer, length, size) : length;
+}
+
+void storeCounter(ReplayState &state, uint16_t node, uint32_t counter)
+{
+  bool newEpoch = counter >> 16 != state.storedCounter >> 16;
+  if (counter <= state.storedCounter || (!newEpoch && counter - state.storedCounter < GUARD_STORE_INTERVAL))
+  {
+    return;
+  }
+
+  char key[FRAME_NODE_TEXT_LENGTH];
+  formatNode(node, key);
+
+  Preferences preferences;
+  preferences.begin(GUARD_NAMESPACE, false);
+  preferences.putUInt(key, counter);
+  preferences.end();
+  state.storedCounter = counter;
+}
+
+uint32_t unauthenticatedFrames()
+{
+  return unauthenticated;
+}
+
+uint32_t replayedFrames()
+{
+  return replayed;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FrameSecurity.h>
+
+// Admission of received frames when a key is set, see FrameSecurity.h. Only frames with a valid tag are decrypted and
+// handed on, plain frames and forged ones are dropped before they can add a node or get an answer.
+// Replay protection: a frame is only accepted if its frame counter, the epoch of the sender and the sequence number,
+// is newer than the one of the last authenticated frame of the node. The same counter is only taken as retransmission
+// if the retry of the header is set and the last frame arrived within DELIVERY_DUPLICATE_WINDOW. The retry is not
+// covered by the tag, so a retransmission is acknowledged but neither published nor taken as a sign of life.
+// The counter of every node is kept in NVS, written on every GUARD_STORE_INTERVAL-th frame and with every new epoch, so
+// at most GUARD_STORE_INTERVAL - 1 frames are accepted after the last write. After a restart of the gateway all counters
+// up to the stored one plus GUARD_STORE_INTERVAL - 1 are rejected, up to that many frames a sender sends right after
+// the restart are lost.
+// A new key starts all counters over, e.g. for a sender whose flash was erased.
+// Everything but storeCounter() belongs to the radio task.
+#define GUARD_NAMESPACE "counters"
+#define GUARD_LEGACY_NAMESPACE "epochs" // stored epochs of firmwares before the counter, read until the first write
+#define GUARD_STORE_INTERVAL 8          // frames of a node between two writes of its counter
+
+typedef enum
+{
+  COUNTER_NEW,
+  COUNTER_RETRANSMISSION, // of the last frame, to be acknowledged again
+  COUNTER_REPLAYED
+} CounterCheck;
+
+typedef struct
+{
+  uint32_t counter;       // radio task only, of the last authenticated frame
+  uint32_t received;      // radio task only, millis of that frame
+  bool heard;             // radio task only, false until the first frame after the reset
+  uint32_t storedCounter; // network task only, as stored in NVS
+} ReplayState;
+
+// Derives the keys, a key of all zeros admits plain frames only
+void setupFrameGuard(const uint8_t *key);
+
+// Derives the new keys and forgets the stored counters, the replay state of every node has to be reset afterwards
+void changeFrameKey(const uint8_t *key);
+bool framesSecured();
+
+// Decrypts a secured frame in place and returns its frame counter, 0 for a plain frame.
+// Returns false for frames that do not match the key or its absence.
+bool admitFrame(uint8_t *buffer, uint8_t &length, uint32_t &counter);
+
+// Loads the stored counter of a new node before its entry is published
+void resetReplay(ReplayState &state, uint16_t node);
+
+// A new frame becomes the last frame of the node, plain frames are always new when no key is set.
+// retry is the one of the header, received the millis of the frame.
+CounterCheck checkCounter(ReplayState &state, uint32_t counter, uint8_t retry, uint32_t received);
+
+// Adds the tag to the link frame that answers the uplink with counter if a key is set, returns the new length
+size_t signAnswer(uint32_t counter, uint8_t *buffer, size_t length, size_t size);
+
+// Network task: stores the counter of an admitted frame every GUARD_STORE_INTERVAL frames and with a new epoch
+void storeCounter(ReplayState &state, uint16_t node, uint32_t counter);
+
+uint32_t unauthenticatedFrames();
+uint32_t replayedFrames();
@@ -0,0 +1,50 @@
+#include "FrameRing.h"
+#include <atomic>
+
+static RadioFrame frames[FRAME_RING_CAPACITY];
+
+// Free-running indices, only the producer writes head and only the consumer writes tail
+static std::atomic<uint32_t> head(0);
+static std::atomic<uint32_t> tail(0);
+static std::atomic<uint32_t> dropped(0);
+
+RadioFrame *reserveFrame()
+{
+  uint32_t current = head.load(std::memory_order_relaxed);
+  if (current - tail.load(std::memory_order_acquire) >= FRAME_RING_CAPACITY)
+  {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+  return &frames[current & (FRAME_RING_CAPACITY - 1)];
+}
+
+void commitFrame()
+{
+  head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+RadioFrame *peekFrame()
+{
+  uint32_t current = tail.load(std::memory_order_relaxed);
+  if (current == head.load(std::memory_order_acquire))
+  {
+    return nullptr;
+  }
+  return &frames[current & (FRAME_RING_CAPACITY - 1)];
+}
+
+void releaseFrame()
+{
+  tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+uint32_t droppedFrames()
+{
+  return dropped.load(std::memory_order_relaxed);
+}
+
+uint32_t queuedFrames()
+{
+  return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+}
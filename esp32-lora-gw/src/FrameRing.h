@@ -0,0 +1,32 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WatermeterFrame.h>
+
+// Single-producer/single-consumer ring of received LoRa frames.
+// The radio task is the only producer and the network task the only consumer, so no locks are needed.
+#define FRAME_RING_CAPACITY 16 // must be a power of two
+
+typedef struct
+{
+  uint8_t data[FRAME_MAX_LENGTH];
+  uint8_t length;
+  int16_t rssi;
+  float snr;
+  int32_t frequencyError; // Hz
+  uint32_t airtime;       // µs, computed from the length and the link profile
+  uint32_t received;      // millis
+  uint32_t counter;       // epoch and sequence number of a secured frame, 0 for a plain one
+  bool retransmission;    // secured frame with the counter of the last one, acknowledged again but not published
+} RadioFrame;
+
+// Producer: returns a free slot or nullptr if the ring is full, the frame is then counted as dropped
+RadioFrame *reserveFrame();
+void commitFrame();
+
+// Consumer: returns the oldest frame or nullptr if the ring is empty
+RadioFrame *peekFrame();
+void releaseFrame();
+
+uint32_t droppedFrames();
+uint32_t queuedFrames();
@@ -0,0 +1,29 @@
+#include "GatewayState.h"
+#include <atomic>
+
+static GatewayState current;
+
+// Sequence lock: the version is odd while the state is written
+static std::atomic<uint32_t> version(0);
+
+void storeState(const GatewayState &state)
+{
+  uint32_t previous = version.load(std::memory_order_relaxed);
+  version.store(previous + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  current = state;
+  version.store(previous + 2, std::memory_order_release);
+}
+
+GatewayState loadState()
+{
+  GatewayState state;
+  uint32_t before;
+  do
+  {
+    before = version.load(std::memory_order_acquire);
+    state = current;
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((before & 1) || version.load(std::memory_order_relaxed) != before);
+  return state;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WatermeterFrame.h>
+
+// Latest decoded packet, written once per packet by the network task and read by the web server.
+// The snapshot is guarded by a sequence lock like the state of a node, readers never block the writer and retry a half-written state.
+typedef struct
+{
+  bool valid; // false until the first packet
+  WatermeterReading reading;
+  uint32_t timestamp; // 0 until NTP has set the clock
+  uint32_t received;  // millis
+  int16_t rssi;
+  float snr;
+  uint32_t packets;
+  uint32_t silence;   // ms the node may stay silent between uplinks, 0 while unknown
+} GatewayState;
+
+void storeState(const GatewayState &state);
+GatewayState loadState();
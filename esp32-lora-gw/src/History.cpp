@@ -0,0 +1,888 @@
+#include "History.h"
+#include "SegmentFiles.h"
+#include <SPIFFS.h>
+#include <Metrics.h>
+
+#define HISTORY_POSITION_FILE "/history/position"
+#define HISTORY_POSITION_MAGIC 0x48495354 // "HIST"
+#define HISTORY_SEGMENT_EXTENSION ".blk"
+#define HISTORY_MAGIC 0x48
+#define HISTORY_SEGMENT_SIZE (HISTORY_SEGMENT_BLOCKS * HISTORY_BLOCK_SIZE) // bytes, at most 64 blocks for the mask of the downsampling
+#define HISTORY_PAYLOAD_BITS (8 * (HISTORY_BLOCK_SIZE - sizeof(HistoryBlockHeader)))
+#define HISTORY_MAX_POINTS 255 // count of the header
+#define HISTORY_NAN 0x7fc00000 // all missing fields are the same NaN, so a field that stays missing costs a bit
+#define HISTORY_NO_WINDOW 0xff
+
+typedef struct
+{
+  uint32_t first[HISTORY_LEVELS];
+  uint32_t last[HISTORY_LEVELS]; // segment appended to
+} HistoryPosition;
+
+typedef struct
+{
+  bool used;
+  uint16_t node;
+  uint8_t meter;
+  uint32_t value; // last meter value, the base of the next block if its first reading has none
+  uint32_t last;  // time of the last point
+  HistoryBlock block;
+  HistoryCodec codec;
+} HistorySeries;
+
+// Prefix and width of the delta of delta, the last bucket takes any value
+static const uint8_t timeBuckets[][3] = {{0b10, 2, 7}, {0b110, 3, 9}, {0b1110, 4, 12}, {0b1111, 4, 32}};
+
+// Everything below is guarded by the mutex
+static SemaphoreHandle_t mutex = NULL;
+static HistoryPosition position;
+static HistorySeries series[HISTORY_SERIES];
+static HistoryBlock scratch; // raw block being downsampled
+static HistoryBlock downsampledBlock;
+static uint32_t points = 0;
+static uint32_t bytes = 0;
+static uint32_t rejected = 0;
+static uint32_t downsampledSegments = 0;
+static uint32_t droppedSegments = 0;
+
+static String levelDirectory(uint8_t level)
+{
+  return "/history/" + String(level);
+}
+
+static String segmentPath(uint8_t level, uint32_t segment)
+{
+  return levelDirectory(level) + "/" + String(segment) + HISTORY_SEGMENT_EXTENSION;
+}
+
+static uint8_t checksum(const HistoryBlock &block)
+{
+  // CRC-8, polynomial 0x07, over the whole block but the checksum
+  const uint8_t *data = (const uint8_t *)&block;
+  uint8_t crc = 0;
+  for (size_t i = 0; i < sizeof(block); i++)
+  {
+    if (i == offsetof(HistoryBlockHeader, checksum))
+    {
+      continue;
+    }
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; bit++)
+    {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+static uint32_t floatBits(float value)
+{
+  if (isnan(value))
+  {
+    return HISTORY_NAN;
+  }
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+static float bitsFloat(uint32_t bits)
+{
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static bool writeBits(HistoryBlock &block, HistoryCodec &codec, uint32_t value, uint8_t count)
+{
+  if (codec.bit + count > HISTORY_PAYLOAD_BITS)
+  {
+    return false;
+  }
+  for (int8_t i = count - 1; i >= 0; i--)
+  {
+    if ((value >> i) & 1)
+    {
+      block.payload[codec.bit >> 3] |= 0x80 >> (codec.bit & 7);
+    }
+    codec.bit++;
+  }
+  return true;
+}
+
+static uint32_t readBits(const HistoryBlock &block, HistoryCodec &codec, uint8_t count)
+{
+  uint32_t value = 0;
+  for (uint8_t i = 0; i < count && codec.bit < HISTORY_PAYLOAD_BITS; i++)
+  {
+    value = (value << 1) | ((block.payload[codec.bit >> 3] >> (7 - (codec.bit & 7))) & 1);
+    codec.bit++;
+  }
+  return value;
+}
+
+static void startCodec(HistoryCodec &codec, uint32_t time)
+{
+  memset(&codec, 0, sizeof(codec));
+  codec.time = time;
+  memset(codec.leading, HISTORY_NO_WINDOW, sizeof(codec.leading));
+}
+
+static void startBlock(HistoryBlock &block, HistoryCodec &codec, uint8_t level, uint16_t node, uint8_t meter, uint32_t base, uint32_t time)
+{
+  memset(&block, 0, sizeof(block));
+  block.header.magic = HISTORY_MAGIC;
+  block.header.level = level;
+  block.header.node = node;
+  block.header.meter = meter;
+  block.header.base = base;
+  block.header.first = time;
+  block.header.last = time;
+  startCodec(codec, time);
+}
+
+static bool encodeTime(HistoryBlock &block, HistoryCodec &codec, uint32_t time)
+{
+  int32_t delta = time - codec.time;
+  int32_t deltaOfDelta = delta - codec.delta;
+  codec.time = time;
+  codec.delta = delta;
+
+  if (deltaOfDelta == 0)
+  {
+    return writeBits(block, codec, 0, 1);
+  }
+  for (const uint8_t *bucket : timeBuckets)
+  {
+    if (bucket[2] == 32 || (deltaOfDelta >= -(1L << (bucket[2] - 1)) && deltaOfDelta < (1L << (bucket[2] - 1))))
+    {
+      return writeBits(block, codec, bucket[0], bucket[1]) && writeBits(block, codec, deltaOfDelta, bucket[2]);
+    }
+  }
+  return false;
+}
+
+static void decodeTime(const HistoryBlock &block, HistoryCodec &codec)
+{
+  uint8_t ones = 0;
+  while (ones < 4 && readBits(block, codec, 1) == 1)
+  {
+    ones++;
+  }
+
+  int32_t deltaOfDelta = 0;
+  if (ones > 0)
+  {
+    uint8_t width = timeBuckets[ones - 1][2];
+    uint32_t bits = readBits(block, codec, width);
+    deltaOfDelta = width == 32 ? (int32_t)bits : (int32_t)(bits << (32 - width)) >> (32 - width);
+  }
+  codec.delta += deltaOfDelta;
+  codec.time += codec.delta;
+}
+
+// '0' for the same value, '10' and the meaningful bits if they fit into the window of the last XOR,
+// '11', 5 bits of leading zeros, 5 bits of length and the meaningful bits otherwise
+static bool encodeField(HistoryBlock &block, HistoryCodec &codec, uint8_t field, uint32_t bits)
+{
+  uint32_t change = bits ^ codec.fields[field];
+  codec.fields[field] = bits;
+  if (change == 0)
+  {
+    return writeBits(block, codec, 0, 1);
+  }
+
+  uint8_t leading = __builtin_clz(change);
+  uint8_t trailing = __builtin_ctz(change);
+  if (codec.leading[field] != HISTORY_NO_WINDOW && leading >= codec.leading[field] && trailing >= codec.trailing[field])
+  {
+    return writeBits(block, codec, 0b10, 2) &&
+           writeBits(block, codec, change >> codec.trailing[field], 32 - codec.leading[field] - codec.trailing[field]);
+  }
+
+  uint8_t length = 32 - leading - trailing;
+  codec.leading[field] = leading;
+  codec.trailing[field] = trailing;
+  return writeBits(block, codec, 0b11, 2) && writeBits(block, codec, leading, 5) && writeBits(block, codec, length - 1, 5) &&
+         writeBits(block, codec, change >> trailing, length);
+}
+
+static void decodeField(const HistoryBlock &block, HistoryCodec &codec, uint8_t field)
+{
+  if (readBits(block, codec, 1) == 0)
+  {
+    return;
+  }
+  if (readBits(block, codec, 1) == 1)
+  {
+    uint8_t leading = readBits(block, codec, 5);
+    uint8_t length = readBits(block, codec, 5) + 1;
+    codec.leading[field] = leading;
+    codec.trailing[field] = leading + length > 32 ? 0 : 32 - leading - length;
+  }
+  if (codec.leading[field] == HISTORY_NO_WINDOW)
+  {
+    return;
+  }
+  uint8_t trailing = codec.trailing[field];
+  codec.fields[field] ^= readBits(block, codec, 32 - codec.leading[field] - trailing) << trailing;
+}
+
+// Appends a point, or leaves the block as it was and returns false if the point does not fit
+static bool appendPoint(HistoryBlock &block, HistoryCodec &codec, uint32_t time, const float *fields)
+{
+  if (block.header.count >= HISTORY_MAX_POINTS)
+  {
+    return false;
+  }
+
+  HistoryCodec saved = codec;
+  bool fits = encodeTime(block, codec, time);
+  for (uint8_t i = 0; fits && i < HISTORY_FIELDS; i++)
+  {
+    fits = encodeField(block, codec, i, floatBits(fields[i]));
+  }
+  if (!fits)
+  {
+    // Only the bits of this point are cleared, the unused part of the payload stays zero for the checksum
+    for (uint16_t bit = saved.bit; bit < codec.bit; bit++)
+    {
+      block.payload[bit >> 3] &= ~(0x80 >> (bit & 7));
+    }
+    codec = saved;
+    return false;
+  }
+
+  block.header.count++;
+  block.header.last = time;
+  block.header.bits = codec.bit;
+  return true;
+}
+
+static void decodePoint(const HistoryBlock &block, HistoryCodec &codec, HistoryPoint &point)
+{
+  decodeTime(block, codec);
+  for (uint8_t i = 0; i < HISTORY_FIELDS; i++)
+  {
+    decodeField(block, codec, i);
+  }
+
+  point.time = codec.time;
+  point.value = (block.header.base + (double)bitsFloat(codec.fields[0])) / FRAME_VALUE_SCALE;
+  point.rate = bitsFloat(codec.fields[1]) / FRAME_RATE_SCALE;
+  point.temperature = bitsFloat(codec.fields[2]) / FRAME_CLIMATE_SCALE;
+  point.humidity = bitsFloat(codec.fields[3]) / FRAME_CLIMATE_SCALE;
+  point.rssi = bitsFloat(codec.fields[4]);
+}
+
+// Fields in the fixed-point units of the frame, values as offset from the base of the block
+static void pointFields(const HistoryPoint &point, uint32_t base, float *fields)
+{
+  fields[0] = isnan(point.value) ? NAN : (float)(llround(point.value * FRAME_VALUE_SCALE) - (int64_t)base);
+  fields[1] = point.rate * FRAME_RATE_SCALE;
+  fields[2] = point.temperature * FRAME_CLIMATE_SCALE;
+  fields[3] = point.humidity * FRAME_CLIMATE_SCALE;
+  fields[4] = point.rssi;
+}
+
+static void readingFields(const WatermeterReading &reading, uint32_t base, float rssi, float *fields)
+{
+  bool meter = !(reading.flags & FRAME_FLAG_METER_FAILED);
+  bool sensor = !(reading.flags & FRAME_FLAG_SENSOR_FAILED);
+  fields[0] = meter ? (float)(int32_t)(reading.value - base) : NAN;
+  fields[1] = meter && (reading.flags & FRAME_FLAG_HAS_RATE) ? (float)reading.rate : NAN;
+  fields[2] = sensor ? (float)reading.temperature : NAN;
+  fields[3] = sensor ? (float)reading.humidity : NAN;
+  fields[4] = rssi;
+}
+
+static void openBucket(HistoryBucket &bucket, uint32_t time, uint32_t step)
+{
+  memset(&bucket, 0, sizeof(bucket));
+  bucket.open = true;
+  bucket.time = time - time % step;
+  bucket.value = NAN;
+}
+
+static void addToBucket(HistoryBucket &bucket, const HistoryPoint &point)
+{
+  if (!isnan(point.value))
+  {
+    bucket.value = point.value;
+  }
+  const float fields[] = {point.rate, point.temperature, point.humidity, point.rssi};
+  for (uint8_t i = 0; i < HISTORY_FIELDS - 1; i++)
+  {
+    if (!isnan(fields[i]))
+    {
+      bucket.sums[i] += fields[i];
+      bucket.counts[i]++;
+    }
+  }
+}
+
+static void closeBucket(HistoryBucket &bucket, HistoryPoint &point)
+{
+  float means[HISTORY_FIELDS - 1];
+  for (uint8_t i = 0; i < HISTORY_FIELDS - 1; i++)
+  {
+    means[i] = bucket.counts[i] > 0 ? bucket.sums[i] / bucket.counts[i] : NAN;
+  }
+  point.time = bucket.time;
+  point.value = bucket.value;
+  point.rate = means[0];
+  point.temperature = means[1];
+  point.humidity = means[2];
+  point.rssi = means[3];
+  bucket.open = false;
+}
+
+// Reads the block at index of a segment, false at the end of the segment or if the block is torn
+static bool readBlock(File &file, uint16_t index, HistoryBlock &block)
+{
+  if (!file.seek(index * HISTORY_BLOCK_SIZE) || file.read((uint8_t *)&block, sizeof(block)) != sizeof(block))
+  {
+    return false;
+  }
+  return block.header.magic == HISTORY_MAGIC && block.header.count > 0 && block.header.bits <= HISTORY_PAYLOAD_BITS &&
+         checksum(block) == block.header.checksum;
+}
+
+static bool spiffsFull()
+{
+  return SPIFFS.usedBytes() + HISTORY_SEGMENT_SIZE > SPIFFS.totalBytes();
+}
+
+static void savePosition()
+{
+  writePositionFile(HISTORY_POSITION_FILE, HISTORY_POSITION_MAGIC, &position, sizeof(position));
+}
+
+static void writeBlock(uint8_t level, HistoryBlock &block);
+
+static void dropOldestSegment()
+{
+  SPIFFS.remove(segmentPath(HISTORY_DOWNSAMPLED, position.first[HISTORY_DOWNSAMPLED]));
+  position.first[HISTORY_DOWNSAMPLED]++;
+  droppedSegments++;
+}
+
+static void appendDownsampled(HistoryCodec &codec, HistoryBucket &bucket, uint16_t node, uint8_t meter, uint32_t base)
+{
+  HistoryPoint point;
+  closeBucket(bucket, point);
+  if (!isnan(point.value))
+  {
+    base = llround(point.value * FRAME_VALUE_SCALE);
+  }
+
+  float fields[HISTORY_FIELDS];
+  if (downsampledBlock.header.count > 0)
+  {
+    pointFields(point, downsampledBlock.header.base, fields);
+    if (appendPoint(downsampledBlock, codec, point.time, fields))
+    {
+      return;
+    }
+    writeBlock(HISTORY_DOWNSAMPLED, downsampledBlock);
+  }
+  startBlock(downsampledBlock, codec, HISTORY_DOWNSAMPLED, node, meter, base, point.time);
+  pointFields(point, base, fields);
+  appendPoint(downsampledBlock, codec, point.time, fields);
+}
+
+// Moves the oldest raw segment to the downsampled level, one series after the other
+static void downsampleOldestSegment()
+{
+  uint32_t segment = position.first[HISTORY_RAW];
+  File file = SPIFFS.open(segmentPath(HISTORY_RAW, segment), FILE_READ);
+  uint16_t blocks = file ? min((size_t)HISTORY_SEGMENT_BLOCKS, file.size() / HISTORY_BLOCK_SIZE) : 0;
+  uint64_t done = 0; // blocks of series already downsampled
+
+  for (uint16_t i = 0; i < blocks; i++)
+  {
+    if ((done & (1ULL << i)) || !readBlock(file, i, scratch))
+    {
+      continue;
+    }
+
+    uint16_t node = scratch.header.node;
+    uint8_t meter = scratch.header.meter;
+    uint32_t base = scratch.header.base;
+    HistoryCodec codec;
+    HistoryBucket bucket = {};
+    downsampledBlock.header.count = 0;
+    for (uint16_t j = i; j < blocks; j++)
+    {
+      if (j > i && ((done & (1ULL << j)) || !readBlock(file, j, scratch) || scratch.header.node != node || scratch.header.meter != meter))
+      {
+        continue;
+      }
+      done |= 1ULL << j;
+      base = scratch.header.base;
+
+      HistoryCodec raw;
+      startCodec(raw, scratch.header.first);
+      for (uint8_t k = 0; k < scratch.header.count; k++)
+      {
+        HistoryPoint point;
+        decodePoint(scratch, raw, point);
+        if (bucket.open && point.time - point.time % HISTORY_DOWNSAMPLE_STEP != bucket.time)
+        {
+          appendDownsampled(codec, bucket, node, meter, base);
+        }
+        if (!bucket.open)
+        {
+          openBucket(bucket, point.time, HISTORY_DOWNSAMPLE_STEP);
+        }
+        addToBucket(bucket, point);
+      }
+    }
+
+    // The last step of the series may continue in the next segment, it then shows up twice
+    if (bucket.open)
+    {
+      appendDownsampled(codec, bucket, node, meter, base);
+    }
+    writeBlock(HISTORY_DOWNSAMPLED, downsampledBlock);
+  }
+  if (file)
+  {
+    file.close();
+  }
+
+  SPIFFS.remove(segmentPath(HISTORY_RAW, segment));
+  position.first[HISTORY_RAW]++;
+  downsampledSegments++;
+  Serial.println("History segment " + String(segment) + " downsampled");
+}
+
+// Starts a new segment for appends to level, full levels move their oldest segment on
+static void startSegment(uint8_t level)
+{
+  position.last[level]++;
+  while (position.last[level] - position.first[level] >= HISTORY_MAX_SEGMENTS)
+  {
+    if (level == HISTORY_RAW)
+    {
+      downsampleOldestSegment();
+    }
+    else
+    {
+      dropOldestSegment();
+    }
+  }
+
+  // SPIFFS is shared with the backlog, which has to keep readings that were not published yet
+  while (spiffsFull() && position.first[HISTORY_DOWNSAMPLED] < position.last[HISTORY_DOWNSAMPLED])
+  {
+    dropOldestSegment();
+  }
+  savePosition();
+}
+
+static void writeBlock(uint8_t level, HistoryBlock &block)
+{
+  if (block.header.count == 0)
+  {
+    return;
+  }
+  block.header.checksum = checksum(block);
+
+  File file = SPIFFS.open(segmentPath(level, position.last[level]), FILE_APPEND);
+  if (file && file.size() + HISTORY_BLOCK_SIZE > HISTORY_SEGMENT_SIZE)
+  {
+    file.close();
+    startSegment(level);
+    file = SPIFFS.open(segmentPath(level, position.last[level]), FILE_APPEND);
+  }
+  if (!file)
+  {
+    Serial.println("Could not open history segment " + String(position.last[level]));
+    return;
+  }
+
+  size_t written = file.write((const uint8_t *)&block, sizeof(block));
+  file.close();
+  if (written != sizeof(block))
+  {
+    // Blocks are found by their index, appends after a torn block continue in a new segment
+    startSegment(level);
+    return;
+  }
+
+  if (level == HISTORY_RAW)
+  {
+    points += block.header.count;
+    bytes += sizeof(HistoryBlockHeader) + (block.header.bits + 7) / 8;
+  }
+}
+
+static HistorySeries *findSeries(uint16_t node, uint8_t meter, bool create)
+{
+  HistorySeries *unused = nullptr;
+  for (HistorySeries &entry : series)
+  {
+    if (entry.used && entry.node == node && entry.meter == meter)
+    {
+      return &entry;
+    }
+    if (!entry.used && unused == nullptr)
+    {
+      unused = &entry;
+    }
+  }
+  if (!create || unused == nullptr)
+  {
+    return nullptr;
+  }
+
+  memset(unused, 0, sizeof(HistorySeries));
+  unused->used = true;
+  unused->node = node;
+  unused->meter = meter;
+  return unused;
+}
+
+void setupHistory()
+{
+  mutex = xSemaphoreCreateMutex();
+  HistoryPosition saved = {};
+  bool valid = readPositionFile(HISTORY_POSITION_FILE, HISTORY_POSITION_MAGIC, &saved, sizeof(saved));
+  if (!valid)
+  {
+    Serial.println("History position missing or torn, taking the segments from flash");
+  }
+
+  // The position is only saved with a new segment, a reset during downsampling leaves segments it does not know.
+  // The segment files on flash are the range of a level, the saved position only keeps a new segment without blocks.
+  for (uint8_t level = 0; level < HISTORY_LEVELS; level++)
+  {
+    uint32_t oldest;
+    uint32_t newest;
+    if (findSegments(levelDirectory(level).c_str(), HISTORY_SEGMENT_EXTENSION, oldest, newest))
+    {
+      position.first[level] = oldest;
+      position.last[level] = valid ? max(newest, saved.last[level]) : newest;
+    }
+    else
+    {
+      position.first[level] = valid ? saved.last[level] : 0;
+      position.last[level] = position.first[level];
+    }
+  }
+
+  // Blocks are found by their index, appends after a torn block continue in a new segment
+  for (uint8_t level = 0; level < HISTORY_LEVELS; level++)
+  {
+    File last = SPIFFS.open(segmentPath(level, position.last[level]), FILE_READ);
+    if (last && last.size() % HISTORY_BLOCK_SIZE != 0)
+    {
+      Serial.println("History segment " + String(position.last[level]) + " ends with a torn block");
+      startSegment(level);
+    }
+    if (last)
+    {
+      last.close();
+    }
+  }
+
+  Serial.println("History holds " + String(position.last[HISTORY_RAW] - position.first[HISTORY_RAW] + 1) + " raw and " +
+                 String(position.last[HISTORY_DOWNSAMPLED] - position.first[HISTORY_DOWNSAMPLED] + 1) + " downsampled segments");
+}
+
+void recordHistory(const WatermeterReading &reading, uint32_t timestamp, float rssi)
+{
+  // Points without a time cannot be queried, they arrive before NTP set the clock
+  if (timestamp == 0)
+  {
+    return;
+  }
+
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  HistorySeries *entry = findSeries(reading.node, reading.meter, true);
+  if (entry == nullptr || timestamp < entry->last)
+  {
+    rejected++;
+    xSemaphoreGive(mutex);
+    return;
+  }
+
+  bool hasValue = !(reading.flags & FRAME_FLAG_METER_FAILED);
+  uint32_t base = hasValue ? reading.value : entry->value;
+  HistoryBlock &block = entry->block;
+  if (block.header.count > 0 && timestamp - block.header.first >= HISTORY_BLOCK_SPAN)
+  {
+    writeBlock(HISTORY_RAW, block);
+    block.header.count = 0;
+  }
+
+  float fields[HISTORY_FIELDS];
+  if (block.header.count > 0)
+  {
+    readingFields(reading, block.header.base, rssi, fields);
+    if (!appendPoint(block, entry->codec, timestamp, fields))
+    {
+      writeBlock(HISTORY_RAW, block);
+      block.header.count = 0;
+    }
+  }
+  if (block.header.count == 0)
+  {
+    startBlock(block, entry->codec, HISTORY_RAW, reading.node, reading.meter, base, timestamp);
+    readingFields(reading, base, rssi, fields);
+    appendPoint(block, entry->codec, timestamp, fields);
+  }
+
+  if (hasValue)
+  {
+    entry->value = reading.value;
+  }
+  entry->last = timestamp;
+  xSemaphoreGive(mutex);
+}
+
+void beginHistoryQuery(HistoryQuery &query, uint16_t node, uint8_t meter, uint32_t from, uint32_t to, uint32_t step)
+{
+  memset(&query, 0, sizeof(query));
+  query.node = node;
+  query.meter = meter;
+  query.from = from;
+  query.to = to;
+  query.step = step;
+}
+
+static bool blockMatches(const HistoryQuery &query, const HistoryBlockHeader &header)
+{
+  return header.node == query.node && header.meter == query.meter && header.last >= query.from && header.first <= query.to;
+}
+
+// Loads the next block of the series that overlaps the range, false after the open block.
+// The end of the raw level and the copy of the open block are one step, so a block flushed in between is not missed.
+static bool loadBlock(HistoryQuery &query)
+{
+  bool loaded = false;
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  while (!loaded && query.pass < 3)
+  {
+    if (query.pass == 2)
+    {
+      HistorySeries *entry = findSeries(query.node, query.meter, false);
+      if (entry != nullptr && entry->block.header.count > 0)
+      {
+        query.block = entry->block;
+        loaded = blockMatches(query, query.block.header);
+      }
+      query.pass++;
+      break;
+    }
+
+    uint8_t level = query.pass == 0 ? HISTORY_DOWNSAMPLED : HISTORY_RAW;
+    if (query.segment < position.first[level])
+    {
+      query.segment = position.first[level];
+      query.blockIndex = 0;
+    }
+    if (query.segment > position.last[level])
+    {
+      query.pass++;
+      query.segment = 0;
+      query.blockIndex = 0;
+      continue;
+    }
+
+    File file = SPIFFS.open(segmentPath(level, query.segment), FILE_READ);
+    while (file && !loaded && query.blockIndex < HISTORY_SEGMENT_BLOCKS)
+    {
+      if (!readBlock(file, query.blockIndex, query.block))
+      {
+        break;
+      }
+      query.blockIndex++;
+      loaded = blockMatches(query, query.block.header);
+    }
+    if (file)
+    {
+      file.close();
+    }
+    if (!loaded && query.segment < position.last[level])
+    {
+      query.segment++;
+      query.blockIndex = 0;
+    }
+    else if (!loaded)
+    {
+      // Blocks appended to the last segment after this read are picked up by the next pass
+      query.pass++;
+      query.segment = 0;
+      query.blockIndex = 0;
+    }
+  }
+  xSemaphoreGive(mutex);
+
+  if (loaded)
+  {
+    startCodec(query.codec, query.block.header.first);
+    query.decoded = 0;
+  }
+  return loaded;
+}
+
+static bool nextStoredPoint(HistoryQuery &query, HistoryPoint &point)
+{
+  while (true)
+  {
+    while (query.decoded < query.block.header.count)
+    {
+      decodePoint(query.block, query.codec, point);
+      query.decoded++;
+      if (point.time < query.from || point.time > query.to || (query.started && point.time < query.last))
+      {
+        continue;
+      }
+      query.started = true;
+      query.last = point.time;
+      return true;
+    }
+    if (!loadBlock(query))
+    {
+      query.block.header.count = 0;
+      return false;
+    }
+  }
+}
+
+bool nextHistoryPoint(HistoryQuery &query, HistoryPoint &point)
+{
+  if (query.step == 0)
+  {
+    return nextStoredPoint(query, point);
+  }
+
+  HistoryPoint stored;
+  while (nextStoredPoint(query, stored))
+  {
+    if (query.bucket.open && stored.time - stored.time % query.step != query.bucket.time)
+    {
+      closeBucket(query.bucket, point);
+      openBucket(query.bucket, stored.time, query.step);
+      addToBucket(query.bucket, stored);
+      return true;
+    }
+    if (!query.bucket.open)
+    {
+      openBucket(query.bucket, stored.time, query.step);
+    }
+    addToBucket(query.bucket, stored);
+  }
+
+  if (query.bucket.open)
+  {
+    closeBucket(query.bucket, point);
+    return true;
+  }
+  return false;
+}
+
+static void formatField(char *line, int &length, double value, uint8_t decimals)
+{
+  if (length < HISTORY_LINE_LENGTH)
+  {
+    length += isnan(value) ? snprintf(line + length, HISTORY_LINE_LENGTH - length, ",null")
+                           : snprintf(line + length, HISTORY_LINE_LENGTH - length, ",%.*f", decimals, value);
+  }
+}
+
+static uint8_t formatPoint(char *line, const HistoryPoint &point, bool first)
+{
+  int length = snprintf(line, HISTORY_LINE_LENGTH, "%s[%lu", first ? "" : ",", (unsigned long)point.time);
+  formatField(line, length, point.value, 4);
+  formatField(line, length, point.rate, 4);
+  formatField(line, length, point.temperature, 2);
+  formatField(line, length, point.humidity, 2);
+  formatField(line, length, point.rssi, 1);
+  if (length < HISTORY_LINE_LENGTH)
+  {
+    length += snprintf(line + length, HISTORY_LINE_LENGTH - length, "]");
+  }
+  return min(length, HISTORY_LINE_LENGTH - 1);
+}
+
+size_t readHistoryJson(HistoryQuery &query, uint8_t *buffer, size_t size)
+{
+  size_t written = 0;
+  while (written < size)
+  {
+    // What did not fit into the last chunk goes first
+    if (query.lineOffset < query.lineLength)
+    {
+      size_t length = min((size_t)(query.lineLength - query.lineOffset), size - written);
+      memcpy(buffer + written, query.line + query.lineOffset, length);
+      query.lineOffset += length;
+      written += length;
+      continue;
+    }
+
+    query.lineOffset = 0;
+    query.lineLength = 0;
+    HistoryPoint point;
+    if (query.stage == 0)
+    {
+      char node[FRAME_NODE_TEXT_LENGTH];
+      formatNode(query.node, node);
+      int length = snprintf(query.line, HISTORY_LINE_LENGTH,
+                            "{\"node\":\"%s\",\"meter\":%u,\"step\":%lu,\"columns\":[\"time\",\"value\",\"rate\",\"temperature\",\"humidity\",\"rssi\"],\"points\":[",
+                            node, query.meter, (unsigned long)query.step);
+      query.lineLength = min(length, HISTORY_LINE_LENGTH - 1);
+      query.stage = 1;
+    }
+    else if (query.stage == 1 && nextHistoryPoint(query, point))
+    {
+      query.lineLength = formatPoint(query.line, point, query.points++ == 0);
+    }
+    else if (query.stage == 1)
+    {
+      query.lineLength = snprintf(query.line, HISTORY_LINE_LENGTH, "]}");
+      query.stage = 2;
+    }
+    else
+    {
+      break;
+    }
+  }
+  return written;
+}
+
+uint16_t defaultHistoryNode()
+{
+  for (const HistorySeries &entry : series)
+  {
+    if (entry.used)
+    {
+      return entry.node;
+    }
+  }
+  return FRAME_NO_NODE;
+}
+
+uint32_t historyPoints()
+{
+  return points;
+}
+
+uint32_t historyBytes()
+{
+  return bytes;
+}
+
+void writeHistoryMetrics(String &out)
+{
+  writeCounter(out, "gateway_history_points_total", "Points written to the raw level of the history.", points);
+  writeCounter(out, "gateway_history_encoded_bytes_total", "Header and compressed points of these blocks, without the padding to the block size.", bytes);
+  writeCounter(out, "gateway_history_rejected_total", "Readings not recorded, older than the last one of their series or of a series beyond HISTORY_SERIES.", rejected);
+  writeCounter(out, "gateway_history_downsampled_segments_total", "Raw segments moved to the downsampled level.", downsampledSegments);
+  writeCounter(out, "gateway_history_dropped_segments_total", "Downsampled segments dropped for space.", droppedSegments);
+  writeHeader(out, "gateway_history_segments", "gauge", "Segment files of a level.");
+  writeSample(out, "gateway_history_segments", "level=\"raw\"", position.last[HISTORY_RAW] - position.first[HISTORY_RAW] + 1);
+  writeSample(out, "gateway_history_segments", "level=\"downsampled\"", position.last[HISTORY_DOWNSAMPLED] - position.first[HISTORY_DOWNSAMPLED] + 1);
+}
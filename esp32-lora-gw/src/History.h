@@ -0,0 +1,131 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WatermeterFrame.h>
+
+// Time series of the readings of every node in SPIFFS, queried with GET /api/history?node=&meter=&from=&to=&step=.
+// Points are compressed like in Gorilla into fixed-size blocks: timestamps as delta of delta, the fields as XOR of their
+// float bits with the field of the previous point. Fields are kept in their fixed-point units, so a meter that does not
+// move costs a bit per field. The open block of each series stays in RAM until it is full or spans HISTORY_BLOCK_SPAN.
+// Once the raw level is full its oldest segment is downsampled into points of HISTORY_DOWNSAMPLE_STEP seconds.
+// Appending is done by the network task, queries run on the web server, a mutex keeps them apart.
+#define HISTORY_BLOCK_SIZE 256       // bytes on flash
+#define HISTORY_SEGMENT_BLOCKS 64    // blocks per segment file, 16 KB
+#define HISTORY_MAX_SEGMENTS 8       // per level, 128 KB raw and 128 KB downsampled
+#define HISTORY_SERIES 8             // node and meter pairs with an open block, readings of further ones are not recorded
+#define HISTORY_BLOCK_SPAN 3600      // seconds, bounds what a reset loses of the open blocks
+#define HISTORY_DOWNSAMPLE_STEP 900  // seconds per point of the downsampled level
+#define HISTORY_FIELDS 5             // value, rate, temperature, humidity, RSSI
+#define HISTORY_LINE_LENGTH 128      // bytes of the JSON of a point, and of the head of the answer
+
+typedef enum
+{
+  HISTORY_RAW,
+  HISTORY_DOWNSAMPLED,
+  HISTORY_LEVELS
+} HistoryLevel;
+
+typedef struct
+{
+  uint8_t magic;
+  uint8_t level;
+  uint8_t meter;
+  uint8_t count;  // points in the block
+  uint16_t node;
+  uint16_t bits;  // used bits of the payload
+  uint32_t first; // timestamp of the first point
+  uint32_t last;  // timestamp of the last point
+  uint32_t base;  // meter value the values of the block are offsets from, fixed-point FRAME_VALUE_SCALE
+  uint8_t checksum;
+  uint8_t reserved[3];
+} HistoryBlockHeader;
+
+typedef struct
+{
+  HistoryBlockHeader header;
+  uint8_t payload[HISTORY_BLOCK_SIZE - sizeof(HistoryBlockHeader)];
+} HistoryBlock;
+
+// Position in the bit stream of a block and the previous point, the same for encoding and decoding
+typedef struct
+{
+  uint16_t bit;
+  uint32_t time;
+  int32_t delta;
+  uint32_t fields[HISTORY_FIELDS]; // float bits
+  uint8_t leading[HISTORY_FIELDS]; // window of the meaningful bits of the last XOR, 0xff before the first one
+  uint8_t trailing[HISTORY_FIELDS];
+} HistoryCodec;
+
+// Fields are NAN if the sender did not have them, e.g. the rate of a failed meter or a failed DHT22
+typedef struct
+{
+  uint32_t time;     // seconds since the epoch
+  double value;      // m^3
+  float rate;        // m^3/min
+  float temperature; // °C
+  float humidity;    // %
+  float rssi;        // dBm
+} HistoryPoint;
+
+// Points averaged over a step: the last meter value, the mean of the other fields
+typedef struct
+{
+  bool open;
+  uint32_t time; // start of the step
+  double value;
+  float sums[HISTORY_FIELDS - 1];
+  uint16_t counts[HISTORY_FIELDS - 1];
+} HistoryBucket;
+
+// Streams the points of one series between from and to, oldest first, averaged over step seconds if step is not 0.
+// Walks the downsampled level, then the raw level and then the open block, one block at a time.
+typedef struct
+{
+  uint16_t node;
+  uint8_t meter;
+  uint32_t from;
+  uint32_t to;
+  uint32_t step;
+
+  uint8_t pass; // 0 downsampled level, 1 raw level, 2 open block, 3 done
+  uint32_t segment;
+  uint16_t blockIndex;
+  HistoryBlock block;
+  HistoryCodec codec;
+  uint8_t decoded;
+  uint32_t last; // time of the last point, skips points that moved to the other level during the query
+  bool started;
+  HistoryBucket bucket;
+
+  // JSON that did not fit into the last chunk
+  uint8_t stage;
+  uint32_t points;
+  char line[HISTORY_LINE_LENGTH];
+  uint8_t lineLength;
+  uint8_t lineOffset;
+} HistoryQuery;
+
+// Call once after SPIFFS is mounted
+void setupHistory();
+
+// Records a reading received at timestamp, readings older than the last one of the series are rejected
+void recordHistory(const WatermeterReading &reading, uint32_t timestamp, float rssi);
+
+void beginHistoryQuery(HistoryQuery &query, uint16_t node, uint8_t meter, uint32_t from, uint32_t to, uint32_t step);
+
+// Returns false after the last point
+bool nextHistoryPoint(HistoryQuery &query, HistoryPoint &point);
+
+// Writes the next part of the JSON answer into buffer, the filler of a chunked response. Returns 0 at the end.
+size_t readHistoryJson(HistoryQuery &query, uint8_t *buffer, size_t size);
+
+// Node of the first series recorded since boot, FRAME_NO_NODE before
+uint16_t defaultHistoryNode();
+
+// Points and bytes of the blocks written to flash since boot, their ratio is the compression
+uint32_t historyPoints();
+uint32_t historyBytes();
+
+// Appends points, bytes, rejected readings and segments for /metrics
+void writeHistoryMetrics(String &out);
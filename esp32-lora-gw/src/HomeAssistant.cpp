@@ -0,0 +1,223 @@
+#include "HomeAssistant.h"
+#include <WiFi.h>
+#include <Preferences.h>
+#include <stdarg.h>
+#include <WatermeterFrame.h>
+
+#define HA_NAMESPACE "discovery"
+#define HA_HASH_KEY "hash"
+
+// Texts end up in JSON strings unescaped, so they must not contain quotes or backslashes
+static constexpr HomeAssistantEntity entities[] = {
+    // diagnostic information
+    {"uptime", "Uptime", "clock-time-eight-outline", "s", "", "", HA_DIAGNOSTIC, HA_GATEWAY, "state"},
+    {"mac", "MAC-Address", "network-outline", "", "", "", HA_DIAGNOSTIC, HA_GATEWAY, "state"},
+    {"hostname", "Hostname", "network-outline", "", "", "", HA_DIAGNOSTIC, HA_GATEWAY, "state"},
+    {"wifiRSSI", "WiFi-RSSI", "wifi", "dBm", "signal_strength", "", HA_DIAGNOSTIC, HA_GATEWAY, "state"},
+    {"ip", "IP", "network-outline", "", "", "", HA_DIAGNOSTIC, HA_GATEWAY, "state"},
+    {"loraDropped", "LoRa Dropped Frames", "alert-circle-outline", "", "", "total_increasing", HA_DIAGNOSTIC, HA_GATEWAY, "state"},
+    {"loraSF", "LoRa Spreading Factor", "signal-distance-variant", "", "", "measurement", HA_DIAGNOSTIC, HA_GATEWAY, "state"},
+    {"backlog", "Backlog", "tray-full", "", "", "measurement", HA_DIAGNOSTIC, HA_GATEWAY, "state"},
+    {"backlogDropped", "Backlog Dropped Readings", "tray-remove", "", "", "total_increasing", HA_DIAGNOSTIC, HA_GATEWAY, "state"},
+    {"deliveryRatio", "LoRa Delivery Ratio", "check-network-outline", "%", "", "measurement", HA_DIAGNOSTIC, HA_GATEWAY, "state"},
+    {"loraRetries", "LoRa Retransmissions", "repeat", "", "", "total_increasing", HA_DIAGNOSTIC, HA_GATEWAY, "state"},
+    {"loraDuplicates", "LoRa Duplicate Frames", "content-duplicate", "", "", "total_increasing", HA_DIAGNOSTIC, HA_GATEWAY, "state"},
+    {"loraLost", "LoRa Lost Packets", "close-network-outline", "", "", "total_increasing", HA_DIAGNOSTIC, HA_GATEWAY, "state"},
+    {"nodes", "LoRa Nodes", "access-point-network", "", "", "measurement", HA_DIAGNOSTIC, HA_GATEWAY, "state"},
+    {"loraRejected", "LoRa Rejected Frames", "table-cancel", "", "", "total_increasing", HA_DIAGNOSTIC, HA_GATEWAY, "state"},
+
+    // link quality of all frames
+    {"loraRSSI", "LoRa-RSSI", "wifi", "dBm", "signal_strength", "measurement", HA_DIAGNOSTIC, HA_GATEWAY, "link"},
+    {"loraRSSIP10", "LoRa-RSSI 10th Percentile", "wifi-strength-1", "dBm", "signal_strength", "measurement", HA_DIAGNOSTIC, HA_GATEWAY, "link"},
+    {"loraSNR", "LoRa-SNR", "signal", "dB", "", "measurement", HA_DIAGNOSTIC, HA_GATEWAY, "link"},
+    {"loraSNRP10", "LoRa-SNR 10th Percentile", "signal-cellular-1", "dB", "", "measurement", HA_DIAGNOSTIC, HA_GATEWAY, "link"},
+    {"loraFrequencyError", "LoRa Frequency Error", "sine-wave", "Hz", "", "measurement", HA_DIAGNOSTIC, HA_GATEWAY, "link"},
+    {"loraAirtime", "LoRa Airtime", "timer-outline", "ms", "duration", "measurement", HA_DIAGNOSTIC, HA_GATEWAY, "link"},
+    {"loraInterval", "LoRa Frame Interval", "timer-sync-outline", "s", "duration", "measurement", HA_DIAGNOSTIC, HA_GATEWAY, "link"},
+    {"loraIntervalP90", "LoRa Frame Interval 90th Percentile", "timer-alert-outline", "s", "duration", "measurement", HA_DIAGNOSTIC, HA_GATEWAY, "link"},
+
+    // link quality of a node, averaged over its frames
+    {"loraRSSI", "LoRa-RSSI", "wifi", "dBm", "signal_strength", "measurement", HA_DIAGNOSTIC, HA_NODE, "link"},
+    {"loraSNR", "LoRa-SNR", "signal", "dB", "", "measurement", HA_DIAGNOSTIC, HA_NODE, "link"},
+    {"loraSF", "LoRa Spreading Factor", "signal-distance-variant", "", "", "measurement", HA_DIAGNOSTIC, HA_NODE, "link"},
+    {"loraTxPower", "LoRa TX Power", "antenna", "dBm", "", "measurement", HA_DIAGNOSTIC, HA_NODE, "link"},
+    {"deliveryRatio", "LoRa Delivery Ratio", "check-network-outline", "%", "", "measurement", HA_DIAGNOSTIC, HA_NODE, "link"},
+    {"loraRetries", "LoRa Retransmissions", "repeat", "", "", "total_increasing", HA_DIAGNOSTIC, HA_NODE, "link"},
+    {"loraLost", "LoRa Lost Packets", "close-network-outline", "", "", "total_increasing", HA_DIAGNOSTIC, HA_NODE, "link"},
+
+    // sensor information
+    {"value", "Water Consumption", "gauge", "m^3", "", "", HA_WATERMETER, HA_NODE, "state"},
+    {"previous", "Previous Water Consumption", "gauge", "m^3", "", "", HA_WATERMETER, HA_NODE, "state"},
+    {"raw", "RAW Reading", "message", "", "", "", HA_WATERMETER, HA_NODE, "state"},
+    {"rate", "Water Rate", "gauge", "m^3", "", "", HA_WATERMETER, HA_NODE, "state"},
+    {"error", "Watermeter Error", "message", "", "", "", HA_WATERMETER, HA_NODE, "state"},
+    {"temperature", "Temperature Forest", "thermometer", "°C", "", "", HA_SENSOR, HA_NODE, "state"},
+    {"humidity", "Humidity Forest", "water-percent", "%", "", "", HA_SENSOR, HA_NODE, "state"},
+    {"message", "LoRa Message", "message", "", "", "", HA_SENSOR, HA_NODE, "state"},
+    {"packet_number", "LoRa Packet Number", "counter", "", "", "", HA_SENSOR, HA_NODE, "state"},
+
+    // flow analytics, computed by the gateway
+    {"flow", "Water Flow", "water-pump", "L/min", "volume_flow_rate", "measurement", HA_SENSOR, HA_NODE, "flow"},
+    {"continuousFlow", "Continuous Water Flow", "timer-sand", "min", "duration", "measurement", HA_SENSOR, HA_NODE, "flow"},
+    {"today", "Water Consumption Today", "water", "L", "water", "total_increasing", HA_SENSOR, HA_NODE, "flow"},
+    {"yesterday", "Water Consumption Yesterday", "water-outline", "L", "water", "", HA_SENSOR, HA_NODE, "flow"},
+    {"nightFlow", "Minimum Night Flow", "weather-night", "L/h", "", "measurement", HA_SENSOR, HA_NODE, "flow"},
+    {"leak", "Water Leak", "water-alert", "", "moisture", "", HA_ALARM, HA_NODE, "flow"},
+    {"continuousLeak", "Continuous Water Flow Alarm", "pipe-leak", "", "problem", "", HA_ALARM, HA_NODE, "flow"},
+    {"burst", "Burst Pipe", "pipe-disconnected", "", "problem", "", HA_ALARM, HA_NODE, "flow"},
+    {"meterResets", "Watermeter Resets", "restore-alert", "", "", "total_increasing", HA_DIAGNOSTIC, HA_NODE, "flow"},
+};
+
+#define HA_ENTITIES (sizeof(entities) / sizeof(entities[0]))
+
+// Appends to the buffer like snprintf, the length keeps counting past the end so an overflow can be detected
+static void append(char *buffer, size_t size, size_t &length, const char *format, ...)
+{
+  va_list arguments;
+  va_start(arguments, format);
+  int written = vsnprintf(buffer + min(length, size), length < size ? size - length : 0, format, arguments);
+  va_end(arguments);
+  length += max(written, 0);
+}
+
+// Same fields as the ArduinoJson documents the discovery was built with before, optional ones are left out if empty.
+// topic is the base of the state topics, id the prefix of the unique IDs.
+static size_t formatEntity(const HomeAssistantEntity &entity, const char *topic, const char *id, const char *device, char *payload, size_t size)
+{
+  size_t length = 0;
+  append(payload, size, length, "{\"device\":%s,\"~\":\"%s\",\"unique_id\":\"%s-%s\",\"object_id\":\"%s-%s\",\"name\":\"%s\",\"icon\":\"mdi:%s\"",
+         device, topic, id, entity.field, id, entity.field, entity.name, entity.icon);
+  if (entity.unit[0] != '\0')
+  {
+    append(payload, size, length, ",\"unit_of_measurement\":\"%s\"", entity.unit);
+  }
+  append(payload, size, length, ",\"state_topic\":\"%s/%s\",\"value_template\":\"{{ value_json.%s%s }}\"",
+         topic, entity.stateTopic, entity.category == HA_WATERMETER ? "watermeter." : "", entity.field);
+  if (entity.deviceClass[0] != '\0')
+  {
+    append(payload, size, length, ",\"device_class\":\"%s\"", entity.deviceClass);
+  }
+  if (entity.stateClass[0] != '\0')
+  {
+    append(payload, size, length, ",\"state_class\":\"%s\"", entity.stateClass);
+  }
+  if (entity.category == HA_DIAGNOSTIC)
+  {
+    append(payload, size, length, ",\"entity_category\":\"diagnostic\"");
+  }
+  // The gateway reports a node that stayed silent for longer than it announced as offline
+  if (entity.device == HA_NODE)
+  {
+    append(payload, size, length, ",\"availability_topic\":\"%s/availability\"", topic);
+  }
+  append(payload, size, length, "}");
+  return length < size ? length : 0;
+}
+
+static uint32_t hashText(uint32_t hash, const char *text, size_t length)
+{
+  // FNV-1a
+  for (size_t i = 0; i < length; i++)
+  {
+    hash = (hash ^ (uint8_t)text[i]) * 16777619;
+  }
+  return hash;
+}
+
+// Publishes the entities of one device, hashKey is the NVS key of the hash of its messages
+static bool publishEntities(PubSubClient &client, HomeAssistantDevice scope, const char *topic, const char *id, const char *device, const char *hashKey, bool force)
+{
+  char discoveryTopic[HA_TOPIC_LENGTH];
+  char payload[HA_PAYLOAD_LENGTH];
+
+  // Formatting is cheap compared to publishing, the hash tells whether the retained messages are still current
+  uint32_t hash = 2166136261;
+  for (size_t i = 0; i < HA_ENTITIES; i++)
+  {
+    if (entities[i].device == scope)
+    {
+      size_t length = formatEntity(entities[i], topic, id, device, payload, sizeof(payload));
+      hash = hashText(hash, payload, length);
+    }
+  }
+
+  Preferences preferences;
+  preferences.begin(HA_NAMESPACE, true);
+  bool current = preferences.getUInt(hashKey, 0) == hash;
+  preferences.end();
+  if (current && !force)
+  {
+    return true;
+  }
+
+  size_t published = 0;
+  for (size_t i = 0; i < HA_ENTITIES; i++)
+  {
+    const HomeAssistantEntity &entity = entities[i];
+    if (entity.device != scope)
+    {
+      continue;
+    }
+    size_t length = formatEntity(entity, topic, id, device, payload, sizeof(payload));
+    snprintf(discoveryTopic, sizeof(discoveryTopic), "%s%s/%s/config", entity.category == HA_ALARM ? HA_BINARY_DISCOVERY_PREFIX : HA_DISCOVERY_PREFIX, id, entity.field);
+
+    if (length == 0 || !client.beginPublish(discoveryTopic, length, true) || client.write((const uint8_t *)payload, length) != length || !client.endPublish())
+    {
+      Serial.println("Could not publish Home Assistant discovery of " + String(id) + " " + String(entity.field));
+      return false;
+    }
+    published++;
+  }
+
+  preferences.begin(HA_NAMESPACE, false);
+  preferences.putUInt(hashKey, hash);
+  preferences.end();
+  Serial.println("Published Home Assistant discovery of " + String(published) + " entities of " + String(id));
+  return true;
+}
+
+bool publishDiscovery(PubSubClient &client, const char *channel, bool force)
+{
+  IPAddress ip = WiFi.localIP();
+  char device[192];
+  snprintf(device, sizeof(device),
+           "{\"identifiers\":\"%s\",\"model\":\"LoRa-Watermeter\",\"manufacturer\":\"IoT\",\"name\":\"LoRa-Watermeter\",\"sw_version\":\"0.0.2\",\"configuration_url\":\"http://%u.%u.%u.%u\"}",
+           channel, ip[0], ip[1], ip[2], ip[3]);
+
+  if (!publishEntities(client, HA_GATEWAY, channel, channel, device, HA_HASH_KEY, force))
+  {
+    return false;
+  }
+
+  // The readings used to be entities of the gateway, the retained configs of those are removed
+  char discoveryTopic[HA_TOPIC_LENGTH];
+  for (size_t i = 0; i < HA_ENTITIES; i++)
+  {
+    if (entities[i].device == HA_NODE && entities[i].category != HA_DIAGNOSTIC && strcmp(entities[i].stateTopic, "state") == 0)
+    {
+      snprintf(discoveryTopic, sizeof(discoveryTopic), HA_DISCOVERY_PREFIX "%s/%s/config", channel, entities[i].field);
+      client.publish(discoveryTopic, "", true);
+    }
+  }
+  return true;
+}
+
+bool publishNodeDiscovery(PubSubClient &client, const char *channel, uint16_t node, bool force)
+{
+  char name[FRAME_NODE_TEXT_LENGTH];
+  formatNode(node, name);
+
+  char topic[HA_TOPIC_LENGTH];
+  char id[HA_TOPIC_LENGTH];
+  char hashKey[8];
+  snprintf(topic, sizeof(topic), "%s/%s", channel, name);
+  snprintf(id, sizeof(id), "%s-%s", channel, name);
+  snprintf(hashKey, sizeof(hashKey), "n%s", name);
+
+  char device[256];
+  snprintf(device, sizeof(device),
+           "{\"identifiers\":\"%s\",\"model\":\"LoRa-Watermeter Sender\",\"manufacturer\":\"IoT\",\"name\":\"LoRa-Watermeter %s\",\"via_device\":\"%s\"}",
+           id, name, channel);
+
+  return publishEntities(client, HA_NODE, topic, id, device, hashKey, force);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <Arduino.h>
+#include <PubSubClient.h>
+
+// Home Assistant MQTT discovery of the gateway and of every node it serves, each one as its own device.
+// The entities are a constant table in flash, every config message is formatted into one stack buffer and
+// streamed to the broker from there. Only the network task may use it.
+#define HA_STATUS_TOPIC "homeassistant/status" // HA publishes "online" there after every start
+#define HA_DISCOVERY_PREFIX "homeassistant/sensor/"
+#define HA_BINARY_DISCOVERY_PREFIX "homeassistant/binary_sensor/"
+#define HA_TOPIC_LENGTH 96
+#define HA_PAYLOAD_LENGTH 768
+
+typedef enum
+{
+  HA_SENSOR,
+  HA_DIAGNOSTIC,
+  HA_WATERMETER, // nested in the reading on the state topic
+  HA_ALARM       // binary sensor, "ON" or "OFF"
+} HomeAssistantCategory;
+
+typedef enum
+{
+  HA_GATEWAY,
+  HA_NODE // published once per node, the state topic is below the topic of the node
+} HomeAssistantDevice;
+
+typedef struct
+{
+  const char *field;
+  const char *name;
+  const char *icon;
+  const char *unit;
+  const char *deviceClass;
+  const char *stateClass;
+  HomeAssistantCategory category;
+  HomeAssistantDevice device;
+  const char *stateTopic; // subtopic of the channel or of the node
+} HomeAssistantEntity;
+
+// The config messages are retained, so they are only published again if they changed since the last time,
+// e.g. after a firmware update or a new IP address, or if force is set because HA asked for them with its birth message.
+// Returns false if a message could not be published.
+bool publishDiscovery(PubSubClient &client, const char *channel, bool force);
+
+// Same for a node, its topics are <channel>/<node>/...
+bool publishNodeDiscovery(PubSubClient &client, const char *channel, uint16_t node, bool force);
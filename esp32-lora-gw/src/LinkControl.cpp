@@ -0,0 +1,83 @@
+#include "LinkControl.h"
+
+static LinkProfile listening = defaultLinkProfile;
+
+static bool sameDataRate(const LinkProfile &a, const LinkProfile &b)
+{
+  return a.spreadingFactor == b.spreadingFactor && a.bandwidth == b.bandwidth;
+}
+
+static LinkProfile recommend(float snr, const LinkProfile &current, float margin, bool fixedRate)
+{
+  return fixedRate ? recommendPower(snr, current, margin) : recommendProfile(snr, current, margin);
+}
+
+void resetLink(LinkState &state)
+{
+  state = {};
+  state.profile = defaultLinkProfile;
+}
+
+LinkProfile updateLink(LinkState &state, float snr, uint32_t received, bool fixedRate)
+{
+  if (state.heard)
+  {
+    state.uplinkInterval = received - state.lastUplink;
+  }
+  state.heard = true;
+  state.lastUplink = received;
+
+  state.maxSnr = state.frames == 0 ? snr : max(state.maxSnr, snr);
+  state.frames = min(state.frames + 1, LINK_HISTORY);
+
+  if (fixedRate && !sameDataRate(state.profile, defaultLinkProfile))
+  {
+    return defaultLinkProfile;
+  }
+
+  // A worse link is followed right away, a better one only once it held for a while
+  const LinkProfile &profile = state.profile;
+  LinkProfile needed = recommend(snr, profile, LINK_MARGIN - LINK_HYSTERESIS, fixedRate);
+  if (isMoreRobust(needed, profile))
+  {
+    return recommend(snr, profile, LINK_MARGIN, fixedRate);
+  }
+
+  if (state.frames >= LINK_HISTORY)
+  {
+    LinkProfile faster = recommend(state.maxSnr, profile, LINK_MARGIN, fixedRate);
+    if (isMoreRobust(profile, faster))
+    {
+      return faster;
+    }
+  }
+  return profile;
+}
+
+void switchLink(LinkState &state, const LinkProfile &profile)
+{
+  state.profile = profile;
+  state.frames = 0;
+}
+
+bool linkTimedOut(const LinkState &state, uint32_t now)
+{
+  if (!state.heard || sameProfile(state.profile, defaultLinkProfile))
+  {
+    return false;
+  }
+
+  uint32_t interval = max(state.uplinkInterval, state.silence);
+  uint32_t timeout = interval * LINK_FALLBACK_MISSES + interval / 2;
+  return now - state.lastUplink > max(timeout, (uint32_t)LINK_MIN_FALLBACK_TIMEOUT);
+}
+
+const LinkProfile &currentLinkProfile()
+{
+  return listening;
+}
+
+void setListeningProfile(const LinkProfile &profile)
+{
+  listening = profile;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <Arduino.h>
+#include <LinkProfile.h>
+
+// Adaptive data rate: picks the profile of the next uplink of a node from the SNR of its received ones.
+// The radio listens with one data rate only, so with several nodes the data rate stays at the default and only the TX power adapts.
+// Only the radio task may use it, the gateway listens with currentLinkProfile().
+#define LINK_MARGIN 10     // dB above the demodulation floor, headroom for fading and rain
+#define LINK_HYSTERESIS 3  // dB the margin may shrink before the link is slowed down
+#define LINK_HISTORY 8     // uplinks with the current profile before the link is sped up
+#define LINK_MIN_FALLBACK_TIMEOUT 10000 // ms
+
+// Link of a single node
+typedef struct
+{
+  LinkProfile profile;
+  float maxSnr;
+  uint8_t frames;
+  uint32_t lastUplink;
+  uint32_t uplinkInterval;
+  uint32_t silence; // ms the node announced in its last heartbeat it may stay silent
+  bool heard;
+} LinkState;
+
+void resetLink(LinkState &state);
+
+// Records an uplink received with the current profile of the node and returns the profile for its next one.
+// With fixedRate only the TX power changes, a node on another data rate is sent back to the default profile.
+LinkProfile updateLink(LinkState &state, float snr, uint32_t received, bool fixedRate);
+void switchLink(LinkState &state, const LinkProfile &profile);
+
+// True once the node has been silent for as many intervals as it waits before falling back itself.
+// A node in report-by-exception mode sends at irregular times, its interval is at least the announced silence.
+bool linkTimedOut(const LinkState &state, uint32_t now);
+
+// Profile the radio listens with
+const LinkProfile &currentLinkProfile();
+void setListeningProfile(const LinkProfile &profile);
@@ -0,0 +1,97 @@
+#include "LinkStats.h"
+
+#define LINK_NO_BIN 0xFF // the first frame has no interval
+
+typedef struct
+{
+  float minimum;
+  float width;
+} LinkRange;
+
+static const LinkRange ranges[LINK_METRICS] = {
+    {-148, 2},     // RSSI
+    {-20, 0.5},    // SNR
+    {-16000, 500}, // frequency error
+    {0, 25},       // airtime
+    {0, 5},        // interval
+};
+
+static uint8_t window[LINK_STATS_WINDOW][LINK_METRICS];
+static uint8_t counts[LINK_METRICS][LINK_HISTOGRAM_BINS];
+static uint8_t frames = 0;
+static uint8_t next = 0;
+static uint32_t lastReceived = 0;
+
+static uint8_t toBin(LinkMetric metric, float value)
+{
+  float bin = (value - ranges[metric].minimum) / ranges[metric].width;
+  return constrain(bin, 0, LINK_HISTOGRAM_BINS - 1);
+}
+
+void recordLinkFrame(int16_t rssi, float snr, int32_t frequencyError, uint32_t airtime, uint32_t received)
+{
+  uint8_t *bins = window[next];
+
+  // The oldest frame leaves the histograms before its slot is reused
+  if (frames == LINK_STATS_WINDOW)
+  {
+    for (uint8_t metric = 0; metric < LINK_METRICS; metric++)
+    {
+      if (bins[metric] != LINK_NO_BIN)
+      {
+        counts[metric][bins[metric]]--;
+      }
+    }
+  }
+
+  bins[LINK_RSSI] = toBin(LINK_RSSI, rssi);
+  bins[LINK_SNR] = toBin(LINK_SNR, snr);
+  bins[LINK_FREQUENCY_ERROR] = toBin(LINK_FREQUENCY_ERROR, frequencyError);
+  bins[LINK_AIRTIME] = toBin(LINK_AIRTIME, airtime / 1000.0f);
+  bins[LINK_INTERVAL] = frames > 0 ? toBin(LINK_INTERVAL, (received - lastReceived) / 1000.0f) : LINK_NO_BIN;
+  lastReceived = received;
+
+  for (uint8_t metric = 0; metric < LINK_METRICS; metric++)
+  {
+    if (bins[metric] != LINK_NO_BIN)
+    {
+      counts[metric][bins[metric]]++;
+    }
+  }
+
+  next = (next + 1) % LINK_STATS_WINDOW;
+  frames = min(frames + 1, LINK_STATS_WINDOW);
+}
+
+uint8_t linkStatsFrames()
+{
+  return frames;
+}
+
+bool linkPercentile(LinkMetric metric, uint8_t percent, float &value)
+{
+  uint16_t total = 0;
+  for (uint8_t bin = 0; bin < LINK_HISTOGRAM_BINS; bin++)
+  {
+    total += counts[metric][bin];
+  }
+  if (total == 0)
+  {
+    return false;
+  }
+
+  // Nearest rank, the smallest bin that holds at least percent of the frames
+  uint16_t rank = max((total * percent + 99) / 100, 1);
+  uint16_t seen = 0;
+  uint8_t bin = 0;
+  for (; bin < LINK_HISTOGRAM_BINS - 1; bin++)
+  {
+    seen += counts[metric][bin];
+    if (seen >= rank)
+    {
+      break;
+    }
+  }
+  value = ranges[metric].minimum + (bin + 0.5f) * ranges[metric].width;
+  return true;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Link quality of the received frames, kept as histograms over the last frames.
+// Every frame is stored as one bin index per metric, so the histograms roll over the window in fixed memory
+// and percentiles are read from the bins without sorting. Only the network task may use it.
+#define LINK_STATS_WINDOW 64 // frames the histograms cover
+#define LINK_HISTOGRAM_BINS 64
+
+typedef enum
+{
+  LINK_RSSI,            // dBm, 2 dB bins from -148 dBm
+  LINK_SNR,             // dB, 0.5 dB bins from -20 dB
+  LINK_FREQUENCY_ERROR, // Hz, 500 Hz bins from -16 kHz
+  LINK_AIRTIME,         // ms, 25 ms bins
+  LINK_INTERVAL,        // s between two frames, 5 s bins
+  LINK_METRICS
+} LinkMetric;
+
+// Airtime in µs as returned by frameAirtime(), received in millis
+void recordLinkFrame(int16_t rssi, float snr, int32_t frequencyError, uint32_t airtime, uint32_t received);
+
+// Frames in the window, the interval histogram holds one less
+uint8_t linkStatsFrames();
+
+// Centre of the bin holding the given percentile, false if the histogram is empty.
+// Values outside the range of a metric are counted in its first or last bin.
+bool linkPercentile(LinkMetric metric, uint8_t percent, float &value);
@@ -0,0 +1,26 @@
+#include "Liveness.h"
+
+void recordUplink(LivenessState &state, uint32_t received)
+{
+  if (state.heard)
+  {
+    state.interval = received - state.lastUplink;
+  }
+  state.heard = true;
+  state.lastUplink = received;
+}
+
+void recordHeartbeat(LivenessState &state, uint32_t silence)
+{
+  state.silence = silence * 1000;
+}
+
+uint32_t expectedSilence(const LivenessState &state)
+{
+  return state.silence != 0 ? state.silence : state.interval;
+}
+
+bool nodeStale(uint32_t lastUplink, uint32_t silence, uint32_t now)
+{
+  return silence != 0 && now - lastUplink > silence * LIVENESS_MISSES + LIVENESS_MARGIN;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Whether a node is still alive. A sender announces in its heartbeats how long it may stay silent, in report-by-exception
+// mode that is several intervals, and the node is stale once it stayed silent LIVENESS_MISSES times as long.
+// Nodes that never announced it, e.g. with an older firmware, are judged by the time between their last two uplinks.
+// Only the network task may record, staleness is computed from the snapshot of the node by any task.
+#define LIVENESS_MISSES 2      // announced silences without an uplink, one lost heartbeat is not enough
+#define LIVENESS_MARGIN 15000  // ms for polling the meters, the duty cycle and retransmissions at the sender
+
+typedef struct
+{
+  bool heard;
+  uint32_t lastUplink; // millis
+  uint32_t interval;   // ms between the last two uplinks
+  uint32_t silence;    // ms announced by the last heartbeat, 0 before the first one
+} LivenessState;
+
+void recordUplink(LivenessState &state, uint32_t received);
+void recordHeartbeat(LivenessState &state, uint32_t silence);
+
+// ms the node may stay silent, 0 while unknown
+uint32_t expectedSilence(const LivenessState &state);
+
+// Never stale while the silence is unknown
+bool nodeStale(uint32_t lastUplink, uint32_t silence, uint32_t now);
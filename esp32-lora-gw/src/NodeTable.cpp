@@ -0,0 +1,123 @@
+#include "NodeTable.h"
+
+static Node nodes[NODE_TABLE_CAPACITY];
+static std::atomic<uint8_t> count(0);
+static uint32_t rejected = 0;
+
+// Fibonacci hashing spreads consecutive IDs over the table
+static uint8_t homeSlot(uint16_t id)
+{
+  return (uint16_t)(id * 40503u) >> (16 - NODE_TABLE_BITS);
+}
+
+Node *addNode(uint16_t id)
+{
+  if (id == FRAME_NO_NODE)
+  {
+    return nullptr;
+  }
+
+  uint8_t slot = homeSlot(id);
+  for (uint8_t i = 0; i < NODE_TABLE_CAPACITY; i++, slot = (slot + 1) & (NODE_TABLE_CAPACITY - 1))
+  {
+    Node &node = nodes[slot];
+    uint16_t current = node.id.load(std::memory_order_relaxed);
+    if (current == id)
+    {
+      return &node;
+    }
+    if (current == FRAME_NO_NODE)
+    {
+      // Published last, other tasks only look at an entry once its ID is set
+      resetLink(node.link);
+      resetReplay(node.replay, id);
+      node.id.store(id, std::memory_order_release);
+      count.fetch_add(1, std::memory_order_relaxed);
+      return &node;
+    }
+  }
+
+  rejected++;
+  return nullptr;
+}
+
+Node *findNode(uint16_t id)
+{
+  if (id == FRAME_NO_NODE)
+  {
+    return nullptr;
+  }
+
+  // Entries are never removed, so the first free slot ends the probe sequence
+  uint8_t slot = homeSlot(id);
+  for (uint8_t i = 0; i < NODE_TABLE_CAPACITY; i++, slot = (slot + 1) & (NODE_TABLE_CAPACITY - 1))
+  {
+    uint16_t current = nodes[slot].id.load(std::memory_order_acquire);
+    if (current == id)
+    {
+      return &nodes[slot];
+    }
+    if (current == FRAME_NO_NODE)
+    {
+      return nullptr;
+    }
+  }
+  return nullptr;
+}
+
+Node *nodeAt(uint8_t index)
+{
+  if (index >= NODE_TABLE_CAPACITY || nodes[index].id.load(std::memory_order_acquire) == FRAME_NO_NODE)
+  {
+    return nullptr;
+  }
+  return &nodes[index];
+}
+
+uint8_t nodeCount()
+{
+  return count.load(std::memory_order_relaxed);
+}
+
+uint8_t staleNodes(uint32_t now)
+{
+  uint8_t stale = 0;
+  for (uint8_t i = 0; i < NODE_TABLE_CAPACITY; i++)
+  {
+    Node *node = nodeAt(i);
+    if (node != nullptr)
+    {
+      GatewayState state = loadNodeState(*node);
+      stale += state.packets > 0 && nodeStale(state.received, state.silence, now) ? 1 : 0;
+    }
+  }
+  return stale;
+}
+
+uint32_t rejectedFrames()
+{
+  return rejected;
+}
+
+// Sequence lock: the version is odd while the state is written
+void storeNodeState(Node &node, const GatewayState &state)
+{
+  uint32_t version = node.version.load(std::memory_order_relaxed);
+  node.version.store(version + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  node.state = state;
+  node.version.store(version + 2, std::memory_order_release);
+}
+
+GatewayState loadNodeState(const Node &node)
+{
+  GatewayState state;
+  uint32_t version;
+  do
+  {
+    version = node.version.load(std::memory_order_acquire);
+    state = node.state;
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((version & 1) || node.version.load(std::memory_order_relaxed) != version);
+  return state;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+#include <WatermeterFrame.h>
+#include "GatewayState.h"
+#include "LinkControl.h"
+#include "DeliveryStats.h"
+#include "FlowAnalytics.h"
+#include "Liveness.h"
+#include "FrameGuard.h"
+
+// Fixed-capacity table of the senders (nodes) a gateway serves, open-addressed by the node ID of the frames.
+// Entries are only added by the radio task and never removed, so a lookup from another task never sees a moving entry.
+// A table entry takes about 860 bytes, frames of nodes that do not fit any more are dropped and counted.
+#define NODE_TABLE_BITS 5
+#define NODE_TABLE_CAPACITY (1 << NODE_TABLE_BITS)
+#define NODE_METERS 4       // delta references per node, one for every meter slot of a sender
+#define NODE_AVERAGE_WEIGHT 0.125f // of the latest frame in the moving averages of RSSI and SNR
+
+typedef struct
+{
+  std::atomic<uint16_t> id; // FRAME_NO_NODE while free, set once by the radio task
+
+  // Radio task only
+  LinkState link;
+
+  // Counter by the radio task, stored epoch by the network task
+  ReplayState replay;
+
+  // Network task only
+  DeliveryState delivery;
+  DeltaReference references[NODE_METERS];
+  FlowState flow[NODE_METERS];
+  LivenessState liveness;
+  bool availabilityPublished; // for the current broker session
+  bool stale;                 // as published on the availability topic
+  float rssi; // moving averages
+  float snr;
+  bool discovered;      // Home Assistant discovery checked for the current broker
+  bool discoveryForced; // Home Assistant asked for it again
+
+  // Written by the network task with storeNodeState(), read with loadNodeState()
+  std::atomic<uint32_t> version;
+  GatewayState state;
+} Node;
+
+// Radio task: returns the node and adds it if it is new, nullptr if the table is full or the ID is invalid
+Node *addNode(uint16_t id);
+
+// Any task: nullptr if the node was never heard
+Node *findNode(uint16_t id);
+
+// For iterating over the table, nullptr for free entries
+Node *nodeAt(uint8_t index);
+
+uint8_t nodeCount();
+
+// Any task: nodes that stayed silent for longer than they announced
+uint8_t staleNodes(uint32_t now);
+uint32_t rejectedFrames();
+
+// The last packet of the node, readers never block the network task and retry if it wrote in the meantime
+void storeNodeState(Node &node, const GatewayState &state);
+GatewayState loadNodeState(const Node &node);
@@ -0,0 +1,124 @@
+#include "SegmentFiles.h"
+#include <SPIFFS.h>
+
+#define POSITION_TEMPORARY_SUFFIX ".tmp"
+#define POSITION_MAX_SIZE 64 // bytes of the largest position struct
+
+static uint32_t crc32(const uint8_t *data, size_t length, uint32_t crc = 0)
+{
+  // CRC-32, reflected polynomial 0xedb88320
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++)
+  {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; bit++)
+    {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+    }
+  }
+  return ~crc;
+}
+
+static uint32_t positionChecksum(uint32_t magic, const void *position, size_t size)
+{
+  return crc32((const uint8_t *)position, size, crc32((const uint8_t *)&magic, sizeof(magic)));
+}
+
+static bool readCopy(const String &path, uint32_t magic, void *position, size_t size)
+{
+  File file = SPIFFS.open(path, FILE_READ);
+  if (!file)
+  {
+    return false;
+  }
+
+  uint8_t data[POSITION_MAX_SIZE];
+  uint32_t storedMagic = 0;
+  uint32_t storedChecksum = 0;
+  bool complete = file.size() == sizeof(storedMagic) + size + sizeof(storedChecksum) &&
+                  file.read((uint8_t *)&storedMagic, sizeof(storedMagic)) == sizeof(storedMagic) &&
+                  file.read(data, size) == size &&
+                  file.read((uint8_t *)&storedChecksum, sizeof(storedChecksum)) == sizeof(storedChecksum);
+  file.close();
+
+  if (!complete || storedMagic != magic || storedChecksum != positionChecksum(magic, data, size))
+  {
+    return false;
+  }
+  memcpy(position, data, size);
+  return true;
+}
+
+bool writePositionFile(const char *path, uint32_t magic, const void *position, size_t size)
+{
+  String temporary = String(path) + POSITION_TEMPORARY_SUFFIX;
+  File file = SPIFFS.open(temporary, FILE_WRITE);
+  if (!file)
+  {
+    return false;
+  }
+
+  uint32_t checksum = positionChecksum(magic, position, size);
+  size_t written = file.write((const uint8_t *)&magic, sizeof(magic));
+  written += file.write((const uint8_t *)position, size);
+  written += file.write((const uint8_t *)&checksum, sizeof(checksum));
+  file.close();
+  if (written != sizeof(magic) + size + sizeof(checksum))
+  {
+    SPIFFS.remove(temporary);
+    return false;
+  }
+
+  SPIFFS.remove(path);
+  return SPIFFS.rename(temporary, path);
+}
+
+bool readPositionFile(const char *path, uint32_t magic, void *position, size_t size)
+{
+  if (size > POSITION_MAX_SIZE)
+  {
+    return false;
+  }
+  return readCopy(path, magic, position, size) || readCopy(String(path) + POSITION_TEMPORARY_SUFFIX, magic, position, size);
+}
+
+bool findSegments(const char *directory, const char *extension, uint32_t &first, uint32_t &last)
+{
+  File root = SPIFFS.open(directory, FILE_READ);
+  if (!root || !root.isDirectory())
+  {
+    return false;
+  }
+
+  bool found = false;
+  File file;
+  while ((file = root.openNextFile()))
+  {
+    // Older cores return the whole path as name
+    String name = file.name();
+    name = name.substring(name.lastIndexOf('/') + 1);
+    file.close();
+
+    int digits = name.length() - strlen(extension);
+    if (digits <= 0 || !name.endsWith(extension))
+    {
+      continue;
+    }
+    bool number = true;
+    for (int i = 0; i < digits; i++)
+    {
+      number = number && isdigit(name[i]);
+    }
+    if (!number)
+    {
+      continue;
+    }
+
+    uint32_t segment = strtoul(name.c_str(), nullptr, 10);
+    first = found ? min(first, segment) : segment;
+    last = found ? max(last, segment) : segment;
+    found = true;
+  }
+  root.close();
+  return found;
+}
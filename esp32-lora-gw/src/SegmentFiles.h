@@ -0,0 +1,18 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Files the backlog and the history keep their segment logs in: numbered segment files and a position file.
+// A position is written to a temporary file first, which then replaces the old one, so a reset in the middle leaves
+// either the old or the new position and never a truncated one. SPIFFS cannot rename onto an existing file, the old
+// position is removed first and a reset right after leaves only the temporary file, which is read instead.
+// Positions carry a magic and a CRC-32, a torn or foreign file is not taken for a position.
+
+// Returns false if the position could not be written, the old one then stays
+bool writePositionFile(const char *path, uint32_t magic, const void *position, size_t size);
+
+// Returns false if neither the file nor its temporary copy holds a valid position of this size, position is then untouched
+bool readPositionFile(const char *path, uint32_t magic, void *position, size_t size);
+
+// Lowest and highest number of the segment files <number><extension> in directory, false if there are none
+bool findSegments(const char *directory, const char *extension, uint32_t &first, uint32_t &last);
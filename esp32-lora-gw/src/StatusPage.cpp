@@ -0,0 +1,114 @@
+#include "StatusPage.h"
+#include <WiFi.h>
+#include <WatermeterFrame.h>
+#include "FrameRing.h"
+#include "Backlog.h"
+#include "GatewayState.h"
+#include "LinkControl.h"
+#include "DeliveryStats.h"
+#include "NodeTable.h"
+#include "FrameGuard.h"
+#include "Connection.h"
+
+String processorStats(const String &var)
+{
+  // Fields of a failed sensor or meter stay empty, like before the first packet
+  GatewayState state = loadState();
+  const WatermeterReading &reading = state.reading;
+  bool sensor = state.valid && !(reading.flags & FRAME_FLAG_SENSOR_FAILED);
+  bool meter = state.valid && !(reading.flags & FRAME_FLAG_METER_FAILED);
+
+  if (var == "TEMPERATURE")
+  {
+    return sensor ? String(fromFixedPoint(reading.temperature, FRAME_CLIMATE_SCALE), 1) : String();
+  }
+  else if (var == "HUMIDITY")
+  {
+    return sensor ? String(fromFixedPoint(reading.humidity, FRAME_CLIMATE_SCALE), 1) : String();
+  }
+  else if (var == "WATER_VALUE")
+  {
+    return meter ? String(fromFixedPoint(reading.value, FRAME_VALUE_SCALE), 4) : String();
+  }
+  else if (var == "WATER_PREV")
+  {
+    return meter ? String(fromFixedPoint(reading.previous, FRAME_VALUE_SCALE), 4) : String();
+  }
+  else if (var == "WATER_RAW")
+  {
+    if (!meter)
+    {
+      return String();
+    }
+    return (reading.flags & FRAME_FLAG_HAS_RAW) ? String(reading.raw) : String(fromFixedPoint(reading.value, FRAME_VALUE_SCALE), 4);
+  }
+  else if (var == "LORA_RSSI")
+  {
+    return state.valid ? String(state.rssi) : String();
+  }
+  else if (var == "LORA_SNR")
+  {
+    return state.valid ? String(state.snr, 1) : String();
+  }
+  else if (var == "LINK_PROFILE")
+  {
+    LinkProfile profile = currentLinkProfile();
+    return "SF" + String(profile.spreadingFactor) + ", " + String(profile.bandwidth / 1000) + " kHz, sender " + String(profile.txPower) + " dBm";
+  }
+  else if (var == "WIFI_SIGNAL")
+  {
+    return String(WiFi.RSSI());
+  }
+  else if (var == "MQTT_STATE")
+  {
+    return describeConnection();
+  }
+  else if (var == "LORA_QUEUED")
+  {
+    return String(queuedFrames());
+  }
+  else if (var == "LORA_DROPPED")
+  {
+    return String(droppedFrames());
+  }
+  else if (var == "BACKLOG_QUEUED")
+  {
+    return String(backlogCount());
+  }
+  else if (var == "BACKLOG_DROPPED")
+  {
+    return String(backlogDropped());
+  }
+  else if (var == "DELIVERY_RATIO")
+  {
+    return String(deliveryRatio(), 1) + " %";
+  }
+  else if (var == "LORA_RETRIES")
+  {
+    return String(retransmittedPackets());
+  }
+  else if (var == "LORA_DUPLICATES")
+  {
+    return String(duplicatePackets());
+  }
+  else if (var == "LORA_LOST")
+  {
+    return String(lostPackets());
+  }
+  else if (var == "NODES")
+  {
+    return String(nodeCount()) + " of " + String(NODE_TABLE_CAPACITY) + ", " + String(staleNodes(millis())) + " stale";
+  }
+  else if (var == "LORA_REJECTED")
+  {
+    return String(rejectedFrames()) + " for a full node table, " + String(unauthenticatedFrames()) + " unauthenticated, " + String(replayedFrames()) + " replayed";
+  }
+  else if (var == "LAST_NODE")
+  {
+    char node[FRAME_NODE_TEXT_LENGTH];
+    formatNode(reading.node, node);
+    return state.valid ? String(node) : String();
+  }
+
+  return String();
+}
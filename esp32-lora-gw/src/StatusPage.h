@@ -0,0 +1,6 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Placeholders of the status page index.html, rendered by the web server from the snapshots and counters of the other modules
+String processorStats(const String &var);
@@ -3,12 +3,30 @@
 #include <WiFi.h>
 #include <PubSubClient.h>
 #include <ArduinoJson.h>
-#include <Preferences.h>
 #include <SPIFFS.h>
 #include <ESPAsyncWebServer.h>
 #include <Ticker.h>
+#include <memory>
+#include <WatermeterFrame.h>
+#include <Metrics.h>
+#include "FrameRing.h"
+#include "Backlog.h"
+#include "History.h"
+#include "GatewayState.h"
+#include "Config.h"
+#include "LinkControl.h"
+#include "DeliveryStats.h"
+#include "LinkStats.h"
+#include "HomeAssistant.h"
+#include "NodeTable.h"
+#include "FrameGuard.h"
+#include "StatusPage.h"
+#include "Connection.h"
 #include "secrets.h"
 
+// JSON capacity of a reading, the texts and the node are copied into the document
+#define READING_JSON_CAPACITY (JSON_OBJECT_SIZE(8) + JSON_OBJECT_SIZE(6) + 104)
+
 // LoRa Pins
 #define SS 18
 #define RST 14
@@ -19,10 +37,32 @@
 #define MISO 19
 #define MOSI 27
 
+// Radio/Network Tasks
+#define NETWORK_CORE 0
+#define RADIO_CORE 1
+#define NETWORK_IDLE_WAIT 100 // ms
+#define LINK_CHECK_INTERVAL 1000 // ms
+#define LINK_DOWNLINK_DELAY 10   // ms, the sender needs a moment to switch to receive after its uplink
+
+// Delay before new WiFi settings are applied, so the response to the save request still reaches the browser
+#define CONFIG_APPLY_DELAY 1000 // ms
+
+// Prometheus text of /metrics, reserved up front so the answer is not built by a chain of reallocations
+#define METRICS_BUFFER 9216 // bytes
+
 // MQTT Topics/Channels
 #define mqttChannel "esp32-lora-gw"
 #define mqttStatus mqttChannel "/status"
 #define mqttState mqttChannel "/state"
+#define mqttBacklog mqttChannel "/backlog"
+#define mqttLink mqttChannel "/link"
+// Every node has its own topics below mqttChannel "/<node>", e.g. "/state", "/link", "/flow" and "/meter/<number>" and
+// "/meter/<number>/flow" for meters after the first
+
+// Time source for timestamps of batched samples
+#define ntpServer "pool.ntp.org"
+// POSIX TZ of the meters, the days and nights of the flow analytics follow it
+#define TIMEZONE "CET-1CEST,M3.5.0,M10.5.0/3"
 
 // WebConfig Fields
 #define wifiSSID "wifi-ssid"
@@ -33,6 +73,10 @@
 #define mqttPassword "mqtt-password"
 #define mqttClient "mqtt-client"
 #define loraSync "lora-sync"
+#define infoInterval "info-interval"
+#define loraAdaptive "lora-adaptive"
+#define linkStatsInterval "link-interval"
+#define loraKey "lora-key"
 
 // Functions
 void setupLoRa();
@@ -40,34 +84,67 @@ void setupWiFi();
 void setupMQTT();
 void setupTimer();
 void setupWebServer();
-void reconnect();
-void sendHomeAssistantDiscovery();
-void mqttHomeAssistantDiscovery();
+void applyConfig(const Config &newConfig);
+Config currentConfig();
+void applyWiFi();
+void onMqttMessage(char *topic, uint8_t *payload, unsigned int length);
 void sendDeviceInformationMQTT();
+void requestDeviceInformation();
+void requestLinkStats();
+void sendLinkStatsMQTT();
+void setupTasks();
+void radioTask(void *parameter);
+void networkTask(void *parameter);
+void onDio0Rise();
+void answerLink(Node &node, uint16_t sequence, uint32_t counter, float snr, uint32_t received);
+LinkProfile listeningProfile();
+void setRadioProfile(const LinkProfile &profile);
 String processorConfig(const String &var);
-String processorStats(const String &var);
+String nodeTopic(uint16_t node, const String &subtopic);
+String nodesToJson();
+void publishNodeDiscoveries();
+void publishAvailability();
+void sendNodeLinkMQTT(const Node &node);
+void sendNodeFlowMQTT(const Node &node, uint8_t meter);
+String readingToJson(const WatermeterReading &reading, time_t timestamp);
+void writeReadingJson(JsonObject payload, const WatermeterReading &reading, time_t timestamp);
+String stateToJson(const GatewayState &state);
+void handleFrame(const RadioFrame &radioFrame);
+void sendHistory(AsyncWebServerRequest *request);
+bool publishReading(const WatermeterReading &reading, time_t timestamp);
+void replayBacklog();
+String formatMetrics();
+void writeNodeMetric(String &out, const char *name, const char *help, float Node::*field);
 
 // MQTT Client
 WiFiClient espClient;
 PubSubClient client(espClient);
 
 // Variables
-uint32_t interval = 60;
-Preferences preferences;
+Config config;
+portMUX_TYPE configMux = portMUX_INITIALIZER_UNLOCKED;
+volatile bool wifiChanged = false;
+volatile uint32_t wifiChangedAt = 0;
+volatile bool mqttChanged = false;
+volatile bool syncWordChanged = false;
+volatile bool keyChanged = false;
 AsyncWebServer server(80);
 Ticker timer;
-String loraData;
+Ticker linkTimer;
+WatermeterSample batchSamples[FRAME_MAX_BATCH_SAMPLES];
+TaskHandle_t radioTaskHandle;
+TaskHandle_t networkTaskHandle;
+volatile bool deviceInformationDue = false;
+volatile bool linkStatsDue = false;
+bool discoveryForced = false;
+bool mqttConfigured = false;
+
+// A pass of the network task takes ms, one with a reconnect or a discovery up to seconds
+const float networkBounds[] = {0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5};
+MetricHistogram networkLoopSeconds = {"gateway_network_loop_seconds", "Duration of a pass of the network task, without the idle wait.", networkBounds, 11, {}, 0, 0};
+MetricHistogram rxToMqttSeconds = {"gateway_rx_to_mqtt_seconds", "Time from the reception of a frame until its reading was published.", networkBounds, 11, {}, 0, 0};
+uint32_t publishFailures = 0; // only written by the network task
 
-typedef struct
-{
-  String field;
-  String name;
-  String icon;
-  String unit;
-  String deviceClass;
-  String stateClass;
-  String entityCategory;
-} HomeAssistantTopic;
 
 void setup()
 {
@@ -80,6 +157,9 @@ void setup()
     Serial.println("An Error has occurred while mounting SPIFFS");
     return;
   }
+  setupBacklog();
+  setupHistory();
+  loadConfig(config);
 
   // Setup Pin Configuration
   SPI.begin(SCK, MISO, MOSI, SS);
@@ -87,12 +167,12 @@ void setup()
 
   setupLoRa();
   setupWiFi();
-  setupWebServer();
   setupMQTT();
+  setupWebServer();
   setupTimer();
 
-  mqttHomeAssistantDiscovery();
-  sendDeviceInformationMQTT();
+  // MQTT is connected by the network task, so the radio is already receiving while the broker is not reachable
+  setupTasks();
 }
 
 void setupLoRa()
@@ -104,84 +184,30 @@ void setupLoRa()
   }
 
   // Change sync word to match the receiver, ranges from 0-0xFF
-  preferences.begin("lora-settings", true);
-  uint32_t syncWord = preferences.getUInt("sync", 243);
-  preferences.end();
-
-  LoRa.setSyncWord(syncWord);
-  Serial.println("LoRa Initializing OK! With Sync Word " + String(syncWord));
+  LoRa.setSyncWord(config.syncWord);
+  Serial.println("LoRa Initializing OK! With Sync Word " + String(config.syncWord));
 }
 
+// The station connects in the background, the network task follows it through the WiFi events
 void setupWiFi()
 {
-  String ssid;
-  String password;
-
-  preferences.begin("wifi-settings", true);
-  ssid = preferences.getString("ssid", "");
-  password = preferences.getString("password", "");
-  preferences.end();
-
-  if (ssid == "" || password == "")
-  {
-    Serial.println("Creating WiFi-AP to setup device...");
-    WiFi.softAP(INIT_WIFI_SSID, INIT_WIFI_PASSWORD);
-    Serial.println("Started WiFi-AP with the SSID: " + String(INIT_WIFI_SSID));
-  }
-  else
-  {
-    Serial.println("Connecting to WiFi...");
-    WiFi.begin(ssid.c_str(), password.c_str());
-    WiFi.setHostname("esp32-lora-gw");
-    while (WiFi.status() != WL_CONNECTED)
-    {
-      delay(1000);
-      Serial.println("Trying to connect to your WiFi...");
-    }
-    Serial.print("ESP32 IP-Address: ");
-    Serial.print(WiFi.localIP());
-    Serial.println("");
-  }
+  setupConnection();
+  applyWiFi();
 }
 
+// The connection itself is made by the network task, see Connection.h
 void setupMQTT()
 {
-  preferences.begin("mqtt-settings", true);
-  String host = preferences.getString("host", "");
-  int port = preferences.getInt("port", 1883);
-  String user = preferences.getString("user", "");
-  String password = preferences.getString("password", "");
-  String mqtt_client = preferences.getString("client", "ESP32-LoRa-GW");
-  preferences.end();
-
-  if (host != "" && user != "" && password != "")
-  {
-    client.setServer(host.c_str(), port);
-    client.setBufferSize(1024);
-    while (!client.connected())
-    {
-      Serial.println("Attempting MQTT connection...");
-      if (client.connect(mqtt_client.c_str(), user.c_str(), password.c_str()))
-      {
-        Serial.println("MQTT connected with name: " + String(mqtt_client));
-      }
-      else
-      {
-        Serial.println("MQTT connection failed.");
-      }
-    }
-    client.publish(mqttStatus, "connected", true);
-  }
-  else
-  {
-    Serial.println("No MQTT-Server configured!");
-  }
+  client.setBufferSize(1024);
+  client.setCallback(onMqttMessage);
 }
 
 void setupTimer()
 {
-  timer.attach_ms(1000 * interval, sendDeviceInformationMQTT);
-  Serial.println("Started Timer for device information with interval " + String(interval) + " seconds.");
+  timer.attach_ms(1000 * config.interval, requestDeviceInformation);
+  Serial.println("Started Timer for device information with interval " + String(config.interval) + " seconds.");
+  linkTimer.attach_ms(1000 * config.linkInterval, requestLinkStats);
+  Serial.println("Started Timer for link statistics with interval " + String(config.linkInterval) + " seconds.");
 }
 
 void setupWebServer()
@@ -192,275 +218,940 @@ void setupWebServer()
   server.on("/settings", HTTP_GET, [](AsyncWebServerRequest *request)
             { request->send(SPIFFS, "/settings.html", String(), false, processorConfig); });
 
+  server.on("/api/state", HTTP_GET, [](AsyncWebServerRequest *request)
+            { request->send(200, "application/json", stateToJson(loadState())); });
+
+  server.on("/api/nodes", HTTP_GET, [](AsyncWebServerRequest *request)
+            { request->send(200, "application/json", nodesToJson()); });
+
+  server.on("/api/history", HTTP_GET, [](AsyncWebServerRequest *request)
+            { sendHistory(request); });
+
+  server.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request)
+            { request->send(200, METRICS_CONTENT_TYPE, formatMetrics()); });
+
   server.on("/style.css", HTTP_GET, [](AsyncWebServerRequest *request)
             { request->send(SPIFFS, "/style.css", "text/css"); });
 
   server.on("/save", HTTP_POST, [](AsyncWebServerRequest *request)
             {
+    // Fields that are not submitted keep their value
+    Config newConfig = currentConfig();
+
     // WiFi
-    preferences.begin("wifi-settings", false);
     if (request->hasParam(wifiSSID, true)) {
-      preferences.putString("ssid", request->getParam(wifiSSID, true)->value());
+      strlcpy(newConfig.ssid, request->getParam(wifiSSID, true)->value().c_str(), sizeof(newConfig.ssid));
     }
     if (request->hasParam(wifiPassword, true)) {
-      preferences.putString("password", request->getParam(wifiPassword, true)->value());
-    }  
-    preferences.end();
+      strlcpy(newConfig.password, request->getParam(wifiPassword, true)->value().c_str(), sizeof(newConfig.password));
+    }
 
     //MQTT
-    preferences.begin("mqtt-settings", false);
     if (request->hasParam(mqttHost, true)) {
-      preferences.putString("host", request->getParam(mqttHost, true)->value());
+      strlcpy(newConfig.brokerHost, request->getParam(mqttHost, true)->value().c_str(), sizeof(newConfig.brokerHost));
     }
     if (request->hasParam(mqttPort, true)) {
-      preferences.putInt("port", request->getParam(mqttPort, true)->value().toInt());
+      newConfig.brokerPort = request->getParam(mqttPort, true)->value().toInt();
     }
     if (request->hasParam(mqttUser, true)) {
-      preferences.putString("user", request->getParam(mqttUser, true)->value());
+      strlcpy(newConfig.brokerUser, request->getParam(mqttUser, true)->value().c_str(), sizeof(newConfig.brokerUser));
     }
     if (request->hasParam(mqttPassword, true)) {
-      preferences.putString("password", request->getParam(mqttPassword, true)->value());
+      strlcpy(newConfig.brokerPassword, request->getParam(mqttPassword, true)->value().c_str(), sizeof(newConfig.brokerPassword));
     }
     if (request->hasParam(mqttClient, true)) {
-      preferences.putString("client", request->getParam(mqttClient, true)->value());
-    } 
-    preferences.end();
+      strlcpy(newConfig.brokerClient, request->getParam(mqttClient, true)->value().c_str(), sizeof(newConfig.brokerClient));
+    }
 
     //LoRa
-    preferences.begin("lora-settings", false);
     if (request->hasParam(loraSync, true)) {
-      preferences.putUInt("sync", request->getParam(loraSync, true)->value().toInt());
+      newConfig.syncWord = request->getParam(loraSync, true)->value().toInt();
+    }
+    if (request->hasParam(infoInterval, true)) {
+      newConfig.interval = request->getParam(infoInterval, true)->value().toInt();
+    }
+    if (request->hasParam(linkStatsInterval, true)) {
+      newConfig.linkInterval = request->getParam(linkStatsInterval, true)->value().toInt();
+    }
+    // Unchecked checkboxes are not submitted
+    newConfig.adaptive = request->hasParam(loraAdaptive, true);
+    // 32 hex digits, an empty field accepts plain frames
+    bool keyValid = true;
+    if (request->hasParam(loraKey, true)) {
+      keyValid = parseFrameKey(request->getParam(loraKey, true)->value().c_str(), newConfig.key);
     }
-    preferences.end();
 
-    request->send(200, "text/plain", "Saved settings. Rebooting...");
-    delay(500);
-    ESP.restart(); });
+    String invalid = validateConfig(newConfig, currentConfig());
+    if (!keyValid) {
+      invalid += " " loraKey;
+      invalid.trim();
+    }
+    if (invalid != "") {
+      request->send(400, "text/plain", "Invalid settings: " + invalid);
+      return;
+    }
+
+    if (!saveConfig(newConfig)) {
+      request->send(500, "text/plain", "Could not save settings.");
+      return;
+    }
+
+    applyConfig(newConfig);
+    request->send(200, "text/plain", "Saved settings."); });
 
   server.begin();
 }
 
-String processorStats(const String &var)
+String processorConfig(const String &var)
 {
-  DynamicJsonDocument doc(1024);
-  deserializeJson(doc, loraData);
+  // Rendered by the web server, which is also the only writer of the config
+  // WiFi-Properties
+  if (var == "WIFI-SSID")
+  {
+    return String(config.ssid);
+  }
+  else if (var == "WIFI-PASSWORD")
+  {
+    return String(config.password);
+  }
 
-  if (var == "TEMPERATURE")
+  // MQTT-Properties
+  if (var == "MQTT-HOST")
+  {
+    return String(config.brokerHost);
+  }
+  else if (var == "MQTT-PORT")
+  {
+    return String(config.brokerPort);
+  }
+  else if (var == "MQTT-USER")
+  {
+    return String(config.brokerUser);
+  }
+  else if (var == "MQTT-PASSWORD")
+  {
+    return String(config.brokerPassword);
+  }
+  else if (var == "MQTT-CLIENT")
   {
-    return doc["temperature"].as<String>();
+    return String(config.brokerClient);
   }
-  else if (var == "HUMIDITY")
+
+  // LoRa-Properties
+  if (var == "LORA-SYNC")
   {
-    return doc["humidity"].as<String>();
+    return String(config.syncWord);
   }
-  else if (var == "WATER_VALUE")
+  else if (var == "INFO-INTERVAL")
   {
-    return doc["watermeter"]["value"].as<String>();
+    return String(config.interval);
   }
-  else if (var == "WATER_PREV")
+  else if (var == "LINK-INTERVAL")
   {
-    return doc["watermeter"]["previous"].as<String>();
+    return String(config.linkInterval);
   }
-  else if (var == "WATER_RAW")
+  else if (var == "LORA-ADAPTIVE")
   {
-    return doc["watermeter"]["raw"].as<String>();
+    return config.adaptive ? "checked" : "";
   }
-  else if (var == "WIFI_SIGNAL")
+  else if (var == "LORA-KEY")
   {
-    return String(WiFi.RSSI());
+    char key[FRAME_KEY_TEXT_LENGTH];
+    formatFrameKey(config.key, key);
+    return String(key);
   }
 
   return String();
 }
 
-String processorConfig(const String &var)
+// HA's birth message, HA may have restarted without the retained discovery
+void onMqttMessage(char *topic, uint8_t *payload, unsigned int length)
 {
-  // WiFi-Properties
-  preferences.begin("wifi-settings", true);
-  if (var == "WIFI-SSID")
-  {
-    return String(preferences.getString("ssid", ""));
-  }
-  else if (var == "WIFI-PASSWORD")
+  if (strcmp(topic, HA_STATUS_TOPIC) == 0 && length == 6 && memcmp(payload, "online", 6) == 0)
   {
-    return String(preferences.getString("password", ""));
+    discoveryForced = true;
+    for (uint8_t i = 0; i < NODE_TABLE_CAPACITY; i++)
+    {
+      Node *node = nodeAt(i);
+      if (node != nullptr)
+      {
+        node->discoveryForced = true;
+      }
+    }
   }
-  preferences.end();
+}
 
-  // MQTT-Properties
-  preferences.begin("mqtt-settings", true);
-  if (var == "MQTT-HOST")
+// The radio is served on one core and MQTT/WiFi on the other, so a broker outage never stops the reception
+void setupTasks()
+{
+  xTaskCreatePinnedToCore(networkTask, "network", 8192, NULL, 1, &networkTaskHandle, NETWORK_CORE);
+  xTaskCreatePinnedToCore(radioTask, "radio", 4096, NULL, configMAX_PRIORITIES - 2, &radioTaskHandle, RADIO_CORE);
+  registerTaskMetrics("network", networkTaskHandle);
+  registerTaskMetrics("radio", radioTaskHandle);
+  registerTaskMetrics("loop");
+
+  pinMode(DIO0, INPUT);
+  attachInterrupt(digitalPinToInterrupt(DIO0), onDio0Rise, RISING);
+  LoRa.receive();
+}
+
+void loop()
+{
+  // All work happens in the radio and network tasks
+  delay(1000);
+}
+
+// SPI transfers are not allowed in an ISR on the ESP32, the interrupt only wakes the radio task
+void IRAM_ATTR onDio0Rise()
+{
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(radioTaskHandle, &woken);
+  if (woken)
   {
-    return String(preferences.getString("host", ""));
+    portYIELD_FROM_ISR();
   }
-  else if (var == "MQTT-PORT")
+}
+
+void radioTask(void *parameter)
+{
+  setupFrameGuard(currentConfig().key);
+
+  for (;;)
   {
-    return String(preferences.getInt("port", 1883));
+    // Without an interrupt the task only checks whether a node fell back to the default profile
+    if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LINK_CHECK_INTERVAL)) == 0)
+    {
+      bool adaptive = currentConfig().adaptive;
+      for (uint8_t i = 0; i < NODE_TABLE_CAPACITY; i++)
+      {
+        Node *node = nodeAt(i);
+        if (node != nullptr && (linkTimedOut(node->link, millis()) || (!adaptive && !sameProfile(node->link.profile, defaultLinkProfile))))
+        {
+          Serial.println("Node silent or adaptive data rate disabled, falling back to the default profile");
+          switchLink(node->link, defaultLinkProfile);
+        }
+      }
+      if (!sameProfile(listeningProfile(), currentLinkProfile()))
+      {
+        setRadioProfile(listeningProfile());
+        LoRa.receive();
+      }
+      continue;
+    }
+
+    if (syncWordChanged)
+    {
+      syncWordChanged = false;
+      LoRa.setSyncWord(currentConfig().syncWord);
+      Serial.println("Changed Sync Word to " + String(currentConfig().syncWord));
+    }
+
+    // A new key starts the frame counters of all nodes over
+    if (keyChanged)
+    {
+      keyChanged = false;
+      changeFrameKey(currentConfig().key);
+      for (uint8_t i = 0; i < NODE_TABLE_CAPACITY; i++)
+      {
+        Node *node = nodeAt(i);
+        if (node != nullptr)
+        {
+          resetReplay(node->replay, node->id);
+        }
+      }
+      Serial.println(framesSecured() ? "Changed network key" : "Removed network key, accepting plain frames");
+    }
+
+    // Reading the packet puts the radio into standby, so it is switched back to continuous receive right after
+    int packetSize = LoRa.parsePacket();
+    if (packetSize)
+    {
+      // A frame that does not fit into the full ring is counted as dropped and not answered, so an acknowledged sender
+      // retransmits it. It does not touch the node table or the frame counter either, the retransmission counts as new.
+      RadioFrame *radioFrame = reserveFrame();
+      if (radioFrame == nullptr)
+      {
+        Serial.println("Dropped frame with " + String(packetSize) + " bytes, the ring to the network task is full");
+        LoRa.receive();
+        continue;
+      }
+      RadioFrame &target = *radioFrame;
+
+      target.length = 0;
+      while (LoRa.available())
+      {
+        int data = LoRa.read();
+        if (target.length < sizeof(target.data))
+        {
+          target.data[target.length++] = data;
+        }
+      }
+      target.rssi = LoRa.packetRssi();
+      target.snr = LoRa.packetSnr();
+      target.frequencyError = LoRa.packetFrequencyError();
+      target.airtime = frameAirtime(packetSize, currentLinkProfile());
+      target.received = millis();
+
+      // With a key only authenticated frames go on, decrypted before anything looks at them
+      if (!admitFrame(target.data, target.length, target.counter))
+      {
+        const char *reason = !framesSecured() ? "secured frame without a key" : isSecuredFrame(target.data, target.length) ? "tag does not match the key" : "plain frame while a key is set";
+        Serial.println("Rejected frame with " + String(packetSize) + " bytes, " + String(reason));
+        LoRa.receive();
+        continue;
+      }
+
+      // Taken before the frame is handed over to the network task, which finds the node in the table by then
+      bool uplink = target.length >= 6 && frameVersion(target.data) == FRAME_PROTOCOL_VERSION && frameType(target.data) != FRAME_TYPE_LINK;
+      Node *node = uplink ? addNode(frameNode(target.data)) : nullptr;
+      CounterCheck check = node != nullptr ? checkCounter(node->replay, target.counter, frameRetry(target.data), target.received) : COUNTER_NEW;
+      if (check == COUNTER_REPLAYED)
+      {
+        Serial.println("Rejected replayed packet " + String(frameSequence(target.data)) + " of epoch " + String(target.counter >> 16));
+        LoRa.receive();
+        continue;
+      }
+      target.retransmission = check == COUNTER_RETRANSMISSION;
+      bool listens = node != nullptr && (frameFlags(target.data) & FRAME_FLAG_RX_WINDOW);
+      uint16_t sequence = listens ? frameSequence(target.data) : 0;
+      uint32_t counter = target.counter;
+      float snr = target.snr;
+      uint32_t received = target.received;
+
+      // A node in report-by-exception mode may stay silent for as long as its heartbeat says before the link falls back
+      uint16_t heartbeatSequence;
+      uint16_t heartbeatNode;
+      uint32_t silence;
+      if (node != nullptr && !target.retransmission && decodeHeartbeat(target.data, target.length, heartbeatSequence, heartbeatNode, silence))
+      {
+        node->link.silence = silence * 1000;
+      }
+
+      commitFrame();
+      xTaskNotifyGive(networkTaskHandle);
+
+      // Every listening sender of a queued frame gets its acknowledgement, retransmissions too, the answer may have been lost
+      if (listens)
+      {
+        answerLink(*node, sequence, counter, snr, received);
+      }
+    }
+    LoRa.receive();
   }
-  else if (var == "MQTT-USER")
+}
+
+// Answers an uplink with the profile for the next one, still with the profile the sender listens with.
+// Without adaptive data rate the answer only acknowledges the uplink and keeps the current profile.
+// With a key the answer carries a tag for the frame counter of the uplink.
+void answerLink(Node &node, uint16_t sequence, uint32_t counter, float snr, uint32_t received)
+{
+  LinkProfile next = currentConfig().adaptive ? updateLink(node.link, snr, received, nodeCount() > 1) : node.link.profile;
+
+  uint8_t data[LINK_FRAME_LENGTH + FRAME_TAG_LENGTH];
+  size_t length = signAnswer(counter, data, encodeLink(sequence, node.id, next, data, sizeof(data)), sizeof(data));
+  if (length == 0)
   {
-    return String(preferences.getString("user", ""));
+    return;
   }
-  else if (var == "MQTT-PASSWORD")
+
+  delay(LINK_DOWNLINK_DELAY);
+  LoRa.beginPacket();
+  LoRa.write(data, length);
+  LoRa.endPacket();
+
+  if (!sameProfile(next, node.link.profile))
   {
-    return String(preferences.getString("password", ""));
+    switchLink(node.link, next);
   }
-  else if (var == "MQTT-CLIENT")
+  if (!sameProfile(listeningProfile(), currentLinkProfile()))
   {
-    return String(preferences.getString("client", ""));
+    setRadioProfile(listeningProfile());
   }
-  preferences.end();
+}
 
-  // LoRa-Properties
-  preferences.begin("lora-settings", true);
-  if (var == "LORA-SYNC")
+// A single node gets the radio to itself, with more nodes the radio stays at the default data rate they all use
+LinkProfile listeningProfile()
+{
+  if (nodeCount() == 1 && currentConfig().adaptive)
   {
-    return String(preferences.getUInt("sync"));
+    for (uint8_t i = 0; i < NODE_TABLE_CAPACITY; i++)
+    {
+      Node *node = nodeAt(i);
+      if (node != nullptr)
+      {
+        return node->link.profile;
+      }
+    }
   }
-  preferences.end();
+  return defaultLinkProfile;
+}
 
-  return String();
+// The gateway always transmits with full power, the power of the profile is the one of the sender
+void setRadioProfile(const LinkProfile &profile)
+{
+  LoRa.setSpreadingFactor(profile.spreadingFactor);
+  LoRa.setSignalBandwidth(profile.bandwidth);
+  LoRa.setCodingRate4(profile.codingRate);
+  setListeningProfile(profile);
+  Serial.println("Link profile SF" + String(profile.spreadingFactor) + " " + String(profile.bandwidth / 1000) + " kHz CR 4/" + String(profile.codingRate) + ", sender " + String(profile.txPower) + " dBm");
 }
 
-void sendHomeAssistantDiscovery(HomeAssistantTopic haTopic)
+void networkTask(void *parameter)
 {
-  const int capacityPayload = JSON_OBJECT_SIZE(30);
-  StaticJsonDocument<capacityPayload> payload;
+  // Checked once per broker, HA's birth message publishes it again
+  bool discoveryChecked = false;
 
-  String mainTopic = mqttChannel;
-  String configTopic = "homeassistant/sensor/" + mainTopic + "/" + haTopic.field + "/config";
+  for (;;)
+  {
+    unsigned long start = micros();
 
-  JsonObject device = payload.createNestedObject("device");
-  device["identifiers"] = mainTopic;
-  device["model"] = "LoRa-Watermeter";
-  device["manufacturer"] = "IoT";
-  device["name"] = "LoRa-Watermeter";
-  device["sw_version"] = "0.0.2";
-  device["configuration_url"] = "http://" + WiFi.localIP().toString();
+    if (wifiChanged && millis() - wifiChangedAt >= CONFIG_APPLY_DELAY)
+    {
+      wifiChanged = false;
+      applyWiFi();
+    }
 
-  payload["~"] = mainTopic;
-  payload["unique_id"] = "esp32-lora-gw-" + haTopic.field;
-  payload["object_id"] = "esp32-lora-gw-" + haTopic.field;
-  payload["name"] = haTopic.name;
-  payload["icon"] = "mdi:" + haTopic.icon;
-  payload["unit_of_measurement"] = haTopic.unit;
-  payload["state_topic"] = mainTopic + "/state";
-  payload["value_template"] = "{{ value_json." + haTopic.field + " }}";
+    // The next attempt picks up the new broker, which needs the discovery as well
+    if (mqttChanged)
+    {
+      mqttChanged = false;
+      stopMqtt(client, mqttStatus);
+      discoveryChecked = false;
+      discoveryForced = true;
+      for (uint8_t i = 0; i < NODE_TABLE_CAPACITY; i++)
+      {
+        Node *node = nodeAt(i);
+        if (node != nullptr)
+        {
+          node->discovered = false;
+          node->discoveryForced = true;
+        }
+      }
+    }
 
-  if (haTopic.deviceClass != "")
+    Config current = currentConfig();
+    mqttConfigured = brokerConfigured(current);
+    if (serviceConnection(client, current, mqttStatus))
+    {
+      client.subscribe(HA_STATUS_TOPIC);
+      // The broker may have lost the retained availability of the nodes
+      for (uint8_t i = 0; i < NODE_TABLE_CAPACITY; i++)
+      {
+        Node *node = nodeAt(i);
+        if (node != nullptr)
+        {
+          node->availabilityPublished = false;
+        }
+      }
+    }
+    client.loop();
+
+    if (client.connected() && (!discoveryChecked || discoveryForced))
+    {
+      bool forced = discoveryForced;
+      discoveryChecked = publishDiscovery(client, mqttChannel, forced);
+      discoveryForced = forced && !discoveryChecked;
+      sendDeviceInformationMQTT();
+    }
+    publishNodeDiscoveries();
+
+    RadioFrame *radioFrame;
+    while ((radioFrame = peekFrame()) != nullptr)
+    {
+      handleFrame(*radioFrame);
+      releaseFrame();
+    }
+
+    replayBacklog();
+    publishAvailability();
+
+    if (deviceInformationDue)
+    {
+      deviceInformationDue = false;
+      sendDeviceInformationMQTT();
+    }
+
+    if (linkStatsDue)
+    {
+      linkStatsDue = false;
+      sendLinkStatsMQTT();
+    }
+
+    observeSince(networkLoopSeconds, start);
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(NETWORK_IDLE_WAIT));
+  }
+}
+
+Config currentConfig()
+{
+  portENTER_CRITICAL(&configMux);
+  Config current = config;
+  portEXIT_CRITICAL(&configMux);
+  return current;
+}
+
+// Applies new settings without a reboot. The radio and network tasks own LoRa, WiFi and MQTT and pick up their changes,
+// only changed WiFi credentials drop the connection.
+void applyConfig(const Config &newConfig)
+{
+  Config previous = currentConfig();
+  portENTER_CRITICAL(&configMux);
+  config = newConfig;
+  portEXIT_CRITICAL(&configMux);
+
+  if (strcmp(newConfig.ssid, previous.ssid) != 0 || strcmp(newConfig.password, previous.password) != 0)
+  {
+    wifiChangedAt = millis();
+    wifiChanged = true;
+  }
+
+  if (strcmp(newConfig.brokerHost, previous.brokerHost) != 0 || newConfig.brokerPort != previous.brokerPort ||
+      strcmp(newConfig.brokerUser, previous.brokerUser) != 0 || strcmp(newConfig.brokerPassword, previous.brokerPassword) != 0 ||
+      strcmp(newConfig.brokerClient, previous.brokerClient) != 0)
   {
-    payload["device_class"] = haTopic.deviceClass;
+    mqttChanged = true;
   }
 
-  if (haTopic.stateClass != "")
+  if (newConfig.syncWord != previous.syncWord)
   {
-    payload["state_class"] = haTopic.stateClass;
+    syncWordChanged = true;
+    xTaskNotifyGive(radioTaskHandle);
   }
 
-  if (haTopic.entityCategory == "watermeter")
+  if (memcmp(newConfig.key, previous.key, FRAME_KEY_LENGTH) != 0)
   {
-    payload["value_template"] = "{{ value_json.watermeter." + haTopic.field + " }}";
+    keyChanged = true;
+    xTaskNotifyGive(radioTaskHandle);
   }
-  else if (haTopic.entityCategory != "")
+
+  if (newConfig.interval != previous.interval || newConfig.linkInterval != previous.linkInterval)
   {
-    payload["entity_category"] = haTopic.entityCategory;
+    timer.detach();
+    linkTimer.detach();
+    setupTimer();
   }
+  Serial.println("Applied new settings");
+}
 
-  String payloadSerialized;
-  serializeJson(payload, payloadSerialized);
+// Connects to the new WiFi without blocking, serviceConnection() takes over from here
+void applyWiFi()
+{
+  Config current = currentConfig();
+  stopMqtt(client, mqttStatus);
 
-  if (client.connected())
+  if (strlen(current.ssid) == 0 || strlen(current.password) == 0)
   {
-    client.publish(String(configTopic).c_str(), String(payloadSerialized).c_str(), true);
-  }
-}
-
-void mqttHomeAssistantDiscovery()
-{
-  // diagnostic information
-  HomeAssistantTopic uptime = HomeAssistantTopic{"uptime", "Uptime", "clock-time-eight-outline", "s", "", "", "diagnostic"};
-  HomeAssistantTopic MAC = HomeAssistantTopic{"mac", "MAC-Address", "network-outline", "", "", "", "diagnostic"};
-  HomeAssistantTopic hostname = HomeAssistantTopic{"hostname", "Hostname", "network-outline", "", "", "", "diagnostic"};
-  HomeAssistantTopic wifiRSSI = HomeAssistantTopic{"wifiRSSI", "WiFi-RSSI", "wifi", "dBm", "signal_strength", "", "diagnostic"};
-  HomeAssistantTopic loraRSSI = HomeAssistantTopic{"loraRSSI", "LoRa-RSSI", "wifi", "dBm", "signal_strength", "", "diagnostic"};
-  HomeAssistantTopic ip = HomeAssistantTopic{"ip", "IP", "network-outline", "", "", "", "diagnostic"};
-
-  sendHomeAssistantDiscovery(uptime);
-  sendHomeAssistantDiscovery(MAC);
-  sendHomeAssistantDiscovery(hostname);
-  sendHomeAssistantDiscovery(wifiRSSI);
-  sendHomeAssistantDiscovery(loraRSSI);
-  sendHomeAssistantDiscovery(ip);
-
-  // sensor information
-  HomeAssistantTopic watermeterValue = HomeAssistantTopic{"value", "Water Consumption", "gauge", "m^3", "", "", "watermeter"};
-  HomeAssistantTopic watermeterPrevious = HomeAssistantTopic{"previous", "Previous Water Consumption", "gauge", "m^3", "", "", "watermeter"};
-  HomeAssistantTopic watermeterRaw = HomeAssistantTopic{"raw", "RAW Reading", "message", "", "", "", "watermeter"};
-  HomeAssistantTopic watermeterRate = HomeAssistantTopic{"rate", "Water Rate", "gauge", "m^3", "", "", "watermeter"};
-  HomeAssistantTopic watermeterError = HomeAssistantTopic{"error", "Watermeter Error", "message", "", "", "", "watermeter"};
-  HomeAssistantTopic temperature = HomeAssistantTopic{"temperature", "Temperature Forest", "thermometer", "°C", "", "", ""};
-  HomeAssistantTopic humidity = HomeAssistantTopic{"humidity", "Humidity Forest", "water-percent", "%", "", "", ""};
-  HomeAssistantTopic message = HomeAssistantTopic{"message", "LoRa Message", "message", "", "", "", ""};
-  HomeAssistantTopic packet_number = HomeAssistantTopic{"packet_number", "LoRa Packet Number", "counter", "", "", "", ""};
-
-  sendHomeAssistantDiscovery(watermeterValue);
-  sendHomeAssistantDiscovery(watermeterPrevious);
-  sendHomeAssistantDiscovery(watermeterRaw);
-  sendHomeAssistantDiscovery(watermeterRate);
-  sendHomeAssistantDiscovery(watermeterError);
-  sendHomeAssistantDiscovery(temperature);
-  sendHomeAssistantDiscovery(humidity);
-  sendHomeAssistantDiscovery(message);
-  sendHomeAssistantDiscovery(packet_number);
+    WiFi.disconnect();
+    WiFi.softAP(INIT_WIFI_SSID, INIT_WIFI_PASSWORD);
+    Serial.println("Started WiFi-AP with the SSID: " + String(INIT_WIFI_SSID));
+    return;
+  }
+
+  Serial.println("Connecting to WiFi " + String(current.ssid) + "...");
+  WiFi.softAPdisconnect(true);
+  WiFi.mode(WIFI_STA);
+  WiFi.setHostname("esp32-lora-gw");
+  WiFi.begin(current.ssid, current.password);
+  configTzTime(TIMEZONE, ntpServer);
 }
 
-void loop()
+// Called from the timer task, the network task owns the MQTT client
+void requestDeviceInformation()
 {
-  // try to parse packet
-  int packetSize = LoRa.parsePacket();
-  if (packetSize)
+  deviceInformationDue = true;
+}
+
+void requestLinkStats()
+{
+  linkStatsDue = true;
+}
+
+void handleFrame(const RadioFrame &radioFrame)
+{
+  const uint8_t *frame = radioFrame.data;
+  size_t frameLength = radioFrame.length;
+
+  // Every frame counts for the link quality, duplicates and undecodable ones too
+  recordLinkFrame(radioFrame.rssi, radioFrame.snr, radioFrame.frequencyError, radioFrame.airtime, radioFrame.received);
+
+  // Timestamps are only published once NTP has set the clock, frames may have waited in the ring
+  time_t now = time(nullptr) - (millis() - radioFrame.received) / 1000;
+  time_t timestamp = now > 1600000000 ? now : 0;
+
+  // Added by the radio task, frames of other protocol versions and of nodes that did not fit have no entry
+  Node *node = frameLength >= 6 ? findNode(frameNode(frame)) : nullptr;
+  if (node == nullptr)
+  {
+    Serial.println("Dropped packet with " + String(frameLength) + " bytes of an unknown node");
+    return;
+  }
+
+  // Every GUARD_STORE_INTERVAL frames the counter is kept for a restart of the gateway
+  if (radioFrame.counter != 0)
   {
-    // received a packet
-    Serial.print("Received packet '");
+    storeCounter(node->replay, node->id, radioFrame.counter);
+  }
+
+  char nodeName[FRAME_NODE_TEXT_LENGTH];
+  formatNode(node->id, nodeName);
+  node->rssi = node->delivery.delivered == 0 ? radioFrame.rssi : node->rssi + NODE_AVERAGE_WEIGHT * (radioFrame.rssi - node->rssi);
+  node->snr = node->delivery.delivered == 0 ? radioFrame.snr : node->snr + NODE_AVERAGE_WEIGHT * (radioFrame.snr - node->snr);
+
+  // A secured retransmission of the last frame only gets its acknowledgement again, it is no sign of life either
+  if (radioFrame.retransmission)
+  {
+    recordDuplicate(node->delivery);
+    Serial.println("Dropped retransmission of packet " + String(frameSequence(frame)) + " of node " + String(nodeName));
+    return;
+  }
+
+  // Retransmissions of an acknowledged sender whose acknowledgement got lost are only published once
+  if (!recordDelivery(node->delivery, frameSequence(frame), frameRetry(frame), radioFrame.received))
+  {
+    Serial.println("Dropped duplicate of packet " + String(frameSequence(frame)) + " of node " + String(nodeName));
+    return;
+  }
+
+  recordUplink(node->liveness, radioFrame.received);
+  GatewayState state = loadNodeState(*node);
+  state.received = radioFrame.received;
+  state.rssi = radioFrame.rssi;
+  state.snr = radioFrame.snr;
 
-    // read packet
-    while (LoRa.available())
+  if (frameType(frame) == FRAME_TYPE_HEARTBEAT)
+  {
+    uint16_t sequence;
+    uint16_t nodeId;
+    uint32_t silence;
+    if (!decodeHeartbeat(frame, frameLength, sequence, nodeId, silence))
     {
-      loraData = LoRa.readString();
-      Serial.println(loraData);
+      Serial.println("Dropped invalid heartbeat with " + String(frameLength) + " bytes");
+      return;
+    }
+    recordHeartbeat(node->liveness, silence);
+    Serial.println("Heartbeat " + String(sequence) + " of node " + String(nodeName) + ", next uplink in " + String(silence) + " seconds at the latest");
 
-      // Send LoRa RSSI
-      const int capacityPayload = JSON_OBJECT_SIZE(1);
-      StaticJsonDocument<capacityPayload> payload;
-      payload["loraRSSI"] = LoRa.packetRssi();
+    // The readings did not change since the last one, which the flow analytics learn only now
+    for (uint8_t meter = 0; meter < NODE_METERS; meter++)
+    {
+      if (node->flow[meter].started)
+      {
+        confirmFlow(node->flow[meter], node->id, meter, timestamp);
+        sendNodeFlowMQTT(*node, meter);
+      }
+    }
+  }
+  else if (frameType(frame) == FRAME_TYPE_BATCH)
+  {
+    uint16_t sequence;
+    uint16_t nodeId;
+    uint8_t count;
+    if (!decodeBatch(frame, frameLength, now, sequence, nodeId, batchSamples, FRAME_MAX_BATCH_SAMPLES, count))
+    {
+      Serial.println("Dropped invalid batch with " + String(frameLength) + " bytes");
+      return;
+    }
 
-      String payloadSerialized;
-      serializeJson(payload, payloadSerialized);
+    // Every sample becomes its own state update, oldest first. Alarms are published when they change, the rest of
+    // the flow analytics once for the whole batch.
+    uint8_t flowMeters = 0;
+    for (uint8_t i = 0; i < count; i++)
+    {
+      const WatermeterSample &sample = batchSamples[i];
+      WatermeterReading reading = {};
+      reading.sequence = sequence;
+      reading.node = nodeId;
+      reading.meter = sample.meter;
+      reading.flags = sample.flags;
+      reading.value = sample.value;
+      reading.previous = sample.previous;
+      reading.rate = sample.rate;
+      reading.temperature = sample.temperature;
+      reading.humidity = sample.humidity;
+      strcpy(reading.error, "error");
 
-      if (client.connected())
+      if (publishReading(reading, timestamp ? sample.timestamp : 0))
+      {
+        observeHistogram(rxToMqttSeconds, (millis() - radioFrame.received) / 1000.0f);
+      }
+      recordHistory(reading, timestamp ? sample.timestamp : 0, radioFrame.rssi);
+      if (sample.meter < NODE_METERS)
       {
-        client.publish(mqttState, String(loraData).c_str(), true);
-        client.publish(mqttState, String(payloadSerialized).c_str(), true);
+        if (recordFlow(node->flow[sample.meter], reading, timestamp ? sample.timestamp : 0) != 0)
+        {
+          sendNodeFlowMQTT(*node, sample.meter);
+        }
+        flowMeters |= 1 << sample.meter;
+      }
+
+      state.valid = true;
+      state.reading = reading;
+      state.timestamp = timestamp ? sample.timestamp : 0;
+    }
+    for (uint8_t meter = 0; meter < NODE_METERS; meter++)
+    {
+      if (flowMeters & (1 << meter))
+      {
+        sendNodeFlowMQTT(*node, meter);
       }
     }
   }
+  else
+  {
+    // The references of a node only cover the meter slots of a sender
+    uint8_t meter = frameMeter(frame, frameLength);
+    if (meter >= NODE_METERS)
+    {
+      Serial.println("Dropped packet of meter " + String(meter) + " of node " + String(nodeName));
+      return;
+    }
 
-  if (!client.connected())
+    WatermeterReading reading;
+    DecodeResult result = decodeFrame(frame, frameLength, node->references[meter], reading);
+    if (result == DECODE_INVALID)
+    {
+      Serial.println("Dropped invalid packet with " + String(frameLength) + " bytes");
+      return;
+    }
+    else if (result == DECODE_MISSING_KEYFRAME)
+    {
+      Serial.println("Dropped packet " + String(reading.sequence) + ", waiting for the next keyframe");
+      return;
+    }
+    if (publishReading(reading, timestamp))
+    {
+      observeHistogram(rxToMqttSeconds, (millis() - radioFrame.received) / 1000.0f);
+    }
+    recordHistory(reading, timestamp, radioFrame.rssi);
+    recordFlow(node->flow[meter], reading, timestamp);
+    sendNodeFlowMQTT(*node, meter);
+
+    state.valid = true;
+    state.reading = reading;
+    state.timestamp = timestamp;
+  }
+
+  // Decoded once, the web server renders from these snapshots. The one of the gateway shows the latest packet of any node.
+  state.silence = expectedSilence(node->liveness);
+  state.packets++;
+  storeNodeState(*node, state);
+  GatewayState latest = state;
+  latest.packets = loadState().packets + 1;
+  storeState(latest);
+}
+
+// Returns true if the reading reached the broker
+bool publishReading(const WatermeterReading &reading, time_t timestamp)
+{
+  String payloadSerialized = readingToJson(reading, timestamp);
+  Serial.print("Received packet ");
+  Serial.println(payloadSerialized);
+
+  // Readings that cannot be published wait in flash until the broker is back
+  String topic = nodeTopic(reading.node, reading.meter == 0 ? String("state") : "meter/" + String(reading.meter));
+  if (client.connected() && client.publish(topic.c_str(), payloadSerialized.c_str(), true))
+  {
+    return true;
+  }
+  if (mqttConfigured)
+  {
+    publishFailures++;
+    if (!appendBacklog(reading, timestamp))
+    {
+      Serial.println("Lost packet " + String(reading.sequence) + ", backlog not writable");
+    }
+  }
+  return false;
+}
+
+// Replays the backlog oldest first at a bounded rate, so live readings and other MQTT traffic are not held up.
+// Replayed readings go to their own topic, the retained state keeps showing the latest reading.
+void replayBacklog()
+{
+  static uint32_t lastReplay = 0;
+
+  if (!client.connected() || backlogCount() == 0 || millis() - lastReplay < BACKLOG_REPLAY_INTERVAL)
   {
-    reconnect();
+    return;
+  }
+  lastReplay = millis();
+
+  WatermeterReading reading;
+  uint32_t timestamp;
+  if (peekBacklog(reading, timestamp))
+  {
+    String payloadSerialized = readingToJson(reading, timestamp);
+    if (client.publish(mqttBacklog, payloadSerialized.c_str(), false))
+    {
+      releaseBacklog();
+    }
+    else
+    {
+      publishFailures++;
+    }
   }
 }
 
-void reconnect()
+// Keeps the JSON layout the sender used to transmit, so MQTT consumers are unaffected by the binary frame
+String readingToJson(const WatermeterReading &reading, time_t timestamp)
+{
+  StaticJsonDocument<READING_JSON_CAPACITY> payload;
+  writeReadingJson(payload.to<JsonObject>(), reading, timestamp);
+
+  String payloadSerialized;
+  serializeJson(payload, payloadSerialized);
+  return payloadSerialized;
+}
+
+// Same layout as the state topic plus the radio details of the packet
+String stateToJson(const GatewayState &state)
 {
-  if (WiFi.status() != WL_CONNECTED)
+  StaticJsonDocument<READING_JSON_CAPACITY + JSON_OBJECT_SIZE(7)> payload;
+  JsonObject root = payload.to<JsonObject>();
+
+  if (state.valid)
   {
-    setupWiFi();
+    writeReadingJson(root, state.reading, state.timestamp);
   }
 
-  if (WiFi.status() == WL_CONNECTED)
+  JsonObject lora = root.createNestedObject("lora");
+  lora["packets"] = state.packets;
+  if (state.packets > 0)
   {
-    setupMQTT();
+    lora["rssi"] = state.rssi;
+    lora["snr"] = state.snr;
+    lora["age"] = (millis() - state.received) / 1000;
+    if (state.silence > 0)
+    {
+      lora["silence"] = state.silence / 1000;
+    }
+    lora["stale"] = nodeStale(state.received, state.silence, millis());
+  }
+
+  String payloadSerialized;
+  serializeJson(payload, payloadSerialized);
+  return payloadSerialized;
+}
+
+// Numeric query parameter, or fallback if it is missing
+uint32_t historyParam(AsyncWebServerRequest *request, const char *name, uint32_t fallback, int base = 10)
+{
+  return request->hasParam(name) ? strtoul(request->getParam(name)->value().c_str(), nullptr, base) : fallback;
+}
+
+// The points are formatted chunk by chunk while the answer is sent, a long range is never held in RAM
+void sendHistory(AsyncWebServerRequest *request)
+{
+  uint16_t node = historyParam(request, "node", defaultHistoryNode(), 16);
+  if (node == FRAME_NO_NODE)
+  {
+    request->send(404, "text/plain", "No history recorded yet");
+    return;
+  }
+
+  std::shared_ptr<HistoryQuery> query = std::make_shared<HistoryQuery>();
+  beginHistoryQuery(*query, node, historyParam(request, "meter", 0), historyParam(request, "from", 0),
+                    historyParam(request, "to", UINT32_MAX), historyParam(request, "step", 0));
+  request->send(request->beginChunkedResponse("application/json", [query](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+                                              { return readHistoryJson(*query, buffer, maxLen); }));
+}
+
+void writeReadingJson(JsonObject payload, const WatermeterReading &reading, time_t timestamp)
+{
+
+  if (!(reading.flags & FRAME_FLAG_SENSOR_FAILED))
+  {
+    payload["humidity"] = fromFixedPoint(reading.humidity, FRAME_CLIMATE_SCALE);
+    payload["temperature"] = fromFixedPoint(reading.temperature, FRAME_CLIMATE_SCALE);
+  }
+  payload["packet_number"] = reading.sequence;
+  char node[FRAME_NODE_TEXT_LENGTH];
+  formatNode(reading.node, node);
+  payload["node"] = node;
+  if (reading.meter > 0)
+  {
+    payload["meter"] = reading.meter;
+  }
+
+  JsonObject watermeter = payload.createNestedObject("watermeter");
+
+  if (!(reading.flags & FRAME_FLAG_METER_FAILED))
+  {
+    if (reading.value > reading.previous)
+    {
+      watermeter["current"] = fromFixedPoint(reading.value, FRAME_VALUE_SCALE);
+    }
+    watermeter["previous"] = fromFixedPoint(reading.previous, FRAME_VALUE_SCALE);
+
+    if (reading.flags & FRAME_FLAG_HAS_RAW)
+    {
+      watermeter["raw"] = reading.raw;
+    }
+    else
+    {
+      watermeter["raw"] = String(fromFixedPoint(reading.value, FRAME_VALUE_SCALE), 4);
+    }
+
+    if (reading.flags & FRAME_FLAG_HAS_RATE)
+    {
+      watermeter["rate"] = String(fromFixedPoint(reading.rate, FRAME_RATE_SCALE), 4);
+    }
+    watermeter["error"] = (reading.flags & FRAME_FLAG_METER_ERROR) ? reading.error : "no error";
+  }
+
+  payload["message"] = "Hello";
+
+  if (timestamp)
+  {
+    payload["timestamp"] = (uint32_t)timestamp;
+  }
+}
+
+String formatMetrics()
+{
+  String out;
+  out.reserve(METRICS_BUFFER);
+  writeHistogram(out, networkLoopSeconds);
+  writeHistogram(out, rxToMqttSeconds);
+  writeCounter(out, "gateway_mqtt_publish_failures_total", "Readings that could not be published, live or from the backlog.", publishFailures);
+  writeCounter(out, "gateway_frames_dropped_total", "Frames dropped because the ring to the network task was full.", droppedFrames());
+  writeCounter(out, "gateway_frames_rejected_total", "Frames of nodes that did not fit into the node table.", rejectedFrames());
+  writeCounter(out, "gateway_frames_unauthenticated_total", "Frames dropped because their tag did not match the key, or without a tag while a key is set.", unauthenticatedFrames());
+  writeCounter(out, "gateway_frames_replayed_total", "Authenticated frames dropped because their frame counter was not newer than the last one of the node and no retransmission of it.", replayedFrames());
+  writeCounter(out, "gateway_packets_delivered_total", "Packets of all nodes, without duplicates.", deliveredPackets());
+  writeCounter(out, "gateway_packets_retransmitted_total", "Packets that arrived as retransmission.", retransmittedPackets());
+  writeCounter(out, "gateway_packets_duplicate_total", "Duplicates of packets that were already published.", duplicatePackets());
+  writeCounter(out, "gateway_packets_lost_total", "Packets missing in the sequence numbers.", lostPackets());
+  writeCounter(out, "gateway_backlog_dropped_total", "Readings dropped from the full backlog.", backlogDropped());
+  writeGauge(out, "gateway_frames_queued", "Frames waiting for the network task.", queuedFrames());
+  writeGauge(out, "gateway_backlog_readings", "Readings waiting in the backlog for the broker.", backlogCount());
+  writeGauge(out, "gateway_mqtt_connected", "1 while the MQTT client is connected.", connectionState() == CONNECTION_ONLINE ? 1 : 0);
+  writeGauge(out, "gateway_nodes", "Nodes in the node table.", nodeCount());
+  writeGauge(out, "gateway_nodes_stale", "Nodes that stayed silent for longer than they announced.", staleNodes(millis()));
+
+  writeNodeMetric(out, "gateway_node_rssi_dbm", "Moving average of the RSSI of a node.", &Node::rssi);
+  writeNodeMetric(out, "gateway_node_snr_db", "Moving average of the SNR of a node.", &Node::snr);
+  writeConnectionMetrics(out);
+  writeHistoryMetrics(out);
+  writeSystemMetrics(out);
+  return out;
+}
+
+// One gauge per node, labelled with the ID the sender reports
+void writeNodeMetric(String &out, const char *name, const char *help, float Node::*field)
+{
+  writeHeader(out, name, "gauge", help);
+  char id[FRAME_NODE_TEXT_LENGTH];
+  char labels[FRAME_NODE_TEXT_LENGTH + 8];
+  for (uint8_t i = 0; i < NODE_TABLE_CAPACITY; i++)
+  {
+    Node *node = nodeAt(i);
+    if (node != nullptr)
+    {
+      formatNode(node->id, id);
+      snprintf(labels, sizeof(labels), "node=\"%s\"", id);
+      writeSample(out, name, labels, node->*field);
+    }
   }
 }
 
@@ -468,7 +1159,7 @@ void sendDeviceInformationMQTT()
 {
   if (client.connected())
   {
-    const int capacityPayload = JSON_OBJECT_SIZE(14);
+    const int capacityPayload = JSON_OBJECT_SIZE(18);
     StaticJsonDocument<capacityPayload> payload;
 
     payload["uptime"] = millis();
@@ -476,10 +1167,213 @@ void sendDeviceInformationMQTT()
     payload["hostname"] = WiFi.getHostname();
     payload["wifiRSSI"] = WiFi.RSSI();
     payload["ip"] = WiFi.localIP();
+    payload["loraDropped"] = droppedFrames();
+    payload["backlog"] = backlogCount();
+    payload["backlogDropped"] = backlogDropped();
+    payload["loraSF"] = currentLinkProfile().spreadingFactor;
+    payload["deliveryRatio"] = round(deliveryRatio() * 10) / 10;
+    payload["loraRetries"] = retransmittedPackets();
+    payload["loraDuplicates"] = duplicatePackets();
+    payload["loraLost"] = lostPackets();
+    payload["nodes"] = nodeCount();
+    payload["loraRejected"] = rejectedFrames();
 
     String payloadSerialized;
     serializeJson(payload, payloadSerialized);
 
     client.publish(mqttState, String(payloadSerialized).c_str(), true);
   }
+}
+
+// Medians and the tails that matter, the low RSSI/SNR of a fading link and the long gaps between frames
+void sendLinkStatsMQTT()
+{
+  if (!client.connected() || linkStatsFrames() == 0)
+  {
+    return;
+  }
+
+  const int capacityPayload = JSON_OBJECT_SIZE(9);
+  StaticJsonDocument<capacityPayload> payload;
+  float value;
+
+  payload["frames"] = linkStatsFrames();
+  if (linkPercentile(LINK_RSSI, 50, value))
+  {
+    payload["loraRSSI"] = value;
+  }
+  if (linkPercentile(LINK_RSSI, 10, value))
+  {
+    payload["loraRSSIP10"] = value;
+  }
+  if (linkPercentile(LINK_SNR, 50, value))
+  {
+    payload["loraSNR"] = value;
+  }
+  if (linkPercentile(LINK_SNR, 10, value))
+  {
+    payload["loraSNRP10"] = value;
+  }
+  if (linkPercentile(LINK_FREQUENCY_ERROR, 50, value))
+  {
+    payload["loraFrequencyError"] = value;
+  }
+  if (linkPercentile(LINK_AIRTIME, 50, value))
+  {
+    payload["loraAirtime"] = value;
+  }
+  if (linkPercentile(LINK_INTERVAL, 50, value))
+  {
+    payload["loraInterval"] = value;
+  }
+  if (linkPercentile(LINK_INTERVAL, 90, value))
+  {
+    payload["loraIntervalP90"] = value;
+  }
+
+  String payloadSerialized;
+  serializeJson(payload, payloadSerialized);
+  client.publish(mqttLink, payloadSerialized.c_str(), true);
+
+  for (uint8_t i = 0; i < NODE_TABLE_CAPACITY; i++)
+  {
+    Node *node = nodeAt(i);
+    if (node != nullptr && node->delivery.delivered > 0)
+    {
+      sendNodeLinkMQTT(*node);
+    }
+  }
+}
+
+// Averages and delivery of a single node. The profile is the one the radio task assigned last, read without a lock,
+// a torn value is corrected by the next publication.
+void sendNodeLinkMQTT(const Node &node)
+{
+  const int capacityPayload = JSON_OBJECT_SIZE(8);
+  StaticJsonDocument<capacityPayload> payload;
+  LinkProfile profile = node.link.profile;
+
+  payload["loraRSSI"] = round(node.rssi * 10) / 10;
+  payload["loraSNR"] = round(node.snr * 10) / 10;
+  payload["loraSF"] = profile.spreadingFactor;
+  payload["loraTxPower"] = profile.txPower;
+  payload["packets"] = node.delivery.delivered;
+  payload["deliveryRatio"] = round(deliveryRatio(node.delivery) * 10) / 10;
+  payload["loraRetries"] = node.delivery.retransmitted;
+  payload["loraLost"] = node.delivery.lost;
+
+  String payloadSerialized;
+  serializeJson(payload, payloadSerialized);
+  client.publish(nodeTopic(node.id, "link").c_str(), payloadSerialized.c_str(), true);
+}
+
+// Flow analytics of a meter of a node, retained like the reading. Volumes in L, NAN becomes null until it is known.
+void sendNodeFlowMQTT(const Node &node, uint8_t meter)
+{
+  const FlowState &flow = node.flow[meter];
+  if (!flow.started)
+  {
+    return;
+  }
+
+  const int capacityPayload = JSON_OBJECT_SIZE(9);
+  StaticJsonDocument<capacityPayload> payload;
+
+  payload["flow"] = round(flow.flow * 100) / 100;
+  payload["continuousFlow"] = flowDuration(flow) / 60;
+  payload["today"] = round(flow.today * (1000.0f / FRAME_VALUE_SCALE) * 10) / 10;
+  payload["yesterday"] = round(flow.yesterday * (1000.0f / FRAME_VALUE_SCALE) * 10) / 10;
+  payload["nightFlow"] = round(flow.nightFlow * 10) / 10;
+  payload["leak"] = flow.alarms & FLOW_ALARM_LEAK ? "ON" : "OFF";
+  payload["continuousLeak"] = flow.alarms & FLOW_ALARM_CONTINUOUS ? "ON" : "OFF";
+  payload["burst"] = flow.alarms & FLOW_ALARM_BURST ? "ON" : "OFF";
+  payload["meterResets"] = flow.resets;
+
+  String payloadSerialized;
+  serializeJson(payload, payloadSerialized);
+  client.publish(nodeTopic(node.id, meter == 0 ? String("flow") : "meter/" + String(meter) + "/flow").c_str(), payloadSerialized.c_str(), true);
+}
+
+String nodeTopic(uint16_t node, const String &subtopic)
+{
+  char name[FRAME_NODE_TEXT_LENGTH];
+  formatNode(node, name);
+  return String(mqttChannel) + "/" + name + "/" + subtopic;
+}
+
+// One node per call, so a Home Assistant restart with dozens of nodes does not hold up the frames
+void publishNodeDiscoveries()
+{
+  if (!client.connected())
+  {
+    return;
+  }
+
+  for (uint8_t i = 0; i < NODE_TABLE_CAPACITY; i++)
+  {
+    Node *node = nodeAt(i);
+    if (node != nullptr && (!node->discovered || node->discoveryForced))
+    {
+      node->discovered = publishNodeDiscovery(client, mqttChannel, node->id, node->discoveryForced);
+      node->discoveryForced = node->discoveryForced && !node->discovered;
+      return;
+    }
+  }
+}
+
+// Retained "online" or "offline" on the availability topic of every node, the entities of a stale node become unavailable in HA
+void publishAvailability()
+{
+  if (!client.connected())
+  {
+    return;
+  }
+
+  uint32_t now = millis();
+  for (uint8_t i = 0; i < NODE_TABLE_CAPACITY; i++)
+  {
+    Node *node = nodeAt(i);
+    if (node == nullptr || !node->liveness.heard)
+    {
+      continue;
+    }
+    bool stale = nodeStale(node->liveness.lastUplink, expectedSilence(node->liveness), now);
+    if (node->availabilityPublished && stale == node->stale)
+    {
+      continue;
+    }
+    if (!client.publish(nodeTopic(node->id, "availability").c_str(), stale ? "offline" : "online", true))
+    {
+      return;
+    }
+    if (stale != node->stale)
+    {
+      char name[FRAME_NODE_TEXT_LENGTH];
+      formatNode(node->id, name);
+      Serial.println(stale ? "Node " + String(name) + " is stale, silent for " + String((now - node->liveness.lastUplink) / 1000) + " seconds"
+                           : "Node " + String(name) + " is back");
+    }
+    node->availabilityPublished = true;
+    node->stale = stale;
+  }
+}
+
+// Last packet of every node, in the layout of /api/state
+String nodesToJson()
+{
+  String json = "[";
+  for (uint8_t i = 0; i < NODE_TABLE_CAPACITY; i++)
+  {
+    Node *node = nodeAt(i);
+    if (node == nullptr)
+    {
+      continue;
+    }
+    GatewayState state = loadNodeState(*node);
+    if (state.valid)
+    {
+      json += (json.length() > 1 ? "," : "") + stateToJson(state);
+    }
+  }
+  return json + "]";
 }
\ No newline at end of file
@@ -0,0 +1,221 @@
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <unity.h>
+#include "Backlog.h"
+
+// A broker outage of several hours against the backlog in SPIFFS, run with `pio test -e native_test`.
+// SPIFFS lives in NATIVE_STATE, which the test points to a directory of its own. setupBacklog() again is a reboot.
+#define TEST_STATE ".native/test_backlog"
+#define TEST_START 1687115042
+#define TEST_INTERVAL 60 // seconds between the readings of a node
+#define TEST_NODES 3
+#define TEST_HOURS 12
+#define TEST_RECORD_SIZE 28 // record header and a reading with rate
+#define TEST_SEGMENT_RECORDS (BACKLOG_SEGMENT_SIZE / TEST_RECORD_SIZE)
+
+// Reading number i of the outage, the nodes take turns
+static WatermeterReading testReading(uint32_t i)
+{
+  WatermeterReading reading = {};
+  reading.sequence = i / TEST_NODES;
+  reading.node = 1 + i % TEST_NODES;
+  reading.flags = FRAME_FLAG_HAS_RATE;
+  reading.value = 4826027 + 8 * i;
+  reading.previous = reading.value - 8;
+  reading.rate = 8;
+  reading.temperature = 215;
+  reading.humidity = 452;
+  return reading;
+}
+
+static uint32_t testTimestamp(uint32_t i)
+{
+  return TEST_START + TEST_INTERVAL * (i / TEST_NODES);
+}
+
+static void appendReadings(uint32_t from, uint32_t to)
+{
+  for (uint32_t i = from; i < to; i++)
+  {
+    TEST_ASSERT_TRUE(appendBacklog(testReading(i), testTimestamp(i)));
+  }
+}
+
+// Replays up to limit readings and checks that they are reading from, from + 1, ... Returns the next expected one.
+static uint32_t replayReadings(uint32_t from, uint32_t limit)
+{
+  WatermeterReading reading;
+  uint32_t timestamp;
+  uint32_t next = from;
+  while (next - from < limit && peekBacklog(reading, timestamp))
+  {
+    WatermeterReading expected = testReading(next);
+    TEST_ASSERT_EQUAL_UINT16(expected.node, reading.node);
+    TEST_ASSERT_EQUAL_UINT16(expected.sequence, reading.sequence);
+    TEST_ASSERT_EQUAL_UINT32(expected.value, reading.value);
+    TEST_ASSERT_EQUAL_UINT32(testTimestamp(next), timestamp);
+    releaseBacklog();
+    next++;
+  }
+  return next;
+}
+
+static uint32_t segmentFiles()
+{
+  uint32_t files = 0;
+  File root = SPIFFS.open("/backlog", FILE_READ);
+  File file;
+  while (root && (file = root.openNextFile()))
+  {
+    String name = file.name();
+    files += name.endsWith(".log") ? 1 : 0;
+  }
+  return files;
+}
+
+void setUp()
+{
+  setenv("NATIVE_STATE", TEST_STATE, 1);
+  SPIFFS.begin(true);
+  SPIFFS.format();
+  setupBacklog();
+}
+
+void tearDown()
+{
+  SPIFFS.format();
+}
+
+static void test_outage_replays_in_order()
+{
+  uint32_t readings = TEST_HOURS * 3600 / TEST_INTERVAL * TEST_NODES;
+  TEST_ASSERT_GREATER_THAN(2 * TEST_SEGMENT_RECORDS, readings);
+  appendReadings(0, readings);
+  TEST_ASSERT_EQUAL_UINT32(readings, backlogCount());
+  TEST_ASSERT_GREATER_THAN(2, segmentFiles());
+
+  TEST_ASSERT_EQUAL_UINT32(readings, replayReadings(0, readings));
+  TEST_ASSERT_EQUAL_UINT32(0, backlogCount());
+  TEST_ASSERT_EQUAL_UINT32(0, backlogDropped());
+
+  // Replayed segments are gone, appends continue in the last one
+  TEST_ASSERT_LESS_OR_EQUAL(1, segmentFiles());
+  appendReadings(readings, readings + 10);
+  TEST_ASSERT_EQUAL_UINT32(readings + 10, replayReadings(readings, 10));
+}
+
+static void test_reboot_during_outage()
+{
+  appendReadings(0, 3 * TEST_SEGMENT_RECORDS);
+  setupBacklog();
+  TEST_ASSERT_EQUAL_UINT32(3 * TEST_SEGMENT_RECORDS, backlogCount());
+
+  appendReadings(3 * TEST_SEGMENT_RECORDS, 4 * TEST_SEGMENT_RECORDS);
+  TEST_ASSERT_EQUAL_UINT32(4 * TEST_SEGMENT_RECORDS, replayReadings(0, UINT32_MAX));
+  TEST_ASSERT_EQUAL_UINT32(0, backlogCount());
+}
+
+// The position is saved every BACKLOG_POSITION_INTERVAL readings, a reboot replays at most that many again
+static void test_reboot_during_replay()
+{
+  uint32_t readings = 3 * TEST_SEGMENT_RECORDS;
+  appendReadings(0, readings);
+  uint32_t next = replayReadings(0, TEST_SEGMENT_RECORDS + 100);
+
+  setupBacklog();
+  WatermeterReading reading;
+  uint32_t timestamp;
+  TEST_ASSERT_TRUE(peekBacklog(reading, timestamp));
+  uint32_t resumed = (timestamp - TEST_START) / TEST_INTERVAL * TEST_NODES + reading.node - 1;
+  TEST_ASSERT_LESS_OR_EQUAL(next, resumed);
+  TEST_ASSERT_GREATER_OR_EQUAL(next - BACKLOG_POSITION_INTERVAL, resumed);
+
+  TEST_ASSERT_EQUAL_UINT32(readings, replayReadings(resumed, UINT32_MAX));
+  TEST_ASSERT_EQUAL_UINT32(0, backlogCount());
+}
+
+// A full backlog drops whole segments of the oldest readings, the newest ones all stay
+static void test_capacity_drops_oldest()
+{
+  uint32_t readings = (BACKLOG_MAX_SEGMENTS + 2) * TEST_SEGMENT_RECORDS;
+  appendReadings(0, readings);
+  TEST_ASSERT_LESS_OR_EQUAL(BACKLOG_MAX_SEGMENTS, segmentFiles());
+  TEST_ASSERT_GREATER_THAN(0, backlogDropped());
+  TEST_ASSERT_EQUAL_UINT32(readings, backlogCount() + backlogDropped());
+
+  setupBacklog();
+  uint32_t kept = backlogCount();
+  TEST_ASSERT_EQUAL_UINT32(readings, replayReadings(readings - kept, UINT32_MAX));
+  TEST_ASSERT_EQUAL_UINT32(0, backlogCount());
+}
+
+// A reset while the position is written leaves a torn file, the segments on flash tell where the log is
+static void test_torn_position_file()
+{
+  uint32_t readings = 4 * TEST_SEGMENT_RECORDS;
+  appendReadings(0, readings);
+  uint32_t next = replayReadings(0, TEST_SEGMENT_RECORDS + 100);
+
+  File file = SPIFFS.open("/backlog/position", FILE_WRITE);
+  file.write((const uint8_t *)"\x02\x00", 2);
+  file.close();
+  SPIFFS.remove("/backlog/position.tmp");
+
+  // Replays the oldest segment left from its start, nothing is lost and no segment stays behind
+  setupBacklog();
+  uint32_t resumed = TEST_SEGMENT_RECORDS;
+  TEST_ASSERT_LESS_OR_EQUAL(next, resumed);
+  TEST_ASSERT_EQUAL_UINT32(readings - resumed, backlogCount());
+  TEST_ASSERT_EQUAL_UINT32(readings, replayReadings(resumed, UINT32_MAX));
+  TEST_ASSERT_LESS_OR_EQUAL(1, segmentFiles());
+}
+
+// A reset between removing the old position and renaming the new one leaves only the temporary file
+static void test_position_from_temporary_file()
+{
+  uint32_t readings = 2 * TEST_SEGMENT_RECORDS;
+  appendReadings(0, readings);
+  uint32_t next = replayReadings(0, 100);
+  TEST_ASSERT_TRUE(SPIFFS.rename("/backlog/position", "/backlog/position.tmp"));
+
+  setupBacklog();
+  WatermeterReading reading;
+  uint32_t timestamp;
+  TEST_ASSERT_TRUE(peekBacklog(reading, timestamp));
+  uint32_t resumed = (timestamp - TEST_START) / TEST_INTERVAL * TEST_NODES + reading.node - 1;
+  TEST_ASSERT_GREATER_OR_EQUAL(next - BACKLOG_POSITION_INTERVAL, resumed);
+  TEST_ASSERT_GREATER_THAN(0, resumed);
+  TEST_ASSERT_EQUAL_UINT32(readings, replayReadings(resumed, UINT32_MAX));
+}
+
+// A reset during an append leaves a torn record, appends after the reboot go to a new segment
+static void test_torn_record()
+{
+  appendReadings(0, 100);
+  File file = SPIFFS.open("/backlog/0.log", FILE_APPEND);
+  file.write((const uint8_t *)"\x16\x55\x01", 3);
+  file.close();
+
+  setupBacklog();
+  TEST_ASSERT_EQUAL_UINT32(100, backlogCount());
+  appendReadings(100, 200);
+  TEST_ASSERT_EQUAL_UINT32(2, segmentFiles());
+  TEST_ASSERT_EQUAL_UINT32(200, replayReadings(0, UINT32_MAX));
+}
+
+void setup()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_outage_replays_in_order);
+  RUN_TEST(test_reboot_during_outage);
+  RUN_TEST(test_reboot_during_replay);
+  RUN_TEST(test_capacity_drops_oldest);
+  RUN_TEST(test_torn_position_file);
+  RUN_TEST(test_position_from_temporary_file);
+  RUN_TEST(test_torn_record);
+  exit(UNITY_END());
+}
+
+void loop()
+{
+}
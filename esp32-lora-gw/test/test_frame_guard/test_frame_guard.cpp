@@ -0,0 +1,145 @@
+#include <Arduino.h>
+#include <Preferences.h>
+#include <unity.h>
+#include <WatermeterFrame.h>
+#include "FrameGuard.h"
+#include "DeliveryStats.h"
+
+// Replay protection of the frame counters, run with `pio test -e native_test`.
+// NVS lives in NATIVE_STATE, which the test points to a directory of its own. resetReplay() again is a reboot.
+#define TEST_STATE ".native/test_frame_guard"
+#define TEST_NODE 0x1a2b
+#define TEST_EPOCH 3
+#define TEST_NOW 100000 // millis
+
+static const uint8_t testKey[FRAME_KEY_LENGTH] = {0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+                                                  0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+static ReplayState state;
+
+static uint32_t testCounter(uint16_t sequence)
+{
+  return (uint32_t)TEST_EPOCH << 16 | sequence;
+}
+
+// What the network task does with an accepted frame
+static CounterCheck receive(uint32_t counter, uint8_t retry, uint32_t received)
+{
+  CounterCheck check = checkCounter(state, counter, retry, received);
+  if (check == COUNTER_NEW)
+  {
+    storeCounter(state, TEST_NODE, counter);
+  }
+  return check;
+}
+
+void setUp()
+{
+  setenv("NATIVE_STATE", TEST_STATE, 1);
+  setupFrameGuard(testKey);
+  changeFrameKey(testKey);
+  resetReplay(state, TEST_NODE);
+}
+
+void tearDown()
+{
+}
+
+static void test_counter_counts_up()
+{
+  TEST_ASSERT_EQUAL(COUNTER_NEW, receive(testCounter(1), 0, TEST_NOW));
+  TEST_ASSERT_EQUAL(COUNTER_NEW, receive(testCounter(5), 0, TEST_NOW));
+  TEST_ASSERT_EQUAL(COUNTER_REPLAYED, receive(testCounter(4), 0, TEST_NOW));
+  TEST_ASSERT_EQUAL(COUNTER_NEW, receive(testCounter(0xFFFF) + 1, 0, TEST_NOW));
+}
+
+// Only a retransmission within the window gets its answer again, a replay of the same frame later does not
+static void test_equal_counter()
+{
+  uint32_t replayedBefore = replayedFrames();
+  TEST_ASSERT_EQUAL(COUNTER_NEW, receive(testCounter(7), 0, TEST_NOW));
+  TEST_ASSERT_EQUAL(COUNTER_REPLAYED, receive(testCounter(7), 0, TEST_NOW + 1000));
+  TEST_ASSERT_EQUAL(COUNTER_RETRANSMISSION, receive(testCounter(7), 1, TEST_NOW + 1000));
+  TEST_ASSERT_EQUAL(COUNTER_RETRANSMISSION, receive(testCounter(7), 3, TEST_NOW + DELIVERY_DUPLICATE_WINDOW - 1));
+  TEST_ASSERT_EQUAL(COUNTER_REPLAYED, receive(testCounter(7), 1, TEST_NOW + DELIVERY_DUPLICATE_WINDOW));
+  TEST_ASSERT_EQUAL(COUNTER_REPLAYED, receive(testCounter(7), 3, TEST_NOW + 3600000));
+  TEST_ASSERT_EQUAL_UINT32(3, replayedFrames() - replayedBefore);
+
+  // An older counter is never a retransmission
+  TEST_ASSERT_EQUAL(COUNTER_NEW, receive(testCounter(8), 0, TEST_NOW + 3600000));
+  TEST_ASSERT_EQUAL(COUNTER_REPLAYED, receive(testCounter(7), 1, TEST_NOW + 3600001));
+}
+
+// Every frame accepted before a reboot stays rejected after it, however many went by since the last write
+static void test_reboot_keeps_counter()
+{
+  for (uint16_t accepted = 1; accepted <= 3 * GUARD_STORE_INTERVAL; accepted++)
+  {
+    setUp();
+    for (uint16_t sequence = 1; sequence <= accepted; sequence++)
+    {
+      TEST_ASSERT_EQUAL(COUNTER_NEW, receive(testCounter(sequence), 0, TEST_NOW));
+    }
+
+    resetReplay(state, TEST_NODE);
+    for (uint16_t sequence = 1; sequence <= accepted; sequence++)
+    {
+      TEST_ASSERT_EQUAL(COUNTER_REPLAYED, receive(testCounter(sequence), 0, TEST_NOW));
+      TEST_ASSERT_EQUAL(COUNTER_REPLAYED, receive(testCounter(sequence), 1, TEST_NOW));
+    }
+
+    // At most GUARD_STORE_INTERVAL - 1 new frames are lost to the floor
+    uint16_t next = accepted + 1;
+    while (receive(testCounter(next), 0, TEST_NOW) == COUNTER_REPLAYED)
+    {
+      next++;
+    }
+    uint16_t lost = next - accepted - 1;
+    TEST_ASSERT_LESS_THAN(GUARD_STORE_INTERVAL, lost);
+  }
+}
+
+// A new epoch is written right away
+static void test_new_epoch_stored()
+{
+  TEST_ASSERT_EQUAL(COUNTER_NEW, receive(testCounter(0xFFF0), 0, TEST_NOW));
+  TEST_ASSERT_EQUAL(COUNTER_NEW, receive((uint32_t)(TEST_EPOCH + 1) << 16, 0, TEST_NOW));
+  resetReplay(state, TEST_NODE);
+  TEST_ASSERT_EQUAL(COUNTER_REPLAYED, receive(testCounter(0xFFFF), 0, TEST_NOW));
+  TEST_ASSERT_EQUAL(COUNTER_NEW, receive(((uint32_t)(TEST_EPOCH + 1) << 16) + GUARD_STORE_INTERVAL, 0, TEST_NOW));
+}
+
+// Firmwares before kept only the epoch, its frames are checked from the start of it
+static void test_legacy_epoch()
+{
+  char key[FRAME_NODE_TEXT_LENGTH];
+  formatNode(TEST_NODE, key);
+  Preferences preferences;
+  preferences.begin(GUARD_LEGACY_NAMESPACE, false);
+  preferences.putUShort(key, TEST_EPOCH);
+  preferences.end();
+
+  resetReplay(state, TEST_NODE);
+  TEST_ASSERT_EQUAL(COUNTER_REPLAYED, receive((uint32_t)(TEST_EPOCH - 1) << 16 | 0xFFFF, 0, TEST_NOW));
+  TEST_ASSERT_EQUAL(COUNTER_REPLAYED, receive(testCounter(1), 0, TEST_NOW));
+  TEST_ASSERT_EQUAL(COUNTER_NEW, receive(testCounter(100), 0, TEST_NOW));
+
+  // A new key forgets the legacy epochs as well
+  changeFrameKey(testKey);
+  resetReplay(state, TEST_NODE);
+  TEST_ASSERT_EQUAL(COUNTER_NEW, receive(testCounter(1), 0, TEST_NOW));
+}
+
+void setup()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_counter_counts_up);
+  RUN_TEST(test_equal_counter);
+  RUN_TEST(test_reboot_keeps_counter);
+  RUN_TEST(test_new_epoch_stored);
+  RUN_TEST(test_legacy_epoch);
+  exit(UNITY_END());
+}
+
+void loop()
+{
+}
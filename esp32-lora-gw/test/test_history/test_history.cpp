@@ -0,0 +1,300 @@
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <unity.h>
+#include "History.h"
+
+// A known series through the history in SPIFFS and back out of nextHistoryPoint(), run with `pio test -e native_test`.
+// SPIFFS lives in NATIVE_STATE, which the test points to a directory of its own. setupHistory() again is a reboot.
+// The open blocks stay in RAM over such a reboot, each test records its own node so the series do not mix.
+#define TEST_STATE ".native/test_history"
+#define TEST_START 1687113000 // a full hour, so blocks and steps start with the series
+#define TEST_METER 0
+
+// Reading number i of a node: the meter fails every 7th, the DHT22 every 5th, every 3rd has no rate
+static WatermeterReading testReading(uint16_t node, uint32_t i)
+{
+  WatermeterReading reading = {};
+  reading.sequence = i;
+  reading.node = node;
+  reading.meter = TEST_METER;
+  reading.value = 4826027 + 3 * i + (i % 4);
+  reading.rate = 3 + i % 5;
+  reading.temperature = 215 + (int16_t)(i % 9) - 4;
+  reading.humidity = 452 + i % 13;
+  reading.flags = i % 3 != 0 ? FRAME_FLAG_HAS_RATE : 0;
+  reading.flags |= i % 7 == 3 ? FRAME_FLAG_METER_FAILED : 0;
+  reading.flags |= i % 5 == 2 ? FRAME_FLAG_SENSOR_FAILED : 0;
+  return reading;
+}
+
+static float testRssi(uint32_t i)
+{
+  return -90.5f - i % 6;
+}
+
+// The point the history returns for a reading
+static HistoryPoint expectedPoint(const WatermeterReading &reading, uint32_t time, float rssi)
+{
+  bool meter = !(reading.flags & FRAME_FLAG_METER_FAILED);
+  bool sensor = !(reading.flags & FRAME_FLAG_SENSOR_FAILED);
+  HistoryPoint point;
+  point.time = time;
+  point.value = meter ? (double)reading.value / FRAME_VALUE_SCALE : NAN;
+  point.rate = meter && (reading.flags & FRAME_FLAG_HAS_RATE) ? (float)reading.rate / FRAME_RATE_SCALE : NAN;
+  point.temperature = sensor ? (float)reading.temperature / FRAME_CLIMATE_SCALE : NAN;
+  point.humidity = sensor ? (float)reading.humidity / FRAME_CLIMATE_SCALE : NAN;
+  point.rssi = rssi;
+  return point;
+}
+
+static void recordReadings(uint16_t node, uint32_t from, uint32_t to, uint32_t interval)
+{
+  for (uint32_t i = from; i < to; i++)
+  {
+    recordHistory(testReading(node, i), TEST_START + i * interval, testRssi(i));
+  }
+}
+
+// Raw points are stored in the fixed-point units of the frame, they come back bit for bit
+static void assertExactField(float expected, float actual, const char *field)
+{
+  if (isnan(expected))
+  {
+    TEST_ASSERT_TRUE_MESSAGE(isnan(actual), field);
+  }
+  else
+  {
+    TEST_ASSERT_TRUE_MESSAGE(expected == actual, field);
+  }
+}
+
+static void assertRawPoint(const HistoryPoint &expected, const HistoryPoint &actual)
+{
+  TEST_ASSERT_EQUAL_UINT32(expected.time, actual.time);
+  TEST_ASSERT_TRUE_MESSAGE(isnan(expected.value) ? isnan(actual.value) : expected.value == actual.value, "value");
+  assertExactField(expected.rate, actual.rate, "rate");
+  assertExactField(expected.temperature, actual.temperature, "temperature");
+  assertExactField(expected.humidity, actual.humidity, "humidity");
+  assertExactField(expected.rssi, actual.rssi, "rssi");
+}
+
+// Means of a step are rounded to the fixed-point units once more when they are stored
+static void assertMeanField(float expected, float actual, const char *field)
+{
+  if (isnan(expected))
+  {
+    TEST_ASSERT_TRUE_MESSAGE(isnan(actual), field);
+  }
+  else
+  {
+    TEST_ASSERT_FLOAT_WITHIN_MESSAGE(1e-5f * fabsf(expected) + 1e-9f, expected, actual, field);
+  }
+}
+
+// The mean of the readings from to to, the meter value is the last one there is
+static HistoryPoint expectedStep(uint16_t node, uint32_t from, uint32_t to, uint32_t interval, uint32_t step)
+{
+  HistoryPoint point = {};
+  point.time = TEST_START + from * interval - (TEST_START + from * interval) % step;
+  point.value = NAN;
+  float sums[4] = {};
+  uint16_t counts[4] = {};
+  for (uint32_t i = from; i < to; i++)
+  {
+    HistoryPoint raw = expectedPoint(testReading(node, i), TEST_START + i * interval, testRssi(i));
+    point.value = isnan(raw.value) ? point.value : raw.value;
+    const float fields[] = {raw.rate, raw.temperature, raw.humidity, raw.rssi};
+    for (uint8_t j = 0; j < 4; j++)
+    {
+      sums[j] += isnan(fields[j]) ? 0 : fields[j];
+      counts[j] += isnan(fields[j]) ? 0 : 1;
+    }
+  }
+  point.rate = counts[0] > 0 ? sums[0] / counts[0] : NAN;
+  point.temperature = counts[1] > 0 ? sums[1] / counts[1] : NAN;
+  point.humidity = counts[2] > 0 ? sums[2] / counts[2] : NAN;
+  point.rssi = counts[3] > 0 ? sums[3] / counts[3] : NAN;
+  return point;
+}
+
+static void assertStepPoint(const HistoryPoint &expected, const HistoryPoint &actual)
+{
+  TEST_ASSERT_EQUAL_UINT32(expected.time, actual.time);
+  TEST_ASSERT_TRUE_MESSAGE(isnan(expected.value) ? isnan(actual.value) : expected.value == actual.value, "value");
+  assertMeanField(expected.rate, actual.rate, "rate");
+  assertMeanField(expected.temperature, actual.temperature, "temperature");
+  assertMeanField(expected.humidity, actual.humidity, "humidity");
+  assertMeanField(expected.rssi, actual.rssi, "rssi");
+}
+
+// Checks that a query of all points returns readings from to to one by one
+static void assertRawSeries(uint16_t node, uint32_t from, uint32_t to, uint32_t interval)
+{
+  HistoryQuery query;
+  HistoryPoint point;
+  beginHistoryQuery(query, node, TEST_METER, TEST_START + from * interval, UINT32_MAX, 0);
+  for (uint32_t i = from; i < to; i++)
+  {
+    TEST_ASSERT_TRUE(nextHistoryPoint(query, point));
+    assertRawPoint(expectedPoint(testReading(node, i), TEST_START + i * interval, testRssi(i)), point);
+  }
+  TEST_ASSERT_FALSE(nextHistoryPoint(query, point));
+}
+
+void setUp()
+{
+  setenv("NATIVE_STATE", TEST_STATE, 1);
+  SPIFFS.begin(true);
+  SPIFFS.format();
+  setupHistory();
+}
+
+void tearDown()
+{
+  SPIFFS.format();
+}
+
+// Every field of every point comes back, missing ones as NaN, from flash and from the open block
+static void test_series_round_trip()
+{
+  uint16_t node = 0x0101;
+  uint32_t interval = 60;
+  uint32_t readings = 3 * HISTORY_BLOCK_SPAN / interval + 17;
+  uint32_t written = historyPoints();
+  recordReadings(node, 0, readings, interval);
+
+  // Full blocks and blocks that span an hour went to flash, the newest points are in the open block
+  TEST_ASSERT_GREATER_OR_EQUAL(3 * HISTORY_BLOCK_SPAN / interval, historyPoints() - written);
+  TEST_ASSERT_LESS_THAN(readings, historyPoints() - written);
+  assertRawSeries(node, 0, readings, interval);
+
+  // A range in the middle starts and ends within blocks
+  HistoryQuery query;
+  HistoryPoint point;
+  uint32_t from = 50;
+  uint32_t to = 130;
+  beginHistoryQuery(query, node, TEST_METER, TEST_START + from * interval, TEST_START + to * interval, 0);
+  for (uint32_t i = from; i <= to; i++)
+  {
+    TEST_ASSERT_TRUE(nextHistoryPoint(query, point));
+    assertRawPoint(expectedPoint(testReading(node, i), TEST_START + i * interval, testRssi(i)), point);
+  }
+  TEST_ASSERT_FALSE(nextHistoryPoint(query, point));
+
+  // Older readings than the last one are not recorded
+  recordHistory(testReading(node, readings), TEST_START, -80);
+  assertRawSeries(node, 0, readings, interval);
+}
+
+// At 10 seconds a block reaches its size long before its hour is over, the next one continues the series
+static void test_block_rollover()
+{
+  uint16_t node = 0x0102;
+  uint32_t interval = 10;
+  uint32_t readings = HISTORY_BLOCK_SPAN / interval;
+  uint32_t written = historyPoints();
+  recordReadings(node, 0, readings, interval);
+
+  TEST_ASSERT_GREATER_THAN(0, historyPoints() - written);
+  TEST_ASSERT_LESS_THAN(readings, historyPoints() - written);
+  assertRawSeries(node, 0, readings, interval);
+}
+
+// A query with a step averages the points of each step
+static void test_query_step()
+{
+  uint16_t node = 0x0103;
+  uint32_t interval = 60;
+  uint32_t step = 600;
+  uint32_t readings = 2 * HISTORY_BLOCK_SPAN / interval + 25;
+  recordReadings(node, 0, readings, interval);
+
+  HistoryQuery query;
+  HistoryPoint point;
+  beginHistoryQuery(query, node, TEST_METER, TEST_START, UINT32_MAX, step);
+  uint32_t perStep = step / interval;
+  for (uint32_t i = 0; i < readings; i += perStep)
+  {
+    TEST_ASSERT_TRUE(nextHistoryPoint(query, point));
+    assertStepPoint(expectedStep(node, i, min(i + perStep, readings), interval, step), point);
+  }
+  TEST_ASSERT_FALSE(nextHistoryPoint(query, point));
+}
+
+// A full raw level moves its oldest segment to the downsampled level, its points come back per HISTORY_DOWNSAMPLE_STEP
+static void test_downsampling()
+{
+  uint16_t node = 0x0104;
+  uint32_t interval = 600;
+  uint32_t perHour = HISTORY_BLOCK_SPAN / interval;
+  uint32_t segmentHours = HISTORY_SEGMENT_BLOCKS; // one block per hour at this interval
+  uint32_t hours = HISTORY_MAX_SEGMENTS * segmentHours + 10;
+  recordReadings(node, 0, hours * perHour, interval);
+
+  // The first segment is downsampled. At 600 seconds a step of 900 seconds holds one or two readings.
+  HistoryQuery query;
+  HistoryPoint point;
+  beginHistoryQuery(query, node, TEST_METER, TEST_START, UINT32_MAX, 0);
+  uint32_t i = 0;
+  uint32_t downsampled = 0;
+  while (i < segmentHours * perHour)
+  {
+    uint32_t stepEnd = (TEST_START + i * interval) / HISTORY_DOWNSAMPLE_STEP * HISTORY_DOWNSAMPLE_STEP + HISTORY_DOWNSAMPLE_STEP;
+    uint32_t next = i;
+    while (TEST_START + next * interval < stepEnd)
+    {
+      next++;
+    }
+    TEST_ASSERT_TRUE(nextHistoryPoint(query, point));
+    assertStepPoint(expectedStep(node, i, next, interval, HISTORY_DOWNSAMPLE_STEP), point);
+    downsampled++;
+    i = next;
+  }
+  TEST_ASSERT_EQUAL_UINT32(segmentHours * HISTORY_BLOCK_SPAN / HISTORY_DOWNSAMPLE_STEP, downsampled);
+
+  // The raw level follows, point by point
+  for (; i < hours * perHour; i++)
+  {
+    TEST_ASSERT_TRUE(nextHistoryPoint(query, point));
+    assertRawPoint(expectedPoint(testReading(node, i), TEST_START + i * interval, testRssi(i)), point);
+  }
+  TEST_ASSERT_FALSE(nextHistoryPoint(query, point));
+}
+
+// A reset while the position is written leaves a torn file, the segments on flash tell where the history is
+static void test_torn_position_file()
+{
+  uint16_t node = 0x0105;
+  uint32_t interval = 600;
+  uint32_t perHour = HISTORY_BLOCK_SPAN / interval;
+  uint32_t hours = 2 * HISTORY_SEGMENT_BLOCKS + 5;
+  recordReadings(node, 0, hours * perHour, interval);
+
+  File file = SPIFFS.open("/history/position", FILE_WRITE);
+  file.write((const uint8_t *)"\x01", 1);
+  file.close();
+  SPIFFS.remove("/history/position.tmp");
+
+  setupHistory();
+  assertRawSeries(node, 0, hours * perHour, interval);
+
+  // Appends continue after the last segment
+  recordReadings(node, hours * perHour, (hours + HISTORY_SEGMENT_BLOCKS) * perHour, interval);
+  setupHistory();
+  assertRawSeries(node, 0, (hours + HISTORY_SEGMENT_BLOCKS) * perHour, interval);
+}
+
+void setup()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_series_round_trip);
+  RUN_TEST(test_block_rollover);
+  RUN_TEST(test_query_step);
+  RUN_TEST(test_downsampling);
+  RUN_TEST(test_torn_position_file);
+  exit(UNITY_END());
+}
+
+void loop()
+{
+}
@@ -0,0 +1,167 @@
+#include <Arduino.h>
+#include <Benchmark.h>
+#include <WatermeterFrame.h>
+#include <FrameSecurity.h>
+#include <LinkProfile.h>
+#include "Meters.h"
+#include "SampleBuffer.h"
+
+#define BENCH_KEY "000102030405060708090a0b0c0d0e0f"
+
+// Replaces main.cpp in the bench environments, runs the code of every LoRa interval without radio, WiFi or meters.
+// Build and run with `pio run -e bench -t upload -t monitor` on the board or `pio run -e native_bench -t exec` on the host.
+
+// /json of AI-on-the-edge 15 with a second number sequence, which the filter has to skip
+static const char meterJson[] = R"({
+"main":
+  {
+    "value": "482.6027",
+    "raw": "00482.6027",
+    "pre": "482.6019",
+    "error": "no error",
+    "rate": "0.000800",
+    "rate_per_time_unit": "0.000800",
+    "rate_per_digitization_round": "0.0008",
+    "timestamp": "2023-06-18T21:04:02+0200"
+  },
+"garden":
+  {
+    "value": "17.2210",
+    "raw": "0017.2210",
+    "pre": "17.2210",
+    "error": "no error",
+    "rate": "0.000000",
+    "rate_per_time_unit": "0.000000",
+    "rate_per_digitization_round": "0.0000",
+    "timestamp": "2023-06-18T21:04:02+0200"
+  }
+}
+)";
+
+// Serves the body like the connection to the meter, rewound before every parse
+class BodyStream : public Stream
+{
+public:
+  BodyStream(const char *body) : body(body), length(strlen(body)), position(0) {}
+
+  void rewind() { position = 0; }
+  int available() override { return length - position; }
+  int read() override { return position < length ? (uint8_t)body[position++] : -1; }
+  int peek() override { return position < length ? (uint8_t)body[position] : -1; }
+  size_t write(uint8_t value) override { return 0; }
+
+private:
+  const char *body;
+  size_t length;
+  size_t position;
+};
+
+static BodyStream meterStream(meterJson);
+static String meterString;
+static WatermeterReading reading;
+static DeltaReference reference;
+static WatermeterSample samples[SAMPLE_BUFFER_CAPACITY];
+static uint8_t frame[FRAME_MAX_LENGTH];
+static volatile size_t frameLength; // keeps the compiler from dropping the encoding
+static FrameKey frameKey;
+static uint8_t plainFrame[FRAME_MAX_LENGTH];
+static size_t plainLength;
+
+static void benchParseStream()
+{
+  WatermeterReading parsed = {};
+  char timestamp[METER_TIMESTAMP_LENGTH];
+  meterStream.rewind();
+  parseMeterJson(meterStream, parsed, timestamp);
+  frameLength = parsed.value;
+}
+
+static void benchParseString()
+{
+  WatermeterReading parsed = {};
+  char timestamp[METER_TIMESTAMP_LENGTH];
+  parseMeterJson(meterString, parsed, timestamp);
+  frameLength = parsed.value;
+}
+
+// A reading of a running meter, with the default keyframe interval 9 of 10 frames are deltas
+static void benchEncodeFrame()
+{
+  reading.sequence++;
+  reading.previous = reading.value;
+  reading.value += 8;
+  frameLength = encodeFrame(reading, reference, 10, frame, sizeof(frame));
+}
+
+static void benchEncodeBatch()
+{
+  uint8_t encoded;
+  frameLength = encodeBatch(reading.sequence, reading.node, samples, SAMPLE_BUFFER_CAPACITY, 1687115042, frame, sizeof(frame), encoded);
+}
+
+// Seals a copy of the same keyframe every time, the sequence number changes like on air
+static void benchSealFrame()
+{
+  memcpy(frame, plainFrame, plainLength);
+  frameLength = sealFrame(frameKey, 1, frame, plainLength, sizeof(frame));
+}
+
+static void benchAirtime()
+{
+  frameLength = frameAirtime(frameLength % FRAME_MAX_LENGTH, defaultLinkProfile);
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  delay(1000);
+
+  meterString = meterJson;
+  reading.node = 0x1a2b;
+  reading.flags = FRAME_FLAG_HAS_RATE;
+  reading.value = 4826027;
+  reading.rate = 8;
+  reading.temperature = 215;
+  reading.humidity = 452;
+  for (uint8_t i = 0; i < SAMPLE_BUFFER_CAPACITY; i++)
+  {
+    WatermeterSample &sample = samples[i];
+    sample.timestamp = 1687115042 - 60 * (SAMPLE_BUFFER_CAPACITY - i);
+    sample.flags = FRAME_FLAG_HAS_RATE;
+    sample.value = 4826027 + 8 * i;
+    sample.previous = sample.value - 8;
+    sample.rate = 8;
+    sample.temperature = 215;
+    sample.humidity = 452;
+  }
+
+  uint8_t key[FRAME_KEY_LENGTH];
+  parseFrameKey(BENCH_KEY, key);
+  setupFrameKey(frameKey, key);
+  DeltaReference keyframeReference = {};
+  plainLength = encodeFrame(reading, keyframeReference, 10, plainFrame, sizeof(plainFrame) - FRAME_SECURED_OVERHEAD);
+
+  beginBenchmarks();
+  runBenchmark("parseMeterJson/stream", benchParseStream);
+  runBenchmark("parseMeterJson/string", benchParseString);
+  runBenchmark("encodeFrame", benchEncodeFrame);
+  runBenchmark("encodeBatch", benchEncodeBatch);
+  runBenchmark("frameAirtime", benchAirtime);
+  runBenchmark("sealFrame", benchSealFrame);
+
+  // What epoch and tag cost on air for a keyframe with the default link profile
+  size_t sealedLength = plainLength + FRAME_SECURED_OVERHEAD;
+  Serial.println("{\"security\":{\"plain_bytes\":" + String(plainLength) + ",\"sealed_bytes\":" + String(sealedLength) +
+                 ",\"plain_airtime_us\":" + String(frameAirtime(plainLength, defaultLinkProfile)) +
+                 ",\"sealed_airtime_us\":" + String(frameAirtime(sealedLength, defaultLinkProfile)) + "}}");
+  endBenchmarks();
+
+#ifndef ARDUINO_ARCH_ESP32
+  exit(0);
+#endif
+}
+
+void loop()
+{
+  delay(1000);
+}
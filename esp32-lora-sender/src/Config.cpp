@@ -0,0 +1,160 @@
+#include "Config.h"
+#include <Preferences.h>
+#include "secrets.h"
+
+#define CONFIG_NAMESPACE "settings"
+#define CONFIG_KEY "config"
+
+static Config defaultConfig()
+{
+  Config config = {};
+  config.version = CONFIG_VERSION;
+  strlcpy(config.ssid, WIFI_SSID, sizeof(config.ssid));
+  strlcpy(config.password, WIFI_PASSWORD, sizeof(config.password));
+  config.interval = 10;
+  config.word = 243;
+  config.keyframe = 10;
+  config.sampleInterval = 10;
+  config.lowPower = false;
+  config.meterTimeout = 30;
+  config.adaptive = false;
+  config.acknowledged = false;
+  config.exception = false;
+  config.heartbeat = 30;
+  config.valueThreshold = 1;
+  config.temperatureThreshold = 5;
+  config.humidityThreshold = 30;
+  return config;
+}
+
+// Firmwares before the config blob stored every setting as its own key
+static void loadLegacyConfig(Preferences &preferences, Config &config)
+{
+  strlcpy(config.ssid, preferences.getString("wifi-ssid", config.ssid).c_str(), sizeof(config.ssid));
+  strlcpy(config.password, preferences.getString("wifi-password", config.password).c_str(), sizeof(config.password));
+  config.interval = preferences.getUInt("lora-interval", config.interval);
+  config.word = preferences.getUInt("lora-sync", config.word);
+  config.keyframe = preferences.getUInt("lora-keyframe", config.keyframe);
+  config.sampleInterval = preferences.getUInt("sample-interval", config.interval);
+  config.lowPower = preferences.getBool("low-power", config.lowPower);
+  config.meterTimeout = preferences.getUInt("meter-timeout", config.meterTimeout);
+}
+
+void loadConfig(Config &config)
+{
+  Config defaults = defaultConfig();
+  config = defaults;
+
+  Preferences preferences;
+  preferences.begin(CONFIG_NAMESPACE, true);
+  // Fields added after the blob was stored keep their defaults
+  size_t length = preferences.getBytesLength(CONFIG_KEY);
+  bool stored = length >= sizeof(config.version) && length <= sizeof(Config);
+  if (stored)
+  {
+    preferences.getBytes(CONFIG_KEY, &config, length);
+  }
+  if (!stored || config.version == 0 || config.version > CONFIG_VERSION)
+  {
+    Serial.println("Migrating preferences");
+    config = defaults;
+    if (preferences.isKey("hasInit"))
+    {
+      loadLegacyConfig(preferences, config);
+    }
+    stored = false;
+  }
+  preferences.end();
+
+  String invalid = validateConfig(config, defaults);
+  if (invalid != "")
+  {
+    Serial.println("Reset invalid settings to defaults: " + invalid);
+  }
+
+  if (!stored || length != sizeof(Config) || invalid != "")
+  {
+    saveConfig(config);
+  }
+  Serial.println("Loaded preferences");
+}
+
+bool saveConfig(const Config &config)
+{
+  Preferences preferences;
+  preferences.begin(CONFIG_NAMESPACE, false);
+  bool saved = preferences.putBytes(CONFIG_KEY, &config, sizeof(Config)) == sizeof(Config);
+  preferences.end();
+  return saved;
+}
+
+String validateConfig(Config &config, const Config &fallback)
+{
+  String invalid;
+
+  config.version = CONFIG_VERSION;
+  config.ssid[CONFIG_SSID_LENGTH] = '\0';
+  config.password[CONFIG_PASSWORD_LENGTH] = '\0';
+
+  if (strlen(config.ssid) == 0)
+  {
+    strlcpy(config.ssid, fallback.ssid, sizeof(config.ssid));
+    invalid += "wifi-ssid ";
+  }
+  // WPA2 needs at least 8 characters, the AP would not start otherwise
+  if (strlen(config.password) < 8)
+  {
+    strlcpy(config.password, fallback.password, sizeof(config.password));
+    invalid += "wifi-password ";
+  }
+  if (config.interval == 0)
+  {
+    config.interval = fallback.interval;
+    invalid += "lora-interval ";
+  }
+  if (config.word > 0xFF)
+  {
+    config.word = fallback.word;
+    invalid += "lora-sync ";
+  }
+  if (config.keyframe == 0 || config.keyframe > 0xFF)
+  {
+    config.keyframe = fallback.keyframe;
+    invalid += "lora-keyframe ";
+  }
+  if (config.sampleInterval == 0)
+  {
+    config.sampleInterval = fallback.sampleInterval;
+    invalid += "sample-interval ";
+  }
+  if (config.meterTimeout == 0)
+  {
+    config.meterTimeout = fallback.meterTimeout;
+    invalid += "meter-timeout ";
+  }
+
+  if (config.heartbeat == 0 || config.heartbeat > 0xFF)
+  {
+    config.heartbeat = fallback.heartbeat;
+    invalid += "report-heartbeat ";
+  }
+  // A threshold of 0 would report every reading
+  if (config.valueThreshold == 0)
+  {
+    config.valueThreshold = fallback.valueThreshold;
+    invalid += "report-value ";
+  }
+  if (config.temperatureThreshold == 0)
+  {
+    config.temperatureThreshold = fallback.temperatureThreshold;
+    invalid += "report-temperature ";
+  }
+  if (config.humidityThreshold == 0)
+  {
+    config.humidityThreshold = fallback.humidityThreshold;
+    invalid += "report-humidity ";
+  }
+
+  invalid.trim();
+  return invalid;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FrameSecurity.h>
+
+// Settings of the sender, loaded once at boot and kept in RAM.
+// The whole struct is stored as one blob, so a save is a single NVS commit.
+#define CONFIG_VERSION 5 // new fields are only appended, older blobs are read as prefix
+#define CONFIG_SSID_LENGTH 32
+#define CONFIG_PASSWORD_LENGTH 63
+
+typedef struct
+{
+  uint32_t version;
+  char ssid[CONFIG_SSID_LENGTH + 1];
+  char password[CONFIG_PASSWORD_LENGTH + 1];
+  uint32_t interval;
+  uint32_t word;
+  uint32_t keyframe;
+  uint32_t sampleInterval;
+  bool lowPower;
+  uint32_t meterTimeout;
+  bool adaptive;     // since version 2
+  bool acknowledged; // since version 3
+  bool exception;                // since version 4, report by exception
+  uint32_t heartbeat;            // intervals without a report before a heartbeat
+  uint32_t valueThreshold;       // fixed-point FRAME_VALUE_SCALE
+  uint32_t temperatureThreshold; // fixed-point FRAME_CLIMATE_SCALE
+  uint32_t humidityThreshold;    // fixed-point FRAME_CLIMATE_SCALE
+  uint8_t key[FRAME_KEY_LENGTH]; // since version 5, all zero sends plain frames
+} Config;
+
+// Loads the stored config, settings of older firmwares are migrated and invalid fields are replaced by defaults
+void loadConfig(Config &config);
+bool saveConfig(const Config &config);
+
+// Replaces invalid fields with the ones of fallback, returns the names of the replaced fields or an empty string
+String validateConfig(Config &config, const Config &fallback);
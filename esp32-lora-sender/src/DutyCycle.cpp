@@ -0,0 +1,86 @@
+#include "DutyCycle.h"
+
+#define DUTY_CYCLE_MAGIC 0x44555459
+#define DUTY_CYCLE_REFILL (DUTY_CYCLE_PERMILLE * 1000UL) // µs per second
+#define DUTY_CYCLE_CAPACITY (DUTY_CYCLE_WINDOW * DUTY_CYCLE_REFILL)
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t budget;   // µs
+  time_t lastRefill; // seconds, the system time keeps running in deep sleep
+} DutyCycleBucket;
+
+RTC_NOINIT_ATTR DutyCycleBucket dutyCycle;
+
+// The encode stage reserves airtime for new frames, the transmit stage for retransmissions
+portMUX_TYPE dutyCycleMux = portMUX_INITIALIZER_UNLOCKED;
+
+void setupDutyCycle()
+{
+  if (dutyCycle.magic != DUTY_CYCLE_MAGIC || dutyCycle.budget > DUTY_CYCLE_CAPACITY)
+  {
+    Serial.println("Initializing duty cycle budget");
+    dutyCycle.magic = DUTY_CYCLE_MAGIC;
+    dutyCycle.budget = DUTY_CYCLE_CAPACITY;
+    dutyCycle.lastRefill = time(nullptr);
+  }
+  else
+  {
+    Serial.println("Recovered duty cycle budget of " + String(dutyCycle.budget / 1000) + " ms");
+  }
+}
+
+// Call with dutyCycleMux held
+static void refill()
+{
+  time_t now = time(nullptr);
+
+  // A clock that went backwards, e.g. after a reset, refills nothing rather than too much
+  if (now < dutyCycle.lastRefill)
+  {
+    dutyCycle.lastRefill = now;
+    return;
+  }
+
+  uint64_t budget = dutyCycle.budget + (uint64_t)(now - dutyCycle.lastRefill) * DUTY_CYCLE_REFILL;
+  dutyCycle.budget = budget < DUTY_CYCLE_CAPACITY ? budget : DUTY_CYCLE_CAPACITY;
+  dutyCycle.lastRefill = now;
+}
+
+bool reserveAirtime(uint32_t airtime)
+{
+  portENTER_CRITICAL(&dutyCycleMux);
+  refill();
+  bool reserved = airtime <= dutyCycle.budget;
+  if (reserved)
+  {
+    dutyCycle.budget -= airtime;
+  }
+  portEXIT_CRITICAL(&dutyCycleMux);
+  return reserved;
+}
+
+uint32_t airtimeBudget()
+{
+  portENTER_CRITICAL(&dutyCycleMux);
+  refill();
+  uint32_t budget = dutyCycle.budget;
+  portEXIT_CRITICAL(&dutyCycleMux);
+  return budget;
+}
+
+uint32_t airtimeCapacity()
+{
+  return DUTY_CYCLE_CAPACITY;
+}
+
+uint32_t airtimeWait(uint32_t airtime)
+{
+  uint32_t budget = airtimeBudget();
+  if (airtime <= budget)
+  {
+    return 0;
+  }
+  return (airtime - budget + DUTY_CYCLE_REFILL - 1) / DUTY_CYCLE_REFILL;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Token bucket for the airtime of the sender. The 865-868 MHz band allows a duty cycle of 1% in the EU (ETSI EN 300 220),
+// so the bucket refills with 1% of the elapsed time and holds at most the airtime of one hour.
+// It is kept in RTC memory, a deep sleep or software reset does not hand out a fresh hour.
+#define DUTY_CYCLE_PERMILLE 10
+#define DUTY_CYCLE_WINDOW 3600 // seconds
+
+// Discards the bucket if it does not hold valid data, e.g. after a power loss, and starts with a full one
+void setupDutyCycle();
+
+// Takes airtime µs from the bucket, returns false and takes nothing if the budget does not cover it
+bool reserveAirtime(uint32_t airtime);
+
+// µs of airtime left
+uint32_t airtimeBudget();
+uint32_t airtimeCapacity();
+
+// Seconds until the budget covers airtime µs
+uint32_t airtimeWait(uint32_t airtime);
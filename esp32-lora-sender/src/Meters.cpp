@@ -0,0 +1,687 @@
+#include "Meters.h"
+#include <WiFi.h>
+#include <esp_wifi.h>
+#include <HTTPClient.h>
+#include <ArduinoJson.h>
+#include <Preferences.h>
+#include <Metrics.h>
+
+#define METER_NAMESPACE "meters"
+#define METER_KEY "macs"
+#define METER_EVENT_QUEUE_LENGTH 8
+#define METER_POLL_TIMEOUT (2 * METER_HTTP_TIMEOUT + 500) // connect and read timeout of a poll
+#define METER_JSON_CAPACITY 384                            // only the filtered fields of "main", the whole /json takes about 1 KB
+
+typedef enum
+{
+  METER_CONNECTED,    // a station got an IP
+  METER_DISCONNECTED, // a station left the AP
+  METER_FAILING       // a meter failed METER_MAX_FAILED_POLLS polls in a row
+} MeterEventType;
+
+typedef struct
+{
+  MeterEventType type;
+  uint8_t mac[6]; // only set by the disconnected event
+  uint32_t ip;    // only set by the IP-assigned event
+  uint8_t slot;   // only set for a failing meter
+} MeterEvent;
+
+// mac, ip and the reading with its round are guarded by slotMux
+typedef struct
+{
+  uint8_t mac[6];            // all zero for a free slot
+  volatile uint32_t ip;      // 0 while disconnected
+  TaskHandle_t task;
+  uint32_t requested;        // round of the last poll asked for
+  uint32_t answered;         // round the reading belongs to
+  WatermeterReading reading; // written by the poll task of the slot
+} MeterSlot;
+
+// Kept by the poll task between polls, so the TCP connection to the meter is reused
+typedef struct
+{
+  WiFiClient client;
+  HTTPClient http;
+  uint32_t ip;
+  String etag;
+  String timestamp; // of the round the meter last computed
+  WatermeterReading last;
+  bool hasLast;
+} MeterConnection;
+
+static MeterSlot slots[METER_SLOTS];
+static portMUX_TYPE slotMux = portMUX_INITIALIZER_UNLOCKED;
+static QueueHandle_t events;
+static EventGroupHandle_t polled;
+static uint32_t pollRound = 0;
+RTC_DATA_ATTR static uint8_t failedPolls[METER_SLOTS]; // in a row, kept across deep sleep
+
+static MeterPollStats stats;
+static uint32_t lowestHeap;
+static portMUX_TYPE statsMux = portMUX_INITIALIZER_UNLOCKED;
+static const char *etagHeader[] = {"ETag"};
+
+// A request to a meter on the AP takes tens of ms, a timeout up to 2 * METER_HTTP_TIMEOUT
+static const float requestBounds[] = {0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+static MetricHistogram requestSeconds = {"sender_meter_request_seconds", "Duration of a request to a meter.", requestBounds, 10, {}, 0, 0};
+static MetricHistogram pollSeconds = {"sender_meter_poll_seconds", "Duration of a poll until all meters answered.", requestBounds, 10, {}, 0, 0};
+static uint32_t failedRequests = 0;
+static char taskNames[METER_SLOTS][12]; // "meter" and the slot
+
+static bool isFree(const MeterSlot &slot)
+{
+  static const uint8_t none[6] = {};
+  return memcmp(slot.mac, none, sizeof(none)) == 0;
+}
+
+static int8_t findSlot(const uint8_t *mac)
+{
+  for (uint8_t i = 0; i < METER_SLOTS; i++)
+  {
+    if (!isFree(slots[i]) && memcmp(slots[i].mac, mac, 6) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static bool isKnown(uint8_t index)
+{
+  portENTER_CRITICAL(&slotMux);
+  bool known = !isFree(slots[index]);
+  portEXIT_CRITICAL(&slotMux);
+  return known;
+}
+
+// Only the discovery task changes the MAC addresses, so the NVS writes do not overtake each other
+static void saveSlots()
+{
+  uint8_t macs[METER_SLOTS][6];
+  portENTER_CRITICAL(&slotMux);
+  for (uint8_t i = 0; i < METER_SLOTS; i++)
+  {
+    memcpy(macs[i], slots[i].mac, 6);
+  }
+  portEXIT_CRITICAL(&slotMux);
+
+  Preferences preferences;
+  preferences.begin(METER_NAMESPACE, false);
+  preferences.putBytes(METER_KEY, macs, sizeof(macs));
+  preferences.end();
+}
+
+static void loadSlots()
+{
+  uint8_t macs[METER_SLOTS][6] = {};
+
+  Preferences preferences;
+  preferences.begin(METER_NAMESPACE, true);
+  if (preferences.getBytesLength(METER_KEY) == sizeof(macs))
+  {
+    preferences.getBytes(METER_KEY, macs, sizeof(macs));
+  }
+  preferences.end();
+
+  for (uint8_t i = 0; i < METER_SLOTS; i++)
+  {
+    memcpy(slots[i].mac, macs[i], 6);
+  }
+}
+
+static String formatIP(uint32_t ip)
+{
+  return IPAddress(ip).toString();
+}
+
+// The IP-assigned event only carries the IP, the MAC comes from the station list of the AP
+static bool findStation(uint32_t ip, uint8_t *mac)
+{
+  wifi_sta_list_t wifi_sta_list;
+  tcpip_adapter_sta_list_t adapter_sta_list;
+
+  memset(&wifi_sta_list, 0, sizeof(wifi_sta_list));
+  memset(&adapter_sta_list, 0, sizeof(adapter_sta_list));
+
+  esp_wifi_ap_get_sta_list(&wifi_sta_list);
+  tcpip_adapter_get_sta_list(&wifi_sta_list, &adapter_sta_list);
+
+  for (int i = 0; i < adapter_sta_list.num; i++)
+  {
+    if (adapter_sta_list.sta[i].ip.addr == ip)
+    {
+      memcpy(mac, adapter_sta_list.sta[i].mac, 6);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Called at the points of a request that hold the most memory, the poll reports the lowest free heap seen
+static void sampleHeap()
+{
+  uint32_t free = ESP.getFreeHeap();
+  portENTER_CRITICAL(&statsMux);
+  lowestHeap = min(lowestHeap, free);
+  portEXIT_CRITICAL(&statsMux);
+}
+
+static void countUnchanged()
+{
+  portENTER_CRITICAL(&statsMux);
+  stats.unchanged++;
+  portEXIT_CRITICAL(&statsMux);
+}
+
+template <typename TInput>
+static bool parseMeter(TInput &&body, WatermeterReading &reading, char *timestamp)
+{
+  StaticJsonDocument<128> filter;
+  JsonObject fields = filter.createNestedObject("main");
+  fields["value"] = true;
+  fields["pre"] = true;
+  fields["rate"] = true;
+  fields["raw"] = true;
+  fields["error"] = true;
+  fields["timestamp"] = true;
+
+  StaticJsonDocument<METER_JSON_CAPACITY> doc;
+  DeserializationError error = deserializeJson(doc, body, DeserializationOption::Filter(filter));
+  JsonObject main = doc["main"];
+  if (error || main.isNull())
+  {
+    return false;
+  }
+
+  reading.value = toFixedPoint(main["value"].as<float>(), FRAME_VALUE_SCALE);
+  reading.previous = toFixedPoint(main["pre"].as<float>(), FRAME_VALUE_SCALE);
+
+  // AI-on-the-edge sends all values as text
+  const char *rate = main["rate"] | "";
+  if (rate[0] != '\0')
+  {
+    reading.rate = toFixedPoint(atof(rate), FRAME_RATE_SCALE);
+    reading.flags |= FRAME_FLAG_HAS_RATE;
+  }
+
+  // Only send the raw reading if it tells more than the value, e.g. unreadable digits
+  const char *raw = main["raw"] | "";
+  if (raw[0] != '\0' && (uint32_t)toFixedPoint(atof(raw), FRAME_VALUE_SCALE) != reading.value)
+  {
+    strncpy(reading.raw, raw, FRAME_MAX_RAW_LENGTH);
+    reading.flags |= FRAME_FLAG_HAS_RAW;
+  }
+
+  const char *meterError = main["error"] | "";
+  if (meterError[0] != '\0' && strcmp(meterError, "no error") != 0)
+  {
+    strncpy(reading.error, meterError, FRAME_MAX_ERROR_LENGTH);
+    reading.flags |= FRAME_FLAG_METER_ERROR;
+  }
+
+  strlcpy(timestamp, main["timestamp"] | "", METER_TIMESTAMP_LENGTH);
+  return true;
+}
+
+bool parseMeterJson(Stream &body, WatermeterReading &reading, char *timestamp)
+{
+  return parseMeter(body, reading, timestamp);
+}
+
+bool parseMeterJson(const String &body, WatermeterReading &reading, char *timestamp)
+{
+  return parseMeter(body, reading, timestamp);
+}
+
+// Returns false if the meter could not be reached, the JSON is parsed into the meter fields of the reading.
+// The body is parsed straight from the socket and everything except the fields of the reading is skipped.
+static bool fetchMeter(MeterConnection &connection, uint32_t ip, WatermeterReading &reading)
+{
+  if (connection.ip != ip)
+  {
+    connection.client.stop();
+    connection.ip = ip;
+    connection.etag = "";
+    connection.timestamp = "";
+    connection.hasLast = false;
+  }
+
+  HTTPClient &http = connection.http;
+  http.setReuse(true);
+  http.setConnectTimeout(METER_HTTP_TIMEOUT);
+  http.setTimeout(METER_HTTP_TIMEOUT);
+  http.begin(connection.client, "http://" + formatIP(ip) + "/json");
+  http.collectHeaders(etagHeader, 1);
+  if (connection.etag != "")
+  {
+    http.addHeader("If-None-Match", connection.etag);
+  }
+
+  int resCode = http.GET();
+  sampleHeap();
+
+  if (resCode == 304 && connection.hasLast)
+  {
+    http.end();
+    reading = connection.last;
+    countUnchanged();
+    return true;
+  }
+  if (resCode != 200)
+  {
+    Serial.println("Meter " + formatIP(ip) + " error code: " + String(resCode));
+    http.end();
+    connection.client.stop();
+    return false;
+  }
+
+  // A chunked body cannot be parsed from the raw stream, HTTPClient removes the chunk headers in getString()
+  WatermeterReading fresh = reading;
+  char timestamp[METER_TIMESTAMP_LENGTH];
+  bool parsed = http.getSize() >= 0 ? parseMeterJson(http.getStream(), fresh, timestamp) : parseMeterJson(http.getString(), fresh, timestamp);
+  sampleHeap();
+  connection.etag = http.header("ETag");
+  http.end();
+
+  if (!parsed)
+  {
+    Serial.println("Meter " + formatIP(ip) + " sent no reading");
+    connection.client.stop();
+    return false;
+  }
+
+  // The meter only computes a new reading every round, polls in between get the same answer
+  if (connection.hasLast && timestamp[0] != '\0' && connection.timestamp == timestamp)
+  {
+    reading = connection.last;
+    countUnchanged();
+    return true;
+  }
+
+  reading = fresh;
+  connection.timestamp = timestamp;
+  connection.last = reading;
+  connection.hasLast = true;
+  return true;
+}
+
+// Every meter is polled in its own task, so a slow meter does not hold up the others
+static void pollTask(void *parameter)
+{
+  uint8_t index = (uintptr_t)parameter;
+  MeterSlot &slot = slots[index];
+  MeterConnection connection = {};
+
+  for (;;)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    portENTER_CRITICAL(&slotMux);
+    uint32_t round = slot.requested;
+    uint32_t ip = slot.ip;
+    portEXIT_CRITICAL(&slotMux);
+
+    WatermeterReading reading = {};
+    reading.meter = index;
+    unsigned long start = micros();
+    if (ip == 0 || !fetchMeter(connection, ip, reading))
+    {
+      reading.flags = FRAME_FLAG_METER_FAILED;
+      portENTER_CRITICAL(&statsMux);
+      failedRequests++;
+      portEXIT_CRITICAL(&statsMux);
+    }
+    observeSince(requestSeconds, start);
+
+    // A poll that outlasted the timeout of pollMeters is dropped, the next request is already pending
+    portENTER_CRITICAL(&slotMux);
+    bool current = slot.requested == round;
+    if (current)
+    {
+      slot.reading = reading;
+      slot.answered = round;
+    }
+    portEXIT_CRITICAL(&slotMux);
+    if (current)
+    {
+      xEventGroupSetBits(polled, 1 << index);
+    }
+  }
+}
+
+static void startPolling(uint8_t index)
+{
+  if (slots[index].task == nullptr)
+  {
+    xTaskCreate(pollTask, "meter", 6144, (void *)(uintptr_t)index, 1, &slots[index].task);
+    snprintf(taskNames[index], sizeof(taskNames[index]), "meter%u", index);
+    registerTaskMetrics(taskNames[index], slots[index].task);
+  }
+}
+
+static void addStation(uint32_t ip)
+{
+  uint8_t mac[6];
+  if (!findStation(ip, mac))
+  {
+    return;
+  }
+
+  // A known meter is not probed again, that saves a request on every wake-up in low-power mode
+  portENTER_CRITICAL(&slotMux);
+  int8_t index = findSlot(mac);
+  portEXIT_CRITICAL(&slotMux);
+  if (index < 0)
+  {
+    WatermeterReading probe = {};
+    MeterConnection connection = {};
+    bool isMeter = false;
+    for (uint8_t attempt = 0; attempt < METER_PROBE_ATTEMPTS && !isMeter; attempt++)
+    {
+      if (attempt > 0)
+      {
+        delay(METER_PROBE_INTERVAL);
+      }
+      isMeter = fetchMeter(connection, ip, probe);
+    }
+    connection.client.stop();
+    if (!isMeter)
+    {
+      Serial.println("Station " + formatIP(ip) + " is no watermeter");
+      return;
+    }
+
+    portENTER_CRITICAL(&slotMux);
+    for (uint8_t i = 0; i < METER_SLOTS && index < 0; i++)
+    {
+      if (isFree(slots[i]))
+      {
+        index = i;
+        memcpy(slots[i].mac, mac, 6);
+      }
+    }
+    portEXIT_CRITICAL(&slotMux);
+    if (index < 0)
+    {
+      Serial.println("No free slot for watermeter " + formatIP(ip));
+      return;
+    }
+    failedPolls[index] = 0;
+    saveSlots();
+  }
+
+  portENTER_CRITICAL(&slotMux);
+  slots[index].ip = ip;
+  portEXIT_CRITICAL(&slotMux);
+  startPolling(index);
+  Serial.println("Watermeter " + String(index) + " connected with IP " + formatIP(ip));
+}
+
+static void removeStation(const uint8_t *mac)
+{
+  portENTER_CRITICAL(&slotMux);
+  int8_t index = findSlot(mac);
+  bool connected = index >= 0 && slots[index].ip != 0;
+  if (connected)
+  {
+    slots[index].ip = 0;
+  }
+  portEXIT_CRITICAL(&slotMux);
+  if (connected)
+  {
+    Serial.println("Watermeter " + String(index) + " disconnected");
+  }
+}
+
+// A meter that was replaced or moved away gives its slot to the next station that answers as a meter.
+// The poll task of the slot stays and polls the next meter.
+static void freeSlot(uint8_t index)
+{
+  if (failedPolls[index] < METER_MAX_FAILED_POLLS)
+  {
+    return;
+  }
+
+  portENTER_CRITICAL(&slotMux);
+  memset(slots[index].mac, 0, 6);
+  slots[index].ip = 0;
+  portEXIT_CRITICAL(&slotMux);
+  failedPolls[index] = 0;
+  saveSlots();
+  Serial.println("Watermeter " + String(index) + " failed " + String(METER_MAX_FAILED_POLLS) + " polls in a row, its slot is free again");
+}
+
+// Probing takes seconds, so the events are handled here and not in the event task of the WiFi driver
+static void discoveryTask(void *parameter)
+{
+  MeterEvent event;
+  for (;;)
+  {
+    if (xQueueReceive(events, &event, portMAX_DELAY) != pdTRUE)
+    {
+      continue;
+    }
+
+    if (event.type == METER_CONNECTED)
+    {
+      addStation(event.ip);
+    }
+    else if (event.type == METER_DISCONNECTED)
+    {
+      removeStation(event.mac);
+    }
+    else
+    {
+      freeSlot(event.slot);
+    }
+  }
+}
+
+static void onStationEvent(arduino_event_id_t event, arduino_event_info_t info)
+{
+  MeterEvent meterEvent = {};
+  if (event == ARDUINO_EVENT_WIFI_AP_STAIPASSIGNED)
+  {
+    meterEvent.type = METER_CONNECTED;
+    meterEvent.ip = info.wifi_ap_staipassigned.ip.addr;
+  }
+  else
+  {
+    meterEvent.type = METER_DISCONNECTED;
+    memcpy(meterEvent.mac, info.wifi_ap_stadisconnected.mac, 6);
+  }
+  xQueueSend(events, &meterEvent, 0);
+}
+
+void setupMeters()
+{
+  loadSlots();
+  events = xQueueCreate(METER_EVENT_QUEUE_LENGTH, sizeof(MeterEvent));
+  polled = xEventGroupCreate();
+
+  for (uint8_t i = 0; i < METER_SLOTS; i++)
+  {
+    if (!isFree(slots[i]))
+    {
+      startPolling(i);
+    }
+  }
+
+  TaskHandle_t discovery;
+  xTaskCreate(discoveryTask, "meters", 4096, NULL, 1, &discovery);
+  registerTaskMetrics("meters", discovery);
+  WiFi.onEvent(onStationEvent, ARDUINO_EVENT_WIFI_AP_STAIPASSIGNED);
+  WiFi.onEvent(onStationEvent, ARDUINO_EVENT_WIFI_AP_STADISCONNECTED);
+}
+
+uint8_t pollMeters(WatermeterReading *readings, uint8_t maxReadings)
+{
+  EventBits_t requested = 0;
+  unsigned long start = millis();
+  unsigned long startMicros = micros();
+  uint32_t freeHeap = ESP.getFreeHeap();
+  lowestHeap = freeHeap;
+  uint32_t round = ++pollRound;
+  portENTER_CRITICAL(&slotMux);
+  for (uint8_t i = 0; i < METER_SLOTS; i++)
+  {
+    if (slots[i].ip != 0 && slots[i].task != nullptr)
+    {
+      requested |= 1 << i;
+      slots[i].requested = round;
+    }
+  }
+  portEXIT_CRITICAL(&slotMux);
+
+  xEventGroupClearBits(polled, (1 << METER_SLOTS) - 1);
+  for (uint8_t i = 0; i < METER_SLOTS; i++)
+  {
+    if (requested & (1 << i))
+    {
+      xTaskNotifyGive(slots[i].task);
+    }
+  }
+
+  EventBits_t done = 0;
+  if (requested)
+  {
+    // A poll task that finished the last round just now may still set its bit, only answers of this round count
+    uint32_t elapsed = 0;
+    while ((requested & ~done) != 0 && elapsed < METER_POLL_TIMEOUT)
+    {
+      EventBits_t bits = xEventGroupWaitBits(polled, requested & ~done, pdTRUE, pdFALSE, pdMS_TO_TICKS(METER_POLL_TIMEOUT - elapsed));
+      portENTER_CRITICAL(&slotMux);
+      for (uint8_t i = 0; i < METER_SLOTS; i++)
+      {
+        if ((bits & (1 << i)) && slots[i].answered == round)
+        {
+          done |= 1 << i;
+        }
+      }
+      portEXIT_CRITICAL(&slotMux);
+      elapsed = millis() - start;
+    }
+
+    portENTER_CRITICAL(&statsMux);
+    stats.latency = millis() - start;
+    stats.maxLatency = max(stats.maxLatency, stats.latency);
+    stats.heapUse = freeHeap > lowestHeap ? freeHeap - lowestHeap : 0;
+    stats.maxHeapUse = max(stats.maxHeapUse, stats.heapUse);
+    portEXIT_CRITICAL(&statsMux);
+    observeSince(pollSeconds, startMicros);
+  }
+
+  // Known meters that are not connected are reported as failed, like a meter that does not answer
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < METER_SLOTS && count < maxReadings; i++)
+  {
+    portENTER_CRITICAL(&slotMux);
+    bool known = !isFree(slots[i]);
+    bool answered = known && (done & (1 << i));
+    if (answered)
+    {
+      readings[count] = slots[i].reading;
+    }
+    portEXIT_CRITICAL(&slotMux);
+    if (!known)
+    {
+      continue;
+    }
+
+    if (!answered)
+    {
+      readings[count] = {};
+      readings[count].meter = i;
+      readings[count].flags = FRAME_FLAG_METER_FAILED;
+    }
+
+    // The slot is freed by the discovery task, it writes the MAC addresses to NVS
+    if (!(readings[count].flags & FRAME_FLAG_METER_FAILED))
+    {
+      failedPolls[i] = 0;
+    }
+    else if (failedPolls[i] < METER_MAX_FAILED_POLLS)
+    {
+      failedPolls[i]++;
+    }
+    if (failedPolls[i] >= METER_MAX_FAILED_POLLS)
+    {
+      MeterEvent event = {};
+      event.type = METER_FAILING;
+      event.slot = i;
+      xQueueSend(events, &event, 0);
+    }
+    count++;
+  }
+  return count;
+}
+
+bool waitForMeters(uint32_t timeout)
+{
+  uint8_t known = 0;
+  for (uint8_t i = 0; i < METER_SLOTS; i++)
+  {
+    known += isKnown(i) ? 1 : 0;
+  }
+
+  unsigned long start = millis();
+  while (millis() - start < timeout)
+  {
+    uint8_t connected = connectedMeters();
+    if (connected > 0 && connected >= known)
+    {
+      return true;
+    }
+    delay(250);
+  }
+  Serial.println("Watermeters did not connect within " + String(timeout) + " ms");
+  return false;
+}
+
+uint8_t connectedMeters()
+{
+  uint8_t connected = 0;
+  for (uint8_t i = 0; i < METER_SLOTS; i++)
+  {
+    connected += slots[i].ip != 0 ? 1 : 0;
+  }
+  return connected;
+}
+
+String describeMeters()
+{
+  String description;
+  for (uint8_t i = 0; i < METER_SLOTS; i++)
+  {
+    if (!isKnown(i))
+    {
+      continue;
+    }
+    uint32_t ip = slots[i].ip;
+    description += (description == "" ? "" : ", ") + String(i) + ": " + (ip != 0 ? formatIP(ip) : String("disconnected"));
+  }
+  return description == "" ? "none" : description;
+}
+
+MeterPollStats meterPollStats()
+{
+  portENTER_CRITICAL(&statsMux);
+  MeterPollStats copy = stats;
+  portEXIT_CRITICAL(&statsMux);
+  return copy;
+}
+
+void writeMeterMetrics(String &out)
+{
+  portENTER_CRITICAL(&statsMux);
+  uint32_t failed = failedRequests;
+  uint32_t unchanged = stats.unchanged;
+  portEXIT_CRITICAL(&statsMux);
+
+  writeHistogram(out, requestSeconds);
+  writeHistogram(out, pollSeconds);
+  writeCounter(out, "sender_meter_failures_total", "Polls of a meter that got no reading.", failed);
+  writeCounter(out, "sender_meter_unchanged_total", "Answers that repeated the last reading of the meter.", unchanged);
+  writeGauge(out, "sender_meters_connected", "Meters connected to the WiFi-AP.", connectedMeters());
+}
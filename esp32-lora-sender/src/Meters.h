@@ -0,0 +1,50 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WatermeterFrame.h>
+
+// Watermeters connected to the WiFi-AP of the sender, e.g. AI-on-the-edge devices for cold and hot water.
+// Stations are picked up by the AP events and probed for the /json endpoint, a station that answers becomes a meter.
+// A meter keeps the number of its slot, the MAC addresses of the slots are stored in NVS. A meter that fails
+// METER_MAX_FAILED_POLLS polls in a row, connected or not, loses its slot to the next station that answers as a meter.
+#define METER_SLOTS 4              // the WiFi-AP accepts 4 stations by default
+#define METER_HTTP_TIMEOUT 5000    // ms per request
+#define METER_PROBE_ATTEMPTS 6     // the web server of a meter may start a while after it joined the AP
+#define METER_PROBE_INTERVAL 5000  // ms
+#define METER_TIMESTAMP_LENGTH 32  // e.g. "2023-06-12T14:32:05+0200"
+#define METER_MAX_FAILED_POLLS 200 // ~30 minutes at the default interval of 10 s
+
+// Cost of the last poll of all meters and the worst one since boot
+typedef struct
+{
+  uint32_t latency;    // ms until all meters answered
+  uint32_t maxLatency; // ms
+  uint32_t heapUse;    // bytes of heap held by the requests at the same time
+  uint32_t maxHeapUse; // bytes
+  uint32_t unchanged;  // answers that repeated the last reading of the meter
+} MeterPollStats;
+
+// Registers the AP events, call before the WiFi-AP is started
+void setupMeters();
+
+// Polls all connected meters at the same time, every meter gets its own reading with the meter fields and flags set.
+// Returns the number of readings, 0 if no meter is connected.
+uint8_t pollMeters(WatermeterReading *readings, uint8_t maxReadings);
+
+// Waits until every meter known from before is connected again, or at least one if none is known yet
+bool waitForMeters(uint32_t timeout);
+
+uint8_t connectedMeters();
+
+// Number and IP of the connected meters for the web interface
+String describeMeters();
+
+MeterPollStats meterPollStats();
+
+// Appends the request and poll durations and counters for /metrics
+void writeMeterMetrics(String &out);
+
+// Parses the fields of the reading from the /json of AI-on-the-edge into the meter fields and flags of reading,
+// timestamp gets the time the meter computed the reading. Returns false if the body holds no reading.
+bool parseMeterJson(Stream &body, WatermeterReading &reading, char *timestamp);
+bool parseMeterJson(const String &body, WatermeterReading &reading, char *timestamp);
@@ -0,0 +1,75 @@
+#include "Reporting.h"
+#include "Meters.h"
+
+// What the thresholds are checked against, the last reading sent for a meter
+typedef struct
+{
+  bool valid;
+  uint8_t flags;
+  uint32_t value;
+  int16_t temperature;
+  uint16_t humidity;
+} ReportReference;
+
+#define REPORT_STATE_FLAGS (FRAME_FLAG_METER_FAILED | FRAME_FLAG_METER_ERROR | FRAME_FLAG_SENSOR_FAILED)
+
+RTC_DATA_ATTR ReportReference reportReferences[METER_SLOTS];
+RTC_DATA_ATTR uint8_t quietIntervals = 0;
+RTC_DATA_ATTR uint32_t announcedSilence = 0; // 0 until the first heartbeat
+
+static bool crossed(int32_t value, int32_t reference, uint32_t threshold)
+{
+  return (uint32_t)abs(value - reference) >= threshold;
+}
+
+bool reportDue(const WatermeterReading &reading, const Config &config)
+{
+  const ReportReference &reference = reportReferences[reading.meter % METER_SLOTS];
+  if (!reference.valid || ((reading.flags ^ reference.flags) & REPORT_STATE_FLAGS))
+  {
+    return true;
+  }
+
+  // The meter only counts up, a smaller value is a misread or a new meter and reported too
+  if (!(reading.flags & FRAME_FLAG_METER_FAILED))
+  {
+    uint32_t change = reading.value >= reference.value ? reading.value - reference.value : reference.value - reading.value;
+    if (change >= config.valueThreshold)
+    {
+      return true;
+    }
+  }
+  if (!(reading.flags & FRAME_FLAG_SENSOR_FAILED))
+  {
+    return crossed(reading.temperature, reference.temperature, config.temperatureThreshold) ||
+           crossed(reading.humidity, reference.humidity, config.humidityThreshold);
+  }
+  return false;
+}
+
+void markReported(const WatermeterReading &reading)
+{
+  ReportReference &reference = reportReferences[reading.meter % METER_SLOTS];
+  reference.valid = true;
+  reference.flags = reading.flags;
+  reference.value = reading.value;
+  reference.temperature = reading.temperature;
+  reference.humidity = reading.humidity;
+}
+
+bool heartbeatDue(const Config &config, bool reported)
+{
+  quietIntervals = reported ? 0 : min(quietIntervals + 1, 0xFF);
+  return announcedSilence != reportSilence(config) || (config.exception && quietIntervals >= config.heartbeat);
+}
+
+void markHeartbeat(const Config &config)
+{
+  announcedSilence = reportSilence(config);
+  quietIntervals = 0;
+}
+
+uint32_t reportSilence(const Config &config)
+{
+  return config.exception ? config.interval * config.heartbeat : config.interval;
+}
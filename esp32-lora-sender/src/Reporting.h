@@ -0,0 +1,23 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WatermeterFrame.h>
+#include "Config.h"
+
+// Report by exception: the meters are still polled every interval, but a reading is only sent if its meter value,
+// error state, temperature or humidity crossed a threshold against the last reading sent for the meter. After
+// `heartbeat` intervals without a report a heartbeat frame tells the gateway that the sender is alive.
+// Every heartbeat announces the silence, the seconds until the next uplink at the latest, one is also sent whenever
+// it changes, e.g. after power-on or new settings, so the gateway knows when a node is stale.
+// The references are kept in RTC memory, only the acquire and encode stages may use them.
+
+// True if the reading differs enough from the last one sent for its meter, or if none was sent since power-on
+bool reportDue(const WatermeterReading &reading, const Config &config);
+void markReported(const WatermeterReading &reading);
+
+// Called once per interval, reported tells whether it sent anything. Returns true if a heartbeat is due.
+bool heartbeatDue(const Config &config, bool reported);
+void markHeartbeat(const Config &config);
+
+// Seconds the sender may stay silent with the given settings
+uint32_t reportSilence(const Config &config);
@@ -0,0 +1,74 @@
+#include "SampleBuffer.h"
+
+#define SAMPLE_BUFFER_MAGIC 0x5741544E // changed with the layout of WatermeterSample
+
+typedef struct
+{
+  uint32_t magic;
+  uint8_t head;
+  uint8_t count;
+  WatermeterSample samples[SAMPLE_BUFFER_CAPACITY];
+} SampleBuffer;
+
+RTC_NOINIT_ATTR SampleBuffer sampleBuffer;
+
+// Samples are pushed by the acquire stage and removed by the encode stage
+portMUX_TYPE sampleBufferMux = portMUX_INITIALIZER_UNLOCKED;
+
+void setupSampleBuffer()
+{
+  if (sampleBuffer.magic != SAMPLE_BUFFER_MAGIC || sampleBuffer.head >= SAMPLE_BUFFER_CAPACITY || sampleBuffer.count > SAMPLE_BUFFER_CAPACITY)
+  {
+    Serial.println("Initializing sample buffer");
+    sampleBuffer.magic = SAMPLE_BUFFER_MAGIC;
+    sampleBuffer.head = 0;
+    sampleBuffer.count = 0;
+  }
+  else
+  {
+    Serial.println("Recovered " + String(sampleBuffer.count) + " buffered samples");
+  }
+}
+
+void pushSample(const WatermeterSample &sample)
+{
+  portENTER_CRITICAL(&sampleBufferMux);
+  uint8_t tail = (sampleBuffer.head + sampleBuffer.count) % SAMPLE_BUFFER_CAPACITY;
+  sampleBuffer.samples[tail] = sample;
+
+  if (sampleBuffer.count < SAMPLE_BUFFER_CAPACITY)
+  {
+    sampleBuffer.count++;
+  }
+  else
+  {
+    sampleBuffer.head = (sampleBuffer.head + 1) % SAMPLE_BUFFER_CAPACITY;
+  }
+  portEXIT_CRITICAL(&sampleBufferMux);
+}
+
+uint8_t peekSamples(WatermeterSample *samples, uint8_t max)
+{
+  portENTER_CRITICAL(&sampleBufferMux);
+  uint8_t count = min(max, sampleBuffer.count);
+  for (uint8_t i = 0; i < count; i++)
+  {
+    samples[i] = sampleBuffer.samples[(sampleBuffer.head + i) % SAMPLE_BUFFER_CAPACITY];
+  }
+  portEXIT_CRITICAL(&sampleBufferMux);
+  return count;
+}
+
+void dropSamples(uint8_t count)
+{
+  portENTER_CRITICAL(&sampleBufferMux);
+  count = min(count, sampleBuffer.count);
+  sampleBuffer.head = (sampleBuffer.head + count) % SAMPLE_BUFFER_CAPACITY;
+  sampleBuffer.count -= count;
+  portEXIT_CRITICAL(&sampleBufferMux);
+}
+
+uint8_t sampleCount()
+{
+  return sampleBuffer.count;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WatermeterFrame.h>
+
+// Ring buffer of samples in RTC memory, it survives deep sleep and software resets
+#define SAMPLE_BUFFER_CAPACITY 64
+
+// Discards the buffer if it does not hold valid data, e.g. after a power loss
+void setupSampleBuffer();
+
+// Overwrites the oldest sample if the buffer is full
+void pushSample(const WatermeterSample &sample);
+
+// Copies up to max samples, oldest first, without removing them
+uint8_t peekSamples(WatermeterSample *samples, uint8_t max);
+
+void dropSamples(uint8_t count);
+uint8_t sampleCount();
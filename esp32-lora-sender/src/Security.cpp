@@ -0,0 +1,90 @@
+#include "Security.h"
+#include <Preferences.h>
+#include <WatermeterFrame.h>
+
+RTC_DATA_ATTR uint16_t epoch = 0; // 0 until the first one was taken from NVS after power-on
+RTC_DATA_ATTR bool sealed = false;
+RTC_DATA_ATTR uint16_t lastSequence = 0; // of the last sealed frame
+
+FrameKey frameKey;
+volatile bool keyChanged = true; // derived before the first frame
+// The encode task derives the key and seals with it while the transmit task verifies link frames with it
+static SemaphoreHandle_t keyMutex = nullptr;
+
+// The new epoch is stored before it is used, a power loss right after it cannot bring back an old one
+static void advanceEpoch()
+{
+  Preferences preferences;
+  preferences.begin(SECURITY_NAMESPACE, false);
+  epoch = preferences.getUShort(SECURITY_EPOCH_KEY, 0) + 1;
+  // 0 marks a frame counter that was never set on the gateway
+  epoch = epoch != 0 ? epoch : 1;
+  preferences.putUShort(SECURITY_EPOCH_KEY, epoch);
+  preferences.end();
+  sealed = false;
+  Serial.println("Frame counter epoch " + String(epoch));
+}
+
+void setupSecurity()
+{
+  keyMutex = xSemaphoreCreateMutex();
+  if (epoch == 0)
+  {
+    advanceEpoch();
+  }
+}
+
+void changeSecurityKey()
+{
+  keyChanged = true;
+}
+
+uint8_t securityOverhead(const Config &config)
+{
+  return hasFrameKey(config.key) ? FRAME_SECURED_OVERHEAD : 0;
+}
+
+size_t secureFrame(const Config &config, uint8_t *buffer, size_t length, size_t size, uint32_t &counter)
+{
+  counter = frameSequence(buffer);
+  if (!hasFrameKey(config.key))
+  {
+    return length;
+  }
+
+  // The sequence numbers wrapped, the same counter must not come again
+  uint16_t sequence = frameSequence(buffer);
+  if (sealed && sequence <= lastSequence)
+  {
+    advanceEpoch();
+  }
+
+  xSemaphoreTake(keyMutex, portMAX_DELAY);
+  if (keyChanged)
+  {
+    keyChanged = false;
+    setupFrameKey(frameKey, config.key);
+  }
+  length = sealFrame(frameKey, epoch, buffer, length, size);
+  xSemaphoreGive(keyMutex);
+  if (length > 0)
+  {
+    sealed = true;
+    lastSequence = sequence;
+    counter = frameCounter(epoch, sequence);
+  }
+  return length;
+}
+
+bool verifyLinkFrame(uint8_t *buffer, size_t &length, uint32_t counter)
+{
+  xSemaphoreTake(keyMutex, portMAX_DELAY);
+  bool verified = verifyLink(frameKey, counter, buffer, length);
+  xSemaphoreGive(keyMutex);
+  return verified;
+}
+
+uint16_t securityEpoch()
+{
+  return epoch;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FrameSecurity.h>
+#include "Config.h"
+
+// Frames are encrypted and authenticated once a key is set on the settings page, see FrameSecurity.h.
+// The epoch, the high half of the frame counter, is kept in NVS and counts up after every power-on and whenever the
+// sequence numbers wrap, so no frame counter is used twice with the same key, not even after a power loss.
+// Only the encode stage may seal frames and only the transmit stage may verify link frames, the key they share is guarded
+// by a mutex.
+#define SECURITY_NAMESPACE "security"
+#define SECURITY_EPOCH_KEY "epoch"
+
+// Starts a new epoch at power-on, a wake-up from deep sleep keeps the one in RTC memory
+void setupSecurity();
+
+// Web server: the encode stage derives the new key before the next frame
+void changeSecurityKey();
+
+// Bytes the encoders have to leave free at the end of the buffer
+uint8_t securityOverhead(const Config &config);
+
+// Encrypts and authenticates the encoded frame in place if a key is set, returns the new length or 0 if it does not fit.
+// counter returns the frame counter, the link frame that answers the uplink is authenticated with it.
+size_t secureFrame(const Config &config, uint8_t *buffer, size_t length, size_t size, uint32_t &counter);
+
+// Checks the tag of the link frame that answers the uplink with counter and strips it
+bool verifyLinkFrame(uint8_t *buffer, size_t &length, uint32_t counter);
+
+uint16_t securityEpoch();
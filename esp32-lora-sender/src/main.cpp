@@ -3,14 +3,21 @@
 #include <LoRa.h>
 #include <ArduinoJson.h>
 #include <WiFi.h>
-#include <esp_wifi.h>
 #include <ESP32Ping.h>
 #include <HTTPClient.h>
 #include <Ticker.h>
-#include <Preferences.h>
 #include <SPIFFS.h>
 #include <ESPAsyncWebServer.h>
 #include <DHT.h>
+#include <WatermeterFrame.h>
+#include <LinkProfile.h>
+#include <Metrics.h>
+#include "SampleBuffer.h"
+#include "Reporting.h"
+#include "Security.h"
+#include "DutyCycle.h"
+#include "Meters.h"
+#include "Config.h"
 #include "secrets.h"
 
 // LoRa Pins
@@ -27,47 +34,154 @@
 #define DHTPIN 13
 #define DHTTYPE DHT22
 
+// Pipeline
+#define PIPELINE_QUEUE_LENGTH 2
+#define TX_DONE_TIMEOUT 10000 // ms, longer than the airtime of the largest frame at SF12
+
+// Adaptive Data Rate, the gateway answers every uplink with the link profile for the next one
+#define LINK_RX_WINDOW 200 // ms to wait for the link frame in addition to its airtime
+
+// Acknowledged Mode, unacknowledged packets are retransmitted up to FRAME_MAX_RETRIES times
+#define ACK_BACKOFF 500 // ms before the first retransmission, doubled for each further one plus up to the same again as jitter
+
+// Low-Power Mode
+#define LOW_POWER_SETUP_WINDOW 120 // seconds the web interface stays up after power-on
+#define LOW_POWER_MIN_SLEEP 1      // seconds
+
+// Delay before new WiFi settings are applied, so the response to the save request still reaches the browser
+#define CONFIG_APPLY_DELAY 1000 // ms
+
+// Prometheus text of /metrics, reserved up front so the answer is not built by a chain of reallocations
+#define METRICS_BUFFER 8192 // bytes
+
 // Functions
-void setupPreferences();
 void setupLoRa();
 void setupWiFi();
 void setupTimer();
 void setupWebServer();
+void applyConfig(const Config &newConfig);
+Config currentConfig();
 String processor(const String &var);
+String formatMetrics();
 void sendLoRa();
+void sendBatch();
+void sampleMetrics();
+uint8_t collectReadings(WatermeterReading *readings);
+void setupPipeline();
+void acquireTask(void *parameter);
+void encodeTask(void *parameter);
+void transmitTask(void *parameter);
+void onTxDone();
+void runLowPowerCycle();
+void scheduleLowPowerCycle();
 
 // DHT
 DHT dht(DHTPIN, DHTTYPE);
 
-// Variables
-int counter = 0;
-String watermeterIP = "127.0.0.1";
+// Variables, kept in RTC memory to survive deep sleep
+RTC_DATA_ATTR int counter = 0;
+RTC_DATA_ATTR DeltaReference deltaReferences[METER_SLOTS];
+RTC_DATA_ATTR time_t lastUplink = 0;
+RTC_DATA_ATTR LinkProfile linkProfile; // zeroed at power-on, which is not a valid profile
+RTC_DATA_ATTR uint8_t missedLinkFrames = 0;
 
-Preferences preferences;
 AsyncWebServer server(80);
 Ticker timer;
+Ticker sampleTimer;
+Ticker wifiTimer;
+
+// ID of this sender in every frame, taken from the last two bytes of the MAC address
+uint16_t nodeId = FRAME_NO_NODE;
+
+// Only written by the web server, the pipeline tasks and timers work on a copy taken by currentConfig()
+Config config;
+portMUX_TYPE configMux = portMUX_INITIALIZER_UNLOCKED;
+volatile bool syncWordChanged = false;
+volatile bool lowPowerDue = false;
+
+// Duration of each phase of the last low-power cycle in milliseconds
+typedef struct
+{
+  uint32_t boot;
+  uint32_t wait;
+  uint32_t poll;
+  uint32_t transmit;
+  uint32_t awake;
+} PhaseDurations;
+
+PhaseDurations phaseDurations;
+
+// Work flowing through the pipeline acquire -> encode -> transmit
+typedef enum
+{
+  JOB_READING,
+  JOB_SAMPLE,
+  JOB_BATCH
+} JobKind;
 
 typedef struct
 {
-  float current;
-  float previous;
-  String raw;
-  String error;
-  String rate;
-  bool failed;
-} WatermeterMetric;
+  JobKind kind;
+  WatermeterReading readings[METER_SLOTS]; // one per meter, each one becomes its own frame
+  uint8_t count;
+  bool heartbeat;          // a heartbeat follows the frames of the readings
+  unsigned long triggered; // micros
+} PipelineJob;
 
 typedef struct
 {
-  String ssid;
-  String password;
-  uint32_t interval;
-  uint32_t word;
-} Config;
+  uint8_t data[FRAME_MAX_LENGTH];
+  size_t length;
+  uint32_t counter;        // epoch and sequence number, the link frame is authenticated with it
+  unsigned long triggered; // micros
+} PipelineFrame;
 
-Config config;
+// Latency of each stage in microseconds, the histogram keeps the distribution for /metrics
+typedef struct
+{
+  uint32_t last;
+  uint32_t max;
+  MetricHistogram histogram;
+} StageLatency;
+
+// Encoding takes µs, a transmission with retries at SF12 seconds
+const float latencyBounds[] = {0.0001, 0.001, 0.005, 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+const float airtimeBounds[] = {0.025, 0.05, 0.1, 0.25, 0.5, 1, 1.5, 2.5};
+
+StageLatency acquireLatency = {0, 0, {"sender_acquire_seconds", "Duration of the acquire stage, polling the meters and the DHT22.", latencyBounds, 12, {}, 0, 0}};
+StageLatency encodeLatency = {0, 0, {"sender_encode_seconds", "Duration of the encode stage per frame.", latencyBounds, 12, {}, 0, 0}};
+StageLatency transmitLatency = {0, 0, {"sender_transmit_seconds", "Duration of the transmit stage per frame, including retransmissions.", latencyBounds, 12, {}, 0, 0}};
+StageLatency totalLatency = {0, 0, {"sender_pipeline_seconds", "Time from the trigger of an interval until its frame was sent.", latencyBounds, 12, {}, 0, 0}};
+MetricHistogram txAirtime = {"sender_tx_airtime_seconds", "Time on air of every transmission.", airtimeBounds, 8, {}, 0, 0};
+uint32_t txTimeouts = 0;
+uint32_t skippedTriggers = 0;
+uint32_t retransmissions = 0;
+uint32_t unacknowledged = 0;
+uint32_t deferredBatches = 0;
+uint32_t coalescedReadings = 0;
+uint32_t suppressedReadings = 0;
+uint32_t heartbeats = 0;
+uint32_t rejectedLinkFrames = 0;
+
+QueueHandle_t triggerQueue;
+QueueHandle_t encodeQueue;
+QueueHandle_t transmitQueue;
+SemaphoreHandle_t txDone;
+
+float lastTemperature = NAN;
+float lastHumidity = NAN;
 
-WatermeterMetric getWatermeterMetrics(String);
+void triggerPipeline(JobKind kind);
+bool acquireStage(PipelineJob &job);
+uint8_t jobFrames(const PipelineJob &job);
+WatermeterSample toSample(const WatermeterReading &reading);
+bool encodeStage(const PipelineJob &job, uint8_t index, PipelineFrame &frame);
+void transmitStage(const PipelineFrame &frame);
+bool receiveLinkFrame(uint16_t sequence, uint32_t counter, bool secured);
+void setLinkProfile(const LinkProfile &profile);
+void runPipeline(JobKind kind);
+void recordLatency(StageLatency &latency, unsigned long start);
+String formatLatency(const StageLatency &latency);
 
 void setup()
 {
@@ -87,43 +201,29 @@ void setup()
 
   dht.begin();
 
-  setupPreferences();
+  nodeId = (ESP.getEfuseMac() >> 32) & 0xFFFF;
+  nodeId = nodeId != FRAME_NO_NODE ? nodeId : 1;
+  char node[FRAME_NODE_TEXT_LENGTH];
+  formatNode(nodeId, node);
+  Serial.println("Node ID " + String(node));
+
+  setupSampleBuffer();
+  setupDutyCycle();
+  loadConfig(config);
+  setupSecurity();
   setupLoRa();
+  setupMeters();
   setupWiFi();
-  setupWebServer();
-  setupTimer();
-}
-
-void setupPreferences()
-{
+  setupPipeline();
 
-  preferences.begin("settings", true);
-  bool tpInit = preferences.isKey("hasInit");
-
-  if (tpInit == false)
+  // Woken up by the timer, do the work and go back to sleep without the web interface
+  if (config.lowPower && esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER)
   {
-    Serial.println("Inital preferences setup...");
-    preferences.end();
-    preferences.begin("settings", false);
-
-    preferences.putString("wifi-ssid", WIFI_SSID);
-    preferences.putString("wifi-password", WIFI_PASSWORD);
-    preferences.putUInt("lora-interval", 10);
-    preferences.putUInt("lora-sync", 243);
-
-    preferences.putBool("hasInit", true);
-
-    preferences.end();
-    preferences.begin("settings", true);
+    runLowPowerCycle();
   }
 
-  Serial.println("Loading preferences");
-  config.ssid = preferences.getString("wifi-ssid");
-  config.password = preferences.getString("wifi-password");
-  config.interval = preferences.getUInt("lora-interval");
-  config.word = preferences.getUInt("lora-sync");
-
-  preferences.end();
+  setupWebServer();
+  setupTimer();
 }
 
 void setupLoRa()
@@ -136,6 +236,17 @@ void setupLoRa()
 
   // Change sync word to match the receiver, ranges from 0-0xFF
   LoRa.setSyncWord(config.word);
+  LoRa.onTxDone(onTxDone);
+
+  // Keep the profile the gateway recommended before the deep sleep
+  if (config.adaptive && isValidProfile(linkProfile))
+  {
+    setLinkProfile(linkProfile);
+  }
+  else
+  {
+    linkProfile = defaultLinkProfile;
+  }
   Serial.println("LoRa Initializing OK! With Sync Word " + String(config.word));
 }
 
@@ -143,8 +254,9 @@ void setupWiFi()
 {
   Serial.println("Starting WiFi-AP");
 
-  WiFi.softAP(config.ssid, config.password);
-  Serial.println("Started WiFi-AP with the SSID: " + config.ssid);
+  Config current = currentConfig();
+  WiFi.softAP(current.ssid, current.password);
+  Serial.println("Started WiFi-AP with the SSID: " + String(current.ssid));
 
   Serial.print("AP-IP: ");
   Serial.println(WiFi.softAPIP());
@@ -161,16 +273,20 @@ void setupWebServer()
   server.on("/style.css", HTTP_GET, [](AsyncWebServerRequest *request)
             { request->send(SPIFFS, "/style.css", "text/css"); });
 
+  server.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request)
+            { request->send(200, METRICS_CONTENT_TYPE, formatMetrics()); });
+
   server.on("/save", HTTP_POST, [](AsyncWebServerRequest *request)
             {
 
-    Config newConfig;
+    // Fields that are not submitted keep their value
+    Config newConfig = currentConfig();
 
     if (request->hasParam("wifi-ssid", true)) {
-        newConfig.ssid = request->getParam("wifi-ssid", true)->value();
+        strlcpy(newConfig.ssid, request->getParam("wifi-ssid", true)->value().c_str(), sizeof(newConfig.ssid));
     }
-    if (request->hasParam("wifi-ssid", true)) {
-        newConfig.password = request->getParam("wifi-password", true)->value();
+    if (request->hasParam("wifi-password", true)) {
+        strlcpy(newConfig.password, request->getParam("wifi-password", true)->value().c_str(), sizeof(newConfig.password));
     }
     if (request->hasParam("lora-interval", true)) {
         newConfig.interval = request->getParam("lora-interval", true)->value().toInt();
@@ -178,51 +294,140 @@ void setupWebServer()
     if (request->hasParam("lora-sync", true)) {
         newConfig.word = request->getParam("lora-sync", true)->value().toInt();
     }
-
-    
-    preferences.begin("settings", false);
-
-    if (newConfig.ssid != ""){
-      preferences.putString("wifi-ssid", newConfig.ssid);
+    if (request->hasParam("lora-keyframe", true)) {
+        newConfig.keyframe = request->getParam("lora-keyframe", true)->value().toInt();
     }
-    if (newConfig.password != "") {
-      preferences.putString("wifi-password", newConfig.password);
+    if (request->hasParam("sample-interval", true)) {
+        newConfig.sampleInterval = request->getParam("sample-interval", true)->value().toInt();
     }
-    if (newConfig.interval) {
-      preferences.putUInt("lora-interval", newConfig.interval);
+    // Unchecked checkboxes are not submitted
+    newConfig.lowPower = request->hasParam("low-power", true);
+    newConfig.adaptive = request->hasParam("lora-adaptive", true);
+    newConfig.acknowledged = request->hasParam("lora-ack", true);
+    newConfig.exception = request->hasParam("report-exception", true);
+    if (request->hasParam("report-heartbeat", true)) {
+        newConfig.heartbeat = request->getParam("report-heartbeat", true)->value().toInt();
     }
-    if (newConfig.word) {
-      preferences.putUInt("lora-sync", newConfig.word);
+    // Thresholds are entered in L, °C and %
+    if (request->hasParam("report-value", true)) {
+        newConfig.valueThreshold = toFixedPoint(request->getParam("report-value", true)->value().toFloat() / 1000, FRAME_VALUE_SCALE);
+    }
+    if (request->hasParam("report-temperature", true)) {
+        newConfig.temperatureThreshold = toFixedPoint(request->getParam("report-temperature", true)->value().toFloat(), FRAME_CLIMATE_SCALE);
+    }
+    if (request->hasParam("report-humidity", true)) {
+        newConfig.humidityThreshold = toFixedPoint(request->getParam("report-humidity", true)->value().toFloat(), FRAME_CLIMATE_SCALE);
+    }
+    if (request->hasParam("meter-timeout", true)) {
+        newConfig.meterTimeout = request->getParam("meter-timeout", true)->value().toInt();
+    }
+    // 32 hex digits, an empty field sends plain frames
+    bool keyValid = true;
+    if (request->hasParam("lora-key", true)) {
+        keyValid = parseFrameKey(request->getParam("lora-key", true)->value().c_str(), newConfig.key);
     }
-      
-    preferences.end();
-    
-    request->send(200, "text/plain", "Saved settings. Rebooting...");
-    delay(500);
-    ESP.restart(); });
+
+    String invalid = validateConfig(newConfig, currentConfig());
+    if (!keyValid) {
+      invalid += " lora-key";
+      invalid.trim();
+    }
+    if (invalid != "") {
+      request->send(400, "text/plain", "Invalid settings: " + invalid);
+      return;
+    }
+
+    if (!saveConfig(newConfig)) {
+      request->send(500, "text/plain", "Could not save settings.");
+      return;
+    }
+
+    applyConfig(newConfig);
+    request->send(200, "text/plain", "Saved settings."); });
 
   server.begin();
 }
 
+Config currentConfig()
+{
+  portENTER_CRITICAL(&configMux);
+  Config current = config;
+  portEXIT_CRITICAL(&configMux);
+  return current;
+}
+
+// Applies new settings without a reboot, only changed WiFi credentials restart the AP
+void applyConfig(const Config &newConfig)
+{
+  Config previous = currentConfig();
+  portENTER_CRITICAL(&configMux);
+  config = newConfig;
+  portEXIT_CRITICAL(&configMux);
+
+  // The radio belongs to the transmit stage, it switches the sync word before the next packet
+  if (newConfig.word != previous.word)
+  {
+    syncWordChanged = true;
+  }
+
+  if (memcmp(newConfig.key, previous.key, FRAME_KEY_LENGTH) != 0)
+  {
+    changeSecurityKey();
+  }
+
+  if (newConfig.interval != previous.interval || newConfig.sampleInterval != previous.sampleInterval || newConfig.lowPower != previous.lowPower)
+  {
+    timer.detach();
+    sampleTimer.detach();
+    setupTimer();
+  }
+
+  if (strcmp(newConfig.ssid, previous.ssid) != 0 || strcmp(newConfig.password, previous.password) != 0)
+  {
+    wifiTimer.once_ms(CONFIG_APPLY_DELAY, setupWiFi);
+  }
+  Serial.println("Applied new settings");
+}
+
 void setupTimer()
 {
-  timer.attach_ms(1000 * config.interval, sendLoRa);
-  Serial.println("Started LoRa Interval with " + String(config.interval) + " seconds.");
+  Config current = currentConfig();
+
+  // Keep the web interface reachable after power-on before the device starts to sleep
+  if (current.lowPower)
+  {
+    timer.once_ms(1000 * LOW_POWER_SETUP_WINDOW, scheduleLowPowerCycle);
+    Serial.println("Entering low-power mode in " + String(LOW_POWER_SETUP_WINDOW) + " seconds.");
+    return;
+  }
+
+  // Sampling faster than the LoRa interval sends the buffered samples as batch
+  if (current.sampleInterval < current.interval)
+  {
+    sampleTimer.attach_ms(1000 * current.sampleInterval, sampleMetrics);
+    timer.attach_ms(1000 * current.interval, sendBatch);
+    Serial.println("Started sampling with " + String(current.sampleInterval) + " seconds and LoRa Interval with " + String(current.interval) + " seconds.");
+  }
+  else
+  {
+    timer.attach_ms(1000 * current.interval, sendLoRa);
+    Serial.println("Started LoRa Interval with " + String(current.interval) + " seconds.");
+  }
 }
 
 String processor(const String &var)
 {
   if (var == "TEMPERATURE")
   {
-    return String(dht.readTemperature());
+    return String(lastTemperature);
   }
   else if (var == "HUMIDITY")
   {
-    return String(dht.readHumidity());
+    return String(lastHumidity);
   }
-  else if (var == "WATERMETERIP")
+  else if (var == "WATERMETERS")
   {
-    return watermeterIP;
+    return describeMeters();
   }
   else if (var == "COUNTER")
   {
@@ -244,113 +449,710 @@ String processor(const String &var)
   {
     return String(config.word);
   }
+  else if (var == "CONFIG_KEYFRAME")
+  {
+    return String(config.keyframe);
+  }
+  else if (var == "CONFIG_SAMPLE_INTERVAL")
+  {
+    return String(config.sampleInterval);
+  }
+  else if (var == "SAMPLES")
+  {
+    return String(sampleCount());
+  }
+  else if (var == "LATENCY_ACQUIRE")
+  {
+    return formatLatency(acquireLatency);
+  }
+  else if (var == "LATENCY_ENCODE")
+  {
+    return formatLatency(encodeLatency);
+  }
+  else if (var == "LATENCY_TRANSMIT")
+  {
+    return formatLatency(transmitLatency);
+  }
+  else if (var == "LATENCY_TOTAL")
+  {
+    return formatLatency(totalLatency);
+  }
+  else if (var == "METER_POLL")
+  {
+    MeterPollStats poll = meterPollStats();
+    return String(poll.latency) + " ms (max. " + String(poll.maxLatency) + " ms), heap " + String(poll.heapUse) +
+           " B (max. " + String(poll.maxHeapUse) + " B), " + String(poll.unchanged) + " unchanged";
+  }
+  else if (var == "SKIPPED_TRIGGERS")
+  {
+    return String(skippedTriggers);
+  }
+  else if (var == "CONFIG_LOW_POWER")
+  {
+    return config.lowPower ? "checked" : "";
+  }
+  else if (var == "CONFIG_METER_TIMEOUT")
+  {
+    return String(config.meterTimeout);
+  }
+  else if (var == "CONFIG_ADAPTIVE")
+  {
+    return config.adaptive ? "checked" : "";
+  }
+  else if (var == "CONFIG_ACK")
+  {
+    return config.acknowledged ? "checked" : "";
+  }
+  else if (var == "CONFIG_EXCEPTION")
+  {
+    return config.exception ? "checked" : "";
+  }
+  else if (var == "CONFIG_HEARTBEAT")
+  {
+    return String(config.heartbeat);
+  }
+  else if (var == "CONFIG_VALUE_THRESHOLD")
+  {
+    return String(fromFixedPoint(config.valueThreshold, FRAME_VALUE_SCALE) * 1000, 1);
+  }
+  else if (var == "CONFIG_TEMPERATURE_THRESHOLD")
+  {
+    return String(fromFixedPoint(config.temperatureThreshold, FRAME_CLIMATE_SCALE), 1);
+  }
+  else if (var == "CONFIG_HUMIDITY_THRESHOLD")
+  {
+    return String(fromFixedPoint(config.humidityThreshold, FRAME_CLIMATE_SCALE), 1);
+  }
+  else if (var == "CONFIG_KEY")
+  {
+    char key[FRAME_KEY_TEXT_LENGTH];
+    formatFrameKey(config.key, key);
+    return key;
+  }
+  else if (var == "SECURITY")
+  {
+    return hasFrameKey(config.key) ? "AES-CTR and CMAC, epoch " + String(securityEpoch()) + ", " + String(rejectedLinkFrames) + " link frames rejected" : "plain frames";
+  }
+  else if (var == "REPORTING")
+  {
+    return config.exception ? String(suppressedReadings) + " readings not sent, " + String(heartbeats) + " heartbeats" : "every interval";
+  }
+  else if (var == "RETRANSMISSIONS")
+  {
+    return String(retransmissions);
+  }
+  else if (var == "UNACKNOWLEDGED")
+  {
+    return String(unacknowledged);
+  }
+  else if (var == "DUTY_CYCLE")
+  {
+    return String(airtimeBudget() / 1e6, 1) + " s of " + String(airtimeCapacity() / 1e6, 1) + " s airtime left, " +
+           String(deferredBatches) + " batches deferred, " + String(coalescedReadings) + " readings coalesced";
+  }
+  else if (var == "NODE_ID")
+  {
+    char node[FRAME_NODE_TEXT_LENGTH];
+    formatNode(nodeId, node);
+    return node;
+  }
+  else if (var == "LINK_PROFILE")
+  {
+    return "SF" + String(linkProfile.spreadingFactor) + ", " + String(linkProfile.bandwidth / 1000) + " kHz, " + String(linkProfile.txPower) + " dBm";
+  }
   return String();
 }
 
+String formatMetrics()
+{
+  String out;
+  out.reserve(METRICS_BUFFER);
+  writeHistogram(out, acquireLatency.histogram);
+  writeHistogram(out, encodeLatency.histogram);
+  writeHistogram(out, transmitLatency.histogram);
+  writeHistogram(out, totalLatency.histogram);
+  writeHistogram(out, txAirtime);
+  writeMeterMetrics(out);
+  writeCounter(out, "sender_skipped_triggers_total", "Intervals dropped because the pipeline was still busy.", skippedTriggers);
+  writeCounter(out, "sender_retransmissions_total", "Retransmissions of unacknowledged frames.", retransmissions);
+  writeCounter(out, "sender_unacknowledged_total", "Frames the gateway did not answer.", unacknowledged);
+  writeCounter(out, "sender_tx_timeouts_total", "Transmissions without TX done interrupt.", txTimeouts);
+  writeCounter(out, "sender_deferred_batches_total", "Batches deferred by the duty cycle.", deferredBatches);
+  writeCounter(out, "sender_coalesced_readings_total", "Readings buffered by the duty cycle and sent with the next batch.", coalescedReadings);
+  writeCounter(out, "sender_suppressed_readings_total", "Readings not sent in report-by-exception mode, they did not cross a threshold.", suppressedReadings);
+  writeCounter(out, "sender_heartbeats_total", "Heartbeats sent instead of a reading.", heartbeats);
+  writeCounter(out, "sender_rejected_link_frames_total", "Link frames for this sender with a tag that did not match.", rejectedLinkFrames);
+  writeGauge(out, "sender_airtime_budget_seconds", "Airtime left in the duty cycle budget.", airtimeBudget() / 1e6);
+  writeGauge(out, "sender_buffered_samples", "Samples waiting in the sample buffer.", sampleCount());
+  writeGauge(out, "sender_spreading_factor", "Spreading factor of the current link profile.", linkProfile.spreadingFactor);
+  writeSystemMetrics(out);
+  return out;
+}
+
 void loop()
 {
-  if (watermeterIP == "127.0.0.1"){
-    wifi_sta_list_t wifi_sta_list;
-    tcpip_adapter_sta_list_t adapter_sta_list;
+  // The low-power cycle blocks for seconds until the deep sleep, so it runs here and not in the timer task of the Ticker.
+  // Settings saved in the meantime may have turned low-power mode off.
+  if (lowPowerDue)
+  {
+    lowPowerDue = false;
+    if (currentConfig().lowPower)
+    {
+      runLowPowerCycle();
+    }
+  }
+
+  // Meters are found by the WiFi events, all other work happens in the pipeline tasks
+  delay(1000);
+}
+
+// Ticker callback, only hands the cycle over to loop()
+void scheduleLowPowerCycle()
+{
+  lowPowerDue = true;
+}
+
+// One wake-up in low-power mode: wait for the watermeters, sample, transmit and sleep again
+void runLowPowerCycle()
+{
+  unsigned long start = millis();
+  phaseDurations.boot = start;
+  Config current = currentConfig();
+
+  waitForMeters(1000 * current.meterTimeout);
+  phaseDurations.wait = millis() - start;
+
+  bool sampling = current.sampleInterval < current.interval;
+  if (sampling)
+  {
+    runPipeline(JOB_SAMPLE);
+    if (time(nullptr) - lastUplink >= (time_t)current.interval)
+    {
+      runPipeline(JOB_BATCH);
+      lastUplink = time(nullptr);
+    }
+  }
+  else
+  {
+    runPipeline(JOB_READING);
+  }
+
+  LoRa.sleep();
+  WiFi.softAPdisconnect(true);
 
-    memset(&wifi_sta_list, 0, sizeof(wifi_sta_list));
-    memset(&adapter_sta_list, 0, sizeof(adapter_sta_list));
+  phaseDurations.awake = millis();
+  Serial.println("Phase durations (ms): boot=" + String(phaseDurations.boot) +
+                 " wait=" + String(phaseDurations.wait) +
+                 " poll=" + String(phaseDurations.poll) +
+                 " transmit=" + String(phaseDurations.transmit) +
+                 " awake=" + String(phaseDurations.awake));
 
-    esp_wifi_ap_get_sta_list(&wifi_sta_list);
-    tcpip_adapter_get_sta_list(&wifi_sta_list, &adapter_sta_list);
+  // The time spent awake counts towards the interval
+  uint32_t period = sampling ? current.sampleInterval : current.interval;
+  uint32_t awake = phaseDurations.awake / 1000;
+  uint32_t sleep = period > awake + LOW_POWER_MIN_SLEEP ? period - awake : LOW_POWER_MIN_SLEEP;
 
-    int count = adapter_sta_list.num;
-    if (count > 0)
+  Serial.println("Sleeping for " + String(sleep) + " seconds");
+  Serial.flush();
+  esp_sleep_enable_timer_wakeup((uint64_t)sleep * 1000000);
+  esp_deep_sleep_start();
+}
+
+// Polls all meters and the DHT22, returns the number of readings
+uint8_t collectReadings(WatermeterReading *readings)
+{
+  unsigned long pollStart = millis();
+  uint8_t count = pollMeters(readings, METER_SLOTS);
+  phaseDurations.poll = millis() - pollStart;
+
+  // Without any meter the DHT22 values are still sent
+  if (count == 0)
+  {
+    readings[0] = {};
+    readings[0].flags = FRAME_FLAG_METER_FAILED;
+    count = 1;
+  }
+
+  float humidity = dht.readHumidity();
+  float temperature = dht.readTemperature();
+  lastHumidity = humidity;
+  lastTemperature = temperature;
+
+  // The DHT22 values travel with the first meter only, the frames of the other meters stay smaller
+  for (uint8_t i = 0; i < count; i++)
+  {
+    WatermeterReading &reading = readings[i];
+    reading.sequence = counter;
+    reading.node = nodeId;
+    if (i > 0 || isnan(humidity) || isnan(temperature))
     {
-      String ips[count];
-      for (int i = 0; i < adapter_sta_list.num; i++)
+      reading.flags |= FRAME_FLAG_SENSOR_FAILED;
+    }
+    else
+    {
+      reading.temperature = toFixedPoint(temperature, FRAME_CLIMATE_SCALE);
+      reading.humidity = toFixedPoint(humidity, FRAME_CLIMATE_SCALE);
+    }
+  }
+  return count;
+}
+
+void setupPipeline()
+{
+  triggerQueue = xQueueCreate(PIPELINE_QUEUE_LENGTH, sizeof(JobKind));
+  encodeQueue = xQueueCreate(PIPELINE_QUEUE_LENGTH, sizeof(PipelineJob));
+  transmitQueue = xQueueCreate(PIPELINE_QUEUE_LENGTH, sizeof(PipelineFrame));
+  txDone = xSemaphoreCreateBinary();
+
+  TaskHandle_t acquire, encode, transmit;
+  xTaskCreatePinnedToCore(acquireTask, "acquire", 8192, NULL, 1, &acquire, 1);
+  xTaskCreatePinnedToCore(encodeTask, "encode", 6144, NULL, 2, &encode, 1);
+  xTaskCreatePinnedToCore(transmitTask, "transmit", 4096, NULL, 3, &transmit, 1);
+  registerTaskMetrics("acquire", acquire);
+  registerTaskMetrics("encode", encode);
+  registerTaskMetrics("transmit", transmit);
+  registerTaskMetrics("loop");
+}
+
+// Timer callbacks only hand the work over to the pipeline
+void sendLoRa()
+{
+  triggerPipeline(JOB_READING);
+}
+
+void sampleMetrics()
+{
+  triggerPipeline(JOB_SAMPLE);
+}
+
+void sendBatch()
+{
+  triggerPipeline(JOB_BATCH);
+}
+
+void triggerPipeline(JobKind kind)
+{
+  if (xQueueSend(triggerQueue, &kind, 0) != pdTRUE)
+  {
+    skippedTriggers++;
+  }
+}
+
+// Runs all stages in the calling task, used in low-power mode where nothing else is running
+void runPipeline(JobKind kind)
+{
+  static PipelineJob job;
+  PipelineFrame frame;
+  job.kind = kind;
+  job.triggered = micros();
+
+  if (!acquireStage(job))
+  {
+    return;
+  }
+  for (uint8_t i = 0; i < jobFrames(job); i++)
+  {
+    if (encodeStage(job, i, frame))
+    {
+      transmitStage(frame);
+    }
+  }
+}
+
+void acquireTask(void *parameter)
+{
+  JobKind kind;
+  PipelineJob job;
+
+  for (;;)
+  {
+    if (xQueueReceive(triggerQueue, &kind, portMAX_DELAY) == pdTRUE)
+    {
+      job.kind = kind;
+      job.triggered = micros();
+      if (acquireStage(job))
       {
+        xQueueSend(encodeQueue, &job, portMAX_DELAY);
+      }
+    }
+  }
+}
 
-        tcpip_adapter_sta_info_t station = adapter_sta_list.sta[i];
+void encodeTask(void *parameter)
+{
+  PipelineJob job;
+  PipelineFrame frame;
 
-        char ip[IP4ADDR_STRLEN_MAX];
-        esp_ip4addr_ntoa(&station.ip, ip, IP4ADDR_STRLEN_MAX);
-        ips[i] = ip;
+  for (;;)
+  {
+    if (xQueueReceive(encodeQueue, &job, portMAX_DELAY) != pdTRUE)
+    {
+      continue;
+    }
+    for (uint8_t i = 0; i < jobFrames(job); i++)
+    {
+      if (encodeStage(job, i, frame))
+      {
+        xQueueSend(transmitQueue, &frame, portMAX_DELAY);
       }
-      watermeterIP = ips[0];
     }
   }
-  delay(10000);
 }
 
-WatermeterMetric getWatermeterMetrics(String ip)
+void transmitTask(void *parameter)
 {
-  WatermeterMetric metrics;
-  HTTPClient http;
-  String url = "http://" + ip + "/json";
-  http.begin(url.c_str());
+  PipelineFrame frame;
 
-  int resCode = http.GET();
+  for (;;)
+  {
+    if (xQueueReceive(transmitQueue, &frame, portMAX_DELAY) == pdTRUE)
+    {
+      transmitStage(frame);
+    }
+  }
+}
+
+// Returns true if the job needs to be encoded and sent
+bool acquireStage(PipelineJob &job)
+{
+  unsigned long start = micros();
+  Config current = currentConfig();
+
+  job.count = job.kind != JOB_BATCH ? collectReadings(job.readings) : 0;
+  job.heartbeat = false;
+
+  // Readings that did not change enough are neither sent nor buffered
+  if (current.exception)
+  {
+    uint8_t due = 0;
+    for (uint8_t i = 0; i < job.count; i++)
+    {
+      if (reportDue(job.readings[i], current))
+      {
+        markReported(job.readings[i]);
+        job.readings[due++] = job.readings[i];
+      }
+    }
+    suppressedReadings += job.count - due;
+    job.count = due;
+  }
 
-  if (resCode == 200)
+  // Readings that did not fit into the duty cycle are still buffered, the new ones join them in a single batch
+  if (job.kind == JOB_READING && sampleCount() > 0)
   {
-    String payload = http.getString();
-    Serial.println(payload);
+    for (uint8_t i = 0; i < job.count; i++)
+    {
+      pushSample(toSample(job.readings[i]));
+    }
+    job.kind = JOB_BATCH;
+  }
 
-    DynamicJsonDocument doc(1024);
-    deserializeJson(doc, payload);
+  for (uint8_t i = 0; i < job.count && job.kind == JOB_SAMPLE; i++)
+  {
+    pushSample(toSample(job.readings[i]));
+  }
 
-    metrics = WatermeterMetric{doc["main"]["value"],
-                               doc["main"]["pre"],
-                               doc["main"]["raw"],
-                               doc["main"]["error"],
-                               doc["main"]["rate"],
-                               false};
+  // A sample worth reporting goes out right away, together with the ones buffered before it
+  if (current.exception && job.kind == JOB_SAMPLE && job.count > 0)
+  {
+    job.kind = JOB_BATCH;
   }
-  else
+
+  // Sampling only fills the buffer, every other job ends an interval
+  if (job.kind != JOB_SAMPLE)
   {
-    Serial.print("Error code: ");
-    Serial.println(resCode);
-    metrics = WatermeterMetric{0, 0, "", "", "", true};
+    job.heartbeat = heartbeatDue(current, job.kind == JOB_BATCH ? sampleCount() > 0 : job.count > 0);
   }
 
-  http.end();
-  return metrics;
+  recordLatency(acquireLatency, start);
+  return job.kind != JOB_SAMPLE && jobFrames(job) > 0;
 }
 
-void sendLoRa()
+WatermeterSample toSample(const WatermeterReading &reading)
 {
+  return {(uint32_t)time(nullptr),
+          reading.meter,
+          reading.flags,
+          reading.value,
+          reading.previous,
+          reading.rate,
+          reading.temperature,
+          reading.humidity};
+}
 
-  WatermeterMetric watermeterResult = getWatermeterMetrics(watermeterIP);
+// A batch is one frame, every other job has a frame per meter, a heartbeat comes last
+uint8_t jobFrames(const PipelineJob &job)
+{
+  return (job.kind == JOB_BATCH ? 1 : job.count) + (job.heartbeat ? 1 : 0);
+}
 
-  // Manage LoRa-Payload
-  StaticJsonDocument<192> payload;
+bool encodeStage(const PipelineJob &job, uint8_t index, PipelineFrame &frame)
+{
+  unsigned long start = micros();
+  frame.triggered = job.triggered;
+  Config current = currentConfig();
 
-  payload["humidity"] = dht.readHumidity();
-  payload["temperature"] = dht.readTemperature();
-  payload["packet_number"] = counter;
+  // Epoch and tag of a secured frame follow the encoded one, the airtime is charged for both
+  uint8_t overhead = securityOverhead(current);
+  size_t size = sizeof(frame.data) - overhead;
 
-  JsonObject watermeter = payload.createNestedObject("watermeter");
+  // The silence is only announced once the heartbeat is on its way, until then the next interval tries again
+  bool heartbeat = job.heartbeat && index == jobFrames(job) - 1;
+  if (heartbeat)
+  {
+    frame.length = encodeHeartbeat(counter, nodeId, reportSilence(current), frame.data, size);
+    if (frame.length == 0)
+    {
+      Serial.println("Could not encode the heartbeat");
+      return false;
+    }
+    if (!reserveAirtime(frameAirtime(frame.length + overhead, linkProfile)))
+    {
+      Serial.println("Duty cycle budget exhausted, skipping the heartbeat");
+      return false;
+    }
 
-  if (!watermeterResult.failed)
+    Serial.println("Sending heartbeat " + String(counter) + ", next uplink in " + String(reportSilence(current)) + " seconds at the latest");
+  }
+  else if (job.kind == JOB_BATCH)
   {
-    if (watermeterResult.current > watermeterResult.previous)
+    WatermeterSample samples[SAMPLE_BUFFER_CAPACITY];
+    uint8_t count = peekSamples(samples, SAMPLE_BUFFER_CAPACITY);
+    if (count == 0)
     {
-      watermeter["current"] = watermeterResult.current;
+      Serial.println("No samples to send");
+      return false;
     }
-    watermeter["previous"] = watermeterResult.previous;
-    watermeter["raw"] = watermeterResult.raw;
-    watermeter["rate"] = watermeterResult.rate;
-    watermeter["error"] = watermeterResult.error;
+
+    uint8_t encoded;
+    frame.length = encodeBatch(counter, nodeId, samples, count, time(nullptr), frame.data, size, encoded);
+
+    // The samples stay buffered and go out with the next batch
+    uint32_t airtime = frameAirtime(frame.length + overhead, linkProfile);
+    if (!reserveAirtime(airtime))
+    {
+      deferredBatches++;
+      Serial.println("Deferring " + String(count) + " samples, duty cycle budget covers them in " + String(airtimeWait(airtime)) + " seconds");
+      return false;
+    }
+    dropSamples(encoded);
+
+    Serial.println("Sending packet " + String(counter) + " with " + String(encoded) + " of " + String(count) + " samples in " + String(frame.length) + " bytes");
   }
+  else
+  {
+    WatermeterReading reading = job.readings[index];
+    reading.sequence = counter;
+    reading.node = nodeId;
 
-  payload["message"] = "Hello";
+    // The meters share the sequence numbers, the keyframe interval counts the packets of each meter
+    uint8_t keyframe = min((uint32_t)current.keyframe * job.count, (uint32_t)0xFF);
+    DeltaReference reference = deltaReferences[reading.meter % METER_SLOTS];
+    frame.length = encodeFrame(reading, reference, keyframe, frame.data, size);
 
-  String payloadSerialized;
-  serializeJson(payload, payloadSerialized);
+    // Over budget the reading waits in the sample buffer and goes out with the next reading as batch
+    if (frame.length > 0 && !reserveAirtime(frameAirtime(frame.length + overhead, linkProfile)))
+    {
+      pushSample(toSample(reading));
+      coalescedReadings++;
+      Serial.println("Duty cycle budget exhausted, buffering the reading of meter " + String(reading.meter));
+      return false;
+    }
+    deltaReferences[reading.meter % METER_SLOTS] = reference;
 
-  Serial.print("Sending packet: ");
-  Serial.println(payloadSerialized);
+    Serial.println("Sending packet " + String(counter) + " of meter " + String(reading.meter) + " with " + String(frame.length) + " bytes");
+  }
 
-  // Send LoRa packet to receiver
-  LoRa.beginPacket();
-  LoRa.print(payloadSerialized);
-  LoRa.endPacket();
+  // Tells the gateway to answer with a link frame
+  if ((current.adaptive || current.acknowledged) && frame.length > 0)
+  {
+    frame.data[1] |= FRAME_FLAG_RX_WINDOW;
+  }
+
+  // Sealed last, the tag covers the flags
+  if (frame.length > 0)
+  {
+    frame.length = secureFrame(current, frame.data, frame.length, sizeof(frame.data), frame.counter);
+  }
+
+  if (heartbeat && frame.length > 0)
+  {
+    markHeartbeat(current);
+    heartbeats++;
+  }
 
   counter++;
-}
\ No newline at end of file
+  recordLatency(encodeLatency, start);
+  return frame.length > 0;
+}
+
+void transmitStage(const PipelineFrame &frame)
+{
+  unsigned long start = micros();
+  Config current = currentConfig();
+
+  if (syncWordChanged)
+  {
+    syncWordChanged = false;
+    LoRa.setSyncWord(current.word);
+    Serial.println("Changed Sync Word to " + String(current.word));
+  }
+
+  if (!current.adaptive && !sameProfile(linkProfile, defaultLinkProfile))
+  {
+    setLinkProfile(defaultLinkProfile);
+  }
+
+  // Retransmissions carry their number in the header, everything else stays the same
+  uint8_t data[FRAME_MAX_LENGTH];
+  memcpy(data, frame.data, frame.length);
+  bool listens = frameFlags(data) & FRAME_FLAG_RX_WINDOW;
+  uint8_t retries = current.acknowledged ? FRAME_MAX_RETRIES : 0;
+  bool answered = false;
+
+  for (uint8_t retry = 0; retry <= retries && !answered; retry++)
+  {
+    if (retry > 0)
+    {
+      if (!reserveAirtime(frameAirtime(frame.length, linkProfile)))
+      {
+        Serial.println("Duty cycle budget exhausted, giving up on packet " + String(frameSequence(data)));
+        break;
+      }
+
+      // Exponential backoff with jitter, so a collision with another sender does not repeat
+      uint32_t backoff = ACK_BACKOFF << (retry - 1);
+      delay(backoff + random(backoff));
+      setFrameRetry(data, retry);
+      retransmissions++;
+      Serial.println("Retransmitting packet " + String(frameSequence(data)) + ", attempt " + String(retry + 1));
+    }
+
+    // Send LoRa packet to receiver, the TX-done interrupt signals the end of the transmission
+    xSemaphoreTake(txDone, 0);
+    LoRa.beginPacket();
+    LoRa.write(data, frame.length);
+    LoRa.endPacket(true);
+
+    if (xSemaphoreTake(txDone, pdMS_TO_TICKS(TX_DONE_TIMEOUT)) != pdTRUE)
+    {
+      txTimeouts++;
+      Serial.println("LoRa transmission did not finish in time");
+      LoRa.idle();
+    }
+    else
+    {
+      observeHistogram(txAirtime, frameAirtime(frame.length, linkProfile) / 1e6f);
+      if (listens)
+      {
+        answered = receiveLinkFrame(frameSequence(data), frame.counter, isSecuredFrame(data, frame.length));
+      }
+    }
+  }
+
+  if (listens && !answered)
+  {
+    unacknowledged++;
+    missedLinkFrames++;
+  }
+  else if (listens)
+  {
+    missedLinkFrames = 0;
+  }
+
+  // The gateway falls back on its own after the same number of silent intervals
+  if (missedLinkFrames >= LINK_FALLBACK_MISSES && !sameProfile(linkProfile, defaultLinkProfile))
+  {
+    Serial.println("No link frame for " + String(missedLinkFrames) + " packets, falling back to the default profile");
+    setLinkProfile(defaultLinkProfile);
+    missedLinkFrames = 0;
+  }
+
+  recordLatency(transmitLatency, start);
+  recordLatency(totalLatency, frame.triggered);
+  phaseDurations.transmit = transmitLatency.last / 1000;
+}
+
+// Listens for the answer of the gateway with the current profile, that is what the gateway still uses for the downlink.
+// Returns true if the gateway acknowledged the uplink with the given sequence number. The answer to a secured uplink
+// only counts with the tag for its frame counter.
+bool receiveLinkFrame(uint16_t sequence, uint32_t counter, bool secured)
+{
+  size_t expected = LINK_FRAME_LENGTH + (secured ? FRAME_TAG_LENGTH : 0);
+  uint32_t window = LINK_RX_WINDOW + frameAirtime(expected, linkProfile) / 1000;
+  unsigned long start = millis();
+  bool answered = false;
+
+  while (!answered && millis() - start < window)
+  {
+    // DIO0 stays mapped to TX done, so polling is the only way to see the received frame
+    if ((size_t)LoRa.parsePacket() == expected)
+    {
+      uint8_t data[LINK_FRAME_LENGTH + FRAME_TAG_LENGTH];
+      for (uint8_t i = 0; i < expected; i++)
+      {
+        data[i] = LoRa.read();
+      }
+
+      // Other senders of the same gateway may get their answer at the same time, only answers for this one are checked
+      size_t length = expected;
+      bool ours = frameNode(data) == nodeId && frameSequence(data) == sequence;
+      if (ours && secured && !verifyLinkFrame(data, length, counter))
+      {
+        rejectedLinkFrames++;
+        Serial.println("Rejected link frame with invalid tag for packet " + String(sequence));
+        continue;
+      }
+
+      uint16_t answeredSequence;
+      uint16_t answeredNode;
+      LinkProfile recommended;
+      if (ours && decodeLink(data, length, answeredSequence, answeredNode, recommended))
+      {
+        answered = true;
+        if (currentConfig().adaptive && !sameProfile(recommended, linkProfile))
+        {
+          setLinkProfile(recommended);
+        }
+      }
+    }
+    else
+    {
+      vTaskDelay(1);
+    }
+  }
+  LoRa.idle();
+  return answered;
+}
+
+void setLinkProfile(const LinkProfile &profile)
+{
+  LoRa.setSpreadingFactor(profile.spreadingFactor);
+  LoRa.setSignalBandwidth(profile.bandwidth);
+  LoRa.setCodingRate4(profile.codingRate);
+  LoRa.setTxPower(profile.txPower);
+  linkProfile = profile;
+  Serial.println("Link profile SF" + String(profile.spreadingFactor) + " " + String(profile.bandwidth / 1000) + " kHz CR 4/" + String(profile.codingRate) + " " + String(profile.txPower) + " dBm");
+}
+
+void IRAM_ATTR onTxDone()
+{
+  BaseType_t woken = pdFALSE;
+  xSemaphoreGiveFromISR(txDone, &woken);
+  if (woken)
+  {
+    portYIELD_FROM_ISR();
+  }
+}
+
+void recordLatency(StageLatency &latency, unsigned long start)
+{
+  latency.last = micros() - start;
+  latency.max = max(latency.max, latency.last);
+  observeHistogram(latency.histogram, latency.last / 1e6f);
+}
+
+String formatLatency(const StageLatency &latency)
+{
+  return String(latency.last / 1000.0, 1) + " ms (max. " + String(latency.max / 1000.0, 1) + " ms)";
+}
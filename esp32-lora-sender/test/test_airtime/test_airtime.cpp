@@ -0,0 +1,126 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <LinkProfile.h>
+
+// frameAirtime() against the time on air of Semtech AN1200.13, run with `pio test -e native_test`.
+// The expected values are worked out by hand with explicit header, no CRC and a preamble of 8 symbols:
+//   symbol = 2^SF / BW, payload symbols = 8 + max(ceil((8 * length - 4 * SF + 28) / (4 * (SF - 2 * LDRO))) * (CR + 4), 0)
+//   airtime = (8 + 4.25 + payload symbols) * symbol
+// LDRO, the low data rate optimization, is on above 16 ms per symbol as Semtech recommends.
+
+typedef struct
+{
+  size_t length;    // bytes
+  uint32_t airtime; // microseconds
+} AirtimeCase;
+
+static void assertAirtime(const LinkProfile &profile, const AirtimeCase *cases, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    char message[32];
+    snprintf(message, sizeof(message), "SF%u, %u bytes", profile.spreadingFactor, (unsigned)cases[i].length);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(cases[i].airtime, frameAirtime(cases[i].length, profile), message);
+  }
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+static void test_sf7_bw125()
+{
+  // 1.024 ms per symbol
+  LinkProfile profile = {7, 125000, 5, 17};
+  AirtimeCase cases[] = {
+      {0, 20736},  // 8 payload symbols, the numerator is 0
+      {10, 36096}, // ceil(80 / 28) = 3 blocks, 23 symbols, a link frame
+      {22, 56576}, // ceil(176 / 28) = 7 blocks, 43 symbols, a reading
+      {51, 97536}, // ceil(408 / 28) = 15 blocks, 83 symbols
+  };
+  assertAirtime(profile, cases, sizeof(cases) / sizeof(cases[0]));
+}
+
+static void test_sf10_bw125()
+{
+  // 8.192 ms per symbol, no LDRO
+  LinkProfile profile = {10, 125000, 5, 17};
+  AirtimeCase cases[] = {
+      {0, 165888},  // numerator -12, 8 payload symbols
+      {10, 247808}, // ceil(68 / 40) = 2 blocks, 18 symbols
+      {22, 370688}, // ceil(164 / 40) = 5 blocks, 33 symbols
+      {51, 575488}, // ceil(396 / 40) = 10 blocks, 58 symbols
+  };
+  assertAirtime(profile, cases, sizeof(cases) / sizeof(cases[0]));
+}
+
+static void test_sf12_bw125()
+{
+  // 32.768 ms per symbol, LDRO on
+  LinkProfile profile = {12, 125000, 5, 17};
+  AirtimeCase cases[] = {
+      {0, 663552},   // numerator -20, 8 payload symbols
+      {10, 991232},  // ceil(60 / 40) = 2 blocks, 18 symbols
+      {22, 1318912}, // ceil(156 / 40) = 4 blocks, 28 symbols
+      {51, 2301952}, // ceil(388 / 40) = 10 blocks, 58 symbols
+  };
+  assertAirtime(profile, cases, sizeof(cases) / sizeof(cases[0]));
+}
+
+// 16.384 ms per symbol is the first one with LDRO, 8.192 ms is the last one without
+static void test_low_data_rate_boundary()
+{
+  // SF11 at 125 kHz, 16.384 ms: ceil(160 / 36) = 5 blocks. The LoRa library computes 16 ms in whole ms and leaves LDRO
+  // off, so the radio sends 4 blocks in 659456 µs and frameAirtime() is an upper bound here.
+  LinkProfile sf11bw125 = {11, 125000, 5, 17};
+  AirtimeCase sf11bw125Cases[] = {{22, 741376}};
+  assertAirtime(sf11bw125, sf11bw125Cases, 1);
+
+  // SF11 at 250 kHz, 8.192 ms: ceil(160 / 44) = 4 blocks, with LDRO it would be 5 and 370688 µs
+  LinkProfile sf11bw250 = {11, 250000, 5, 17};
+  AirtimeCase sf11bw250Cases[] = {{22, 329728}};
+  assertAirtime(sf11bw250, sf11bw250Cases, 1);
+
+  // SF12 at 250 kHz, 16.384 ms: ceil(388 / 40) = 10 blocks, the LoRa library sends 9 in 1069056 µs like at SF11
+  LinkProfile sf12bw250 = {12, 250000, 5, 17};
+  AirtimeCase sf12bw250Cases[] = {{51, 1150976}};
+  assertAirtime(sf12bw250, sf12bw250Cases, 1);
+
+  // SF10 at 125 kHz stays without LDRO, see test_sf10_bw125
+}
+
+static void test_coding_rate()
+{
+  // CR 4/8 at SF7: ceil(176 / 28) = 7 blocks of 8 symbols, 64 symbols
+  LinkProfile profile = {7, 125000, 8, 17};
+  AirtimeCase cases[] = {{22, 78080}};
+  assertAirtime(profile, cases, 1);
+}
+
+// Power does not change the time on air
+static void test_power_independent()
+{
+  LinkProfile full = {9, 125000, 5, LINK_MAX_TX_POWER};
+  LinkProfile low = {9, 125000, 5, LINK_MIN_TX_POWER};
+  TEST_ASSERT_EQUAL_UINT32(frameAirtime(22, full), frameAirtime(22, low));
+}
+
+void setup()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_sf7_bw125);
+  RUN_TEST(test_sf10_bw125);
+  RUN_TEST(test_sf12_bw125);
+  RUN_TEST(test_low_data_rate_boundary);
+  RUN_TEST(test_coding_rate);
+  RUN_TEST(test_power_independent);
+  exit(UNITY_END());
+}
+
+void loop()
+{
+}
@@ -0,0 +1,446 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <WatermeterFrame.h>
+#include <LinkProfile.h>
+
+// Round trips of the binary frame, run with `pio test -e native_test`.
+// The layout is described in lib/WatermeterProtocol/README.md.
+#define TEST_NODE 0x1a2b
+#define TEST_NOW 1687115042
+
+// What the sender sent before the binary frame for the same reading, as ArduinoJson serialized it
+static const char jsonPayload[] = "{\"humidity\":45.2,\"temperature\":21.5,\"packet_number\":1234,"
+                                  "\"watermeter\":{\"current\":482.6027,\"previous\":482.6019,\"raw\":\"00482.6027\","
+                                  "\"rate\":0.0008,\"error\":\"no error\"},\"message\":\"Hello\"}";
+
+static WatermeterReading reading;
+static uint8_t frame[FRAME_MAX_LENGTH];
+
+void setUp()
+{
+  memset(&reading, 0, sizeof(reading));
+  reading.sequence = 1234;
+  reading.node = TEST_NODE;
+  reading.flags = FRAME_FLAG_HAS_RATE;
+  reading.value = 4826027;
+  reading.previous = 4826019;
+  reading.rate = 8;
+  reading.temperature = 215;
+  reading.humidity = 452;
+  memset(frame, 0, sizeof(frame));
+}
+
+void tearDown()
+{
+}
+
+static void assertSameReading(const WatermeterReading &expected, const WatermeterReading &actual)
+{
+  TEST_ASSERT_EQUAL_UINT16(expected.sequence, actual.sequence);
+  TEST_ASSERT_EQUAL_UINT16(expected.node, actual.node);
+  TEST_ASSERT_EQUAL_UINT8(expected.meter, actual.meter);
+  TEST_ASSERT_EQUAL_HEX8(expected.flags, actual.flags);
+  TEST_ASSERT_EQUAL_UINT32(expected.value, actual.value);
+  TEST_ASSERT_EQUAL_UINT32(expected.previous, actual.previous);
+  TEST_ASSERT_EQUAL_INT32(expected.rate, actual.rate);
+  TEST_ASSERT_EQUAL_INT16(expected.temperature, actual.temperature);
+  TEST_ASSERT_EQUAL_UINT16(expected.humidity, actual.humidity);
+  TEST_ASSERT_EQUAL_STRING(expected.raw, actual.raw);
+  TEST_ASSERT_EQUAL_STRING(expected.error, actual.error);
+}
+
+static void assertSameSample(const WatermeterSample &expected, const WatermeterSample &actual)
+{
+  TEST_ASSERT_EQUAL_UINT32(expected.timestamp, actual.timestamp);
+  TEST_ASSERT_EQUAL_UINT8(expected.meter, actual.meter);
+  TEST_ASSERT_EQUAL_HEX8(expected.flags, actual.flags);
+  TEST_ASSERT_EQUAL_UINT32(expected.value, actual.value);
+  TEST_ASSERT_EQUAL_UINT32(expected.previous, actual.previous);
+  TEST_ASSERT_EQUAL_INT32(expected.rate, actual.rate);
+  TEST_ASSERT_EQUAL_INT16(expected.temperature, actual.temperature);
+  TEST_ASSERT_EQUAL_UINT16(expected.humidity, actual.humidity);
+}
+
+static void test_reading_round_trip()
+{
+  size_t length = encodeReading(reading, frame, sizeof(frame));
+  TEST_ASSERT_EQUAL_size_t(22, length);
+  TEST_ASSERT_EQUAL_UINT8(FRAME_PROTOCOL_VERSION, frameVersion(frame));
+  TEST_ASSERT_EQUAL_UINT8(FRAME_TYPE_READING, frameType(frame));
+  TEST_ASSERT_EQUAL_UINT16(1234, frameSequence(frame));
+  TEST_ASSERT_EQUAL_UINT16(TEST_NODE, frameNode(frame));
+
+  WatermeterReading decoded;
+  TEST_ASSERT_TRUE(decodeReading(frame, length, decoded));
+  assertSameReading(reading, decoded);
+}
+
+static void test_reading_with_texts_and_meter()
+{
+  reading.meter = 3;
+  reading.flags |= FRAME_FLAG_HAS_RAW | FRAME_FLAG_METER_ERROR;
+  reading.rate = -120;
+  reading.temperature = -85;
+  strcpy(reading.raw, "00482.60N7");
+  strcpy(reading.error, "Neg. Rate - Read: 482.6019");
+
+  size_t length = encodeReading(reading, frame, sizeof(frame));
+  TEST_ASSERT_EQUAL_size_t(22 + 1 + strlen(reading.raw) + 1 + strlen(reading.error), length);
+  TEST_ASSERT_EQUAL_UINT8(3, frameMeter(frame, length));
+
+  WatermeterReading decoded;
+  TEST_ASSERT_TRUE(decodeReading(frame, length, decoded));
+  assertSameReading(reading, decoded);
+}
+
+static void test_reading_without_meter_and_sensor()
+{
+  reading.flags = FRAME_FLAG_METER_FAILED | FRAME_FLAG_SENSOR_FAILED;
+  reading.value = 0;
+  reading.previous = 0;
+  reading.rate = 0;
+  reading.temperature = 0;
+  reading.humidity = 0;
+
+  size_t length = encodeReading(reading, frame, sizeof(frame));
+  TEST_ASSERT_EQUAL_size_t(7, length);
+
+  WatermeterReading decoded;
+  TEST_ASSERT_TRUE(decodeReading(frame, length, decoded));
+  assertSameReading(reading, decoded);
+}
+
+// Retry and RX_WINDOW only live in the header, the decoded flags do not show them
+static void test_header_bits()
+{
+  size_t length = encodeReading(reading, frame, sizeof(frame));
+  frame[1] |= FRAME_FLAG_RX_WINDOW;
+  for (uint8_t retry = 0; retry <= FRAME_MAX_RETRIES; retry++)
+  {
+    setFrameRetry(frame, retry);
+    TEST_ASSERT_EQUAL_UINT8(retry, frameRetry(frame));
+    TEST_ASSERT_TRUE(frameFlags(frame) & FRAME_FLAG_RX_WINDOW);
+
+    WatermeterReading decoded;
+    TEST_ASSERT_TRUE(decodeReading(frame, length, decoded));
+    assertSameReading(reading, decoded);
+  }
+
+  setFrameRetry(frame, 0);
+  TEST_ASSERT_EQUAL_HEX8(FRAME_FLAG_RX_WINDOW | FRAME_FLAG_HAS_RATE, frameFlags(frame));
+}
+
+static void test_delta_round_trip()
+{
+  DeltaReference encoder = {};
+  DeltaReference decoder = {};
+  WatermeterReading decoded;
+
+  size_t length = encodeFrame(reading, encoder, 10, frame, sizeof(frame));
+  TEST_ASSERT_EQUAL_UINT8(FRAME_TYPE_READING, frameType(frame));
+  TEST_ASSERT_EQUAL(DECODE_OK, decodeFrame(frame, length, decoder, decoded));
+
+  // A running meter, a falling rate and a cooling basement
+  for (uint8_t i = 1; i < 10; i++)
+  {
+    reading.sequence++;
+    reading.previous = reading.value;
+    reading.value += 8 * i;
+    reading.rate = 8 - i;
+    reading.temperature -= 3;
+    reading.humidity += 1;
+
+    length = encodeFrame(reading, encoder, 10, frame, sizeof(frame));
+    TEST_ASSERT_EQUAL_UINT8(FRAME_TYPE_DELTA, frameType(frame));
+    TEST_ASSERT_LESS_THAN(22, length);
+    TEST_ASSERT_EQUAL(DECODE_OK, decodeFrame(frame, length, decoder, decoded));
+    assertSameReading(reading, decoded);
+  }
+
+  // The keyframe interval is over
+  reading.sequence++;
+  length = encodeFrame(reading, encoder, 10, frame, sizeof(frame));
+  TEST_ASSERT_EQUAL_UINT8(FRAME_TYPE_READING, frameType(frame));
+  TEST_ASSERT_EQUAL(DECODE_OK, decodeFrame(frame, length, decoder, decoded));
+  assertSameReading(reading, decoded);
+}
+
+static void test_delta_needs_its_keyframe()
+{
+  DeltaReference encoder = {};
+  DeltaReference decoder = {};
+  WatermeterReading decoded;
+
+  encodeFrame(reading, encoder, 10, frame, sizeof(frame));
+  reading.sequence++;
+  reading.value += 8;
+  size_t length = encodeFrame(reading, encoder, 10, frame, sizeof(frame));
+  TEST_ASSERT_EQUAL_UINT8(FRAME_TYPE_DELTA, frameType(frame));
+
+  // The keyframe was lost
+  TEST_ASSERT_EQUAL(DECODE_MISSING_KEYFRAME, decodeFrame(frame, length, decoder, decoded));
+
+  // A keyframe of an older stream
+  WatermeterReading older = reading;
+  older.sequence -= 5;
+  uint8_t keyframe[FRAME_MAX_LENGTH];
+  size_t keyframeLength = encodeReading(older, keyframe, sizeof(keyframe));
+  TEST_ASSERT_EQUAL(DECODE_OK, decodeFrame(keyframe, keyframeLength, decoder, decoded));
+  TEST_ASSERT_EQUAL(DECODE_MISSING_KEYFRAME, decodeFrame(frame, length, decoder, decoded));
+}
+
+// A reading with a field the keyframe does not have is sent as keyframe
+static void test_delta_falls_back_to_keyframe()
+{
+  DeltaReference encoder = {};
+  reading.flags = FRAME_FLAG_SENSOR_FAILED;
+  encodeFrame(reading, encoder, 10, frame, sizeof(frame));
+
+  reading.sequence++;
+  reading.flags = FRAME_FLAG_HAS_RATE;
+  encodeFrame(reading, encoder, 10, frame, sizeof(frame));
+  TEST_ASSERT_EQUAL_UINT8(FRAME_TYPE_READING, frameType(frame));
+}
+
+static void test_batch_round_trip()
+{
+  WatermeterSample samples[12] = {};
+  for (uint8_t i = 0; i < 12; i++)
+  {
+    WatermeterSample &sample = samples[i];
+    sample.timestamp = TEST_NOW - 60 * (12 - i);
+    sample.meter = i % 2;
+    sample.flags = FRAME_FLAG_HAS_RATE;
+    sample.value = (sample.meter ? 172210 : 4826027) + 8 * i;
+    sample.previous = sample.value - 8;
+    sample.rate = 8;
+    sample.temperature = 215 - i;
+    sample.humidity = 452;
+  }
+  samples[4].flags = FRAME_FLAG_METER_FAILED;
+  samples[4].value = samples[4].previous = samples[4].rate = 0;
+  samples[7].flags = FRAME_FLAG_SENSOR_FAILED | FRAME_FLAG_HAS_RATE;
+  samples[7].temperature = samples[7].humidity = 0;
+  samples[9].flags = 0;
+  samples[9].rate = 0;
+
+  uint8_t encoded;
+  size_t length = encodeBatch(77, TEST_NODE, samples, 12, TEST_NOW, frame, sizeof(frame), encoded);
+  TEST_ASSERT_EQUAL_UINT8(12, encoded);
+  TEST_ASSERT_EQUAL_UINT8(FRAME_TYPE_BATCH, frameType(frame));
+
+  WatermeterSample decoded[FRAME_MAX_BATCH_SAMPLES];
+  uint16_t sequence;
+  uint16_t node;
+  uint8_t count;
+  TEST_ASSERT_TRUE(decodeBatch(frame, length, TEST_NOW, sequence, node, decoded, FRAME_MAX_BATCH_SAMPLES, count));
+  TEST_ASSERT_EQUAL_UINT16(77, sequence);
+  TEST_ASSERT_EQUAL_UINT16(TEST_NODE, node);
+  TEST_ASSERT_EQUAL_UINT8(12, count);
+  for (uint8_t i = 0; i < count; i++)
+  {
+    assertSameSample(samples[i], decoded[i]);
+  }
+}
+
+// Samples that do not fit stay for the next frame
+static void test_batch_splits_at_the_buffer_end()
+{
+  WatermeterSample samples[FRAME_MAX_BATCH_SAMPLES] = {};
+  for (uint8_t i = 0; i < FRAME_MAX_BATCH_SAMPLES; i++)
+  {
+    samples[i].timestamp = TEST_NOW - 60 * (FRAME_MAX_BATCH_SAMPLES - i);
+    samples[i].flags = FRAME_FLAG_SENSOR_FAILED;
+    samples[i].value = 4826027 + 100000 * i;
+  }
+
+  uint8_t encoded;
+  size_t length = encodeBatch(1, TEST_NODE, samples, FRAME_MAX_BATCH_SAMPLES, TEST_NOW, frame, 64, encoded);
+  TEST_ASSERT_GREATER_THAN(0, encoded);
+  TEST_ASSERT_LESS_THAN(FRAME_MAX_BATCH_SAMPLES, encoded);
+  TEST_ASSERT_LESS_OR_EQUAL(64, length);
+
+  WatermeterSample decoded[FRAME_MAX_BATCH_SAMPLES];
+  uint16_t sequence;
+  uint16_t node;
+  uint8_t count;
+  TEST_ASSERT_TRUE(decodeBatch(frame, length, TEST_NOW, sequence, node, decoded, FRAME_MAX_BATCH_SAMPLES, count));
+  TEST_ASSERT_EQUAL_UINT8(encoded, count);
+  assertSameSample(samples[encoded - 1], decoded[encoded - 1]);
+}
+
+static void test_heartbeat_round_trip()
+{
+  size_t length = encodeHeartbeat(4321, TEST_NODE, 1800, frame, sizeof(frame));
+  TEST_ASSERT_EQUAL_size_t(8, length);
+
+  uint16_t sequence;
+  uint16_t node;
+  uint32_t silence;
+  TEST_ASSERT_TRUE(decodeHeartbeat(frame, length, sequence, node, silence));
+  TEST_ASSERT_EQUAL_UINT16(4321, sequence);
+  TEST_ASSERT_EQUAL_UINT16(TEST_NODE, node);
+  TEST_ASSERT_EQUAL_UINT32(1800, silence);
+}
+
+// Every cut of a frame is rejected, none decodes into a shorter reading
+static void test_truncated_frames_are_rejected()
+{
+  WatermeterReading decoded;
+  reading.flags |= FRAME_FLAG_HAS_RAW;
+  strcpy(reading.raw, "00482.60N7");
+  size_t length = encodeReading(reading, frame, sizeof(frame));
+  for (size_t cut = 0; cut < length; cut++)
+  {
+    TEST_ASSERT_FALSE(decodeReading(frame, cut, decoded));
+  }
+
+  DeltaReference encoder = {};
+  DeltaReference decoder = {};
+  encodeFrame(reading, encoder, 10, frame, sizeof(frame));
+  decodeFrame(frame, length, decoder, decoded);
+  reading.sequence++;
+  reading.value += 8;
+  length = encodeFrame(reading, encoder, 10, frame, sizeof(frame));
+  for (size_t cut = 0; cut < length; cut++)
+  {
+    TEST_ASSERT_EQUAL(DECODE_INVALID, decodeFrame(frame, cut, decoder, decoded));
+  }
+
+  WatermeterSample samples[3] = {};
+  WatermeterSample decodedSamples[3];
+  uint16_t sequence;
+  uint16_t node;
+  uint8_t count;
+  uint8_t encoded;
+  for (uint8_t i = 0; i < 3; i++)
+  {
+    samples[i].timestamp = TEST_NOW;
+    samples[i].value = 4826027 + i;
+  }
+  length = encodeBatch(1, TEST_NODE, samples, 3, TEST_NOW, frame, sizeof(frame), encoded);
+  for (size_t cut = 0; cut < length; cut++)
+  {
+    TEST_ASSERT_FALSE(decodeBatch(frame, cut, TEST_NOW, sequence, node, decodedSamples, 3, count));
+  }
+
+  uint32_t silence;
+  length = encodeHeartbeat(1, TEST_NODE, 100000, frame, sizeof(frame));
+  for (size_t cut = 0; cut < length; cut++)
+  {
+    TEST_ASSERT_FALSE(decodeHeartbeat(frame, cut, sequence, node, silence));
+  }
+}
+
+// Encoders return 0 instead of writing past a buffer that is too small
+static void test_small_buffers_are_refused()
+{
+  reading.flags |= FRAME_FLAG_METER_ERROR;
+  strcpy(reading.error, "no error");
+  size_t length = encodeReading(reading, frame, sizeof(frame));
+  for (size_t size = 0; size < length; size++)
+  {
+    uint8_t small[FRAME_MAX_LENGTH];
+    memset(small, 0xa5, sizeof(small));
+    TEST_ASSERT_EQUAL_size_t(0, encodeReading(reading, small, size));
+    TEST_ASSERT_EQUAL_HEX8(0xa5, small[size]);
+  }
+
+  for (size_t size = 0; size < 8; size++)
+  {
+    TEST_ASSERT_EQUAL_size_t(0, encodeHeartbeat(1, TEST_NODE, 1800, frame, size));
+  }
+}
+
+// Lengths and counts above the limits of the protocol are rejected instead of overrunning the fields
+static void test_oversized_fields_are_rejected()
+{
+  WatermeterReading decoded;
+  reading.flags |= FRAME_FLAG_HAS_RAW;
+  strcpy(reading.raw, "0123456789abcdef");
+  size_t length = encodeReading(reading, frame, sizeof(frame));
+  TEST_ASSERT_TRUE(decodeReading(frame, length, decoded));
+
+  // The length prefix of the raw reading claims one byte more than the field holds
+  frame[22]++;
+  frame[length++] = '0';
+  TEST_ASSERT_FALSE(decodeReading(frame, length, decoded));
+
+  WatermeterSample samples[4] = {};
+  WatermeterSample decodedSamples[4];
+  uint16_t sequence;
+  uint16_t node;
+  uint8_t count;
+  uint8_t encoded;
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    samples[i].timestamp = TEST_NOW;
+  }
+  length = encodeBatch(1, TEST_NODE, samples, 4, TEST_NOW, frame, sizeof(frame), encoded);
+  TEST_ASSERT_FALSE(decodeBatch(frame, length, TEST_NOW, sequence, node, decodedSamples, 3, count));
+  TEST_ASSERT_EQUAL_UINT8(0, count);
+
+  // Meter numbers beyond FRAME_MAX_METERS, frames without node and other versions
+  length = encodeReading(reading, frame, sizeof(frame));
+  frame[6] = FRAME_MAX_METERS;
+  TEST_ASSERT_FALSE(decodeReading(frame, length, decoded));
+  reading.node = FRAME_NO_NODE;
+  length = encodeReading(reading, frame, sizeof(frame));
+  TEST_ASSERT_FALSE(decodeReading(frame, length, decoded));
+  reading.node = TEST_NODE;
+  length = encodeReading(reading, frame, sizeof(frame));
+  frame[0] = ((FRAME_PROTOCOL_VERSION - 1) << 4) | FRAME_TYPE_READING;
+  TEST_ASSERT_FALSE(decodeReading(frame, length, decoded));
+}
+
+// The numbers of the protocol README, with the default radio settings
+static void test_size_against_json()
+{
+  size_t jsonLength = strlen(jsonPayload);
+  size_t length = encodeReading(reading, frame, sizeof(frame));
+  DeltaReference reference = {};
+  encodeFrame(reading, reference, 10, frame, sizeof(frame));
+  reading.sequence++;
+  reading.previous = reading.value;
+  reading.value += 8;
+  size_t deltaLength = encodeFrame(reading, reference, 10, frame, sizeof(frame));
+
+  uint32_t jsonAirtime = frameAirtime(jsonLength, defaultLinkProfile);
+  uint32_t airtime = frameAirtime(length, defaultLinkProfile);
+  uint32_t deltaAirtime = frameAirtime(deltaLength, defaultLinkProfile);
+  char message[160];
+  snprintf(message, sizeof(message), "JSON %u bytes %u us, reading %u bytes %u us, delta %u bytes %u us", (unsigned)jsonLength,
+           (unsigned)jsonAirtime, (unsigned)length, (unsigned)airtime, (unsigned)deltaLength, (unsigned)deltaAirtime);
+  TEST_MESSAGE(message);
+
+  TEST_ASSERT_EQUAL_size_t(181, jsonLength);
+  TEST_ASSERT_EQUAL_size_t(22, length);
+  TEST_ASSERT_EQUAL_size_t(13, deltaLength);
+  TEST_ASSERT_EQUAL_UINT32(286976, jsonAirtime);
+  TEST_ASSERT_EQUAL_UINT32(56576, airtime);
+  TEST_ASSERT_EQUAL_UINT32(41216, deltaAirtime);
+}
+
+void setup()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_reading_round_trip);
+  RUN_TEST(test_reading_with_texts_and_meter);
+  RUN_TEST(test_reading_without_meter_and_sensor);
+  RUN_TEST(test_header_bits);
+  RUN_TEST(test_delta_round_trip);
+  RUN_TEST(test_delta_needs_its_keyframe);
+  RUN_TEST(test_delta_falls_back_to_keyframe);
+  RUN_TEST(test_batch_round_trip);
+  RUN_TEST(test_batch_splits_at_the_buffer_end);
+  RUN_TEST(test_heartbeat_round_trip);
+  RUN_TEST(test_truncated_frames_are_rejected);
+  RUN_TEST(test_small_buffers_are_refused);
+  RUN_TEST(test_oversized_fields_are_rejected);
+  RUN_TEST(test_size_against_json);
+  exit(UNITY_END());
+}
+
+void loop()
+{
+}
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+"""Estimates the daily charge of the sender in low-power mode.
+
+Phase durations are taken from the "Phase durations (ms)" lines the sender
+prints on the serial console after every wake-up. Either pass them directly
+or pipe a serial log into the script, in that case the averages are used:
+
+    pio device monitor | tee sender.log
+    ./energy_model.py --interval 300 --log sender.log
+    ./energy_model.py --interval 300 --boot 350 --wait 4000 --poll 600 --transmit 60
+
+The default currents are typical values for an ESP32 board with an SX1276,
+measure your own board and override them for better numbers.
+"""
+
+import argparse
+import re
+import sys
+
+PHASE_PATTERN = re.compile(r"Phase durations \(ms\): boot=(\d+) wait=(\d+) poll=(\d+) transmit=(\d+) awake=(\d+)")
+
+
+def read_phases(log):
+    samples = [tuple(int(v) for v in match.groups()) for match in map(PHASE_PATTERN.search, log) if match]
+    if not samples:
+        sys.exit("No phase durations found in the log")
+    averages = [sum(column) / len(samples) for column in zip(*samples)]
+    return dict(zip(("boot", "wait", "poll", "transmit", "awake"), averages)), len(samples)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--interval", type=float, required=True, help="wake-up interval in seconds (lora-interval or sample-interval)")
+    parser.add_argument("--log", type=argparse.FileType("r"), help="serial log with phase durations, '-' for stdin")
+    parser.add_argument("--boot", type=float, default=350, help="ms from reset until the AP is up")
+    parser.add_argument("--wait", type=float, default=4000, help="ms waiting for the watermeter to connect")
+    parser.add_argument("--poll", type=float, default=600, help="ms polling the watermeter and the DHT22")
+    parser.add_argument("--transmit", type=float, default=60, help="ms transmitting the LoRa frame")
+    parser.add_argument("--awake", type=float, help="total ms awake, defaults to the sum of the phases")
+    parser.add_argument("--boot-current", type=float, default=45, help="mA while booting")
+    parser.add_argument("--ap-current", type=float, default=125, help="mA with the WiFi AP up")
+    parser.add_argument("--tx-current", type=float, default=120, help="mA extra while the radio transmits")
+    parser.add_argument("--sleep-current", type=float, default=0.15, help="mA in deep sleep including regulator and DHT22")
+    parser.add_argument("--always-on-current", type=float, default=115, help="mA without low-power mode for comparison")
+    parser.add_argument("--battery", type=float, help="battery capacity in mAh to estimate the runtime")
+    args = parser.parse_args()
+
+    phases = {"boot": args.boot, "wait": args.wait, "poll": args.poll, "transmit": args.transmit, "awake": args.awake}
+    if args.log:
+        phases, count = read_phases(args.log)
+        print(f"Averaged {count} wake-ups from the log")
+    if phases["awake"] is None:
+        phases["awake"] = phases["boot"] + phases["wait"] + phases["poll"] + phases["transmit"]
+
+    # Whatever is not covered by a phase is spent with the AP up (sleep preparation, logging)
+    other = max(phases["awake"] - phases["boot"] - phases["wait"] - phases["poll"] - phases["transmit"], 0)
+    awake = phases["awake"] / 1000
+    sleep = max(args.interval - awake, 0)
+
+    charge_per_wake = (
+        phases["boot"] * args.boot_current
+        + (phases["wait"] + phases["poll"] + phases["transmit"] + other) * args.ap_current
+        + phases["transmit"] * args.tx_current
+    ) / 1000 / 3600 + sleep * args.sleep_current / 3600
+    wakes_per_day = 86400 / max(args.interval, awake)
+    per_day = charge_per_wake * wakes_per_day
+    always_on = args.always_on_current * 24
+
+    print(f"Phases (ms): boot={phases['boot']:.0f} wait={phases['wait']:.0f} poll={phases['poll']:.0f} "
+          f"transmit={phases['transmit']:.0f} awake={phases['awake']:.0f}")
+    print(f"Wake-ups per day: {wakes_per_day:.0f}, duty cycle awake: {100 * awake / max(args.interval, awake):.2f} %")
+    print(f"Low-power mode: {per_day:.1f} mAh/day (average {per_day / 24:.3f} mA)")
+    print(f"Always on:      {always_on:.1f} mAh/day")
+    if args.battery:
+        print(f"Runtime on {args.battery:.0f} mAh: {args.battery / per_day:.1f} days")
+
+
+if __name__ == "__main__":
+    main()
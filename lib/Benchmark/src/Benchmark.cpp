@@ -0,0 +1,249 @@
+#include "Benchmark.h"
+#include <new>
+
+#ifdef ARDUINO_ARCH_ESP32
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#else
+#include <chrono>
+#include <malloc.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
+
+// Written only by the wrappers on the task that runs the benchmark, so no lock is needed
+static volatile bool counting = false;
+static TaskHandle_t countedTask;
+static uint32_t allocations;
+static uint64_t allocatedBytes;
+static int64_t heldBytes;
+static int64_t peakBytes;
+
+static size_t allocatedSize(void *pointer)
+{
+#ifdef ARDUINO_ARCH_ESP32
+  return heap_caps_get_allocated_size(pointer);
+#else
+  return malloc_usable_size(pointer);
+#endif
+}
+
+static bool isCounted()
+{
+  return counting && xTaskGetCurrentTaskHandle() == countedTask;
+}
+
+static void countAllocation(void *pointer)
+{
+  if (pointer == nullptr || !isCounted())
+  {
+    return;
+  }
+  size_t size = allocatedSize(pointer);
+  allocations++;
+  allocatedBytes += size;
+  heldBytes += size;
+  peakBytes = max(peakBytes, heldBytes);
+}
+
+static void countRelease(size_t size)
+{
+  if (isCounted())
+  {
+    heldBytes -= size;
+  }
+}
+
+extern "C"
+{
+  void *__real_malloc(size_t size);
+  void *__real_calloc(size_t count, size_t size);
+  void *__real_realloc(void *pointer, size_t size);
+  void __real_free(void *pointer);
+
+  void *__wrap_malloc(size_t size)
+  {
+    void *pointer = __real_malloc(size);
+    countAllocation(pointer);
+    return pointer;
+  }
+
+  void *__wrap_calloc(size_t count, size_t size)
+  {
+    void *pointer = __real_calloc(count, size);
+    countAllocation(pointer);
+    return pointer;
+  }
+
+  // Growing a String reallocates, every call is counted as churn even if the block stays in place
+  void *__wrap_realloc(void *pointer, size_t size)
+  {
+    size_t before = pointer != nullptr ? allocatedSize(pointer) : 0;
+    void *moved = __real_realloc(pointer, size);
+    if (moved != nullptr || size == 0)
+    {
+      countRelease(before);
+      countAllocation(moved);
+    }
+    return moved;
+  }
+
+  void __wrap_free(void *pointer)
+  {
+    if (pointer != nullptr)
+    {
+      countRelease(allocatedSize(pointer));
+    }
+    __real_free(pointer);
+  }
+}
+
+// The C++ runtime is a prebuilt library whose calls to malloc are not wrapped, new and delete are routed through the wrappers here
+void *operator new(size_t size)
+{
+  void *pointer = __wrap_malloc(size ? size : 1);
+  if (pointer == nullptr)
+  {
+    abort();
+  }
+  return pointer;
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+  return __wrap_malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+  return __wrap_malloc(size ? size : 1);
+}
+
+void operator delete(void *pointer) noexcept
+{
+  __wrap_free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept
+{
+  __wrap_free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+  __wrap_free(pointer);
+}
+
+void operator delete[](void *pointer, size_t) noexcept
+{
+  __wrap_free(pointer);
+}
+
+static uint64_t nanoseconds()
+{
+#ifdef ARDUINO_ARCH_ESP32
+  return esp_timer_get_time() * 1000ULL;
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+#ifdef ARDUINO_ARCH_ESP32
+typedef uint32_t Cycles; // wraps after 17 s at 240 MHz, a benchmark has to stay below that
+static Cycles cycleCount()
+{
+  return ESP.getCycleCount();
+}
+#elif defined(__x86_64__) || defined(__i386__)
+typedef uint64_t Cycles;
+static Cycles cycleCount()
+{
+  return __rdtsc();
+}
+#else
+typedef uint64_t Cycles;
+static Cycles cycleCount()
+{
+  return 0;
+}
+#endif
+
+static uint32_t freeHeap()
+{
+#ifdef ARDUINO_ARCH_ESP32
+  return heap_caps_get_free_size(MALLOC_CAP_8BIT);
+#else
+  return ESP.getFreeHeap();
+#endif
+}
+
+static uint32_t largestFreeBlock()
+{
+#ifdef ARDUINO_ARCH_ESP32
+  return heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+#else
+  return ESP.getFreeHeap();
+#endif
+}
+
+void beginBenchmarks()
+{
+#ifdef ARDUINO_ARCH_ESP32
+  Serial.println("{\"platform\":\"esp32\",\"cpu_mhz\":" + String(getCpuFrequencyMhz()) + ",\"free_heap\":" + String(freeHeap()) + "}");
+#else
+  Serial.println("{\"platform\":\"native\",\"cpu_mhz\":0,\"free_heap\":" + String(freeHeap()) + "}");
+#endif
+}
+
+BenchmarkResult runBenchmark(const char *name, BenchmarkFunction function, uint32_t iterations)
+{
+  // The first call fills caches and lazily created buffers, which every later interval gets for free
+  function();
+
+  countedTask = xTaskGetCurrentTaskHandle();
+  allocations = 0;
+  allocatedBytes = 0;
+  heldBytes = 0;
+  peakBytes = 0;
+  counting = true;
+
+  Cycles startCycles = cycleCount();
+  uint64_t start = nanoseconds();
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    function();
+  }
+  uint64_t elapsed = nanoseconds() - start;
+  Cycles elapsedCycles = cycleCount() - startCycles;
+  counting = false;
+
+  BenchmarkResult result;
+  result.name = name;
+  result.iterations = iterations;
+  result.nanoseconds = (float)elapsed / iterations;
+  result.cycles = (float)elapsedCycles / iterations;
+  result.allocations = (float)allocations / iterations;
+  result.allocatedBytes = (float)allocatedBytes / iterations;
+  result.peakBytes = peakBytes;
+  result.leakedBytes = heldBytes;
+  result.freeHeap = freeHeap();
+  result.largestFreeBlock = largestFreeBlock();
+
+  Serial.println("{\"benchmark\":\"" + String(name) + "\",\"iterations\":" + String(iterations) +
+                 ",\"ns\":" + String(result.nanoseconds, 1) + ",\"cycles\":" + String(result.cycles, 1) +
+                 ",\"allocations\":" + String(result.allocations, 2) + ",\"allocated_bytes\":" + String(result.allocatedBytes, 1) +
+                 ",\"peak_bytes\":" + String(result.peakBytes) + ",\"leaked_bytes\":" + String(result.leakedBytes) +
+                 ",\"free_heap\":" + String(result.freeHeap) + ",\"largest_free_block\":" + String(result.largestFreeBlock) + "}");
+  return result;
+}
+
+void endBenchmarks()
+{
+  Serial.println("{\"done\":true}");
+}
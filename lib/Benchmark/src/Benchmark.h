@@ -0,0 +1,34 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Micro-benchmarks of the code that runs every interval, built by the bench environments of sender and gateway.
+// Every benchmark prints one JSON line with the time, CPU cycles and heap allocations per iteration, so two runs can be compared.
+// Allocations are counted by wrapping malloc, calloc, realloc and free at link time, which the bench environments do with
+// -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free. Only allocations of the task that runs the benchmark are counted.
+#define BENCHMARK_ITERATIONS 1000
+
+typedef struct
+{
+  const char *name;
+  uint32_t iterations;
+  float nanoseconds;    // per iteration
+  float cycles;         // per iteration, 0 if the CPU has no cycle counter
+  float allocations;    // per iteration, reallocations count as allocations
+  float allocatedBytes; // per iteration
+  uint32_t peakBytes;   // most heap held by the benchmark at the same time
+  int32_t leakedBytes;  // still held after the last iteration
+  uint32_t freeHeap;    // after the benchmark
+  uint32_t largestFreeBlock;
+} BenchmarkResult;
+
+typedef void (*BenchmarkFunction)();
+
+// Prints the platform line that starts the output
+void beginBenchmarks();
+
+// Runs function once to warm up, then iterations times, and prints the result
+BenchmarkResult runBenchmark(const char *name, BenchmarkFunction function, uint32_t iterations = BENCHMARK_ITERATIONS);
+
+// Prints the line that ends the output, tools stop reading there
+void endBenchmarks();
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+"""Compares two benchmark runs of the bench environments.
+
+Reads the JSON lines the benchmarks print, everything else in the logs is
+skipped, so a captured serial console works as well:
+
+    pio run -e native_bench -t exec | tee new.log
+    ../lib/Benchmark/tools/compare.py base.log new.log --threshold 10
+
+Exits with 1 if a benchmark got slower by more than the threshold in percent
+or allocates more often or more bytes than before.
+"""
+
+import argparse
+import json
+import sys
+
+METRICS = (("ns", "ns"), ("cycles", "cycles"), ("allocations", "allocs"), ("allocated_bytes", "bytes"),
+           ("peak_bytes", "peak"), ("leaked_bytes", "leaked"))
+
+
+def read_results(path):
+    results = {}
+    platform = None
+    with open(path, errors="replace") as log:
+        for line in log:
+            line = line.strip()
+            if not line.startswith("{"):
+                continue
+            try:
+                entry = json.loads(line)
+            except ValueError:
+                continue
+            if "platform" in entry:
+                platform = entry["platform"]
+            elif "benchmark" in entry:
+                results[entry["benchmark"]] = entry
+    return platform, results
+
+
+def change(base, new):
+    if base == 0:
+        return 0.0 if new == 0 else float("inf")
+    return 100.0 * (new - base) / base
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("base", help="output of the reference run")
+    parser.add_argument("new", help="output of the run to check")
+    parser.add_argument("--threshold", type=float, default=10.0, help="allowed slowdown in percent")
+    args = parser.parse_args()
+
+    base_platform, base = read_results(args.base)
+    new_platform, new = read_results(args.new)
+    if base_platform != new_platform:
+        print("Warning: comparing %s with %s" % (base_platform, new_platform))
+
+    regressions = []
+    print("%-24s" % "benchmark" + "".join("%22s" % label for _, label in METRICS))
+    for name in sorted(set(base) | set(new)):
+        if name not in base or name not in new:
+            print("%-24s only in %s" % (name, "base" if name in base else "new"))
+            continue
+        cells = []
+        for key, label in METRICS:
+            old, current = base[name].get(key, 0), new[name].get(key, 0)
+            cells.append("%22s" % ("%g (%+.0f%%)" % (current, change(old, current)) if old != current else "%g" % current))
+        print("%-24s" % name + "".join(cells))
+
+        if change(base[name]["ns"], new[name]["ns"]) > args.threshold:
+            regressions.append("%s is %.0f%% slower" % (name, change(base[name]["ns"], new[name]["ns"])))
+        for key in ("allocations", "allocated_bytes", "leaked_bytes"):
+            if new[name][key] > base[name][key]:
+                regressions.append("%s: %s went from %g to %g" % (name, key, base[name][key], new[name][key]))
+
+    for regression in regressions:
+        print("Regression: " + regression)
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,152 @@
+#include "Metrics.h"
+
+typedef struct
+{
+  const char *name;
+  TaskHandle_t task;
+} TaskMetric;
+
+static portMUX_TYPE metricsMux = portMUX_INITIALIZER_UNLOCKED;
+static TaskMetric tasks[METRICS_MAX_TASKS];
+static uint8_t taskCount = 0;
+
+void observeHistogram(MetricHistogram &histogram, float value)
+{
+  uint8_t bucket = 0;
+  while (bucket < histogram.bucketCount && value > histogram.bounds[bucket])
+  {
+    bucket++;
+  }
+
+  portENTER_CRITICAL(&metricsMux);
+  histogram.counts[bucket]++;
+  histogram.count++;
+  histogram.sum += value;
+  portEXIT_CRITICAL(&metricsMux);
+}
+
+void observeSince(MetricHistogram &histogram, unsigned long start)
+{
+  observeHistogram(histogram, (micros() - start) / 1000000.0f);
+}
+
+void registerTaskMetrics(const char *name, TaskHandle_t task)
+{
+  if (task == NULL)
+  {
+    task = xTaskGetCurrentTaskHandle();
+  }
+
+  portENTER_CRITICAL(&metricsMux);
+  if (taskCount < METRICS_MAX_TASKS)
+  {
+    tasks[taskCount].name = name;
+    tasks[taskCount].task = task;
+    taskCount++;
+  }
+  portEXIT_CRITICAL(&metricsMux);
+}
+
+// Counters need 10 digits, the float bounds of the buckets are printed with the 6 digits they hold, e.g. 0.1 instead of 0.100000001
+static void appendNumber(String &out, double value, int digits = 10)
+{
+  char number[24];
+  snprintf(number, sizeof(number), "%.*g", digits, value);
+  out += number;
+}
+
+void writeHeader(String &out, const char *name, const char *type, const char *help)
+{
+  out += "# HELP ";
+  out += name;
+  out += ' ';
+  out += help;
+  out += "\n# TYPE ";
+  out += name;
+  out += ' ';
+  out += type;
+  out += '\n';
+}
+
+void writeSample(String &out, const char *name, const char *labels, double value)
+{
+  out += name;
+  if (labels != NULL && labels[0] != '\0')
+  {
+    out += '{';
+    out += labels;
+    out += '}';
+  }
+  out += ' ';
+  appendNumber(out, value);
+  out += '\n';
+}
+
+void writeCounter(String &out, const char *name, const char *help, uint32_t value)
+{
+  writeHeader(out, name, "counter", help);
+  writeSample(out, name, NULL, value);
+}
+
+void writeGauge(String &out, const char *name, const char *help, double value)
+{
+  writeHeader(out, name, "gauge", help);
+  writeSample(out, name, NULL, value);
+}
+
+void writeHistogram(String &out, MetricHistogram &histogram)
+{
+  // Copied first, so the buckets, count and sum of the scrape belong together
+  uint32_t counts[METRICS_MAX_BUCKETS + 1];
+  uint32_t count;
+  double sum;
+  portENTER_CRITICAL(&metricsMux);
+  memcpy(counts, histogram.counts, sizeof(counts));
+  count = histogram.count;
+  sum = histogram.sum;
+  portEXIT_CRITICAL(&metricsMux);
+
+  writeHeader(out, histogram.name, "histogram", histogram.help);
+  uint32_t cumulative = 0;
+  for (uint8_t i = 0; i <= histogram.bucketCount; i++)
+  {
+    cumulative += counts[i];
+    out += histogram.name;
+    out += "_bucket{le=\"";
+    if (i < histogram.bucketCount)
+    {
+      appendNumber(out, histogram.bounds[i], 6);
+    }
+    else
+    {
+      out += "+Inf";
+    }
+    out += "\"} ";
+    appendNumber(out, cumulative);
+    out += '\n';
+  }
+  out += histogram.name;
+  out += "_sum ";
+  appendNumber(out, sum);
+  out += '\n';
+  out += histogram.name;
+  out += "_count ";
+  appendNumber(out, count);
+  out += '\n';
+}
+
+void writeSystemMetrics(String &out)
+{
+  writeGauge(out, "esp_free_heap_bytes", "Free heap.", ESP.getFreeHeap());
+  writeGauge(out, "esp_min_free_heap_bytes", "Lowest free heap since start.", ESP.getMinFreeHeap());
+  writeGauge(out, "esp_largest_free_block_bytes", "Largest block that can be allocated, shows fragmentation.", ESP.getMaxAllocHeap());
+  writeGauge(out, "esp_uptime_seconds", "Time since start.", millis() / 1000.0);
+
+  writeHeader(out, "esp_task_stack_free_bytes", "gauge", "Stack that was never used by the task, its high-water mark.");
+  char labels[40];
+  for (uint8_t i = 0; i < taskCount; i++)
+  {
+    snprintf(labels, sizeof(labels), "task=\"%s\"", tasks[i].name);
+    writeSample(out, "esp_task_stack_free_bytes", labels, uxTaskGetStackHighWaterMark(tasks[i].task));
+  }
+}
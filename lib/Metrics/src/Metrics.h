@@ -0,0 +1,39 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Counters, gauges and histograms for the /metrics endpoint in the Prometheus text format.
+// Observing a histogram takes a short critical section, so it can sit in the hot path of any task, but not in an interrupt.
+// Counters are plain uint32_t of the module that owns them, they are only formatted here.
+#define METRICS_MAX_BUCKETS 12
+#define METRICS_MAX_TASKS 12
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+typedef struct
+{
+  const char *name; // base unit in the name, e.g. "sender_encode_seconds"
+  const char *help;
+  const float *bounds; // upper bounds of the buckets in ascending order, +Inf is added
+  uint8_t bucketCount;
+  uint32_t counts[METRICS_MAX_BUCKETS + 1]; // per bucket, not cumulative, the last one is +Inf
+  uint32_t count;
+  double sum;
+} MetricHistogram;
+
+void observeHistogram(MetricHistogram &histogram, float value);
+
+// Seconds since start, taken with micros()
+void observeSince(MetricHistogram &histogram, unsigned long start);
+
+// Stack high-water marks are reported for registered tasks, the one calling it if task is NULL
+void registerTaskMetrics(const char *name, TaskHandle_t task = NULL);
+
+// Each function appends one metric family, labels are given without braces, e.g. "node=\"1a2b\""
+void writeCounter(String &out, const char *name, const char *help, uint32_t value);
+void writeGauge(String &out, const char *name, const char *help, double value);
+void writeHeader(String &out, const char *name, const char *type, const char *help);
+void writeSample(String &out, const char *name, const char *labels, double value);
+void writeHistogram(String &out, MetricHistogram &histogram);
+
+// Heap, uptime and the stacks of the registered tasks
+void writeSystemMetrics(String &out);
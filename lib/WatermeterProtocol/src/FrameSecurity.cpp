@@ -0,0 +1,288 @@
+#include "FrameSecurity.h"
+#include "WatermeterFrame.h"
+#include <string.h>
+
+#define SECURITY_BLOCK_LENGTH 16
+#define SECURITY_HEADER_LENGTH 6 // readable, the gateway needs node and sequence number before it can decrypt
+
+// First byte of the blocks that derive the keys and of the blocks in front of the data, so no block is used twice
+#define SECURITY_LABEL_CIPHER 0x01
+#define SECURITY_LABEL_MAC 0x02
+#define SECURITY_LABEL_COUNTER 0x10
+#define SECURITY_LABEL_TAG 0x20
+
+typedef enum
+{
+  DIRECTION_UPLINK,
+  DIRECTION_DOWNLINK
+} FrameDirection;
+
+static void deriveKey(mbedtls_aes_context &master, uint8_t label, mbedtls_aes_context &derived)
+{
+  uint8_t block[SECURITY_BLOCK_LENGTH] = {label};
+  uint8_t key[FRAME_KEY_LENGTH];
+  mbedtls_aes_crypt_ecb(&master, MBEDTLS_AES_ENCRYPT, block, key);
+  mbedtls_aes_init(&derived);
+  mbedtls_aes_setkey_enc(&derived, key, 8 * FRAME_KEY_LENGTH);
+  memset(key, 0, sizeof(key));
+}
+
+// Doubling in GF(2^128) as the CMAC subkeys need it
+static void doubleBlock(const uint8_t *in, uint8_t *out)
+{
+  uint8_t carry = in[0] >> 7;
+  for (uint8_t i = 0; i < SECURITY_BLOCK_LENGTH - 1; i++)
+  {
+    out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+  }
+  out[SECURITY_BLOCK_LENGTH - 1] = (in[SECURITY_BLOCK_LENGTH - 1] << 1) ^ (carry ? 0x87 : 0);
+}
+
+bool hasFrameKey(const uint8_t *key)
+{
+  uint8_t bits = 0;
+  for (uint8_t i = 0; i < FRAME_KEY_LENGTH; i++)
+  {
+    bits |= key[i];
+  }
+  return bits != 0;
+}
+
+void setupFrameKey(FrameKey &frameKey, const uint8_t *key)
+{
+  mbedtls_aes_context master;
+  mbedtls_aes_init(&master);
+  mbedtls_aes_setkey_enc(&master, key, 8 * FRAME_KEY_LENGTH);
+  deriveKey(master, SECURITY_LABEL_CIPHER, frameKey.cipher);
+  deriveKey(master, SECURITY_LABEL_MAC, frameKey.mac);
+  mbedtls_aes_free(&master);
+
+  uint8_t zero[SECURITY_BLOCK_LENGTH] = {};
+  uint8_t encrypted[SECURITY_BLOCK_LENGTH];
+  mbedtls_aes_crypt_ecb(&frameKey.mac, MBEDTLS_AES_ENCRYPT, zero, encrypted);
+  doubleBlock(encrypted, frameKey.subkey1);
+  doubleBlock(frameKey.subkey1, frameKey.subkey2);
+}
+
+static int hexDigit(char c)
+{
+  if (c >= '0' && c <= '9')
+  {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f')
+  {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F')
+  {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+bool parseFrameKey(const char *text, uint8_t *key)
+{
+  size_t length = strlen(text);
+  if (length == 0)
+  {
+    memset(key, 0, FRAME_KEY_LENGTH);
+    return true;
+  }
+  if (length != 2 * FRAME_KEY_LENGTH)
+  {
+    return false;
+  }
+
+  uint8_t parsed[FRAME_KEY_LENGTH];
+  for (uint8_t i = 0; i < FRAME_KEY_LENGTH; i++)
+  {
+    int high = hexDigit(text[2 * i]);
+    int low = hexDigit(text[2 * i + 1]);
+    if (high < 0 || low < 0)
+    {
+      return false;
+    }
+    parsed[i] = (high << 4) | low;
+  }
+  memcpy(key, parsed, FRAME_KEY_LENGTH);
+  return true;
+}
+
+void formatFrameKey(const uint8_t *key, char *text)
+{
+  static const char digits[] = "0123456789abcdef";
+  if (!hasFrameKey(key))
+  {
+    text[0] = '\0';
+    return;
+  }
+  for (uint8_t i = 0; i < FRAME_KEY_LENGTH; i++)
+  {
+    text[2 * i] = digits[key[i] >> 4];
+    text[2 * i + 1] = digits[key[i] & 0x0F];
+  }
+  text[2 * FRAME_KEY_LENGTH] = '\0';
+}
+
+bool isSecuredFrame(const uint8_t *buffer, size_t length)
+{
+  return length >= SECURITY_HEADER_LENGTH && (frameType(buffer) & FRAME_TYPE_SECURED);
+}
+
+// Direction, node and counter make every block of the key stream and every tag unique
+static void fillBlock(uint8_t *block, uint8_t label, FrameDirection direction, uint16_t node, uint32_t counter)
+{
+  memset(block, 0, SECURITY_BLOCK_LENGTH);
+  block[0] = label;
+  block[1] = direction;
+  block[2] = node & 0xFF;
+  block[3] = node >> 8;
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    block[4 + i] = (counter >> (8 * i)) & 0xFF;
+  }
+}
+
+// The body is encrypted with the key stream from block 0 of the counter block on, the last two bytes count the blocks
+static void cryptBody(FrameKey &frameKey, FrameDirection direction, uint16_t node, uint32_t counter, uint8_t *data, size_t length)
+{
+  uint8_t counterBlock[SECURITY_BLOCK_LENGTH];
+  uint8_t stream[SECURITY_BLOCK_LENGTH];
+  size_t offset = 0;
+  fillBlock(counterBlock, SECURITY_LABEL_COUNTER, direction, node, counter);
+  mbedtls_aes_crypt_ctr(&frameKey.cipher, length, &offset, counterBlock, stream, data, data);
+  memset(stream, 0, sizeof(stream));
+}
+
+static void xorBlock(uint8_t *block, const uint8_t *data, size_t length)
+{
+  for (size_t i = 0; i < length; i++)
+  {
+    block[i] ^= data[i];
+  }
+}
+
+// CMAC of a first block with direction, node, counter and length, followed by the frame. The retry of the header is
+// left out, a retransmission changes it without a new tag.
+static void computeTag(FrameKey &frameKey, FrameDirection direction, uint32_t counter, const uint8_t *frame, size_t length, uint8_t *tag)
+{
+  uint8_t state[SECURITY_BLOCK_LENGTH];
+  fillBlock(state, SECURITY_LABEL_TAG, direction, frameNode(frame), counter);
+  state[SECURITY_BLOCK_LENGTH - 1] = length;
+  mbedtls_aes_crypt_ecb(&frameKey.mac, MBEDTLS_AES_ENCRYPT, state, state);
+
+  uint8_t header[SECURITY_HEADER_LENGTH];
+  memcpy(header, frame, SECURITY_HEADER_LENGTH);
+  header[1] &= ~FRAME_RETRY_MASK;
+
+  // The header is short, so the first block takes the header and the start of the body
+  size_t position = 0;
+  while (length - position > SECURITY_BLOCK_LENGTH)
+  {
+    for (uint8_t i = 0; i < SECURITY_BLOCK_LENGTH; i++, position++)
+    {
+      state[i] ^= position < SECURITY_HEADER_LENGTH ? header[position] : frame[position];
+    }
+    mbedtls_aes_crypt_ecb(&frameKey.mac, MBEDTLS_AES_ENCRYPT, state, state);
+  }
+
+  // A complete last block is mixed with the first subkey, a padded one with the second
+  size_t remaining = length - position;
+  for (uint8_t i = 0; i < remaining; i++, position++)
+  {
+    state[i] ^= position < SECURITY_HEADER_LENGTH ? header[position] : frame[position];
+  }
+  if (remaining == SECURITY_BLOCK_LENGTH)
+  {
+    xorBlock(state, frameKey.subkey1, SECURITY_BLOCK_LENGTH);
+  }
+  else
+  {
+    state[remaining] ^= 0x80;
+    xorBlock(state, frameKey.subkey2, SECURITY_BLOCK_LENGTH);
+  }
+  mbedtls_aes_crypt_ecb(&frameKey.mac, MBEDTLS_AES_ENCRYPT, state, state);
+  memcpy(tag, state, FRAME_TAG_LENGTH);
+}
+
+// Takes the same time for every tag, so a forged frame does not learn how many bytes matched
+static bool sameTag(const uint8_t *a, const uint8_t *b)
+{
+  uint8_t difference = 0;
+  for (uint8_t i = 0; i < FRAME_TAG_LENGTH; i++)
+  {
+    difference |= a[i] ^ b[i];
+  }
+  return difference == 0;
+}
+
+size_t sealFrame(FrameKey &frameKey, uint16_t epoch, uint8_t *buffer, size_t length, size_t size)
+{
+  if (length < SECURITY_HEADER_LENGTH || length + FRAME_SECURED_OVERHEAD > size || isSecuredFrame(buffer, length))
+  {
+    return 0;
+  }
+
+  uint32_t counter = frameCounter(epoch, frameSequence(buffer));
+  buffer[0] |= FRAME_TYPE_SECURED;
+  cryptBody(frameKey, DIRECTION_UPLINK, frameNode(buffer), counter, buffer + SECURITY_HEADER_LENGTH, length - SECURITY_HEADER_LENGTH);
+  buffer[length++] = epoch & 0xFF;
+  buffer[length++] = epoch >> 8;
+  computeTag(frameKey, DIRECTION_UPLINK, counter, buffer, length, buffer + length);
+  return length + FRAME_TAG_LENGTH;
+}
+
+bool openFrame(FrameKey &frameKey, uint8_t *buffer, size_t &length, uint32_t &counter)
+{
+  if (length < SECURITY_HEADER_LENGTH + FRAME_SECURED_OVERHEAD || !isSecuredFrame(buffer, length))
+  {
+    return false;
+  }
+
+  size_t tagged = length - FRAME_TAG_LENGTH;
+  uint16_t epoch = buffer[tagged - 2] | (buffer[tagged - 1] << 8);
+  uint32_t frameCount = frameCounter(epoch, frameSequence(buffer));
+  uint8_t tag[FRAME_TAG_LENGTH];
+  computeTag(frameKey, DIRECTION_UPLINK, frameCount, buffer, tagged, tag);
+  if (!sameTag(tag, buffer + tagged))
+  {
+    return false;
+  }
+
+  length = tagged - FRAME_EPOCH_LENGTH;
+  cryptBody(frameKey, DIRECTION_UPLINK, frameNode(buffer), frameCount, buffer + SECURITY_HEADER_LENGTH, length - SECURITY_HEADER_LENGTH);
+  buffer[0] &= ~FRAME_TYPE_SECURED;
+  counter = frameCount;
+  return true;
+}
+
+size_t signLink(FrameKey &frameKey, uint32_t counter, uint8_t *buffer, size_t length, size_t size)
+{
+  if (length < SECURITY_HEADER_LENGTH || length + FRAME_TAG_LENGTH > size || isSecuredFrame(buffer, length))
+  {
+    return 0;
+  }
+  buffer[0] |= FRAME_TYPE_SECURED;
+  computeTag(frameKey, DIRECTION_DOWNLINK, counter, buffer, length, buffer + length);
+  return length + FRAME_TAG_LENGTH;
+}
+
+bool verifyLink(FrameKey &frameKey, uint32_t counter, uint8_t *buffer, size_t &length)
+{
+  if (length < SECURITY_HEADER_LENGTH + FRAME_TAG_LENGTH || !isSecuredFrame(buffer, length))
+  {
+    return false;
+  }
+
+  size_t tagged = length - FRAME_TAG_LENGTH;
+  uint8_t tag[FRAME_TAG_LENGTH];
+  computeTag(frameKey, DIRECTION_DOWNLINK, counter, buffer, tagged, tag);
+  if (!sameTag(tag, buffer + tagged))
+  {
+    return false;
+  }
+  length = tagged;
+  buffer[0] &= ~FRAME_TYPE_SECURED;
+  return true;
+}
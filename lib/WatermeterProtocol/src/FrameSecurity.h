@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mbedtls/aes.h>
+
+// Encryption and authentication of frames with a key shared by the senders and the gateway.
+// The body of an uplink is encrypted with AES-CTR, the header stays readable, so the gateway finds the node and the
+// sequence number before it decrypts. A CMAC tag truncated to FRAME_TAG_LENGTH bytes covers header, body and epoch.
+// Link frames carry nothing secret, they are only authenticated, bound to the counter of the uplink they answer.
+// The frame counter is the epoch of the sender in the high and the sequence number in the low 16 bits, it is the nonce
+// of AES-CTR and must never repeat with the same key. mbedtls runs on the AES engine of the ESP32.
+// The layout is described in lib/WatermeterProtocol/README.md, keep both in sync.
+
+#define FRAME_KEY_LENGTH 16 // AES-128
+#define FRAME_KEY_TEXT_LENGTH (2 * FRAME_KEY_LENGTH + 1)
+#define FRAME_TAG_LENGTH 4
+#define FRAME_EPOCH_LENGTH 2
+#define FRAME_SECURED_OVERHEAD (FRAME_EPOCH_LENGTH + FRAME_TAG_LENGTH) // uplinks, link frames only add the tag
+#define FRAME_TYPE_SECURED 0x8 // bit of the frame type, set while the body is encrypted
+
+// Keys derived from the shared key, one for AES-CTR and one for the CMAC with its two subkeys
+typedef struct
+{
+  mbedtls_aes_context cipher;
+  mbedtls_aes_context mac;
+  uint8_t subkey1[16];
+  uint8_t subkey2[16];
+} FrameKey;
+
+// A key of all zeros means plain frames
+bool hasFrameKey(const uint8_t *key);
+void setupFrameKey(FrameKey &frameKey, const uint8_t *key);
+
+// 32 hex digits, an empty text is no key. Returns false for anything else.
+bool parseFrameKey(const char *text, uint8_t *key);
+// Empty text for no key
+void formatFrameKey(const uint8_t *key, char *text);
+
+inline uint32_t frameCounter(uint16_t epoch, uint16_t sequence)
+{
+  return ((uint32_t)epoch << 16) | sequence;
+}
+
+bool isSecuredFrame(const uint8_t *buffer, size_t length);
+
+// Encrypts the body of the uplink in buffer and appends epoch and tag after setting the flags of the header, only the
+// retry may change afterwards. Returns the new length or 0 if it does not fit into size.
+size_t sealFrame(FrameKey &frameKey, uint16_t epoch, uint8_t *buffer, size_t length, size_t size);
+
+// Checks the tag and decrypts the uplink in place, length then excludes epoch and tag and the frame decodes like a plain one.
+// counter returns the frame counter of the sender. Returns false and leaves the frame as it was if the tag does not match.
+bool openFrame(FrameKey &frameKey, uint8_t *buffer, size_t &length, uint32_t &counter);
+
+// counter is the one of the uplink the link frame answers
+size_t signLink(FrameKey &frameKey, uint32_t counter, uint8_t *buffer, size_t length, size_t size);
+bool verifyLink(FrameKey &frameKey, uint32_t counter, uint8_t *buffer, size_t &length);
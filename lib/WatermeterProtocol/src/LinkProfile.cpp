@@ -0,0 +1,159 @@
+#include "LinkProfile.h"
+#include "WatermeterFrame.h"
+#include <math.h>
+
+const LinkProfile defaultLinkProfile = {7, 125000, 5, LINK_MAX_TX_POWER};
+
+// Bandwidths in the order of the SX127x register value, which is also the code on air
+static const uint32_t bandwidths[] = {7800, 10400, 15600, 20800, 31250, 41700, 62500, 125000, 250000, 500000};
+#define BANDWIDTH_COUNT (sizeof(bandwidths) / sizeof(bandwidths[0]))
+
+// Data rates from the most robust to the fastest, 250 kHz is the widest channel allowed in the 868 MHz band
+typedef struct
+{
+  uint8_t spreadingFactor;
+  uint32_t bandwidth;
+} DataRate;
+
+static const DataRate dataRates[] = {{12, 125000}, {11, 125000}, {10, 125000}, {9, 125000}, {8, 125000}, {7, 125000}, {7, 250000}};
+#define DATA_RATE_COUNT (sizeof(dataRates) / sizeof(dataRates[0]))
+
+// Typical uplink used to compare the airtime of two profiles
+#define REFERENCE_FRAME_LENGTH 20
+
+// Power is changed in steps of 3 dB, so measurement noise does not change the profile on every frame
+#define TX_POWER_STEP 3
+
+static int bandwidthCode(uint32_t bandwidth)
+{
+  for (size_t i = 0; i < BANDWIDTH_COUNT; i++)
+  {
+    if (bandwidths[i] == bandwidth)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Lowest SNR the SX127x demodulates at the given spreading factor
+static float requiredSnr(uint8_t spreadingFactor)
+{
+  return -7.5 - 2.5 * (spreadingFactor - 7);
+}
+
+bool isValidProfile(const LinkProfile &profile)
+{
+  return profile.spreadingFactor >= 7 && profile.spreadingFactor <= 12 && bandwidthCode(profile.bandwidth) >= 0 &&
+         profile.codingRate >= 5 && profile.codingRate <= 8 && profile.txPower >= LINK_MIN_TX_POWER && profile.txPower <= LINK_MAX_TX_POWER;
+}
+
+bool sameProfile(const LinkProfile &a, const LinkProfile &b)
+{
+  return a.spreadingFactor == b.spreadingFactor && a.bandwidth == b.bandwidth && a.codingRate == b.codingRate && a.txPower == b.txPower;
+}
+
+bool isMoreRobust(const LinkProfile &a, const LinkProfile &b)
+{
+  uint32_t airtimeA = frameAirtime(REFERENCE_FRAME_LENGTH, a);
+  uint32_t airtimeB = frameAirtime(REFERENCE_FRAME_LENGTH, b);
+  return airtimeA > airtimeB || (airtimeA == airtimeB && a.txPower > b.txPower);
+}
+
+uint32_t frameAirtime(size_t length, const LinkProfile &profile)
+{
+  // Semtech AN1200.13, low data rate optimization is enabled above 16 ms per symbol as Semtech recommends. The LoRa library
+  // compares whole ms and leaves it off at 16.384 ms (SF11 at 125 kHz, SF12 at 250 kHz), the airtime there is an upper bound.
+  double symbol = (double)(1UL << profile.spreadingFactor) / profile.bandwidth;
+  int lowDataRate = symbol > 0.016 ? 1 : 0;
+  double preamble = (LINK_PREAMBLE_LENGTH + 4.25) * symbol;
+
+  int numerator = 8 * (int)length - 4 * profile.spreadingFactor + 28;
+  int denominator = 4 * (profile.spreadingFactor - 2 * lowDataRate);
+  int blocks = numerator > 0 ? (numerator + denominator - 1) / denominator : 0;
+  double payload = (8 + blocks * profile.codingRate) * symbol;
+
+  return (uint32_t)((preamble + payload) * 1e6 + 0.5);
+}
+
+// SNR the frame would have had at 125 kHz with full power
+static float referenceSnr(float snr, const LinkProfile &current)
+{
+  return snr + (LINK_MAX_TX_POWER - current.txPower) + 10 * log10f(current.bandwidth / 125000.0f);
+}
+
+// Returns false if the data rate does not reach the margin even with full power
+static bool fitPower(float reference, const DataRate &rate, float margin, LinkProfile &profile)
+{
+  float headroom = reference - 10 * log10f(rate.bandwidth / 125000.0f) - requiredSnr(rate.spreadingFactor) - margin;
+  if (headroom < 0)
+  {
+    return false;
+  }
+  int reduction = (int)(headroom / TX_POWER_STEP) * TX_POWER_STEP;
+  int power = LINK_MAX_TX_POWER - reduction;
+  profile.spreadingFactor = rate.spreadingFactor;
+  profile.bandwidth = rate.bandwidth;
+  profile.txPower = power < LINK_MIN_TX_POWER ? LINK_MIN_TX_POWER : power;
+  return true;
+}
+
+LinkProfile recommendProfile(float snr, const LinkProfile &current, float margin)
+{
+  float reference = referenceSnr(snr, current);
+
+  LinkProfile profile = {dataRates[0].spreadingFactor, dataRates[0].bandwidth, current.codingRate, LINK_MAX_TX_POWER};
+  for (int i = DATA_RATE_COUNT - 1; i >= 0; i--)
+  {
+    if (fitPower(reference, dataRates[i], margin, profile))
+    {
+      break;
+    }
+  }
+  return profile;
+}
+
+LinkProfile recommendPower(float snr, const LinkProfile &current, float margin)
+{
+  LinkProfile profile = current;
+  profile.txPower = LINK_MAX_TX_POWER;
+  fitPower(referenceSnr(snr, current), {current.spreadingFactor, current.bandwidth}, margin, profile);
+  return profile;
+}
+
+size_t encodeLink(uint16_t sequence, uint16_t node, const LinkProfile &profile, uint8_t *buffer, size_t size)
+{
+  if (size < LINK_FRAME_LENGTH || !isValidProfile(profile))
+  {
+    return 0;
+  }
+
+  buffer[0] = (FRAME_PROTOCOL_VERSION << 4) | FRAME_TYPE_LINK;
+  buffer[1] = 0;
+  buffer[2] = sequence & 0xFF;
+  buffer[3] = sequence >> 8;
+  buffer[4] = node & 0xFF;
+  buffer[5] = node >> 8;
+  buffer[6] = profile.spreadingFactor;
+  buffer[7] = bandwidthCode(profile.bandwidth);
+  buffer[8] = profile.codingRate;
+  buffer[9] = (uint8_t)profile.txPower;
+  return LINK_FRAME_LENGTH;
+}
+
+bool decodeLink(const uint8_t *buffer, size_t length, uint16_t &sequence, uint16_t &node, LinkProfile &profile)
+{
+  if (length != LINK_FRAME_LENGTH || frameVersion(buffer) != FRAME_PROTOCOL_VERSION || frameType(buffer) != FRAME_TYPE_LINK ||
+      buffer[7] >= BANDWIDTH_COUNT)
+  {
+    return false;
+  }
+
+  sequence = buffer[2] | (buffer[3] << 8);
+  node = buffer[4] | (buffer[5] << 8);
+  profile.spreadingFactor = buffer[6];
+  profile.bandwidth = bandwidths[buffer[7]];
+  profile.codingRate = buffer[8];
+  profile.txPower = (int8_t)buffer[9];
+  return isValidProfile(profile);
+}
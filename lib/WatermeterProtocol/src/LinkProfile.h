@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Radio settings of the link between sender and gateway.
+// In adaptive mode the gateway answers every uplink with a link frame that carries the profile for the next uplink.
+
+#define LINK_MIN_TX_POWER 2  // dBm
+#define LINK_MAX_TX_POWER 17 // dBm, PA_BOOST without the +20 dBm mode
+#define LINK_PREAMBLE_LENGTH 8
+#define LINK_FRAME_LENGTH 10
+
+// Both sides fall back to the default profile after this many uplink intervals without a link frame or uplink
+#define LINK_FALLBACK_MISSES 3
+
+typedef struct
+{
+  uint8_t spreadingFactor; // 7-12
+  uint32_t bandwidth;      // Hz
+  uint8_t codingRate;      // denominator of 4/x, 5-8
+  int8_t txPower;          // dBm
+} LinkProfile;
+
+// Settings of the LoRa library after begin(), used until the first link frame and as fallback
+extern const LinkProfile defaultLinkProfile;
+
+bool isValidProfile(const LinkProfile &profile);
+bool sameProfile(const LinkProfile &a, const LinkProfile &b);
+
+// True if a takes longer on air than b, or the same time with more power
+bool isMoreRobust(const LinkProfile &a, const LinkProfile &b);
+
+// Time on air in microseconds of a frame with explicit header and without CRC, like the LoRa library sends it.
+// At SF11 with 125 kHz and SF12 with 250 kHz it is an upper bound, the library leaves the low data rate optimization off.
+uint32_t frameAirtime(size_t length, const LinkProfile &profile);
+
+// Fastest profile, and the lowest power for it, that keeps margin dB above the demodulation floor.
+// snr is measured by the gateway on a frame sent with current.
+LinkProfile recommendProfile(float snr, const LinkProfile &current, float margin);
+
+// Lowest power that keeps margin dB above the demodulation floor without changing the data rate of current
+LinkProfile recommendPower(float snr, const LinkProfile &current, float margin);
+
+// sequence and node are the ones of the uplink the link frame answers
+size_t encodeLink(uint16_t sequence, uint16_t node, const LinkProfile &profile, uint8_t *buffer, size_t size);
+bool decodeLink(const uint8_t *buffer, size_t length, uint16_t &sequence, uint16_t &node, LinkProfile &profile);
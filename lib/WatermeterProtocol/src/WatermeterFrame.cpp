@@ -0,0 +1,605 @@
+#include "WatermeterFrame.h"
+#include <string.h>
+#include <stdio.h>
+
+#define FRAME_HEADER_LENGTH 6
+#define FRAME_NODE_OFFSET 4
+#define FRAME_METER_OFFSET 6 // readings and deltas only, a batch has the meter in every sample
+
+// Bounds-checked cursor over a frame buffer, a failed access sets ok to false
+typedef struct
+{
+  uint8_t *data;
+  size_t length;
+  size_t position;
+  bool ok;
+} FrameWriter;
+
+typedef struct
+{
+  const uint8_t *data;
+  size_t length;
+  size_t position;
+  bool ok;
+} FrameReader;
+
+static void putByte(FrameWriter &writer, uint8_t value)
+{
+  if (writer.position >= writer.length)
+  {
+    writer.ok = false;
+    return;
+  }
+  writer.data[writer.position++] = value;
+}
+
+static void putUInt(FrameWriter &writer, uint32_t value, int bytes)
+{
+  for (int i = 0; i < bytes; i++)
+  {
+    putByte(writer, (value >> (8 * i)) & 0xFF);
+  }
+}
+
+// Signed values are zigzag encoded so small negative deltas stay small
+static void putUnsignedVarint(FrameWriter &writer, uint32_t value)
+{
+  while (value >= 0x80)
+  {
+    putByte(writer, (value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+  putByte(writer, value);
+}
+
+static void putVarint(FrameWriter &writer, int32_t value)
+{
+  putUnsignedVarint(writer, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+}
+
+// Text fields are prefixed with their length and not null-terminated on air
+static void putText(FrameWriter &writer, const char *text, size_t maxLength)
+{
+  uint8_t textLength = strnlen(text, maxLength);
+  putByte(writer, textLength);
+  for (uint8_t i = 0; i < textLength; i++)
+  {
+    putByte(writer, text[i]);
+  }
+}
+
+static uint8_t getByte(FrameReader &reader)
+{
+  if (reader.position >= reader.length)
+  {
+    reader.ok = false;
+    return 0;
+  }
+  return reader.data[reader.position++];
+}
+
+static uint32_t getUInt(FrameReader &reader, int bytes)
+{
+  uint32_t value = 0;
+  for (int i = 0; i < bytes; i++)
+  {
+    value |= (uint32_t)getByte(reader) << (8 * i);
+  }
+  return value;
+}
+
+static uint32_t getUnsignedVarint(FrameReader &reader)
+{
+  uint32_t value = 0;
+  for (int shift = 0; shift < 35 && reader.ok; shift += 7)
+  {
+    uint8_t data = getByte(reader);
+    value |= (uint32_t)(data & 0x7F) << shift;
+    if (!(data & 0x80))
+    {
+      return value;
+    }
+  }
+  reader.ok = false;
+  return 0;
+}
+
+static int32_t getVarint(FrameReader &reader)
+{
+  uint32_t zigzag = getUnsignedVarint(reader);
+  return (int32_t)((zigzag >> 1) ^ -(zigzag & 1));
+}
+
+static void getText(FrameReader &reader, char *text, size_t maxLength)
+{
+  uint8_t textLength = getByte(reader);
+  if (textLength > maxLength)
+  {
+    reader.ok = false;
+    textLength = 0;
+  }
+  for (uint8_t i = 0; i < textLength; i++)
+  {
+    text[i] = getByte(reader);
+  }
+  text[reader.ok ? textLength : 0] = '\0';
+}
+
+// Temperature (11 bit, offset by 40 °C) and humidity (10 bit) share three bytes
+static uint32_t packClimate(int16_t temperature, uint16_t humidity)
+{
+  int32_t t = temperature + FRAME_TEMPERATURE_OFFSET;
+  t = t < 0 ? 0 : (t > 0x7FF ? 0x7FF : t);
+  uint32_t h = humidity > 0x3FF ? 0x3FF : humidity;
+  return (uint32_t)t | (h << 11);
+}
+
+static void unpackClimate(uint32_t packed, int16_t &temperature, uint16_t &humidity)
+{
+  temperature = (int16_t)(packed & 0x7FF) - FRAME_TEMPERATURE_OFFSET;
+  humidity = (packed >> 11) & 0x3FF;
+}
+
+static void putHeader(FrameWriter &writer, uint8_t type, const WatermeterReading &reading)
+{
+  putByte(writer, (FRAME_PROTOCOL_VERSION << 4) | type);
+  putByte(writer, reading.flags);
+  putUInt(writer, reading.sequence, 2);
+  putUInt(writer, reading.node, 2);
+  putByte(writer, reading.meter);
+}
+
+static void putTexts(FrameWriter &writer, const WatermeterReading &reading)
+{
+  if (reading.flags & FRAME_FLAG_HAS_RAW)
+  {
+    putText(writer, reading.raw, FRAME_MAX_RAW_LENGTH);
+  }
+  if (reading.flags & FRAME_FLAG_METER_ERROR)
+  {
+    putText(writer, reading.error, FRAME_MAX_ERROR_LENGTH);
+  }
+}
+
+static void getTexts(FrameReader &reader, WatermeterReading &reading)
+{
+  if (reading.flags & FRAME_FLAG_HAS_RAW)
+  {
+    getText(reader, reading.raw, FRAME_MAX_RAW_LENGTH);
+  }
+  if (reading.flags & FRAME_FLAG_METER_ERROR)
+  {
+    getText(reader, reading.error, FRAME_MAX_ERROR_LENGTH);
+  }
+}
+
+uint8_t frameVersion(const uint8_t *buffer)
+{
+  return buffer[0] >> 4;
+}
+
+uint8_t frameType(const uint8_t *buffer)
+{
+  return buffer[0] & 0x0F;
+}
+
+uint8_t frameFlags(const uint8_t *buffer)
+{
+  return buffer[1];
+}
+
+uint16_t frameSequence(const uint8_t *buffer)
+{
+  return buffer[2] | (buffer[3] << 8);
+}
+
+uint8_t frameRetry(const uint8_t *buffer)
+{
+  return (buffer[1] & FRAME_RETRY_MASK) >> FRAME_RETRY_SHIFT;
+}
+
+uint16_t frameNode(const uint8_t *buffer)
+{
+  return buffer[FRAME_NODE_OFFSET] | (buffer[FRAME_NODE_OFFSET + 1] << 8);
+}
+
+void formatNode(uint16_t node, char *text)
+{
+  snprintf(text, FRAME_NODE_TEXT_LENGTH, "%04x", node);
+}
+
+uint8_t frameMeter(const uint8_t *buffer, size_t length)
+{
+  if (length <= FRAME_METER_OFFSET || (frameType(buffer) != FRAME_TYPE_READING && frameType(buffer) != FRAME_TYPE_DELTA))
+  {
+    return 0;
+  }
+  // Invalid meters are rejected by the decoder, until then they must not index past the references
+  return buffer[FRAME_METER_OFFSET] < FRAME_MAX_METERS ? buffer[FRAME_METER_OFFSET] : 0;
+}
+
+// Retransmissions keep the sequence number, so the gateway can drop duplicates
+void setFrameRetry(uint8_t *buffer, uint8_t retry)
+{
+  buffer[1] = (buffer[1] & ~FRAME_RETRY_MASK) | ((retry << FRAME_RETRY_SHIFT) & FRAME_RETRY_MASK);
+}
+
+size_t encodeReading(const WatermeterReading &reading, uint8_t *buffer, size_t size)
+{
+  FrameWriter writer = {buffer, size, 0, true};
+  putHeader(writer, FRAME_TYPE_READING, reading);
+
+  if (!(reading.flags & FRAME_FLAG_METER_FAILED))
+  {
+    putUInt(writer, reading.value, 4);
+    putUInt(writer, reading.previous, 4);
+    if (reading.flags & FRAME_FLAG_HAS_RATE)
+    {
+      putUInt(writer, (uint32_t)reading.rate, 4);
+    }
+  }
+
+  if (!(reading.flags & FRAME_FLAG_SENSOR_FAILED))
+  {
+    putUInt(writer, packClimate(reading.temperature, reading.humidity), 3);
+  }
+
+  putTexts(writer, reading);
+  return writer.ok ? writer.position : 0;
+}
+
+bool canEncodeDelta(const WatermeterReading &reading, const WatermeterReading &keyframe)
+{
+  uint16_t offset = reading.sequence - keyframe.sequence;
+  if (offset == 0 || offset > 0xFF || reading.meter != keyframe.meter)
+  {
+    return false;
+  }
+
+  // Every field of the reading needs a counterpart in the keyframe
+  if (!(reading.flags & FRAME_FLAG_METER_FAILED) && (keyframe.flags & FRAME_FLAG_METER_FAILED))
+  {
+    return false;
+  }
+  if ((reading.flags & FRAME_FLAG_HAS_RATE) && !(keyframe.flags & FRAME_FLAG_HAS_RATE))
+  {
+    return false;
+  }
+  if (!(reading.flags & FRAME_FLAG_SENSOR_FAILED) && (keyframe.flags & FRAME_FLAG_SENSOR_FAILED))
+  {
+    return false;
+  }
+  return true;
+}
+
+size_t encodeDelta(const WatermeterReading &reading, const WatermeterReading &keyframe, uint8_t *buffer, size_t size)
+{
+  if (!canEncodeDelta(reading, keyframe))
+  {
+    return 0;
+  }
+
+  FrameWriter writer = {buffer, size, 0, true};
+  putHeader(writer, FRAME_TYPE_DELTA, reading);
+  putByte(writer, reading.sequence - keyframe.sequence);
+
+  if (!(reading.flags & FRAME_FLAG_METER_FAILED))
+  {
+    putVarint(writer, (int32_t)(reading.value - keyframe.value));
+    putVarint(writer, (int32_t)(reading.previous - keyframe.previous));
+    if (reading.flags & FRAME_FLAG_HAS_RATE)
+    {
+      putVarint(writer, reading.rate - keyframe.rate);
+    }
+  }
+
+  if (!(reading.flags & FRAME_FLAG_SENSOR_FAILED))
+  {
+    putVarint(writer, reading.temperature - keyframe.temperature);
+    putVarint(writer, reading.humidity - keyframe.humidity);
+  }
+
+  putTexts(writer, reading);
+  return writer.ok ? writer.position : 0;
+}
+
+size_t encodeFrame(const WatermeterReading &reading, DeltaReference &reference, uint8_t keyframeInterval, uint8_t *buffer, size_t size)
+{
+  if (reference.valid && keyframeInterval > 1 && (uint16_t)(reading.sequence - reference.keyframe.sequence) < keyframeInterval)
+  {
+    size_t length = encodeDelta(reading, reference.keyframe, buffer, size);
+    if (length)
+    {
+      return length;
+    }
+  }
+
+  size_t length = encodeReading(reading, buffer, size);
+  if (length)
+  {
+    reference.keyframe = reading;
+    reference.valid = true;
+  }
+  return length;
+}
+
+static bool decodeHeader(FrameReader &reader, WatermeterReading &reading)
+{
+  memset(&reading, 0, sizeof(reading));
+  getByte(reader);
+  reading.flags = getByte(reader) & ~(FRAME_FLAG_RX_WINDOW | FRAME_RETRY_MASK);
+  reading.sequence = getUInt(reader, 2);
+  reading.node = getUInt(reader, 2);
+  reading.meter = getByte(reader);
+  if (reading.node == FRAME_NO_NODE || reading.meter >= FRAME_MAX_METERS)
+  {
+    reader.ok = false;
+  }
+  return reader.ok;
+}
+
+bool decodeReading(const uint8_t *buffer, size_t length, WatermeterReading &reading)
+{
+  if (length < FRAME_HEADER_LENGTH || frameVersion(buffer) != FRAME_PROTOCOL_VERSION || frameType(buffer) != FRAME_TYPE_READING)
+  {
+    return false;
+  }
+
+  FrameReader reader = {buffer, length, 0, true};
+  if (!decodeHeader(reader, reading))
+  {
+    return false;
+  }
+
+  if (!(reading.flags & FRAME_FLAG_METER_FAILED))
+  {
+    reading.value = getUInt(reader, 4);
+    reading.previous = getUInt(reader, 4);
+    if (reading.flags & FRAME_FLAG_HAS_RATE)
+    {
+      reading.rate = (int32_t)getUInt(reader, 4);
+    }
+  }
+
+  if (!(reading.flags & FRAME_FLAG_SENSOR_FAILED))
+  {
+    unpackClimate(getUInt(reader, 3), reading.temperature, reading.humidity);
+  }
+
+  getTexts(reader, reading);
+  return reader.ok;
+}
+
+DecodeResult decodeFrame(const uint8_t *buffer, size_t length, DeltaReference &reference, WatermeterReading &reading)
+{
+  if (length < FRAME_HEADER_LENGTH || frameVersion(buffer) != FRAME_PROTOCOL_VERSION)
+  {
+    return DECODE_INVALID;
+  }
+
+  if (frameType(buffer) == FRAME_TYPE_READING)
+  {
+    if (!decodeReading(buffer, length, reading))
+    {
+      return DECODE_INVALID;
+    }
+    reference.keyframe = reading;
+    reference.valid = true;
+    return DECODE_OK;
+  }
+
+  if (frameType(buffer) != FRAME_TYPE_DELTA)
+  {
+    return DECODE_INVALID;
+  }
+
+  FrameReader reader = {buffer, length, 0, true};
+  if (!decodeHeader(reader, reading))
+  {
+    return DECODE_INVALID;
+  }
+  uint8_t offset = getByte(reader);
+  if (!reader.ok || offset == 0)
+  {
+    return DECODE_INVALID;
+  }
+
+  // The keyframe this delta refers to was lost or belongs to an older stream
+  const WatermeterReading &keyframe = reference.keyframe;
+  if (!reference.valid || (uint16_t)(reading.sequence - offset) != keyframe.sequence || !canEncodeDelta(reading, keyframe))
+  {
+    return DECODE_MISSING_KEYFRAME;
+  }
+
+  if (!(reading.flags & FRAME_FLAG_METER_FAILED))
+  {
+    reading.value = keyframe.value + (uint32_t)getVarint(reader);
+    reading.previous = keyframe.previous + (uint32_t)getVarint(reader);
+    if (reading.flags & FRAME_FLAG_HAS_RATE)
+    {
+      reading.rate = keyframe.rate + getVarint(reader);
+    }
+  }
+
+  if (!(reading.flags & FRAME_FLAG_SENSOR_FAILED))
+  {
+    reading.temperature = keyframe.temperature + getVarint(reader);
+    reading.humidity = keyframe.humidity + getVarint(reader);
+  }
+
+  getTexts(reader, reading);
+  return reader.ok ? DECODE_OK : DECODE_INVALID;
+}
+
+#define SAMPLE_FLAGS (FRAME_FLAG_METER_FAILED | FRAME_FLAG_METER_ERROR | FRAME_FLAG_HAS_RATE | FRAME_FLAG_SENSOR_FAILED)
+
+// Fields missing in the previous sample count as zero, so every sample can be sent as delta
+static WatermeterSample sampleReference(const WatermeterSample &sample)
+{
+  WatermeterSample reference = sample;
+  if (sample.flags & FRAME_FLAG_METER_FAILED)
+  {
+    reference.value = 0;
+    reference.previous = 0;
+  }
+  if ((sample.flags & FRAME_FLAG_METER_FAILED) || !(sample.flags & FRAME_FLAG_HAS_RATE))
+  {
+    reference.rate = 0;
+  }
+  if (sample.flags & FRAME_FLAG_SENSOR_FAILED)
+  {
+    reference.temperature = 0;
+    reference.humidity = 0;
+  }
+  return reference;
+}
+
+size_t encodeBatch(uint16_t sequence, uint16_t node, const WatermeterSample *samples, uint8_t count, uint32_t now, uint8_t *buffer, size_t size, uint8_t &encoded)
+{
+  FrameWriter writer = {buffer, size, 0, true};
+  putByte(writer, (FRAME_PROTOCOL_VERSION << 4) | FRAME_TYPE_BATCH);
+  putByte(writer, 0);
+  putUInt(writer, sequence, 2);
+  putUInt(writer, node, 2);
+  size_t countPosition = writer.position;
+  putByte(writer, 0);
+
+  encoded = 0;
+  if (!writer.ok)
+  {
+    return 0;
+  }
+
+  if (count > FRAME_MAX_BATCH_SAMPLES)
+  {
+    count = FRAME_MAX_BATCH_SAMPLES;
+  }
+
+  // Samples of several meters are interleaved, each one is relative to the previous sample of its meter
+  WatermeterSample references[FRAME_MAX_METERS] = {};
+  for (uint8_t i = 0; i < count; i++)
+  {
+    const WatermeterSample &sample = samples[i];
+    size_t samplePosition = writer.position;
+    uint8_t flags = sample.flags & SAMPLE_FLAGS;
+    uint8_t meter = sample.meter % FRAME_MAX_METERS;
+    const WatermeterSample &reference = references[meter];
+
+    putByte(writer, flags | (meter << FRAME_SAMPLE_METER_SHIFT));
+    putUnsignedVarint(writer, now > sample.timestamp ? now - sample.timestamp : 0);
+    if (!(flags & FRAME_FLAG_METER_FAILED))
+    {
+      putVarint(writer, (int32_t)(sample.value - reference.value));
+      putVarint(writer, (int32_t)(sample.previous - reference.previous));
+      if (flags & FRAME_FLAG_HAS_RATE)
+      {
+        putVarint(writer, sample.rate - reference.rate);
+      }
+    }
+    if (!(flags & FRAME_FLAG_SENSOR_FAILED))
+    {
+      putVarint(writer, sample.temperature - reference.temperature);
+      putVarint(writer, sample.humidity - reference.humidity);
+    }
+
+    // The frame is full, the remaining samples go into the next one
+    if (!writer.ok)
+    {
+      writer.position = samplePosition;
+      writer.ok = true;
+      break;
+    }
+
+    WatermeterSample flagged = sample;
+    flagged.flags = flags;
+    flagged.meter = meter;
+    references[meter] = sampleReference(flagged);
+    encoded++;
+  }
+
+  buffer[countPosition] = encoded;
+  return encoded ? writer.position : 0;
+}
+
+bool decodeBatch(const uint8_t *buffer, size_t length, uint32_t now, uint16_t &sequence, uint16_t &node, WatermeterSample *samples, uint8_t maxSamples, uint8_t &count)
+{
+  count = 0;
+  if (length < FRAME_HEADER_LENGTH + 1 || frameVersion(buffer) != FRAME_PROTOCOL_VERSION || frameType(buffer) != FRAME_TYPE_BATCH)
+  {
+    return false;
+  }
+
+  FrameReader reader = {buffer, length, 0, true};
+  getByte(reader);
+  getByte(reader);
+  sequence = getUInt(reader, 2);
+  node = getUInt(reader, 2);
+  uint8_t encoded = getByte(reader);
+  if (node == FRAME_NO_NODE || encoded > maxSamples || encoded > FRAME_MAX_BATCH_SAMPLES)
+  {
+    return false;
+  }
+
+  WatermeterSample references[FRAME_MAX_METERS] = {};
+  for (uint8_t i = 0; i < encoded && reader.ok; i++)
+  {
+    WatermeterSample &sample = samples[i];
+    memset(&sample, 0, sizeof(sample));
+
+    uint8_t flags = getByte(reader);
+    sample.flags = flags & SAMPLE_FLAGS;
+    sample.meter = (flags & FRAME_SAMPLE_METER_MASK) >> FRAME_SAMPLE_METER_SHIFT;
+    const WatermeterSample &reference = references[sample.meter];
+    uint32_t age = getUnsignedVarint(reader);
+    sample.timestamp = now > age ? now - age : 0;
+    if (!(sample.flags & FRAME_FLAG_METER_FAILED))
+    {
+      sample.value = reference.value + (uint32_t)getVarint(reader);
+      sample.previous = reference.previous + (uint32_t)getVarint(reader);
+      if (sample.flags & FRAME_FLAG_HAS_RATE)
+      {
+        sample.rate = reference.rate + getVarint(reader);
+      }
+    }
+    if (!(sample.flags & FRAME_FLAG_SENSOR_FAILED))
+    {
+      sample.temperature = reference.temperature + getVarint(reader);
+      sample.humidity = reference.humidity + getVarint(reader);
+    }
+    references[sample.meter] = sampleReference(sample);
+  }
+
+  if (!reader.ok)
+  {
+    return false;
+  }
+  count = encoded;
+  return true;
+}
+
+size_t encodeHeartbeat(uint16_t sequence, uint16_t node, uint32_t silence, uint8_t *buffer, size_t size)
+{
+  FrameWriter writer = {buffer, size, 0, true};
+  putByte(writer, (FRAME_PROTOCOL_VERSION << 4) | FRAME_TYPE_HEARTBEAT);
+  putByte(writer, 0);
+  putUInt(writer, sequence, 2);
+  putUInt(writer, node, 2);
+  putUnsignedVarint(writer, silence);
+  return writer.ok ? writer.position : 0;
+}
+
+bool decodeHeartbeat(const uint8_t *buffer, size_t length, uint16_t &sequence, uint16_t &node, uint32_t &silence)
+{
+  if (length < FRAME_HEADER_LENGTH + 1 || frameVersion(buffer) != FRAME_PROTOCOL_VERSION || frameType(buffer) != FRAME_TYPE_HEARTBEAT)
+  {
+    return false;
+  }
+
+  FrameReader reader = {buffer, length, 0, true};
+  getByte(reader);
+  getByte(reader);
+  sequence = getUInt(reader, 2);
+  node = getUInt(reader, 2);
+  silence = getUnsignedVarint(reader);
+  return reader.ok && node != FRAME_NO_NODE;
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Binary LoRa frame shared between the sender and the gateway.
+// The layout is described in lib/WatermeterProtocol/README.md, keep both in sync.
+
+#define FRAME_PROTOCOL_VERSION 3
+#define FRAME_MAX_LENGTH 255
+#define FRAME_MAX_ERROR_LENGTH 32
+#define FRAME_MAX_RAW_LENGTH 16
+#define FRAME_MAX_BATCH_SAMPLES 64
+#define FRAME_MAX_METERS 16
+#define FRAME_NO_NODE 0 // node IDs start at 1
+
+// Fixed-point scales
+#define FRAME_VALUE_SCALE 10000 // m^3
+#define FRAME_RATE_SCALE 10000  // m^3/min
+#define FRAME_CLIMATE_SCALE 10  // °C and %
+#define FRAME_TEMPERATURE_OFFSET 400
+
+// Frame types (low nibble of the first byte)
+#define FRAME_TYPE_READING 0x1
+#define FRAME_TYPE_DELTA 0x2
+#define FRAME_TYPE_BATCH 0x3
+#define FRAME_TYPE_LINK 0x4 // downlink from the gateway, see LinkProfile.h
+#define FRAME_TYPE_HEARTBEAT 0x5 // uplink without a reading, the sender is alive and its readings did not change
+
+// Frame flags
+#define FRAME_FLAG_METER_FAILED 0x01
+#define FRAME_FLAG_METER_ERROR 0x02
+#define FRAME_FLAG_HAS_RATE 0x04
+#define FRAME_FLAG_SENSOR_FAILED 0x08
+#define FRAME_FLAG_HAS_RAW 0x10
+#define FRAME_FLAG_RX_WINDOW 0x80 // header only: the sender listens for a link frame after this frame
+#define FRAME_RETRY_MASK 0x60     // header only: number of the retransmission, 0 for the first attempt
+#define FRAME_RETRY_SHIFT 5
+#define FRAME_MAX_RETRIES 3
+#define FRAME_SAMPLE_METER_MASK 0xF0 // batch only: meter of the sample in the flags of the sample
+#define FRAME_SAMPLE_METER_SHIFT 4
+
+typedef struct
+{
+  uint16_t sequence;
+  uint16_t node; // sender of the frame
+  uint8_t meter; // watermeter at the sender, 0 to FRAME_MAX_METERS - 1
+  uint8_t flags;
+  uint32_t value;
+  uint32_t previous;
+  int32_t rate;
+  int16_t temperature;
+  uint16_t humidity;
+  char raw[FRAME_MAX_RAW_LENGTH + 1];
+  char error[FRAME_MAX_ERROR_LENGTH + 1];
+} WatermeterReading;
+
+// Buffered sample for batched uplinks, texts are not kept to save RTC memory
+typedef struct
+{
+  uint32_t timestamp; // seconds
+  uint8_t meter;
+  uint8_t flags;
+  uint32_t value;
+  uint32_t previous;
+  int32_t rate;
+  int16_t temperature;
+  uint16_t humidity;
+} WatermeterSample;
+
+// Last keyframe seen by the encoder or decoder, deltas are relative to it. Every meter needs its own reference.
+typedef struct
+{
+  WatermeterReading keyframe;
+  bool valid;
+} DeltaReference;
+
+typedef enum
+{
+  DECODE_OK,
+  DECODE_INVALID,
+  DECODE_MISSING_KEYFRAME
+} DecodeResult;
+
+// Returns the number of bytes written to buffer or 0 if it does not fit.
+size_t encodeReading(const WatermeterReading &reading, uint8_t *buffer, size_t size);
+
+// Returns 0 if the reading cannot be expressed relative to the keyframe.
+size_t encodeDelta(const WatermeterReading &reading, const WatermeterReading &keyframe, uint8_t *buffer, size_t size);
+bool canEncodeDelta(const WatermeterReading &reading, const WatermeterReading &keyframe);
+
+// Sends a keyframe every keyframeInterval packets and deltas in between, an interval of 1 disables deltas.
+size_t encodeFrame(const WatermeterReading &reading, DeltaReference &reference, uint8_t keyframeInterval, uint8_t *buffer, size_t size);
+
+// Returns false for truncated frames, unknown versions, unknown types or frames without a node.
+bool decodeReading(const uint8_t *buffer, size_t length, WatermeterReading &reading);
+
+// Decodes keyframes and deltas, keyframes replace the reference.
+DecodeResult decodeFrame(const uint8_t *buffer, size_t length, DeltaReference &reference, WatermeterReading &reading);
+
+// Encodes as many of the given samples (oldest first) as fit, encoded returns how many made it into the frame.
+// Timestamps are sent as age relative to now, so sender and gateway clocks do not need to agree.
+size_t encodeBatch(uint16_t sequence, uint16_t node, const WatermeterSample *samples, uint8_t count, uint32_t now, uint8_t *buffer, size_t size, uint8_t &encoded);
+
+// Decodes up to maxSamples samples, timestamps are converted to the clock of the receiver given by now.
+bool decodeBatch(const uint8_t *buffer, size_t length, uint32_t now, uint16_t &sequence, uint16_t &node, WatermeterSample *samples, uint8_t maxSamples, uint8_t &count);
+
+// silence is the number of seconds the sender may stay silent until its next uplink at the latest
+size_t encodeHeartbeat(uint16_t sequence, uint16_t node, uint32_t silence, uint8_t *buffer, size_t size);
+bool decodeHeartbeat(const uint8_t *buffer, size_t length, uint16_t &sequence, uint16_t &node, uint32_t &silence);
+
+uint8_t frameVersion(const uint8_t *buffer);
+uint8_t frameType(const uint8_t *buffer);
+uint8_t frameFlags(const uint8_t *buffer);
+uint16_t frameSequence(const uint8_t *buffer);
+uint8_t frameRetry(const uint8_t *buffer);
+uint16_t frameNode(const uint8_t *buffer);
+
+// Four lowercase hex digits and the terminator, the same text is used in MQTT topics and on the web interfaces
+#define FRAME_NODE_TEXT_LENGTH 5
+void formatNode(uint16_t node, char *text);
+
+// Meter of a reading or delta, 0 for other frame types or truncated frames
+uint8_t frameMeter(const uint8_t *buffer, size_t length);
+void setFrameRetry(uint8_t *buffer, uint8_t retry);
+
+inline int32_t toFixedPoint(float value, int32_t scale)
+{
+  return (int32_t)((double)value * scale + (value < 0 ? -0.5 : 0.5));
+}
+
+inline double fromFixedPoint(int32_t value, int32_t scale)
+{
+  return (double)value / scale;
+}
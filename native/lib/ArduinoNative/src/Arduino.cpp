@@ -0,0 +1,287 @@
+#include "Arduino.h"
+#include "Native.h"
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <random>
+#include <signal.h>
+#include <thread>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#define NATIVE_HEAP_SIZE 327680 // bytes, the DRAM of an ESP32 that is left to the heap
+
+HardwareSerial Serial;
+EspClass ESP;
+
+static const auto bootTime = std::chrono::steady_clock::now();
+static std::mutex serialMutex;
+static std::mutex interruptMutex;
+static std::map<uint8_t, void (*)()> interrupts;
+static std::mt19937 generator(std::random_device{}());
+static std::mutex randomMutex;
+static uint64_t wakeupTime = 0; // µs
+static char **arguments;
+
+size_t HardwareSerial::write(uint8_t value)
+{
+  return write(&value, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+  std::lock_guard<std::mutex> guard(serialMutex);
+  return fwrite(buffer, 1, size, stdout);
+}
+
+void HardwareSerial::flush()
+{
+  std::lock_guard<std::mutex> guard(serialMutex);
+  fflush(stdout);
+}
+
+unsigned long millis()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - bootTime).count();
+}
+
+unsigned long micros()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - bootTime).count();
+}
+
+void delay(unsigned long ms)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+void yield()
+{
+  std::this_thread::yield();
+}
+
+long random(long max)
+{
+  return max > 0 ? random(0, max) : 0;
+}
+
+long random(long min, long max)
+{
+  if (min >= max)
+  {
+    return min;
+  }
+  std::lock_guard<std::mutex> guard(randomMutex);
+  return std::uniform_int_distribution<long>(min, max - 1)(generator);
+}
+
+void randomSeed(unsigned long seed)
+{
+  std::lock_guard<std::mutex> guard(randomMutex);
+  generator.seed(seed);
+}
+
+uint32_t esp_random()
+{
+  std::lock_guard<std::mutex> guard(randomMutex);
+  return generator();
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+
+void digitalWrite(uint8_t pin, uint8_t value) {}
+
+int digitalRead(uint8_t pin)
+{
+  return LOW;
+}
+
+void attachInterrupt(uint8_t pin, void (*handler)(), int mode)
+{
+  std::lock_guard<std::mutex> guard(interruptMutex);
+  interrupts[pin] = handler;
+}
+
+void detachInterrupt(uint8_t pin)
+{
+  std::lock_guard<std::mutex> guard(interruptMutex);
+  interrupts.erase(pin);
+}
+
+void nativeInterrupt(uint8_t pin)
+{
+  void (*handler)() = nullptr;
+  {
+    std::lock_guard<std::mutex> guard(interruptMutex);
+    auto entry = interrupts.find(pin);
+    if (entry != interrupts.end())
+    {
+      handler = entry->second;
+    }
+  }
+  if (handler)
+  {
+    handler();
+  }
+}
+
+#ifdef NATIVE_STRLCPY
+size_t strlcpy(char *destination, const char *source, size_t size)
+{
+  size_t length = strlen(source);
+  if (size > 0)
+  {
+    size_t count = length < size - 1 ? length : size - 1;
+    memcpy(destination, source, count);
+    destination[count] = 0;
+  }
+  return length;
+}
+#endif
+
+void configTime(long gmtOffset, int daylightOffset, const char *server1, const char *server2, const char *server3) {}
+
+// The host clock needs no NTP, only the time zone for localtime()
+void configTzTime(const char *tz, const char *server1, const char *server2, const char *server3)
+{
+  setenv("TZ", tz, 1);
+  tzset();
+}
+
+bool getLocalTime(struct tm *info, uint32_t ms)
+{
+  time_t now = time(nullptr);
+  localtime_r(&now, info);
+  return true;
+}
+
+const char *nativeSetting(const char *name, const char *fallback)
+{
+  const char *value = getenv(name);
+  return value && *value ? value : fallback;
+}
+
+long nativeSetting(const char *name, long fallback)
+{
+  const char *value = getenv(name);
+  return value && *value ? atol(value) : fallback;
+}
+
+void nativeMakeDirectories(const std::string &path)
+{
+  for (size_t i = 1; i <= path.size(); i++)
+  {
+    if (i == path.size() || path[i] == '/')
+    {
+      mkdir(path.substr(0, i).c_str(), 0755);
+    }
+  }
+}
+
+std::string nativeStatePath(const std::string &path)
+{
+  std::string full = std::string(nativeSetting("NATIVE_STATE", ".native")) + "/" + path;
+  nativeMakeDirectories(full.substr(0, full.find_last_of('/')));
+  return full;
+}
+
+esp_reset_reason_t esp_reset_reason()
+{
+  return getenv("NATIVE_WAKEUP") ? ESP_RST_DEEPSLEEP : ESP_RST_POWERON;
+}
+
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time)
+{
+  wakeupTime = time;
+  return ESP_OK;
+}
+
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause()
+{
+  return getenv("NATIVE_WAKEUP") ? ESP_SLEEP_WAKEUP_TIMER : ESP_SLEEP_WAKEUP_UNDEFINED;
+}
+
+void esp_deep_sleep_start()
+{
+  fflush(stdout);
+  std::this_thread::sleep_for(std::chrono::microseconds(wakeupTime));
+  setenv("NATIVE_WAKEUP", "timer", 1);
+  execv(arguments[0], arguments);
+  perror("Restart after deep sleep failed");
+  exit(1);
+}
+
+int64_t esp_timer_get_time()
+{
+  return micros();
+}
+
+uint64_t EspClass::getEfuseMac()
+{
+  const char *mac = getenv("NATIVE_MAC");
+  uint64_t address = mac ? strtoull(mac, nullptr, 16) : 0x24A4AE100000ULL | (getpid() & 0xFFFF);
+
+  // The eFuse holds the first byte of the MAC address in the lowest byte
+  uint64_t efuse = 0;
+  for (int i = 0; i < 6; i++)
+  {
+    efuse |= ((address >> (8 * (5 - i))) & 0xFF) << (8 * i);
+  }
+  return efuse;
+}
+
+uint32_t EspClass::getHeapSize()
+{
+  return NATIVE_HEAP_SIZE;
+}
+
+uint32_t EspClass::getFreeHeap()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  size_t used = mallinfo2().uordblks;
+  uint32_t free = used < NATIVE_HEAP_SIZE ? NATIVE_HEAP_SIZE - used : 0;
+#else
+  uint32_t free = NATIVE_HEAP_SIZE;
+#endif
+  minFreeHeap = min(minFreeHeap, free);
+  return free;
+}
+
+// Only sees the calls of getFreeHeap(), the ESP32 tracks every allocation
+uint32_t EspClass::getMinFreeHeap()
+{
+  getFreeHeap();
+  return minFreeHeap;
+}
+
+void EspClass::restart()
+{
+  fflush(stdout);
+  unsetenv("NATIVE_WAKEUP");
+  execv(arguments[0], arguments);
+  perror("Restart failed");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  arguments = argv;
+  // A broker or meter that closes the connection must not end the process
+  signal(SIGPIPE, SIG_IGN);
+  setvbuf(stdout, nullptr, _IOLBF, 0);
+  xTaskGetCurrentTaskHandle();
+
+  setup();
+  for (;;)
+  {
+    loop();
+  }
+}
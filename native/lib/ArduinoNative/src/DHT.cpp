@@ -0,0 +1,33 @@
+#include "DHT.h"
+#include "Native.h"
+
+#define NATIVE_DAY 86400.0 // seconds
+
+static bool sensorMissing()
+{
+  return strcmp(nativeSetting("NATIVE_DHT", "on"), "off") == 0;
+}
+
+static float dailySwing(float amplitude)
+{
+  return amplitude * sinf(2 * M_PI * (time(nullptr) % (long)NATIVE_DAY) / NATIVE_DAY);
+}
+
+float DHT::readTemperature(bool fahrenheit, bool force)
+{
+  if (sensorMissing())
+  {
+    return NAN;
+  }
+  float celsius = atof(nativeSetting("NATIVE_TEMPERATURE", "21.5")) + dailySwing(1.5f);
+  return fahrenheit ? celsius * 1.8f + 32 : celsius;
+}
+
+float DHT::readHumidity(bool force)
+{
+  if (sensorMissing())
+  {
+    return NAN;
+  }
+  return atof(nativeSetting("NATIVE_HUMIDITY", "45")) - dailySwing(5);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <Arduino.h>
+
+#define DHT11 11
+#define DHT22 22
+
+// DHT22 with a slow daily swing around NATIVE_TEMPERATURE (default 21.5 °C) and NATIVE_HUMIDITY (default 45 %).
+// NATIVE_DHT=off makes every read fail like an unplugged sensor.
+class DHT
+{
+public:
+  DHT(uint8_t pin, uint8_t type) {}
+  void begin() {}
+  float readTemperature(bool fahrenheit = false, bool force = false);
+  float readHumidity(bool force = false);
+};
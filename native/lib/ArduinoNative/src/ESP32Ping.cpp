@@ -0,0 +1,3 @@
+#include "ESP32Ping.h"
+
+PingClass Ping;
@@ -0,0 +1,342 @@
+#include "ESPAsyncWebServer.h"
+#include "Native.h"
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <thread>
+#include <unistd.h>
+
+#define WEB_REQUEST_TIMEOUT 5            // seconds to receive a request
+#define WEB_MAX_REQUEST_LENGTH 16384     // bytes, header and body
+#define TEMPLATE_PARAM_NAME_LENGTH 32    // like ESPAsyncWebServer
+#define WEB_CHUNK_LENGTH 1436            // bytes, a TCP segment of the ESP32 like the chunks of ESPAsyncWebServer
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // SIGPIPE is ignored by main()
+#endif
+
+static String reasonPhrase(int code)
+{
+  switch (code)
+  {
+  case 200:
+    return "OK";
+  case 204:
+    return "No Content";
+  case 400:
+    return "Bad Request";
+  case 404:
+    return "Not Found";
+  case 405:
+    return "Method Not Allowed";
+  default:
+    return code < 400 ? "OK" : (code < 500 ? "Client Error" : "Server Error");
+  }
+}
+
+static String urlDecode(const String &text)
+{
+  String decoded;
+  for (unsigned int i = 0; i < text.length(); i++)
+  {
+    char value = text[i];
+    if (value == '+')
+    {
+      decoded += ' ';
+    }
+    else if (value == '%' && i + 2 < text.length())
+    {
+      decoded += (char)strtol(text.substring(i + 1, i + 3).c_str(), nullptr, 16);
+      i += 2;
+    }
+    else
+    {
+      decoded += value;
+    }
+  }
+  return decoded;
+}
+
+static void parseParams(AsyncWebServerRequest &request, const String &text, bool post)
+{
+  String rest = text;
+  while (rest.length() > 0)
+  {
+    int separator = rest.indexOf('&');
+    String pair = separator >= 0 ? rest.substring(0, separator) : rest;
+    rest = separator >= 0 ? rest.substring(separator + 1) : String();
+
+    int equals = pair.indexOf('=');
+    if (pair.length() > 0)
+    {
+      request.addParam(urlDecode(equals >= 0 ? pair.substring(0, equals) : pair), equals >= 0 ? urlDecode(pair.substring(equals + 1)) : String(), post);
+    }
+  }
+}
+
+static String contentTypeOf(const String &path)
+{
+  if (path.endsWith(".html") || path.endsWith(".htm"))
+  {
+    return "text/html";
+  }
+  if (path.endsWith(".css"))
+  {
+    return "text/css";
+  }
+  if (path.endsWith(".js"))
+  {
+    return "application/javascript";
+  }
+  if (path.endsWith(".json"))
+  {
+    return "application/json";
+  }
+  return "text/plain";
+}
+
+// %NAME% is replaced by the processor and %% by a single %, text that is no placeholder stays as it is
+static String applyTemplate(const String &text, AwsTemplateProcessor processor)
+{
+  String result;
+  result.reserve(text.length());
+  unsigned int i = 0;
+  while (i < text.length())
+  {
+    int end = text[i] == '%' ? text.indexOf('%', i + 1) : -1;
+    if (end < 0 || end - i - 1 > TEMPLATE_PARAM_NAME_LENGTH)
+    {
+      result += text[i++];
+      continue;
+    }
+    result += end == (int)i + 1 ? String("%") : processor(text.substring(i + 1, end));
+    i = end + 1;
+  }
+  return result;
+}
+
+bool AsyncWebServerRequest::hasParam(const String &name, bool post, bool file) const
+{
+  for (const AsyncWebParameter &parameter : parameters)
+  {
+    if (parameter.name() == name && parameter.isPost() == post)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+AsyncWebParameter *AsyncWebServerRequest::getParam(const String &name, bool post, bool file)
+{
+  for (AsyncWebParameter &parameter : parameters)
+  {
+    if (parameter.name() == name && parameter.isPost() == post)
+    {
+      return &parameter;
+    }
+  }
+  return nullptr;
+}
+
+void AsyncWebServerRequest::send(int code, const String &contentType, const String &content)
+{
+  sent = true;
+  this->code = code;
+  this->contentType = contentType.length() > 0 ? contentType : String("text/plain");
+  this->content = content;
+}
+
+void AsyncWebServerRequest::send(FS &fs, const String &path, const String &contentType, bool download, AwsTemplateProcessor callback)
+{
+  File file = fs.open(path, FILE_READ);
+  if (!file)
+  {
+    send(404);
+    return;
+  }
+  String text;
+  uint8_t buffer[1024];
+  size_t count;
+  while ((count = file.read(buffer, sizeof(buffer))) > 0)
+  {
+    text.concat((const char *)buffer, count);
+  }
+  file.close();
+
+  send(200, contentType.length() > 0 ? contentType : contentTypeOf(path), callback ? applyTemplate(text, callback) : text);
+  if (download)
+  {
+    extraHeaders = "Content-Disposition: attachment; filename=\"" + String(file.name()) + "\"\r\n";
+  }
+}
+
+AsyncWebServerResponse *AsyncWebServerRequest::beginChunkedResponse(const String &contentType, AwsResponseFiller callback, AwsTemplateProcessor templateCallback)
+{
+  return new AsyncWebServerResponse(contentType, callback);
+}
+
+void AsyncWebServerRequest::send(AsyncWebServerResponse *response)
+{
+  sent = true;
+  chunked.reset(response);
+}
+
+void AsyncWebServerResponse::stream(int connection)
+{
+  String head = "HTTP/1.1 200 OK\r\nContent-Type: " + contentType + "\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n";
+  send(connection, head.c_str(), head.length(), MSG_NOSIGNAL);
+
+  uint8_t buffer[WEB_CHUNK_LENGTH];
+  size_t index = 0;
+  size_t length;
+  while ((length = filler(buffer, sizeof(buffer), index)) > 0)
+  {
+    char size[12];
+    int sizeLength = snprintf(size, sizeof(size), "%zx\r\n", length);
+    if (send(connection, size, sizeLength, MSG_NOSIGNAL) < 0 || send(connection, buffer, length, MSG_NOSIGNAL) < 0 ||
+        send(connection, "\r\n", 2, MSG_NOSIGNAL) < 0)
+    {
+      return;
+    }
+    index += length;
+  }
+  send(connection, "0\r\n\r\n", 5, MSG_NOSIGNAL);
+}
+
+String AsyncWebServerRequest::response() const
+{
+  return "HTTP/1.1 " + String(code) + " " + reasonPhrase(code) + "\r\nContent-Type: " + contentType +
+         "\r\nContent-Length: " + String(content.length()) + "\r\n" + extraHeaders + "Connection: close\r\n\r\n" + content;
+}
+
+void AsyncWebServer::on(const char *uri, WebRequestMethodComposite method, ArRequestHandlerFunction handler)
+{
+  routes.push_back({uri, method, handler});
+}
+
+void AsyncWebServer::begin()
+{
+  if (started)
+  {
+    return;
+  }
+  uint16_t listenPort = nativeSetting("NATIVE_WEB_PORT", 8000L + port);
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int enabled = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled));
+
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(listenPort);
+  if (bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 8) != 0)
+  {
+    Serial.println("Web server could not listen on port " + String(listenPort));
+    close(listener);
+    return;
+  }
+  started = true;
+  Serial.println("Web server listening on port " + String(listenPort));
+  std::thread(&AsyncWebServer::serve, this, listener).detach();
+}
+
+void AsyncWebServer::serve(int listener)
+{
+  for (;;)
+  {
+    int connection = accept(listener, nullptr, nullptr);
+    if (connection >= 0)
+    {
+      handle(connection);
+      close(connection);
+    }
+  }
+}
+
+void AsyncWebServer::handle(int connection)
+{
+  timeval timeout = {WEB_REQUEST_TIMEOUT, 0};
+  setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  // Head first, then as much body as the Content-Length announces
+  std::string received;
+  size_t headEnd = std::string::npos;
+  size_t length = 0;
+  char buffer[2048];
+  while (received.size() < WEB_MAX_REQUEST_LENGTH)
+  {
+    if (headEnd != std::string::npos && received.size() >= headEnd + 4 + length)
+    {
+      break;
+    }
+    ssize_t count = recv(connection, buffer, sizeof(buffer), 0);
+    if (count <= 0)
+    {
+      return;
+    }
+    received.append(buffer, count);
+    if (headEnd == std::string::npos && (headEnd = received.find("\r\n\r\n")) != std::string::npos)
+    {
+      size_t header = received.find("\r\nContent-Length:");
+      if (header == std::string::npos)
+      {
+        header = received.find("\r\ncontent-length:");
+      }
+      length = header != std::string::npos && header < headEnd ? atol(received.c_str() + header + 17) : 0;
+    }
+  }
+  if (headEnd == std::string::npos)
+  {
+    return;
+  }
+
+  String head = received.substr(0, headEnd).c_str();
+  String line = head.substring(0, head.indexOf('\r') >= 0 ? head.indexOf('\r') : head.length());
+  int first = line.indexOf(' ');
+  int second = line.indexOf(' ', first + 1);
+  if (first < 0 || second < 0)
+  {
+    return;
+  }
+  String methodName = line.substring(0, first);
+  String target = line.substring(first + 1, second);
+  WebRequestMethodComposite method = methodName == "POST" ? HTTP_POST : (methodName == "DELETE" ? HTTP_DELETE : (methodName == "PUT" ? HTTP_PUT : HTTP_GET));
+
+  int query = target.indexOf('?');
+  AsyncWebServerRequest request(method, urlDecode(query >= 0 ? target.substring(0, query) : target));
+  if (query >= 0)
+  {
+    parseParams(request, target.substring(query + 1), false);
+  }
+  if (method == HTTP_POST)
+  {
+    parseParams(request, received.substr(headEnd + 4, length).c_str(), true);
+  }
+
+  ArRequestHandlerFunction handler = notFound;
+  for (const Route &route : routes)
+  {
+    if (route.uri == request.url() && (route.method & method))
+    {
+      handler = route.handler;
+      break;
+    }
+  }
+  if (handler)
+  {
+    handler(&request);
+  }
+  if (!request.answered())
+  {
+    request.send(handler ? 500 : 404);
+  }
+
+  if (request.streamed())
+  {
+    request.streamed()->stream(connection);
+    return;
+  }
+  String response = request.response();
+  send(connection, response.c_str(), response.length(), MSG_NOSIGNAL);
+}
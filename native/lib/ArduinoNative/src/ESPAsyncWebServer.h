@@ -0,0 +1,120 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// ESPAsyncWebServer on a blocking HTTP/1.1 server thread that answers one request per connection.
+// The server listens on NATIVE_WEB_PORT, or on 8000 plus the port of the ESP32 (8080 for port 80).
+
+typedef enum
+{
+  HTTP_GET = 0b00000001,
+  HTTP_POST = 0b00000010,
+  HTTP_DELETE = 0b00000100,
+  HTTP_PUT = 0b00001000,
+  HTTP_PATCH = 0b00010000,
+  HTTP_HEAD = 0b00100000,
+  HTTP_OPTIONS = 0b01000000,
+  HTTP_ANY = 0b01111111
+} WebRequestMethod;
+
+typedef uint8_t WebRequestMethodComposite;
+typedef std::function<String(const String &)> AwsTemplateProcessor;
+typedef std::function<size_t(uint8_t *buffer, size_t maxLen, size_t index)> AwsResponseFiller;
+
+// Only chunked responses, the filler is called for chunks until it returns 0
+class AsyncWebServerResponse
+{
+public:
+  AsyncWebServerResponse(const String &contentType, AwsResponseFiller filler) : contentType(contentType), filler(filler) {}
+
+  // Used by the server thread
+  void stream(int connection);
+
+private:
+  String contentType;
+  AwsResponseFiller filler;
+};
+
+class AsyncWebParameter
+{
+public:
+  AsyncWebParameter(const String &name, const String &value, bool post) : paramName(name), paramValue(value), post(post) {}
+  const String &name() const { return paramName; }
+  const String &value() const { return paramValue; }
+  bool isPost() const { return post; }
+  bool isFile() const { return false; }
+
+private:
+  String paramName;
+  String paramValue;
+  bool post;
+};
+
+class AsyncWebServerRequest
+{
+public:
+  AsyncWebServerRequest(WebRequestMethodComposite method, const String &url) : requestMethod(method), requestUrl(url) {}
+
+  WebRequestMethodComposite method() const { return requestMethod; }
+  const String &url() const { return requestUrl; }
+
+  size_t params() const { return parameters.size(); }
+  AsyncWebParameter *getParam(size_t index) { return index < parameters.size() ? &parameters[index] : nullptr; }
+  bool hasParam(const String &name, bool post = false, bool file = false) const;
+  AsyncWebParameter *getParam(const String &name, bool post = false, bool file = false);
+
+  void send(int code, const String &contentType = String(), const String &content = String());
+  void send(FS &fs, const String &path, const String &contentType = String(), bool download = false, AwsTemplateProcessor callback = nullptr);
+  AsyncWebServerResponse *beginChunkedResponse(const String &contentType, AwsResponseFiller callback, AwsTemplateProcessor templateCallback = nullptr);
+  void send(AsyncWebServerResponse *response);
+
+  // Used by the server thread
+  void addParam(const String &name, const String &value, bool post) { parameters.emplace_back(name, value, post); }
+  bool answered() const { return sent; }
+  String response() const;
+  AsyncWebServerResponse *streamed() const { return chunked.get(); }
+
+private:
+  WebRequestMethodComposite requestMethod;
+  String requestUrl;
+  std::vector<AsyncWebParameter> parameters;
+  bool sent = false;
+  int code = 500;
+  String contentType;
+  String content;
+  String extraHeaders;
+  std::unique_ptr<AsyncWebServerResponse> chunked;
+};
+
+typedef std::function<void(AsyncWebServerRequest *request)> ArRequestHandlerFunction;
+
+class AsyncWebServer
+{
+public:
+  AsyncWebServer(uint16_t port) : port(port) {}
+
+  void on(const char *uri, WebRequestMethodComposite method, ArRequestHandlerFunction handler);
+  void onNotFound(ArRequestHandlerFunction handler) { notFound = handler; }
+  void begin();
+  void end() {}
+
+private:
+  typedef struct
+  {
+    String uri;
+    WebRequestMethodComposite method;
+    ArRequestHandlerFunction handler;
+  } Route;
+
+  void serve(int listener);
+  void handle(int connection);
+
+  uint16_t port;
+  bool started = false;
+  std::vector<Route> routes;
+  ArRequestHandlerFunction notFound;
+};
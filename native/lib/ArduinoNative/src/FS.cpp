@@ -0,0 +1,252 @@
+#include "FS.h"
+#include "SPIFFS.h"
+#include "Native.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#define NATIVE_SPIFFS_SIZE 1441792 // bytes, the SPIFFS partition of the default partition table
+
+SPIFFSFS SPIFFS;
+
+namespace fs
+{
+  File::File(FILE *file, const String &path) : handle(file, fclose), filePath(path) {}
+
+  File::File(DIR *entries, const String &path) : directory(entries, closedir), filePath(path) {}
+
+  // Regular files only, the directory path is stored without the host root
+  File File::openNextFile(const char *mode)
+  {
+    while (directory)
+    {
+      dirent *entry = readdir(directory.get());
+      if (!entry)
+      {
+        break;
+      }
+      if (entry->d_type != DT_REG)
+      {
+        continue;
+      }
+      String path = filePath + (filePath.endsWith("/") ? "" : "/") + entry->d_name;
+      return SPIFFS.open(path, mode);
+    }
+    return File();
+  }
+
+  size_t File::write(uint8_t value)
+  {
+    return write(&value, 1);
+  }
+
+  size_t File::write(const uint8_t *buffer, size_t size)
+  {
+    return handle ? fwrite(buffer, 1, size, handle.get()) : 0;
+  }
+
+  int File::available()
+  {
+    return handle ? size() - position() : 0;
+  }
+
+  int File::read()
+  {
+    return handle ? fgetc(handle.get()) : -1;
+  }
+
+  size_t File::read(uint8_t *buffer, size_t size)
+  {
+    return handle ? fread(buffer, 1, size, handle.get()) : 0;
+  }
+
+  int File::peek()
+  {
+    if (!handle)
+    {
+      return -1;
+    }
+    int value = fgetc(handle.get());
+    if (value >= 0)
+    {
+      ungetc(value, handle.get());
+    }
+    return value;
+  }
+
+  void File::flush()
+  {
+    if (handle)
+    {
+      fflush(handle.get());
+    }
+  }
+
+  bool File::seek(uint32_t position, SeekMode mode)
+  {
+    return handle && fseek(handle.get(), position, mode == SeekSet ? SEEK_SET : (mode == SeekCur ? SEEK_CUR : SEEK_END)) == 0;
+  }
+
+  size_t File::position() const
+  {
+    return handle ? ftell(handle.get()) : 0;
+  }
+
+  size_t File::size() const
+  {
+    if (!handle)
+    {
+      return 0;
+    }
+    fflush(handle.get());
+    struct stat info;
+    return fstat(fileno(handle.get()), &info) == 0 ? info.st_size : 0;
+  }
+
+  void File::close()
+  {
+    handle.reset();
+    directory.reset();
+  }
+
+  const char *File::name() const
+  {
+    int slash = filePath.lastIndexOf('/');
+    return filePath.c_str() + slash + 1;
+  }
+
+  std::string FS::hostPath(const char *path) const
+  {
+    return root + (path[0] == '/' ? "" : "/") + path;
+  }
+
+  File FS::open(const char *path, const char *mode, bool create)
+  {
+    std::string host = hostPath(path);
+    if (strcmp(mode, FILE_READ) != 0 || create)
+    {
+      nativeMakeDirectories(host.substr(0, host.find_last_of('/')));
+    }
+
+    struct stat info;
+    if (strcmp(mode, FILE_READ) == 0 && stat(host.c_str(), &info) == 0 && S_ISDIR(info.st_mode))
+    {
+      DIR *entries = opendir(host.c_str());
+      return entries ? File(entries, path) : File();
+    }
+
+    // Binary modes, the firmwares store structs
+    std::string hostMode = std::string(mode) + "b";
+    FILE *file = fopen(host.c_str(), hostMode.c_str());
+    return file ? File(file, path) : File();
+  }
+
+  bool FS::exists(const char *path)
+  {
+    struct stat info;
+    return stat(hostPath(path).c_str(), &info) == 0;
+  }
+
+  bool FS::remove(const char *path)
+  {
+    return ::remove(hostPath(path).c_str()) == 0;
+  }
+
+  bool FS::rename(const char *from, const char *to)
+  {
+    return ::rename(hostPath(from).c_str(), hostPath(to).c_str()) == 0;
+  }
+
+  bool FS::mkdir(const char *path)
+  {
+    return ::mkdir(hostPath(path).c_str(), 0755) == 0;
+  }
+}
+
+bool SPIFFSFS::begin(bool formatOnFail, const char *basePath, uint8_t maxOpenFiles, const char *partitionLabel)
+{
+  root = nativeStatePath("spiffs/");
+  root.pop_back();
+
+  std::string data = nativeSetting("NATIVE_DATA", "data");
+  DIR *entries = opendir(data.c_str());
+  if (!entries)
+  {
+    return true;
+  }
+  while (dirent *entry = readdir(entries))
+  {
+    std::string name = std::string("/") + entry->d_name;
+    if (entry->d_name[0] == '.' || exists(name.c_str()))
+    {
+      continue;
+    }
+    FILE *source = fopen((data + name).c_str(), "rb");
+    FILE *target = fopen(hostPath(name.c_str()).c_str(), "wb");
+    char buffer[4096];
+    size_t count;
+    while (source && target && (count = fread(buffer, 1, sizeof(buffer), source)) > 0)
+    {
+      fwrite(buffer, 1, count, target);
+    }
+    if (source)
+    {
+      fclose(source);
+    }
+    if (target)
+    {
+      fclose(target);
+    }
+  }
+  closedir(entries);
+  return true;
+}
+
+// SPIFFS has no directories, paths with slashes become subdirectories on the host.
+// Returns the size of all files below directory and removes them if remove is set.
+static size_t collectFiles(const std::string &directory, bool remove)
+{
+  size_t used = 0;
+  DIR *entries = opendir(directory.c_str());
+  if (!entries)
+  {
+    return 0;
+  }
+  while (dirent *entry = readdir(entries))
+  {
+    std::string path = directory + "/" + entry->d_name;
+    struct stat info;
+    if (entry->d_name[0] == '.' || stat(path.c_str(), &info) != 0)
+    {
+      continue;
+    }
+    if (S_ISDIR(info.st_mode))
+    {
+      used += collectFiles(path, remove);
+      continue;
+    }
+    used += info.st_size;
+    if (remove)
+    {
+      ::remove(path.c_str());
+    }
+  }
+  closedir(entries);
+  return used;
+}
+
+bool SPIFFSFS::format()
+{
+  collectFiles(root, true);
+  return true;
+}
+
+size_t SPIFFSFS::totalBytes()
+{
+  return NATIVE_SPIFFS_SIZE;
+}
+
+size_t SPIFFSFS::usedBytes()
+{
+  return collectFiles(root, false);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <Arduino.h>
+#include <dirent.h>
+#include <memory>
+#include <string>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+enum SeekMode
+{
+  SeekSet = 0,
+  SeekCur = 1,
+  SeekEnd = 2
+};
+
+namespace fs
+{
+  // File of the host file system, closed when the last copy is closed or destroyed.
+  // A directory lists its files with openNextFile() like on SPIFFS, which has no subdirectories of its own.
+  class File : public Stream
+  {
+  public:
+    File() {}
+    File(FILE *file, const String &path);
+    File(DIR *directory, const String &path);
+
+    size_t write(uint8_t value) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    int available() override;
+    int read() override;
+    size_t read(uint8_t *buffer, size_t size);
+    int peek() override;
+    void flush() override;
+    bool seek(uint32_t position, SeekMode mode = SeekSet);
+    size_t position() const;
+    size_t size() const;
+    void close();
+    bool isDirectory() const { return directory != nullptr; }
+    File openNextFile(const char *mode = FILE_READ);
+    operator bool() const { return handle != nullptr || directory != nullptr; }
+    const char *path() const { return filePath.c_str(); }
+    const char *name() const;
+
+    using Print::write;
+
+  private:
+    std::shared_ptr<FILE> handle;
+    std::shared_ptr<DIR> directory;
+    String filePath;
+  };
+
+  // File system in a directory of the host
+  class FS
+  {
+  public:
+    File open(const char *path, const char *mode = FILE_READ, bool create = false);
+    File open(const String &path, const char *mode = FILE_READ, bool create = false) { return open(path.c_str(), mode, create); }
+    bool exists(const char *path);
+    bool exists(const String &path) { return exists(path.c_str()); }
+    bool remove(const char *path);
+    bool remove(const String &path) { return remove(path.c_str()); }
+    bool rename(const char *from, const char *to);
+    bool rename(const String &from, const String &to) { return rename(from.c_str(), to.c_str()); }
+    bool mkdir(const char *path);
+    bool mkdir(const String &path) { return mkdir(path.c_str()); }
+
+  protected:
+    std::string hostPath(const char *path) const;
+
+    std::string root;
+  };
+}
+
+using fs::File;
+using fs::FS;
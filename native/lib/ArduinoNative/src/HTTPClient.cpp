@@ -0,0 +1,234 @@
+#include "HTTPClient.h"
+
+bool HTTPClient::begin(WiFiClient &client, const String &url)
+{
+  if (!url.startsWith("http://"))
+  {
+    return false;
+  }
+  String rest = url.substring(7);
+  int slash = rest.indexOf('/');
+  String authority = slash >= 0 ? rest.substring(0, slash) : rest;
+  path = slash >= 0 ? rest.substring(slash) : String("/");
+
+  int colon = authority.indexOf(':');
+  host = colon >= 0 ? authority.substring(0, colon) : authority;
+  port = colon >= 0 ? authority.substring(colon + 1).toInt() : nativeStationPort(host);
+
+  this->client = &client;
+  requestHeaders = String();
+  responseHeaders.clear();
+  size = -1;
+  chunked = false;
+  canReuse = false;
+  return true;
+}
+
+bool HTTPClient::begin(const String &url)
+{
+  return begin(ownClient, url);
+}
+
+void HTTPClient::end()
+{
+  if (!client)
+  {
+    return;
+  }
+
+  // Like the ESP32, the rest of the response is dropped and the connection kept if possible
+  if (reuse && canReuse && client->connected())
+  {
+    uint8_t buffer[256];
+    while (client->available() > 0 && client->read(buffer, sizeof(buffer)) > 0)
+    {
+    }
+  }
+  else
+  {
+    client->stop();
+    connectedHost = String();
+  }
+}
+
+void HTTPClient::addHeader(const String &name, const String &value)
+{
+  requestHeaders += name + ": " + value + "\r\n";
+}
+
+void HTTPClient::collectHeaders(const char *names[], const size_t count)
+{
+  collected.clear();
+  for (size_t i = 0; i < count; i++)
+  {
+    String name = names[i];
+    name.toLowerCase();
+    collected.push_back(name);
+  }
+}
+
+String HTTPClient::header(const char *name)
+{
+  String key = name;
+  key.toLowerCase();
+  auto entry = responseHeaders.find(key);
+  return entry != responseHeaders.end() ? entry->second : String();
+}
+
+bool HTTPClient::readLine(String &line)
+{
+  line = String();
+  unsigned long start = millis();
+  while (millis() - start < timeout)
+  {
+    int value = client->read();
+    if (value < 0)
+    {
+      if (!client->connected())
+      {
+        return false;
+      }
+      delay(1);
+      continue;
+    }
+    if (value == '\n')
+    {
+      line.trim();
+      return true;
+    }
+    line += (char)value;
+  }
+  return false;
+}
+
+int HTTPClient::GET()
+{
+  if (!client)
+  {
+    return HTTPC_ERROR_NOT_CONNECTED;
+  }
+
+  bool reusable = reuse && client->connected() && connectedHost == host && connectedPort == port;
+  if (!reusable)
+  {
+    connectedHost = String();
+    if (!client->connect(host.c_str(), port, connectTimeout))
+    {
+      return HTTPC_ERROR_CONNECTION_REFUSED;
+    }
+    connectedHost = host;
+    connectedPort = port;
+  }
+
+  String request = "GET " + path + " HTTP/1.1\r\nHost: " + host + "\r\nUser-Agent: ESP32HTTPClient\r\nConnection: " +
+                   (reuse ? "keep-alive" : "close") + "\r\n" + requestHeaders + "\r\n";
+  if (client->write((const uint8_t *)request.c_str(), request.length()) != request.length())
+  {
+    client->stop();
+    return HTTPC_ERROR_SEND_HEADER_FAILED;
+  }
+
+  String line;
+  if (!readLine(line) || !line.startsWith("HTTP/1."))
+  {
+    client->stop();
+    return HTTPC_ERROR_READ_TIMEOUT;
+  }
+  int code = line.substring(9, 12).toInt();
+  canReuse = reuse && line.startsWith("HTTP/1.1");
+  size = -1;
+  chunked = false;
+  responseHeaders.clear();
+
+  while (readLine(line) && line.length() > 0)
+  {
+    int colon = line.indexOf(':');
+    if (colon < 0)
+    {
+      continue;
+    }
+    String name = line.substring(0, colon);
+    String value = line.substring(colon + 1);
+    name.toLowerCase();
+    value.trim();
+
+    if (name == "content-length")
+    {
+      size = value.toInt();
+    }
+    else if (name == "transfer-encoding" && value.equalsIgnoreCase("chunked"))
+    {
+      chunked = true;
+    }
+    else if (name == "connection")
+    {
+      canReuse = canReuse && !value.equalsIgnoreCase("close");
+    }
+    for (const String &wanted : collected)
+    {
+      if (wanted == name)
+      {
+        responseHeaders[name] = value;
+      }
+    }
+  }
+
+  // A response without length or chunks ends with the connection
+  canReuse = canReuse && (size >= 0 || chunked || code == HTTP_CODE_NOT_MODIFIED);
+  client->setTimeout(timeout);
+  return code;
+}
+
+String HTTPClient::getString()
+{
+  String body;
+  if (!client)
+  {
+    return body;
+  }
+
+  if (size >= 0)
+  {
+    body.reserve(size);
+    uint8_t buffer[512];
+    int remaining = size;
+    while (remaining > 0)
+    {
+      size_t count = client->readBytes(buffer, min((int)sizeof(buffer), remaining));
+      if (count == 0)
+      {
+        break;
+      }
+      body.concat((const char *)buffer, count);
+      remaining -= count;
+    }
+  }
+  else if (chunked)
+  {
+    String line;
+    while (readLine(line))
+    {
+      long length = strtol(line.c_str(), nullptr, 16);
+      if (length <= 0)
+      {
+        readLine(line);
+        break;
+      }
+      for (long i = 0; i < length; i++)
+      {
+        char value;
+        if (client->readBytes(&value, 1) != 1)
+        {
+          return body;
+        }
+        body += value;
+      }
+      readLine(line);
+    }
+  }
+  else
+  {
+    body = client->readString();
+  }
+  return body;
+}
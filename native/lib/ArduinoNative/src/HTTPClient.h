@@ -0,0 +1,62 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <map>
+#include <vector>
+
+// HTTP/1.1 client for GET requests with keep-alive, the subset of the ESP32 HTTPClient the firmwares use.
+// A URL without port connects to the port of the station from NATIVE_STATIONS.
+
+#define HTTP_CODE_OK 200
+#define HTTP_CODE_NOT_MODIFIED 304
+#define HTTP_CODE_NOT_FOUND 404
+#define HTTPC_ERROR_CONNECTION_REFUSED (-1)
+#define HTTPC_ERROR_SEND_HEADER_FAILED (-2)
+#define HTTPC_ERROR_NOT_CONNECTED (-4)
+#define HTTPC_ERROR_CONNECTION_LOST (-5)
+#define HTTPC_ERROR_READ_TIMEOUT (-11)
+#define HTTPCLIENT_DEFAULT_TCP_TIMEOUT 5000 // ms
+#define HTTPCLIENT_DEFAULT_CONNECT_TIMEOUT 5000 // ms
+
+class HTTPClient
+{
+public:
+  bool begin(WiFiClient &client, const String &url);
+  bool begin(const String &url);
+  void end();
+
+  void setReuse(bool reuse) { this->reuse = reuse; }
+  void setConnectTimeout(int32_t timeout) { connectTimeout = timeout; }
+  void setTimeout(uint16_t timeout) { this->timeout = timeout; }
+  void addHeader(const String &name, const String &value);
+  void collectHeaders(const char *names[], const size_t count);
+  String header(const char *name);
+
+  int GET();
+  int getSize() { return size; }
+  WiFiClient &getStream() { return *client; }
+  WiFiClient *getStreamPtr() { return client; }
+  String getString();
+  bool connected() { return client && client->connected(); }
+
+private:
+  bool readLine(String &line);
+
+  WiFiClient *client = nullptr;
+  WiFiClient ownClient;
+  String host;
+  uint16_t port = 80;
+  String path;
+  String connectedHost;
+  uint16_t connectedPort = 0;
+  bool reuse = true;
+  bool canReuse = false;
+  bool chunked = false;
+  int32_t connectTimeout = HTTPCLIENT_DEFAULT_CONNECT_TIMEOUT;
+  uint16_t timeout = HTTPCLIENT_DEFAULT_TCP_TIMEOUT;
+  int size = -1;
+  String requestHeaders;
+  std::vector<String> collected;
+  std::map<String, String> responseHeaders;
+};
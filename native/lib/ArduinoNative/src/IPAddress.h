@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include "Printable.h"
+#include "WString.h"
+
+// IPv4 address in network byte order, as lwIP keeps it in u32_t
+class IPAddress : public Printable
+{
+public:
+  IPAddress() : IPAddress((uint32_t)0) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d);
+  IPAddress(uint32_t address);
+
+  operator uint32_t() const;
+  bool operator==(const IPAddress &other) const { return (uint32_t)*this == (uint32_t)other; }
+  bool operator==(uint32_t other) const { return (uint32_t)*this == other; }
+  uint8_t operator[](int index) const { return bytes[index]; }
+  uint8_t &operator[](int index) { return bytes[index]; }
+
+  bool fromString(const char *address);
+  bool fromString(const String &address) { return fromString(address.c_str()); }
+  String toString() const;
+  size_t printTo(Print &p) const override;
+
+private:
+  uint8_t bytes[4];
+};
@@ -0,0 +1,346 @@
+#include "LoRa.h"
+#include "Native.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+// Datagram layout shared with native/tools/radio_channel.py, all fields little-endian
+#define RADIO_TRANSMIT 'T'
+#define RADIO_RECEIVE 'R'
+#define RADIO_HELLO 'H'
+#define RADIO_HEADER_LENGTH 13 // type, SF, CR, TX power, sync word, bandwidth (4), frequency (4)
+#define RADIO_RECEIVE_LENGTH 21 // header, RSSI (2), SNR in quarter dB (2), frequency error (4)
+#define RADIO_NOISE_FLOOR -120 // dBm
+
+LoRaClass LoRa;
+
+static void putUInt32(uint8_t *buffer, uint32_t value)
+{
+  for (int i = 0; i < 4; i++)
+  {
+    buffer[i] = value >> (8 * i);
+  }
+}
+
+static uint32_t getUInt32(const uint8_t *buffer)
+{
+  return buffer[0] | buffer[1] << 8 | buffer[2] << 16 | (uint32_t)buffer[3] << 24;
+}
+
+int LoRaClass::begin(long frequency)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if (socketHandle >= 0)
+  {
+    this->frequency = frequency;
+    mode = MODE_STANDBY;
+    return 1;
+  }
+
+  String address = nativeSetting("NATIVE_RADIO", "127.0.0.1:1700");
+  int separator = address.indexOf(':');
+  sockaddr_in channel = {};
+  channel.sin_family = AF_INET;
+  channel.sin_port = htons(separator >= 0 ? address.substring(separator + 1).toInt() : 1700);
+  if (inet_pton(AF_INET, (separator >= 0 ? address.substring(0, separator) : address).c_str(), &channel.sin_addr) != 1)
+  {
+    return 0;
+  }
+
+  socketHandle = socket(AF_INET, SOCK_DGRAM, 0);
+  if (socketHandle < 0 || connect(socketHandle, (sockaddr *)&channel, sizeof(channel)) != 0)
+  {
+    return 0;
+  }
+
+  // The channel only forwards to radios it has heard from
+  uint8_t hello = RADIO_HELLO;
+  send(socketHandle, &hello, 1, 0);
+
+  this->frequency = frequency;
+  mode = MODE_STANDBY;
+  std::thread(&LoRaClass::receiveTask, this).detach();
+  return 1;
+}
+
+void LoRaClass::end()
+{
+  sleep();
+}
+
+int LoRaClass::beginPacket(int implicitHeader)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if (mode == MODE_TX)
+  {
+    return 0;
+  }
+  mode = MODE_STANDBY;
+  txLength = 0;
+  return 1;
+}
+
+int LoRaClass::endPacket(bool async)
+{
+  uint32_t duration;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    uint8_t datagram[RADIO_HEADER_LENGTH + LORA_MAX_PACKET_LENGTH];
+    datagram[0] = RADIO_TRANSMIT;
+    datagram[1] = spreadingFactor;
+    datagram[2] = codingRate;
+    datagram[3] = (uint8_t)(int8_t)txPower;
+    datagram[4] = syncWord;
+    putUInt32(datagram + 5, bandwidth);
+    putUInt32(datagram + 9, frequency);
+    memcpy(datagram + RADIO_HEADER_LENGTH, txBuffer, txLength);
+    send(socketHandle, datagram, RADIO_HEADER_LENGTH + txLength, 0);
+
+    mode = MODE_TX;
+    duration = airtime(txLength);
+  }
+
+  // The radio is busy for the time on air, then it raises TX done and goes to standby
+  auto finish = [this, duration]()
+  {
+    std::this_thread::sleep_for(std::chrono::microseconds(duration));
+    void (*callback)() = nullptr;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (mode == MODE_TX)
+      {
+        mode = MODE_STANDBY;
+      }
+      callback = txDoneCallback;
+      txFinished.notify_all();
+    }
+    if (callback)
+    {
+      callback();
+    }
+  };
+
+  if (async)
+  {
+    std::thread(finish).detach();
+  }
+  else
+  {
+    finish();
+  }
+  return 1;
+}
+
+int LoRaClass::parsePacket(int size)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if (rxDone)
+  {
+    rxDone = false;
+    memcpy(packet, rxBuffer, rxLength);
+    packetLength = rxLength;
+    packetIndex = 0;
+    mode = MODE_STANDBY;
+    return packetLength;
+  }
+  if (mode != MODE_RX_SINGLE)
+  {
+    mode = MODE_RX_SINGLE;
+  }
+  return 0;
+}
+
+int LoRaClass::packetRssi()
+{
+  return lastRssi;
+}
+
+float LoRaClass::packetSnr()
+{
+  return lastSnr;
+}
+
+long LoRaClass::packetFrequencyError()
+{
+  return lastFrequencyError;
+}
+
+int LoRaClass::rssi()
+{
+  return RADIO_NOISE_FLOOR;
+}
+
+size_t LoRaClass::write(uint8_t value)
+{
+  return write(&value, 1);
+}
+
+size_t LoRaClass::write(const uint8_t *buffer, size_t size)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  size = min(size, (size_t)LORA_MAX_PACKET_LENGTH - txLength);
+  memcpy(txBuffer + txLength, buffer, size);
+  txLength += size;
+  return size;
+}
+
+int LoRaClass::available()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return packetLength - packetIndex;
+}
+
+int LoRaClass::read()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return packetIndex < packetLength ? packet[packetIndex++] : -1;
+}
+
+int LoRaClass::peek()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return packetIndex < packetLength ? packet[packetIndex] : -1;
+}
+
+void LoRaClass::onReceive(void (*callback)(int))
+{
+  std::lock_guard<std::mutex> guard(lock);
+  receiveCallback = callback;
+}
+
+void LoRaClass::onTxDone(void (*callback)())
+{
+  std::lock_guard<std::mutex> guard(lock);
+  txDoneCallback = callback;
+}
+
+void LoRaClass::receive(int size)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  mode = MODE_RX_CONTINUOUS;
+}
+
+void LoRaClass::idle()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  mode = MODE_STANDBY;
+}
+
+void LoRaClass::sleep()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  mode = MODE_SLEEP;
+}
+
+void LoRaClass::setTxPower(int level, int outputPin)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  txPower = constrain(level, 2, 20);
+}
+
+void LoRaClass::setFrequency(long frequency)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  this->frequency = frequency;
+}
+
+void LoRaClass::setSpreadingFactor(int spreadingFactor)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  this->spreadingFactor = constrain(spreadingFactor, 6, 12);
+}
+
+void LoRaClass::setSignalBandwidth(long bandwidth)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  this->bandwidth = bandwidth;
+}
+
+void LoRaClass::setCodingRate4(int denominator)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  codingRate = constrain(denominator, 5, 8);
+}
+
+void LoRaClass::setPreambleLength(long length)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  preambleLength = length;
+}
+
+void LoRaClass::setSyncWord(int syncWord)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  this->syncWord = syncWord & 0xFF;
+}
+
+void LoRaClass::setPins(int ss, int reset, int dio0)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  this->dio0 = dio0;
+}
+
+// Semtech AN1200.13 with explicit header and without CRC, the same as frameAirtime() of the protocol library
+uint32_t LoRaClass::airtime(size_t length) const
+{
+  double symbol = (double)(1UL << spreadingFactor) / bandwidth;
+  int lowDataRate = symbol > 0.016 ? 1 : 0;
+  int numerator = 8 * (int)length - 4 * spreadingFactor + 28;
+  int denominator = 4 * (spreadingFactor - 2 * lowDataRate);
+  int blocks = numerator > 0 ? (numerator + denominator - 1) / denominator : 0;
+  return (uint32_t)(((preambleLength + 4.25) + 8 + blocks * codingRate) * symbol * 1e6);
+}
+
+void LoRaClass::receiveTask()
+{
+  uint8_t datagram[RADIO_RECEIVE_LENGTH + LORA_MAX_PACKET_LENGTH];
+  for (;;)
+  {
+    ssize_t length = recv(socketHandle, datagram, sizeof(datagram), 0);
+    if (length >= RADIO_RECEIVE_LENGTH && datagram[0] == RADIO_RECEIVE)
+    {
+      deliver(datagram, length);
+    }
+  }
+}
+
+void LoRaClass::deliver(const uint8_t *datagram, size_t length)
+{
+  bool interrupt;
+  void (*callback)(int) = nullptr;
+  size_t size = length - RADIO_RECEIVE_LENGTH;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    bool listening = mode == MODE_RX_CONTINUOUS || mode == MODE_RX_SINGLE;
+    if (!listening || datagram[1] != spreadingFactor || datagram[4] != syncWord ||
+        getUInt32(datagram + 5) != (uint32_t)bandwidth || getUInt32(datagram + 9) != (uint32_t)frequency)
+    {
+      return;
+    }
+
+    memcpy(rxBuffer, datagram + RADIO_RECEIVE_LENGTH, size);
+    rxLength = size;
+    rxDone = true;
+    lastRssi = (int16_t)(datagram[13] | datagram[14] << 8);
+    lastSnr = (int16_t)(datagram[15] | datagram[16] << 8) / 4.0f;
+    lastFrequencyError = (int32_t)getUInt32(datagram + 17);
+    if (mode == MODE_RX_SINGLE)
+    {
+      mode = MODE_STANDBY;
+    }
+    interrupt = dio0 >= 0;
+    callback = receiveCallback;
+  }
+
+  // DIO0 signals RX done, with onReceive() the library reads the frame in the interrupt
+  if (callback)
+  {
+    callback(parsePacket());
+  }
+  else if (interrupt)
+  {
+    nativeInterrupt(dio0);
+  }
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <Arduino.h>
+#include <condition_variable>
+#include <mutex>
+
+// sandeepmistry/LoRa on a simulated channel. Every frame goes as UDP datagram to native/tools/radio_channel.py
+// at NATIVE_RADIO (default 127.0.0.1:1700), which applies loss, latency and collisions and hands it to all other radios.
+// A frame is only received with the same frequency, spreading factor, bandwidth and sync word, like on the SX127x.
+
+#define LORA_MAX_PACKET_LENGTH 255
+
+class LoRaClass : public Stream
+{
+public:
+  int begin(long frequency);
+  void end();
+
+  int beginPacket(int implicitHeader = false);
+  int endPacket(bool async = false);
+
+  int parsePacket(int size = 0);
+  int packetRssi();
+  float packetSnr();
+  long packetFrequencyError();
+  int rssi();
+
+  size_t write(uint8_t value) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  int available() override;
+  int read() override;
+  int peek() override;
+  void flush() override {}
+
+  void onReceive(void (*callback)(int));
+  void onTxDone(void (*callback)());
+  void receive(int size = 0);
+  void idle();
+  void sleep();
+
+  void setTxPower(int level, int outputPin = 1);
+  void setFrequency(long frequency);
+  void setSpreadingFactor(int spreadingFactor);
+  void setSignalBandwidth(long bandwidth);
+  void setCodingRate4(int denominator);
+  void setPreambleLength(long length);
+  void setSyncWord(int syncWord);
+  void enableCrc() {}
+  void disableCrc() {}
+  void setPins(int ss, int reset, int dio0);
+
+  using Print::write;
+
+private:
+  typedef enum
+  {
+    MODE_SLEEP,
+    MODE_STANDBY,
+    MODE_TX,
+    MODE_RX_CONTINUOUS,
+    MODE_RX_SINGLE
+  } Mode;
+
+  void receiveTask();
+  void deliver(const uint8_t *datagram, size_t length);
+  uint32_t airtime(size_t length) const; // µs
+
+  std::mutex lock;
+  std::condition_variable txFinished;
+  int socketHandle = -1;
+  Mode mode = MODE_SLEEP;
+  long frequency = 0;
+  int spreadingFactor = 7;
+  long bandwidth = 125000;
+  int codingRate = 5;
+  int txPower = 17;
+  long preambleLength = 8;
+  int syncWord = 0x12;
+  int dio0 = -1;
+  void (*receiveCallback)(int) = nullptr;
+  void (*txDoneCallback)() = nullptr;
+
+  uint8_t txBuffer[LORA_MAX_PACKET_LENGTH];
+  size_t txLength = 0;
+
+  // Like the FIFO of the SX127x, a new frame overwrites one that was not read yet
+  uint8_t rxBuffer[LORA_MAX_PACKET_LENGTH];
+  size_t rxLength = 0;
+  bool rxDone = false;
+  uint8_t packet[LORA_MAX_PACKET_LENGTH];
+  size_t packetLength = 0;
+  size_t packetIndex = 0;
+  int lastRssi = 0;
+  float lastSnr = 0;
+  long lastFrequencyError = 0;
+};
+
+extern LoRaClass LoRa;
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+// Settings of the host build come from environment variables, see native/README.md
+const char *nativeSetting(const char *name, const char *fallback);
+long nativeSetting(const char *name, long fallback);
+
+// Path below NATIVE_STATE (default .native), the directory is created on first use.
+// It holds NVS and SPIFFS of the emulated device, so two firmwares need two directories.
+std::string nativeStatePath(const std::string &path);
+void nativeMakeDirectories(const std::string &path);
+
+// Raises the interrupt attached to pin as if the pin went high
+void nativeInterrupt(uint8_t pin);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The parts of ESP-IDF the firmwares use without an include of their own
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+typedef enum
+{
+  ESP_RST_UNKNOWN,
+  ESP_RST_POWERON,
+  ESP_RST_EXT,
+  ESP_RST_SW,
+  ESP_RST_PANIC,
+  ESP_RST_INT_WDT,
+  ESP_RST_TASK_WDT,
+  ESP_RST_WDT,
+  ESP_RST_DEEPSLEEP,
+  ESP_RST_BROWNOUT,
+  ESP_RST_SDIO
+} esp_reset_reason_t;
+
+typedef enum
+{
+  ESP_SLEEP_WAKEUP_UNDEFINED,
+  ESP_SLEEP_WAKEUP_ALL,
+  ESP_SLEEP_WAKEUP_EXT0,
+  ESP_SLEEP_WAKEUP_EXT1,
+  ESP_SLEEP_WAKEUP_TIMER
+} esp_sleep_wakeup_cause_t;
+
+esp_reset_reason_t esp_reset_reason();
+
+// Deep sleep restarts the process after the wake-up time, RTC memory is not kept
+esp_err_t esp_sleep_enable_timer_wakeup(uint64_t time);
+esp_sleep_wakeup_cause_t esp_sleep_get_wakeup_cause();
+void esp_deep_sleep_start() __attribute__((noreturn));
+
+int64_t esp_timer_get_time();
+uint32_t esp_random();
+
+class EspClass
+{
+public:
+  // NATIVE_MAC as 12 hex digits, otherwise derived from the process ID so every instance gets its own node ID
+  uint64_t getEfuseMac();
+
+  // The heap is emulated as 320 KB minus what malloc has handed out, only the differences are meaningful
+  uint32_t getHeapSize();
+  uint32_t getFreeHeap();
+  uint32_t getMinFreeHeap();
+  uint32_t getMaxAllocHeap() { return getFreeHeap(); }
+
+  uint32_t getCpuFreqMHz() { return 240; }
+  void restart() __attribute__((noreturn));
+
+private:
+  uint32_t minFreeHeap = UINT32_MAX;
+};
+
+extern EspClass ESP;
@@ -0,0 +1,266 @@
+#include "NativeFreeRTOS.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+unsigned long millis();
+
+#define NATIVE_LOOP_STACK 8192 // bytes, the loop task of the Arduino core
+
+struct NativeTask
+{
+  std::string name;
+  uint32_t stackDepth = 0;
+  std::mutex lock;
+  std::condition_variable notified;
+  uint32_t notifications = 0;
+};
+
+struct NativeQueue
+{
+  std::mutex lock;
+  std::condition_variable filled;
+  std::condition_variable drained;
+  std::deque<std::vector<uint8_t>> items;
+  size_t length;
+  size_t itemSize;
+};
+
+struct NativeEventGroup
+{
+  std::mutex lock;
+  std::condition_variable changed;
+  EventBits_t bits = 0;
+};
+
+// The thread that runs setup() and loop() gets its task on first use
+static thread_local NativeTask *currentTask = nullptr;
+
+// Waits on condition until ready() holds or the ticks are over, portMAX_DELAY waits forever
+template <typename Ready>
+static bool waitFor(std::condition_variable &condition, std::unique_lock<std::mutex> &lock, TickType_t ticks, Ready ready)
+{
+  if (ticks == portMAX_DELAY)
+  {
+    condition.wait(lock, ready);
+    return true;
+  }
+  return condition.wait_for(lock, std::chrono::milliseconds(ticks), ready);
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stackDepth, void *parameter, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+  NativeTask *created = new NativeTask();
+  created->name = name;
+  created->stackDepth = stackDepth;
+  // The handle has to be set before the task can use it
+  if (handle)
+  {
+    *handle = created;
+  }
+
+  std::thread([task, parameter, created]()
+              {
+    currentTask = created;
+    task(parameter); })
+      .detach();
+  return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stackDepth, void *parameter, UBaseType_t priority, TaskHandle_t *handle)
+{
+  return xTaskCreatePinnedToCore(task, name, stackDepth, parameter, priority, handle, tskNO_AFFINITY);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+TickType_t xTaskGetTickCount()
+{
+  return millis();
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+  // Threads that are no task, e.g. the one of setup() and loop(), get a handle without allocating,
+  // so the handle can also be asked for from inside malloc
+  static thread_local NativeTask threadTask;
+  if (!currentTask)
+  {
+    threadTask.name = "loopTask";
+    threadTask.stackDepth = NATIVE_LOOP_STACK;
+    currentTask = &threadTask;
+  }
+  return currentTask;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+  return (task ? task : xTaskGetCurrentTaskHandle())->stackDepth;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+  std::lock_guard<std::mutex> guard(task->lock);
+  task->notifications++;
+  task->notified.notify_all();
+  return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken)
+{
+  xTaskNotifyGive(task);
+  if (woken)
+  {
+    *woken = pdFALSE;
+  }
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+  NativeTask *task = xTaskGetCurrentTaskHandle();
+  std::unique_lock<std::mutex> lock(task->lock);
+  waitFor(task->notified, lock, ticks, [task]()
+          { return task->notifications > 0; });
+
+  uint32_t count = task->notifications;
+  if (count > 0)
+  {
+    task->notifications = clear ? 0 : count - 1;
+  }
+  return count;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize)
+{
+  NativeQueue *queue = new NativeQueue();
+  queue->length = length;
+  queue->itemSize = itemSize;
+  return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks)
+{
+  std::unique_lock<std::mutex> lock(queue->lock);
+  if (!waitFor(queue->drained, lock, ticks, [queue]()
+               { return queue->items.size() < queue->length; }))
+  {
+    return pdFALSE;
+  }
+
+  const uint8_t *bytes = (const uint8_t *)item;
+  queue->items.emplace_back(bytes, bytes + queue->itemSize);
+  queue->filled.notify_one();
+  return pdTRUE;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void *item, BaseType_t *woken)
+{
+  if (woken)
+  {
+    *woken = pdFALSE;
+  }
+  return xQueueSend(queue, item, 0);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks)
+{
+  std::unique_lock<std::mutex> lock(queue->lock);
+  if (!waitFor(queue->filled, lock, ticks, [queue]()
+               { return !queue->items.empty(); }))
+  {
+    return pdFALSE;
+  }
+
+  if (queue->itemSize > 0)
+  {
+    memcpy(item, queue->items.front().data(), queue->itemSize);
+  }
+  queue->items.pop_front();
+  queue->drained.notify_one();
+  return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+  std::lock_guard<std::mutex> guard(queue->lock);
+  return queue->items.size();
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary()
+{
+  return xQueueCreate(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex()
+{
+  SemaphoreHandle_t semaphore = xQueueCreate(1, 0);
+  xSemaphoreGive(semaphore);
+  return semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks)
+{
+  return xQueueReceive(semaphore, nullptr, ticks);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+  return xQueueSend(semaphore, nullptr, 0);
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t semaphore, BaseType_t *woken)
+{
+  return xQueueSendFromISR(semaphore, nullptr, woken);
+}
+
+EventGroupHandle_t xEventGroupCreate()
+{
+  return new NativeEventGroup();
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits)
+{
+  std::lock_guard<std::mutex> guard(group->lock);
+  group->bits |= bits;
+  group->changed.notify_all();
+  return group->bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits)
+{
+  std::lock_guard<std::mutex> guard(group->lock);
+  EventBits_t previous = group->bits;
+  group->bits &= ~bits;
+  return previous;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group)
+{
+  std::lock_guard<std::mutex> guard(group->lock);
+  return group->bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear, BaseType_t all, TickType_t ticks)
+{
+  std::unique_lock<std::mutex> lock(group->lock);
+  auto ready = [group, bits, all]()
+  {
+    return all ? (group->bits & bits) == bits : (group->bits & bits) != 0;
+  };
+  bool satisfied = waitFor(group->changed, lock, ticks, ready);
+
+  // Like FreeRTOS, the bits from before clearing are returned
+  EventBits_t result = group->bits;
+  if (satisfied && clear)
+  {
+    group->bits &= ~bits;
+  }
+  return result;
+}
@@ -0,0 +1,134 @@
+#include "Preferences.h"
+#include "Native.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#define NVS_KEY_LENGTH 15
+
+bool Preferences::begin(const char *name, bool readOnly)
+{
+  if (!name || strlen(name) > NVS_KEY_LENGTH)
+  {
+    return false;
+  }
+  this->name = name;
+  this->readOnly = readOnly;
+  started = true;
+  return true;
+}
+
+void Preferences::end()
+{
+  started = false;
+}
+
+String Preferences::path(const char *key)
+{
+  return nativeStatePath("nvs/" + std::string(name.c_str()) + "/" + key).c_str();
+}
+
+bool Preferences::clear()
+{
+  if (!started || readOnly)
+  {
+    return false;
+  }
+  std::string directory = nativeStatePath("nvs/" + std::string(name.c_str()) + "/");
+  DIR *entries = opendir(directory.c_str());
+  if (!entries)
+  {
+    return true;
+  }
+  while (dirent *entry = readdir(entries))
+  {
+    if (entry->d_name[0] != '.')
+    {
+      ::remove((directory + entry->d_name).c_str());
+    }
+  }
+  closedir(entries);
+  return true;
+}
+
+bool Preferences::remove(const char *key)
+{
+  return started && !readOnly && ::remove(path(key).c_str()) == 0;
+}
+
+bool Preferences::isKey(const char *key)
+{
+  struct stat info;
+  return started && stat(path(key).c_str(), &info) == 0;
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t length)
+{
+  if (!started || readOnly || !key || strlen(key) > NVS_KEY_LENGTH)
+  {
+    return 0;
+  }
+
+  // Written to a temporary file first, so a killed process does not leave half a value behind
+  String target = path(key);
+  String temporary = target + ".tmp";
+  FILE *file = fopen(temporary.c_str(), "wb");
+  if (!file)
+  {
+    return 0;
+  }
+  size_t written = fwrite(value, 1, length, file);
+  fclose(file);
+  if (written != length || rename(temporary.c_str(), target.c_str()) != 0)
+  {
+    return 0;
+  }
+  return written;
+}
+
+size_t Preferences::getBytes(const char *key, void *buffer, size_t length)
+{
+  if (!started)
+  {
+    return 0;
+  }
+  size_t stored = getBytesLength(key);
+  if (stored == 0 || stored > length)
+  {
+    return 0;
+  }
+  FILE *file = fopen(path(key).c_str(), "rb");
+  if (!file)
+  {
+    return 0;
+  }
+  size_t count = fread(buffer, 1, stored, file);
+  fclose(file);
+  return count;
+}
+
+size_t Preferences::getBytesLength(const char *key)
+{
+  struct stat info;
+  return started && stat(path(key).c_str(), &info) == 0 ? info.st_size : 0;
+}
+
+size_t Preferences::putString(const char *key, const char *value)
+{
+  return putBytes(key, value, strlen(value) + 1);
+}
+
+String Preferences::getString(const char *key, const String &fallback)
+{
+  size_t length = getBytesLength(key);
+  if (length == 0)
+  {
+    return fallback;
+  }
+  char *value = new char[length + 1];
+  length = getBytes(key, value, length);
+  value[length] = 0;
+  String result = length > 0 ? String(value) : fallback;
+  delete[] value;
+  return result;
+}
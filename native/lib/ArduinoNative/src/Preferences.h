@@ -0,0 +1,56 @@
+#pragma once
+
+#include <Arduino.h>
+
+// NVS as files below NATIVE_STATE/nvs/<namespace>/<key>, every value is stored as its raw bytes
+class Preferences
+{
+public:
+  bool begin(const char *name, bool readOnly = false);
+  void end();
+
+  bool clear();
+  bool remove(const char *key);
+  bool isKey(const char *key);
+
+  size_t putBytes(const char *key, const void *value, size_t length);
+  size_t getBytes(const char *key, void *buffer, size_t length);
+  size_t getBytesLength(const char *key);
+
+  size_t putString(const char *key, const char *value);
+  size_t putString(const char *key, const String &value) { return putString(key, value.c_str()); }
+  String getString(const char *key, const String &fallback = String());
+
+  size_t putBool(const char *key, bool value) { return putValue(key, (uint8_t)value); }
+  size_t putUChar(const char *key, uint8_t value) { return putValue(key, value); }
+  size_t putUShort(const char *key, uint16_t value) { return putValue(key, value); }
+  size_t putInt(const char *key, int32_t value) { return putValue(key, value); }
+  size_t putUInt(const char *key, uint32_t value) { return putValue(key, value); }
+  size_t putULong64(const char *key, uint64_t value) { return putValue(key, value); }
+  size_t putFloat(const char *key, float value) { return putValue(key, value); }
+  bool getBool(const char *key, bool fallback = false) { return getValue(key, (uint8_t)fallback); }
+  uint8_t getUChar(const char *key, uint8_t fallback = 0) { return getValue(key, fallback); }
+  uint16_t getUShort(const char *key, uint16_t fallback = 0) { return getValue(key, fallback); }
+  int32_t getInt(const char *key, int32_t fallback = 0) { return getValue(key, fallback); }
+  uint32_t getUInt(const char *key, uint32_t fallback = 0) { return getValue(key, fallback); }
+  uint64_t getULong64(const char *key, uint64_t fallback = 0) { return getValue(key, fallback); }
+  float getFloat(const char *key, float fallback = NAN) { return getValue(key, fallback); }
+
+private:
+  template <typename T>
+  size_t putValue(const char *key, T value) { return putBytes(key, &value, sizeof(value)); }
+
+  // Like NVS, a key stored with another type reads as missing
+  template <typename T>
+  T getValue(const char *key, T fallback)
+  {
+    T value;
+    return getBytesLength(key) == sizeof(value) && getBytes(key, &value, sizeof(value)) == sizeof(value) ? value : fallback;
+  }
+
+  String path(const char *key);
+
+  String name;
+  bool started = false;
+  bool readOnly = false;
+};
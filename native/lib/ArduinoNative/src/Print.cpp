@@ -0,0 +1,138 @@
+#include "Print.h"
+#include "Stream.h"
+#include "IPAddress.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <vector>
+
+unsigned long millis();
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  size_t count = 0;
+  while (size-- > 0 && write(*buffer++) == 1)
+  {
+    count++;
+  }
+  return count;
+}
+
+size_t Print::printf(const char *format, ...)
+{
+  va_list arguments;
+  va_start(arguments, format);
+  int length = vsnprintf(nullptr, 0, format, arguments);
+  va_end(arguments);
+  if (length < 0)
+  {
+    return 0;
+  }
+
+  std::vector<char> text(length + 1);
+  va_start(arguments, format);
+  vsnprintf(text.data(), text.size(), format, arguments);
+  va_end(arguments);
+  return write((const uint8_t *)text.data(), length);
+}
+
+int Stream::timedRead()
+{
+  unsigned long start = millis();
+  do
+  {
+    int value = read();
+    if (value >= 0)
+    {
+      return value;
+    }
+  } while (millis() - start < timeout);
+  return -1;
+}
+
+size_t Stream::readBytes(char *buffer, size_t length)
+{
+  size_t count = 0;
+  while (count < length)
+  {
+    int value = timedRead();
+    if (value < 0)
+    {
+      break;
+    }
+    buffer[count++] = (char)value;
+  }
+  return count;
+}
+
+String Stream::readString()
+{
+  String text;
+  int value;
+  while ((value = timedRead()) >= 0)
+  {
+    text += (char)value;
+  }
+  return text;
+}
+
+String Stream::readStringUntil(char terminator)
+{
+  String text;
+  int value;
+  while ((value = timedRead()) >= 0 && value != terminator)
+  {
+    text += (char)value;
+  }
+  return text;
+}
+
+IPAddress::IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+  bytes[0] = a;
+  bytes[1] = b;
+  bytes[2] = c;
+  bytes[3] = d;
+}
+
+IPAddress::IPAddress(uint32_t address)
+{
+  memcpy(bytes, &address, sizeof(bytes));
+}
+
+IPAddress::operator uint32_t() const
+{
+  uint32_t address;
+  memcpy(&address, bytes, sizeof(address));
+  return address;
+}
+
+bool IPAddress::fromString(const char *address)
+{
+  unsigned parts[4];
+  char rest;
+  if (sscanf(address, "%u.%u.%u.%u%c", &parts[0], &parts[1], &parts[2], &parts[3], &rest) != 4)
+  {
+    return false;
+  }
+  for (int i = 0; i < 4; i++)
+  {
+    if (parts[i] > 255)
+    {
+      return false;
+    }
+    bytes[i] = parts[i];
+  }
+  return true;
+}
+
+String IPAddress::toString() const
+{
+  char text[16];
+  snprintf(text, sizeof(text), "%u.%u.%u.%u", bytes[0], bytes[1], bytes[2], bytes[3]);
+  return text;
+}
+
+size_t IPAddress::printTo(Print &p) const
+{
+  return p.print(toString());
+}
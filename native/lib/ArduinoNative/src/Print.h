@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "WString.h"
+#include "Printable.h"
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t value) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  virtual void flush() {}
+
+  size_t write(const char *text) { return text ? write((const uint8_t *)text, strlen(text)) : 0; }
+  size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+  size_t print(const String &value) { return write(value.c_str(), value.length()); }
+  size_t print(const char *value) { return write(value); }
+  size_t print(char value) { return write((uint8_t)value); }
+  size_t print(unsigned char value, int base = DEC) { return print(String((unsigned int)value, base)); }
+  size_t print(int value, int base = DEC) { return print(String(value, base)); }
+  size_t print(unsigned int value, int base = DEC) { return print(String(value, base)); }
+  size_t print(long value, int base = DEC) { return print(String(value, base)); }
+  size_t print(unsigned long value, int base = DEC) { return print(String(value, base)); }
+  size_t print(long long value, int base = DEC) { return print(String(value, base)); }
+  size_t print(unsigned long long value, int base = DEC) { return print(String(value, base)); }
+  size_t print(double value, int decimals = 2) { return print(String(value, decimals)); }
+  size_t print(const Printable &value) { return value.printTo(*this); }
+
+  template <typename T>
+  size_t println(const T &value)
+  {
+    size_t count = print(value);
+    return count + println();
+  }
+  template <typename T>
+  size_t println(const T &value, int format)
+  {
+    size_t count = print(value, format);
+    return count + println();
+  }
+  size_t println() { return write("\r\n"); }
+};
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <Arduino.h>
+
+// The radio is simulated, so the SPI bus has nothing to do
+class SPIClass
+{
+public:
+  void begin(int8_t sck = -1, int8_t miso = -1, int8_t mosi = -1, int8_t ss = -1) {}
+  void end() {}
+};
+
+extern SPIClass SPI;
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <FS.h>
+
+// SPIFFS in NATIVE_STATE/spiffs. begin() copies the files of NATIVE_DATA (default data) that are not there yet,
+// which is what uploading the file system image does on the ESP32.
+class SPIFFSFS : public fs::FS
+{
+public:
+  bool begin(bool formatOnFail = false, const char *basePath = "/spiffs", uint8_t maxOpenFiles = 10, const char *partitionLabel = nullptr);
+  void end() {}
+  bool format();
+  size_t totalBytes();
+  size_t usedBytes();
+};
+
+extern SPIFFSFS SPIFFS;
@@ -0,0 +1,62 @@
+#include "Ticker.h"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+struct Ticker::Timer
+{
+  std::mutex lock;
+  std::condition_variable stopped;
+  bool running = true;
+};
+
+void Ticker::start(uint32_t milliseconds, bool repeat, std::function<void()> callback)
+{
+  detach();
+  std::shared_ptr<Timer> current = std::make_shared<Timer>();
+  timer = current;
+
+  // The thread keeps the timer alive, so a callback may detach or restart its own Ticker
+  std::thread([current, milliseconds, repeat, callback]()
+              {
+    auto next = std::chrono::steady_clock::now();
+    do {
+      next += std::chrono::milliseconds(milliseconds);
+      {
+        std::unique_lock<std::mutex> lock(current->lock);
+        if (current->stopped.wait_until(lock, next, [current]() { return !current->running; })) {
+          return;
+        }
+      }
+      callback();
+    } while (repeat);
+
+    std::lock_guard<std::mutex> guard(current->lock);
+    current->running = false; })
+      .detach();
+}
+
+void Ticker::detach()
+{
+  if (!timer)
+  {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> guard(timer->lock);
+    timer->running = false;
+  }
+  timer->stopped.notify_all();
+  timer.reset();
+}
+
+bool Ticker::active()
+{
+  if (!timer)
+  {
+    return false;
+  }
+  std::lock_guard<std::mutex> guard(timer->lock);
+  return timer->running;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+#include <memory>
+
+// Every Ticker runs its callback in a thread of its own, the ESP32 runs all of them in the esp_timer task
+class Ticker
+{
+public:
+  ~Ticker() { detach(); }
+
+  void attach(float seconds, void (*callback)()) { attach_ms(seconds * 1000, callback); }
+  void attach_ms(uint32_t milliseconds, void (*callback)()) { start(milliseconds, true, callback); }
+  void once(float seconds, void (*callback)()) { once_ms(seconds * 1000, callback); }
+  void once_ms(uint32_t milliseconds, void (*callback)()) { start(milliseconds, false, callback); }
+
+  template <typename T>
+  void attach_ms(uint32_t milliseconds, void (*callback)(T), T argument)
+  {
+    start(milliseconds, true, [callback, argument]()
+          { callback(argument); });
+  }
+
+  void detach();
+  bool active();
+
+private:
+  struct Timer;
+  void start(uint32_t milliseconds, bool repeat, std::function<void()> callback);
+
+  std::shared_ptr<Timer> timer;
+};
@@ -0,0 +1,227 @@
+#include "WString.h"
+#include <algorithm>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static std::string formatInteger(unsigned long long value, bool negative, unsigned char base)
+{
+  if (base < 2 || base > 36)
+  {
+    base = 10;
+  }
+  std::string digits;
+  do
+  {
+    unsigned digit = value % base;
+    digits.insert(digits.begin(), (char)(digit < 10 ? '0' + digit : 'a' + digit - 10));
+    value /= base;
+  } while (value > 0);
+  return negative ? "-" + digits : digits;
+}
+
+// Like Arduino, negative numbers are only printed with a sign in base 10
+static std::string formatSigned(long long value, unsigned char base)
+{
+  if (base == 10 && value < 0)
+  {
+    return formatInteger(-(unsigned long long)value, true, base);
+  }
+  return formatInteger((unsigned long long)value, false, base);
+}
+
+static std::string formatDecimal(double value, unsigned int decimals)
+{
+  char text[64];
+  snprintf(text, sizeof(text), "%.*f", decimals, value);
+  return text;
+}
+
+String::String(int value, unsigned char base) : buffer(base == 10 ? formatSigned(value, base) : formatInteger((unsigned int)value, false, base)) {}
+String::String(unsigned int value, unsigned char base) : buffer(formatInteger(value, false, base)) {}
+String::String(long value, unsigned char base) : buffer(base == 10 ? formatSigned(value, base) : formatInteger((unsigned long)value, false, base)) {}
+String::String(unsigned long value, unsigned char base) : buffer(formatInteger(value, false, base)) {}
+String::String(long long value, unsigned char base) : buffer(formatSigned(value, base)) {}
+String::String(unsigned long long value, unsigned char base) : buffer(formatInteger(value, false, base)) {}
+String::String(float value, unsigned int decimals) : buffer(formatDecimal(value, decimals)) {}
+String::String(double value, unsigned int decimals) : buffer(formatDecimal(value, decimals)) {}
+
+bool String::reserve(unsigned int size)
+{
+  buffer.reserve(size);
+  return true;
+}
+
+bool String::concat(const String &value)
+{
+  buffer += value.buffer;
+  return true;
+}
+
+bool String::concat(const char *value)
+{
+  if (value)
+  {
+    buffer += value;
+  }
+  return value != nullptr;
+}
+
+bool String::concat(const char *value, unsigned int length)
+{
+  if (value)
+  {
+    buffer.append(value, length);
+  }
+  return value != nullptr;
+}
+
+bool String::concat(char value)
+{
+  buffer += value;
+  return true;
+}
+
+String &String::operator=(const char *value)
+{
+  buffer = value ? value : "";
+  return *this;
+}
+
+String &String::operator+=(const String &value)
+{
+  concat(value);
+  return *this;
+}
+
+String &String::operator+=(const char *value)
+{
+  concat(value);
+  return *this;
+}
+
+String &String::operator+=(char value)
+{
+  concat(value);
+  return *this;
+}
+
+bool String::equalsIgnoreCase(const String &other) const
+{
+  return buffer.size() == other.buffer.size() && strcasecmp(buffer.c_str(), other.buffer.c_str()) == 0;
+}
+
+bool String::startsWith(const String &prefix) const
+{
+  return buffer.compare(0, prefix.buffer.size(), prefix.buffer) == 0;
+}
+
+bool String::endsWith(const String &suffix) const
+{
+  return buffer.size() >= suffix.buffer.size() && buffer.compare(buffer.size() - suffix.buffer.size(), suffix.buffer.size(), suffix.buffer) == 0;
+}
+
+int String::indexOf(char value, unsigned int from) const
+{
+  size_t index = buffer.find(value, from);
+  return index == std::string::npos ? -1 : (int)index;
+}
+
+int String::indexOf(const String &value, unsigned int from) const
+{
+  size_t index = buffer.find(value.buffer, from);
+  return index == std::string::npos ? -1 : (int)index;
+}
+
+int String::lastIndexOf(char value) const
+{
+  size_t index = buffer.rfind(value);
+  return index == std::string::npos ? -1 : (int)index;
+}
+
+String String::substring(unsigned int from) const
+{
+  return from < buffer.size() ? String(buffer.substr(from)) : String();
+}
+
+String String::substring(unsigned int from, unsigned int to) const
+{
+  if (from > to)
+  {
+    std::swap(from, to);
+  }
+  return from < buffer.size() ? String(buffer.substr(from, to - from)) : String();
+}
+
+void String::replace(const String &find, const String &replacement)
+{
+  if (find.buffer.empty())
+  {
+    return;
+  }
+  size_t index = 0;
+  while ((index = buffer.find(find.buffer, index)) != std::string::npos)
+  {
+    buffer.replace(index, find.buffer.size(), replacement.buffer);
+    index += replacement.buffer.size();
+  }
+}
+
+void String::remove(unsigned int index, unsigned int count)
+{
+  if (index < buffer.size())
+  {
+    buffer.erase(index, count);
+  }
+}
+
+void String::toLowerCase()
+{
+  std::transform(buffer.begin(), buffer.end(), buffer.begin(), [](unsigned char c)
+                 { return (char)tolower(c); });
+}
+
+void String::toUpperCase()
+{
+  std::transform(buffer.begin(), buffer.end(), buffer.begin(), [](unsigned char c)
+                 { return (char)toupper(c); });
+}
+
+void String::trim()
+{
+  size_t start = buffer.find_first_not_of(" \t\r\n");
+  size_t end = buffer.find_last_not_of(" \t\r\n");
+  buffer = start == std::string::npos ? "" : buffer.substr(start, end - start + 1);
+}
+
+long String::toInt() const
+{
+  return atol(buffer.c_str());
+}
+
+float String::toFloat() const
+{
+  return atof(buffer.c_str());
+}
+
+double String::toDouble() const
+{
+  return atof(buffer.c_str());
+}
+
+void String::toCharArray(char *destination, unsigned int size, unsigned int index) const
+{
+  getBytes((unsigned char *)destination, size, index);
+}
+
+void String::getBytes(unsigned char *destination, unsigned int size, unsigned int index) const
+{
+  if (size == 0)
+  {
+    return;
+  }
+  size_t count = index < buffer.size() ? std::min((size_t)size - 1, buffer.size() - index) : 0;
+  memcpy(destination, buffer.c_str() + index, count);
+  destination[count] = 0;
+}
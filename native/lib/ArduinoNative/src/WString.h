@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+// Arduino String on top of std::string
+class String
+{
+public:
+  String() {}
+  String(const char *value) : buffer(value ? value : "") {}
+  String(const std::string &value) : buffer(value) {}
+  explicit String(char value) : buffer(1, value) {}
+  String(int value, unsigned char base = 10);
+  String(unsigned int value, unsigned char base = 10);
+  String(long value, unsigned char base = 10);
+  String(unsigned long value, unsigned char base = 10);
+  String(long long value, unsigned char base = 10);
+  String(unsigned long long value, unsigned char base = 10);
+  String(float value, unsigned int decimals = 2);
+  String(double value, unsigned int decimals = 2);
+
+  const char *c_str() const { return buffer.c_str(); }
+  unsigned int length() const { return buffer.size(); }
+  bool isEmpty() const { return buffer.empty(); }
+  bool reserve(unsigned int size);
+
+  bool concat(const String &value);
+  bool concat(const char *value);
+  bool concat(const char *value, unsigned int length);
+  bool concat(char value);
+
+  String &operator=(const char *value);
+  String &operator+=(const String &value);
+  String &operator+=(const char *value);
+  String &operator+=(char value);
+
+  friend String operator+(const String &a, const String &b) { return String(a.buffer + b.buffer); }
+  friend String operator+(const String &a, const char *b) { return String(a.buffer + (b ? b : "")); }
+  friend String operator+(const char *a, const String &b) { return String((a ? a : "") + b.buffer); }
+  friend String operator+(const String &a, char b) { return String(a.buffer + b); }
+
+  bool operator==(const String &other) const { return buffer == other.buffer; }
+  bool operator==(const char *other) const { return buffer == (other ? other : ""); }
+  bool operator!=(const String &other) const { return !(*this == other); }
+  bool operator!=(const char *other) const { return !(*this == other); }
+  bool operator<(const String &other) const { return buffer < other.buffer; }
+  char operator[](unsigned int index) const { return index < buffer.size() ? buffer[index] : 0; }
+  char &operator[](unsigned int index) { return buffer[index]; }
+
+  bool equals(const String &other) const { return *this == other; }
+  bool equalsIgnoreCase(const String &other) const;
+  bool startsWith(const String &prefix) const;
+  bool endsWith(const String &suffix) const;
+  char charAt(unsigned int index) const { return (*this)[index]; }
+  int indexOf(char value, unsigned int from = 0) const;
+  int indexOf(const String &value, unsigned int from = 0) const;
+  int lastIndexOf(char value) const;
+  String substring(unsigned int from) const;
+  String substring(unsigned int from, unsigned int to) const;
+  void replace(const String &find, const String &replacement);
+  void remove(unsigned int index, unsigned int count = (unsigned int)-1);
+  void toLowerCase();
+  void toUpperCase();
+  void trim();
+  long toInt() const;
+  float toFloat() const;
+  double toDouble() const;
+  void toCharArray(char *destination, unsigned int size, unsigned int index = 0) const;
+  void getBytes(unsigned char *destination, unsigned int size, unsigned int index = 0) const;
+
+private:
+  std::string buffer;
+};
@@ -0,0 +1,474 @@
+#include "WiFi.h"
+#include "esp_wifi.h"
+#include "Native.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define NATIVE_CONNECT_TIMEOUT 3000 // ms, like WiFiClient on the ESP32
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // SIGPIPE is ignored by main()
+#endif
+
+typedef struct
+{
+  IPAddress ip;
+  uint16_t port;
+  uint8_t mac[6];
+  bool joined;
+} Station;
+
+typedef struct
+{
+  arduino_event_id_t event;
+  WiFiEventFuncCb callback;
+} EventHandler;
+
+WiFiClass WiFi;
+
+static std::recursive_mutex wifiMutex;
+static std::vector<EventHandler> handlers;
+static std::vector<Station> stations;
+static wifi_mode_t wifiMode = WIFI_OFF;
+static bool stationConnected = false;
+static uint32_t apGeneration = 0;
+static String hostname = "esp32";
+
+static void dispatch(arduino_event_id_t event, const arduino_event_info_t &info)
+{
+  std::vector<EventHandler> copy;
+  {
+    std::lock_guard<std::recursive_mutex> guard(wifiMutex);
+    copy = handlers;
+  }
+  for (const EventHandler &handler : copy)
+  {
+    if (handler.event == event || handler.event == ARDUINO_EVENT_MAX)
+    {
+      handler.callback(event, info);
+    }
+  }
+}
+
+static void loadStations()
+{
+  stations.clear();
+  String list = nativeSetting("NATIVE_STATIONS", "");
+  while (list.length() > 0)
+  {
+    int separator = list.indexOf(',');
+    String entry = separator >= 0 ? list.substring(0, separator) : list;
+    list = separator >= 0 ? list.substring(separator + 1) : String();
+    entry.trim();
+
+    int colon = entry.indexOf(':');
+    Station station = {};
+    if (!station.ip.fromString(colon >= 0 ? entry.substring(0, colon) : entry))
+    {
+      continue;
+    }
+    station.port = colon >= 0 ? entry.substring(colon + 1).toInt() : 80;
+
+    // Locally administered MAC address that ends with the IP of the station
+    station.mac[0] = 0x02;
+    station.mac[1] = 0x4E;
+    for (int i = 0; i < 4; i++)
+    {
+      station.mac[2 + i] = station.ip[i];
+    }
+    stations.push_back(station);
+  }
+}
+
+static void leaveStations()
+{
+  std::vector<Station> left;
+  {
+    std::lock_guard<std::recursive_mutex> guard(wifiMutex);
+    for (Station &station : stations)
+    {
+      if (station.joined)
+      {
+        station.joined = false;
+        left.push_back(station);
+      }
+    }
+  }
+  for (const Station &station : left)
+  {
+    arduino_event_info_t info = {};
+    memcpy(info.wifi_ap_stadisconnected.mac, station.mac, 6);
+    dispatch(ARDUINO_EVENT_WIFI_AP_STADISCONNECTED, info);
+  }
+}
+
+// Stations join one after another, like meters that boot at different times
+static void joinStations(uint32_t generation)
+{
+  long joinDelay = nativeSetting("NATIVE_STATION_DELAY", 2000L);
+  for (size_t i = 0;; i++)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(joinDelay));
+    Station station;
+    {
+      std::lock_guard<std::recursive_mutex> guard(wifiMutex);
+      if (generation != apGeneration || i >= stations.size())
+      {
+        return;
+      }
+      stations[i].joined = true;
+      station = stations[i];
+    }
+
+    arduino_event_info_t info = {};
+    memcpy(info.wifi_ap_staconnected.mac, station.mac, 6);
+    dispatch(ARDUINO_EVENT_WIFI_AP_STACONNECTED, info);
+    info = {};
+    info.wifi_ap_staipassigned.ip.addr = station.ip;
+    dispatch(ARDUINO_EVENT_WIFI_AP_STAIPASSIGNED, info);
+  }
+}
+
+bool WiFiClass::mode(wifi_mode_t mode)
+{
+  std::lock_guard<std::recursive_mutex> guard(wifiMutex);
+  wifiMode = mode;
+  return true;
+}
+
+wifi_mode_t WiFiClass::getMode()
+{
+  std::lock_guard<std::recursive_mutex> guard(wifiMutex);
+  return wifiMode;
+}
+
+wl_status_t WiFiClass::begin(const char *ssid, const char *password)
+{
+  {
+    std::lock_guard<std::recursive_mutex> guard(wifiMutex);
+    wifiMode = wifiMode == WIFI_AP ? WIFI_AP_STA : WIFI_STA;
+    stationConnected = true;
+  }
+  arduino_event_info_t info = {};
+  dispatch(ARDUINO_EVENT_WIFI_STA_CONNECTED, info);
+  dispatch(ARDUINO_EVENT_WIFI_STA_GOT_IP, info);
+  return WL_CONNECTED;
+}
+
+bool WiFiClass::disconnect(bool wifiOff)
+{
+  bool connected;
+  {
+    std::lock_guard<std::recursive_mutex> guard(wifiMutex);
+    connected = stationConnected;
+    stationConnected = false;
+  }
+  if (connected)
+  {
+    arduino_event_info_t info = {};
+    dispatch(ARDUINO_EVENT_WIFI_STA_DISCONNECTED, info);
+  }
+  return true;
+}
+
+bool WiFiClass::reconnect()
+{
+  begin(nullptr, nullptr);
+  return true;
+}
+
+wl_status_t WiFiClass::status()
+{
+  std::lock_guard<std::recursive_mutex> guard(wifiMutex);
+  return stationConnected ? WL_CONNECTED : WL_DISCONNECTED;
+}
+
+IPAddress WiFiClass::localIP()
+{
+  return status() == WL_CONNECTED ? IPAddress(127, 0, 0, 1) : IPAddress();
+}
+
+bool WiFiClass::setHostname(const char *name)
+{
+  std::lock_guard<std::recursive_mutex> guard(wifiMutex);
+  hostname = name;
+  return true;
+}
+
+const char *WiFiClass::getHostname()
+{
+  std::lock_guard<std::recursive_mutex> guard(wifiMutex);
+  return hostname.c_str();
+}
+
+String WiFiClass::macAddress()
+{
+  uint64_t efuse = ESP.getEfuseMac();
+  char text[18];
+  snprintf(text, sizeof(text), "%02X:%02X:%02X:%02X:%02X:%02X",
+           (uint8_t)efuse, (uint8_t)(efuse >> 8), (uint8_t)(efuse >> 16), (uint8_t)(efuse >> 24), (uint8_t)(efuse >> 32), (uint8_t)(efuse >> 40));
+  return text;
+}
+
+int8_t WiFiClass::RSSI()
+{
+  return status() == WL_CONNECTED ? -55 : 0;
+}
+
+bool WiFiClass::softAP(const char *ssid, const char *password)
+{
+  // Restarting the AP drops the stations, they join again
+  leaveStations();
+
+  std::lock_guard<std::recursive_mutex> guard(wifiMutex);
+  wifiMode = wifiMode == WIFI_STA ? WIFI_AP_STA : WIFI_AP;
+  loadStations();
+  std::thread(joinStations, ++apGeneration).detach();
+  return true;
+}
+
+bool WiFiClass::softAPdisconnect(bool wifiOff)
+{
+  leaveStations();
+
+  std::lock_guard<std::recursive_mutex> guard(wifiMutex);
+  apGeneration++;
+  wifiMode = wifiMode == WIFI_AP_STA ? WIFI_STA : (wifiMode == WIFI_AP ? WIFI_OFF : wifiMode);
+  return true;
+}
+
+IPAddress WiFiClass::softAPIP()
+{
+  return IPAddress(127, 0, 0, 1);
+}
+
+uint8_t WiFiClass::softAPgetStationNum()
+{
+  std::lock_guard<std::recursive_mutex> guard(wifiMutex);
+  uint8_t count = 0;
+  for (const Station &station : stations)
+  {
+    count += station.joined;
+  }
+  return count;
+}
+
+int WiFiClass::onEvent(WiFiEventFuncCb callback, arduino_event_id_t event)
+{
+  std::lock_guard<std::recursive_mutex> guard(wifiMutex);
+  handlers.push_back({event, callback});
+  return handlers.size();
+}
+
+uint16_t nativeStationPort(const String &host)
+{
+  IPAddress ip;
+  if (!ip.fromString(host))
+  {
+    return 80;
+  }
+  std::lock_guard<std::recursive_mutex> guard(wifiMutex);
+  for (const Station &station : stations)
+  {
+    if (station.ip == ip)
+    {
+      return station.port;
+    }
+  }
+  return 80;
+}
+
+esp_err_t esp_wifi_ap_get_sta_list(wifi_sta_list_t *list)
+{
+  std::lock_guard<std::recursive_mutex> guard(wifiMutex);
+  list->num = 0;
+  for (const Station &station : stations)
+  {
+    if (station.joined && list->num < ESP_WIFI_MAX_CONN_NUM)
+    {
+      memcpy(list->sta[list->num].mac, station.mac, 6);
+      list->sta[list->num].rssi = -40;
+      list->num++;
+    }
+  }
+  return ESP_OK;
+}
+
+esp_err_t tcpip_adapter_get_sta_list(const wifi_sta_list_t *wifiList, tcpip_adapter_sta_list_t *list)
+{
+  std::lock_guard<std::recursive_mutex> guard(wifiMutex);
+  list->num = 0;
+  for (int i = 0; i < wifiList->num; i++)
+  {
+    for (const Station &station : stations)
+    {
+      if (memcmp(station.mac, wifiList->sta[i].mac, 6) == 0)
+      {
+        memcpy(list->sta[list->num].mac, station.mac, 6);
+        list->sta[list->num].ip.addr = station.ip;
+        list->num++;
+      }
+    }
+  }
+  return ESP_OK;
+}
+
+int WiFiClient::connect(IPAddress ip, uint16_t port)
+{
+  return connect(ip.toString().c_str(), port, NATIVE_CONNECT_TIMEOUT);
+}
+
+int WiFiClient::connect(const char *host, uint16_t port)
+{
+  return connect(host, port, NATIVE_CONNECT_TIMEOUT);
+}
+
+int WiFiClient::connect(const char *host, uint16_t port, int32_t timeout)
+{
+  stop();
+
+  addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *address = nullptr;
+  if (getaddrinfo(host, String(port).c_str(), &hints, &address) != 0 || !address)
+  {
+    return 0;
+  }
+
+  int handle = socket(AF_INET, SOCK_STREAM, 0);
+  if (handle < 0)
+  {
+    freeaddrinfo(address);
+    return 0;
+  }
+
+  // Connect without blocking longer than the timeout, the socket blocks again afterwards
+  int flags = fcntl(handle, F_GETFL, 0);
+  fcntl(handle, F_SETFL, flags | O_NONBLOCK);
+  int result = ::connect(handle, address->ai_addr, address->ai_addrlen);
+  freeaddrinfo(address);
+  if (result != 0 && errno == EINPROGRESS)
+  {
+    pollfd writable = {handle, POLLOUT, 0};
+    int error = 0;
+    socklen_t length = sizeof(error);
+    result = poll(&writable, 1, timeout) == 1 && getsockopt(handle, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0 ? 0 : -1;
+  }
+  if (result != 0)
+  {
+    close(handle);
+    return 0;
+  }
+  fcntl(handle, F_SETFL, flags);
+
+  int enabled = 1;
+  setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+  socketHandle = std::shared_ptr<int>(new int(handle), [](int *handle)
+                                      {
+    if (*handle >= 0) {
+      close(*handle);
+    }
+    delete handle; });
+  return 1;
+}
+
+size_t WiFiClient::write(uint8_t value)
+{
+  return write(&value, 1);
+}
+
+size_t WiFiClient::write(const uint8_t *buffer, size_t size)
+{
+  if (!socketHandle || *socketHandle < 0)
+  {
+    return 0;
+  }
+  size_t written = 0;
+  while (written < size)
+  {
+    ssize_t sent = send(*socketHandle, buffer + written, size - written, MSG_NOSIGNAL);
+    if (sent <= 0)
+    {
+      stop();
+      break;
+    }
+    written += sent;
+  }
+  return written;
+}
+
+int WiFiClient::available()
+{
+  int count = 0;
+  if (!socketHandle || *socketHandle < 0 || ioctl(*socketHandle, FIONREAD, &count) != 0)
+  {
+    return 0;
+  }
+  return count;
+}
+
+int WiFiClient::read()
+{
+  uint8_t value;
+  return read(&value, 1) == 1 ? value : -1;
+}
+
+int WiFiClient::read(uint8_t *buffer, size_t size)
+{
+  if (!socketHandle || *socketHandle < 0)
+  {
+    return -1;
+  }
+  ssize_t count = recv(*socketHandle, buffer, size, MSG_DONTWAIT);
+  return count > 0 ? count : -1;
+}
+
+int WiFiClient::peek()
+{
+  uint8_t value;
+  if (!socketHandle || *socketHandle < 0 || recv(*socketHandle, &value, 1, MSG_PEEK | MSG_DONTWAIT) != 1)
+  {
+    return -1;
+  }
+  return value;
+}
+
+void WiFiClient::stop()
+{
+  if (socketHandle && *socketHandle >= 0)
+  {
+    close(*socketHandle);
+    *socketHandle = -1;
+  }
+  socketHandle.reset();
+}
+
+uint8_t WiFiClient::connected()
+{
+  if (!socketHandle || *socketHandle < 0)
+  {
+    return 0;
+  }
+
+  // Data that is still buffered counts as connected, like on the ESP32
+  uint8_t value;
+  ssize_t count = recv(*socketHandle, &value, 1, MSG_PEEK | MSG_DONTWAIT);
+  return count > 0 || (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+int WiFiClient::setNoDelay(bool noDelay)
+{
+  int enabled = noDelay;
+  return socketHandle && *socketHandle >= 0 ? setsockopt(*socketHandle, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled)) : -1;
+}
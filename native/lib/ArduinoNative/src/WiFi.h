@@ -0,0 +1,129 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Client.h>
+#include <functional>
+#include <memory>
+
+// WiFi of the host. The station interface is always connected to the network of the host.
+// The access point has the stations listed in NATIVE_STATIONS, e.g. "127.0.0.2:8080,127.0.0.3:8080",
+// which join one after another after softAP() with the port their web server listens on.
+
+typedef enum
+{
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_CONNECTION_LOST = 5,
+  WL_DISCONNECTED = 6
+} wl_status_t;
+
+typedef enum
+{
+  WIFI_OFF,
+  WIFI_STA,
+  WIFI_AP,
+  WIFI_AP_STA
+} wifi_mode_t;
+
+typedef enum
+{
+  ARDUINO_EVENT_WIFI_READY,
+  ARDUINO_EVENT_WIFI_STA_START,
+  ARDUINO_EVENT_WIFI_STA_CONNECTED,
+  ARDUINO_EVENT_WIFI_STA_DISCONNECTED,
+  ARDUINO_EVENT_WIFI_STA_GOT_IP,
+  ARDUINO_EVENT_WIFI_STA_LOST_IP,
+  ARDUINO_EVENT_WIFI_AP_START,
+  ARDUINO_EVENT_WIFI_AP_STOP,
+  ARDUINO_EVENT_WIFI_AP_STACONNECTED,
+  ARDUINO_EVENT_WIFI_AP_STADISCONNECTED,
+  ARDUINO_EVENT_WIFI_AP_STAIPASSIGNED,
+  ARDUINO_EVENT_MAX
+} arduino_event_id_t;
+
+typedef struct
+{
+  uint32_t addr;
+} esp_ip4_addr_t;
+
+typedef struct
+{
+  uint8_t mac[6];
+  uint8_t aid;
+} wifi_event_ap_staconnected_t;
+
+typedef wifi_event_ap_staconnected_t wifi_event_ap_stadisconnected_t;
+
+typedef struct
+{
+  esp_ip4_addr_t ip;
+} ip_event_ap_staipassigned_t;
+
+typedef union
+{
+  wifi_event_ap_staconnected_t wifi_ap_staconnected;
+  wifi_event_ap_stadisconnected_t wifi_ap_stadisconnected;
+  ip_event_ap_staipassigned_t wifi_ap_staipassigned;
+} arduino_event_info_t;
+
+typedef arduino_event_id_t WiFiEvent_t;
+typedef arduino_event_info_t WiFiEventInfo_t;
+typedef std::function<void(arduino_event_id_t event, arduino_event_info_t info)> WiFiEventFuncCb;
+
+class WiFiClass
+{
+public:
+  bool mode(wifi_mode_t mode);
+  wifi_mode_t getMode();
+
+  wl_status_t begin(const char *ssid, const char *password = nullptr);
+  bool disconnect(bool wifiOff = false);
+  bool reconnect();
+  bool setAutoReconnect(bool autoReconnect) { return true; }
+  wl_status_t status();
+  bool isConnected() { return status() == WL_CONNECTED; }
+  IPAddress localIP();
+  bool setHostname(const char *hostname);
+  const char *getHostname();
+  String macAddress();
+  int8_t RSSI();
+
+  bool softAP(const char *ssid, const char *password = nullptr);
+  bool softAPdisconnect(bool wifiOff = false);
+  IPAddress softAPIP();
+  uint8_t softAPgetStationNum();
+
+  int onEvent(WiFiEventFuncCb callback, arduino_event_id_t event = ARDUINO_EVENT_MAX);
+};
+
+extern WiFiClass WiFi;
+
+// Port of the web server of a station, 80 for every other host
+uint16_t nativeStationPort(const String &host);
+
+class WiFiClient : public Client
+{
+public:
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(const char *host, uint16_t port) override;
+  int connect(const char *host, uint16_t port, int32_t timeout);
+  size_t write(uint8_t value) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  int available() override;
+  int read() override;
+  int read(uint8_t *buffer, size_t size) override;
+  int peek() override;
+  void flush() override {}
+  void stop() override;
+  uint8_t connected() override;
+  operator bool() override { return connected(); }
+  int setNoDelay(bool noDelay);
+
+  using Print::write;
+
+private:
+  // Copies share the socket like on the ESP32
+  std::shared_ptr<int> socketHandle;
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <WiFi.h>
+
+// Station list of the access point, filled from NATIVE_STATIONS
+
+#define ESP_WIFI_MAX_CONN_NUM 10
+
+typedef struct
+{
+  uint8_t mac[6];
+  int8_t rssi;
+} wifi_sta_info_t;
+
+typedef struct
+{
+  wifi_sta_info_t sta[ESP_WIFI_MAX_CONN_NUM];
+  int num;
+} wifi_sta_list_t;
+
+typedef struct
+{
+  uint8_t mac[6];
+  esp_ip4_addr_t ip;
+} tcpip_adapter_sta_info_t;
+
+typedef struct
+{
+  tcpip_adapter_sta_info_t sta[ESP_WIFI_MAX_CONN_NUM];
+  int num;
+} tcpip_adapter_sta_list_t;
+
+esp_err_t esp_wifi_ap_get_sta_list(wifi_sta_list_t *list);
+esp_err_t tcpip_adapter_get_sta_list(const wifi_sta_list_t *wifiList, tcpip_adapter_sta_list_t *list);
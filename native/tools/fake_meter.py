@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""Simulated AI-on-the-edge watermeter for the native sender.
+
+Serves /json like AI-on-the-edge-device with a reading that grows by a random
+flow every round. Between rounds the same answer and ETag are returned, a
+request with a matching If-None-Match gets 304:
+
+    ./fake_meter.py --address 127.0.0.2 --port 8090 --value 123.4567 --round 60
+
+The native sender finds the meter through NATIVE_STATIONS, e.g.
+NATIVE_STATIONS=127.0.0.2:8090,127.0.0.3:8090 for two meters.
+"""
+
+import argparse
+import json
+import random
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+class Meter:
+    def __init__(self, args):
+        self.args = args
+        self.random = random.Random(args.seed)
+        self.lock = threading.Lock()
+        self.value = args.value
+        self.previous = args.value
+        self.rate = 0.0
+        self.round = 0
+        self.updated = time.time()
+
+    def update(self):
+        """Computes the rounds that passed since the last request, like the meter does on its own timer."""
+        with self.lock:
+            now = time.time()
+            while now - self.updated >= self.args.round:
+                self.updated += self.args.round
+                self.previous = self.value
+                flowing = self.random.random() < self.args.usage
+                self.rate = self.random.uniform(0.001, self.args.max_rate) if flowing else 0.0
+                self.value = round(self.value + self.rate * self.args.round / 60, 4)
+                self.round += 1
+            return self.round, self.snapshot()
+
+    def snapshot(self):
+        timestamp = time.strftime("%Y-%m-%dT%H:%M:%S%z", time.localtime(self.updated))
+        error = "no error"
+        raw = "%.4f" % self.value
+        if self.args.error_rate and self.random.random() < self.args.error_rate:
+            error = "Neg. Rate - Read: 0.0000 - Raw: %s - Pre: %.4f" % (raw, self.previous)
+            raw = raw[:-1] + "N"
+        return {
+            "main": {
+                "value": "%.4f" % self.value,
+                "raw": raw,
+                "pre": "%.4f" % self.previous,
+                "error": error,
+                "rate": "%.6f" % self.rate,
+                "timestamp": timestamp,
+            }
+        }
+
+
+def handler(meter):
+    class MeterHandler(BaseHTTPRequestHandler):
+        protocol_version = "HTTP/1.1"
+
+        def do_GET(self):
+            if self.path.split("?")[0] != "/json":
+                self.send_error(404)
+                return
+            number, reading = meter.update()
+            etag = '"%d"' % number
+            if self.headers.get("If-None-Match") == etag:
+                self.send_response(304)
+                self.send_header("ETag", etag)
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+
+            body = json.dumps(reading).encode()
+            self.send_response(200)
+            self.send_header("Content-Type", "application/json")
+            self.send_header("ETag", etag)
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def log_message(self, format, *args):
+            if meter.args.verbose:
+                super().log_message(format, *args)
+
+    return MeterHandler
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--address", default="127.0.0.2", help="address the sender polls, one per meter")
+    parser.add_argument("--port", type=int, default=8090, help="port given in NATIVE_STATIONS")
+    parser.add_argument("--value", type=float, default=100.0, help="start value in m3")
+    parser.add_argument("--round", type=float, default=60.0, help="seconds between two readings of the meter")
+    parser.add_argument("--usage", type=float, default=0.3, help="probability that water flows in a round")
+    parser.add_argument("--max-rate", type=float, default=0.015, help="highest flow in m3/min")
+    parser.add_argument("--error-rate", type=float, default=0.0, help="probability of a reading with an error")
+    parser.add_argument("--seed", type=int, help="seed for repeatable runs")
+    parser.add_argument("--verbose", action="store_true", help="log every request")
+    args = parser.parse_args()
+
+    server = ThreadingHTTPServer((args.address, args.port), handler(Meter(args)))
+    print("Watermeter on http://%s:%d/json" % (args.address, args.port), flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    sys.exit(main())
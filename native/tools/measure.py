@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+"""End-to-end throughput and latency of the native sender and gateway.
+
+Subscribes to the reading topics of the gateway with mosquitto_sub and joins
+every published reading by node and packet number with the frame log of
+radio_channel.py. Latency is measured from the start of the first
+transmission of a packet to its arrival at the broker, so it contains the
+time on air, the channel latency, retransmissions and the gateway:
+
+    ./radio_channel.py --log channel.csv &
+    ./measure.py --log channel.csv --duration 600
+
+Stop it with Ctrl-C or let --duration run out to get the summary.
+"""
+
+import argparse
+import csv
+import json
+import subprocess
+import sys
+import threading
+import time
+
+UPLINK_TYPES = {"1", "2", "3", "9", "10", "11"}  # reading, delta and batch frames, plain and secured
+
+
+def read_uplinks(path):
+    """Times of the transmissions of every packet, retransmissions keep the packet number."""
+    uplinks = {}
+    with open(path, newline="") as log:
+        for row in csv.DictReader(log):
+            if row["type"] in UPLINK_TYPES:
+                uplinks.setdefault((row["node"], int(row["sequence"])), []).append(float(row["time"]))
+    return uplinks
+
+
+def percentile(values, fraction):
+    values = sorted(values)
+    return values[min(int(fraction * len(values)), len(values) - 1)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--log", required=True, help="CSV frame log of radio_channel.py")
+    parser.add_argument("--host", default="127.0.0.1", help="MQTT broker of the gateway")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--channel", default="esp32-lora-gw", help="MQTT channel of the gateway")
+    parser.add_argument("--duration", type=float, help="seconds to measure, default until Ctrl-C")
+    args = parser.parse_args()
+
+    command = ["mosquitto_sub", "-h", args.host, "-p", str(args.port), "-v",
+               "-t", args.channel + "/+/state", "-t", args.channel + "/+/meter/+", "-t", args.channel + "/backlog"]
+    subscriber = subprocess.Popen(command, stdout=subprocess.PIPE, text=True)
+    started = time.time()
+    arrivals = {}
+    if args.duration:
+        timer = threading.Timer(args.duration, subscriber.terminate)
+        timer.daemon = True
+        timer.start()
+
+    # Retained messages arrive right after subscribing and belong to an earlier run
+    settle = started + 1
+    try:
+        for line in subscriber.stdout:
+            now = time.time()
+            if now < settle:
+                continue
+            _, _, payload = line.partition(" ")
+            try:
+                reading = json.loads(payload)
+                key = (reading["node"], int(reading["packet_number"]))
+            except (ValueError, KeyError):
+                continue
+            arrivals.setdefault(key, now)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        subscriber.terminate()
+
+    elapsed = time.time() - started
+    sent = {key: times for key, times in read_uplinks(args.log).items() if times[0] >= settle}
+    attempts = sum(len(times) for times in sent.values())
+    latencies = [arrivals[key] - times[0] for key, times in sent.items() if key in arrivals]
+
+    print("%d packets sent in %d transmissions, %d published in %.0f s (%.1f readings/min)" %
+          (len(sent), attempts, len(arrivals), elapsed, 60 * len(arrivals) / elapsed))
+    if sent:
+        print("Delivery ratio %.1f%%" % (100 * len(latencies) / len(sent)))
+    if latencies:
+        print("Latency ms: min %.0f, median %.0f, p95 %.0f, max %.0f" %
+              (1000 * min(latencies), 1000 * percentile(latencies, 0.5), 1000 * percentile(latencies, 0.95),
+               1000 * max(latencies)))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
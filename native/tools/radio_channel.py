@@ -0,0 +1,226 @@
+#!/usr/bin/env python3
+"""Simulated LoRa channel between the native builds of sender and gateway.
+
+Every native firmware sends its frames as UDP datagrams to this hub, which
+holds them for their time on air and hands them to all other radios:
+
+    ./radio_channel.py --loss 0.05 --snr 4 --log channel.csv
+
+A frame is lost if it overlaps another frame on the same frequency, spreading
+factor and bandwidth, if its SNR is below the demodulation floor of its
+spreading factor, or at random with the given loss rate. RSSI and SNR are
+given for 17 dBm at 125 kHz and follow the TX power and bandwidth of each
+frame, --node-snr sets the SNR of a single sender to try adaptive data rate
+with senders at different distances.
+
+Datagrams, all integers little endian:
+    'H'                                          radio -> hub, announces the radio
+    'T' SF CR power sync bandwidth(4) frequency(4) payload
+                                                 radio -> hub, frame sent
+    'R' SF CR power sync bandwidth(4) frequency(4) RSSI(2) SNR*4(2) frequency error(4) payload
+                                                 hub -> radio, frame received
+"""
+
+import argparse
+import csv
+import heapq
+import itertools
+import math
+import random
+import socket
+import struct
+import sys
+import time
+
+HEADER = struct.Struct("<cBBbBII")
+RECEPTION = struct.Struct("<hhi")
+REFERENCE_POWER = 17  # dBm
+REFERENCE_BANDWIDTH = 125000  # Hz
+PREAMBLE_LENGTH = 8
+MAX_PACKET_LENGTH = 255
+FRAME_TYPE_LINK = 0x4  # downlink of the gateway, answers an uplink of the node
+FRAME_TYPE_SECURED = 0x8  # set on top of the type of encrypted and authenticated frames
+
+
+def airtime(length, spreading_factor, bandwidth, coding_rate):
+    """Seconds on air with explicit header and without CRC, like frameAirtime() of the protocol library."""
+    symbol = (1 << spreading_factor) / bandwidth
+    low_data_rate = 1 if symbol > 0.016 else 0
+    numerator = 8 * length - 4 * spreading_factor + 28
+    denominator = 4 * (spreading_factor - 2 * low_data_rate)
+    blocks = -(-numerator // denominator) if numerator > 0 else 0
+    return (PREAMBLE_LENGTH + 4.25 + 8 + blocks * coding_rate) * symbol
+
+
+def required_snr(spreading_factor):
+    return -7.5 - 2.5 * (spreading_factor - 7)
+
+
+def describe(payload):
+    """Type, node and packet number of a watermeter frame, the version is in the upper nibble of the first byte."""
+    if len(payload) < 6 or payload[0] >> 4 < 3:
+        return None, None, None
+    return payload[0] & 0x0F, payload[4] | payload[5] << 8, payload[2] | payload[3] << 8
+
+
+class Frame:
+    def __init__(self, source, header, payload, start):
+        _, self.spreading_factor, self.coding_rate, self.power, self.sync_word, self.bandwidth, self.frequency = header
+        self.source = source
+        self.payload = payload
+        self.start = start
+        self.sent = time.time()
+        self.end = start + airtime(len(payload), self.spreading_factor, self.bandwidth, self.coding_rate)
+        self.collided = False
+        self.type, self.node, self.sequence = describe(payload)
+
+    def overlaps(self, other):
+        return (self.frequency == other.frequency and self.spreading_factor == other.spreading_factor and
+                self.bandwidth == other.bandwidth and self.start < other.end and other.start < self.end)
+
+
+class Channel:
+    def __init__(self, args):
+        self.args = args
+        self.random = random.Random(args.seed)
+        self.peers = {}
+        self.on_air = []
+        self.pending = []
+        self.order = itertools.count()
+        self.started = time.monotonic()
+        self.busy = 0.0
+        self.counts = {"frames": 0, "delivered": 0, "collided": 0, "weak": 0, "lost": 0}
+        self.nodes = {}
+        self.log = None
+        if args.log:
+            self.log_file = open(args.log, "w", newline="")
+            self.log = csv.writer(self.log_file)
+            self.log.writerow(("time", "type", "node", "sequence", "length", "spreading_factor", "bandwidth", "tx_power",
+                               "airtime_ms", "snr", "outcome"))
+
+    def transmit(self, source, datagram, now):
+        if len(datagram) < HEADER.size or len(datagram) > HEADER.size + MAX_PACKET_LENGTH:
+            return
+        frame = Frame(source, HEADER.unpack_from(datagram), datagram[HEADER.size:], now)
+        self.on_air = [other for other in self.on_air if other.end > now]
+        if not self.args.no_collisions:
+            for other in self.on_air:
+                if other.overlaps(frame):
+                    other.collided = frame.collided = True
+        self.on_air.append(frame)
+        heapq.heappush(self.pending, (frame.end + self.args.latency / 1000, next(self.order), frame))
+
+    def snr(self, frame):
+        reference = self.args.snr
+        if frame.node is not None and frame.node in self.args.node_snr:
+            reference = self.args.node_snr[frame.node]
+        return (reference + frame.power - REFERENCE_POWER - 10 * math.log10(frame.bandwidth / REFERENCE_BANDWIDTH) +
+                self.random.gauss(0, self.args.jitter))
+
+    def deliver(self, sock, frame):
+        snr = self.snr(frame)
+        rssi = self.args.rssi + frame.power - REFERENCE_POWER + self.random.gauss(0, self.args.jitter)
+        if frame.collided:
+            outcome = "collided"
+        elif snr < required_snr(frame.spreading_factor):
+            outcome = "weak"
+        elif self.random.random() < self.args.loss:
+            outcome = "lost"
+        else:
+            outcome = "delivered"
+            header = HEADER.pack(b"R", frame.spreading_factor, frame.coding_rate, frame.power, frame.sync_word,
+                                 frame.bandwidth, frame.frequency)
+            reception = RECEPTION.pack(round(rssi), round(snr * 4), self.random.randint(-2000, 2000))
+            for peer in self.peers:
+                if peer != frame.source:
+                    sock.sendto(header + reception + frame.payload, peer)
+
+        duration = frame.end - frame.start
+        self.busy += duration
+        self.counts["frames"] += 1
+        self.counts[outcome] += 1
+        if frame.node is not None and frame.type & ~FRAME_TYPE_SECURED != FRAME_TYPE_LINK:
+            node = self.nodes.setdefault(frame.node, {"frames": 0, "delivered": 0, "airtime": 0.0})
+            node["frames"] += 1
+            node["delivered"] += outcome == "delivered"
+            node["airtime"] += duration
+        if self.log:
+            node = "%04x" % frame.node if frame.node is not None else ""
+            self.log.writerow((round(frame.sent, 3), frame.type, node, frame.sequence, len(frame.payload),
+                               frame.spreading_factor, frame.bandwidth, frame.power, round(duration * 1000, 1),
+                               round(snr, 1), outcome))
+            self.log_file.flush()
+
+    def report(self):
+        elapsed = max(time.monotonic() - self.started, 1e-9)
+        counts = self.counts
+        print("%d frames: %d delivered, %d collided, %d too weak, %d lost, channel busy %.2f%%" %
+              (counts["frames"], counts["delivered"], counts["collided"], counts["weak"], counts["lost"],
+               100 * self.busy / elapsed), flush=True)
+        for node, stats in sorted(self.nodes.items()):
+            print("  node %04x: %d frames, %d delivered, duty cycle %.2f%%" %
+                  (node, stats["frames"], stats["delivered"], 100 * stats["airtime"] / elapsed), flush=True)
+
+    def run(self, sock):
+        next_report = time.monotonic() + self.args.report
+        while True:
+            now = time.monotonic()
+            while self.pending and self.pending[0][0] <= now:
+                self.deliver(sock, heapq.heappop(self.pending)[2])
+            if now >= next_report:
+                self.report()
+                next_report = now + self.args.report
+
+            deadline = min(self.pending[0][0] if self.pending else next_report, next_report)
+            sock.settimeout(max(deadline - now, 0.001))
+            try:
+                datagram, source = sock.recvfrom(HEADER.size + RECEPTION.size + MAX_PACKET_LENGTH)
+            except socket.timeout:
+                continue
+
+            if source not in self.peers:
+                print("Radio %s:%d joined" % source, flush=True)
+            self.peers[source] = time.monotonic()
+            if datagram[:1] == b"T":
+                self.transmit(source, datagram, time.monotonic())
+
+
+def parse_node_snr(value):
+    node, _, snr = value.partition("=")
+    try:
+        return int(node, 16), float(snr)
+    except ValueError:
+        raise argparse.ArgumentTypeError("expected NODE=SNR with the node ID in hex, e.g. 1a2b=-12")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--listen", default="127.0.0.1", help="address to listen on")
+    parser.add_argument("--port", type=int, default=1700, help="UDP port the radios send to")
+    parser.add_argument("--loss", type=float, default=0.0, help="probability that a frame is lost at random")
+    parser.add_argument("--latency", type=float, default=0.0, help="ms added after the time on air")
+    parser.add_argument("--no-collisions", action="store_true", help="deliver overlapping frames")
+    parser.add_argument("--rssi", type=float, default=-90.0, help="dBm at 17 dBm TX power")
+    parser.add_argument("--snr", type=float, default=8.0, help="dB at 17 dBm TX power and 125 kHz")
+    parser.add_argument("--node-snr", type=parse_node_snr, action="append", default=[], metavar="NODE=SNR",
+                        help="SNR of a single sender, can be repeated")
+    parser.add_argument("--jitter", type=float, default=1.0, help="standard deviation of RSSI and SNR in dB")
+    parser.add_argument("--seed", type=int, help="seed for loss and jitter, for repeatable runs")
+    parser.add_argument("--report", type=float, default=60.0, help="seconds between statistics")
+    parser.add_argument("--log", help="CSV file with one line per frame")
+    args = parser.parse_args()
+    args.node_snr = dict(args.node_snr)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind((args.listen, args.port))
+    print("Radio channel on %s:%d" % (args.listen, args.port), flush=True)
+
+    channel = Channel(args)
+    try:
+        channel.run(sock)
+    except KeyboardInterrupt:
+        channel.report()
+
+
+if __name__ == "__main__":
+    sys.exit(main())
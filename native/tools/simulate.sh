@@ -0,0 +1,50 @@
+#!/usr/bin/env bash
+# Runs the native gateway, a number of native senders with their watermeters and the radio channel on this machine.
+#
+#   ./simulate.sh [senders] [meters per sender] [radio_channel.py options...]
+#   ./simulate.sh 3 2 --loss 0.05 --snr 2
+#
+# Build both firmwares first with `pio run -e native` in esp32-lora-sender and esp32-lora-gw.
+# The MQTT broker of the gateway is taken from its settings, start mosquitto before if it is 127.0.0.1.
+# All state, logs and the frame log channel.csv go to $SIMULATION (default /tmp/lora-watermeter).
+set -euo pipefail
+
+SENDERS=${1:-1}
+METERS=${2:-1}
+shift $(($# > 2 ? 2 : $#))
+
+ROOT=$(cd "$(dirname "$0")/../.." && pwd)
+TOOLS="$ROOT/native/tools"
+SIMULATION=${SIMULATION:-/tmp/lora-watermeter}
+SENDER="$ROOT/esp32-lora-sender/.pio/build/native/program"
+GATEWAY="$ROOT/esp32-lora-gw/.pio/build/native/program"
+
+for program in "$SENDER" "$GATEWAY"; do
+  if [ ! -x "$program" ]; then
+    echo "Missing $program, build it with: pio run -e native" >&2
+    exit 1
+  fi
+done
+
+mkdir -p "$SIMULATION"
+trap 'kill $(jobs -p) 2>/dev/null; wait' EXIT
+
+"$TOOLS/radio_channel.py" --log "$SIMULATION/channel.csv" "$@" &
+sleep 1
+
+(cd "$ROOT/esp32-lora-gw" && NATIVE_STATE="$SIMULATION/gateway" exec "$GATEWAY" > "$SIMULATION/gateway.log" 2>&1) &
+
+# Every sender gets its own MAC, so its own node ID, and its meters get their own addresses
+for sender in $(seq 1 "$SENDERS"); do
+  stations=""
+  for meter in $(seq 1 "$METERS"); do
+    address="127.0.$sender.$((meter + 1))"
+    "$TOOLS/fake_meter.py" --address "$address" --port 8090 --value $((sender * 100 + meter)) > /dev/null &
+    stations="$stations${stations:+,}$address:8090"
+  done
+  (cd "$ROOT/esp32-lora-sender" && NATIVE_STATE="$SIMULATION/sender-$sender" NATIVE_MAC=$(printf "24A4AE10%04X" "$sender") \
+    NATIVE_STATIONS="$stations" NATIVE_WEB_PORT=$((8080 + sender)) exec "$SENDER" > "$SIMULATION/sender-$sender.log" 2>&1) &
+done
+
+echo "Gateway on http://127.0.0.1:8080, senders from http://127.0.0.1:8081, logs in $SIMULATION"
+wait